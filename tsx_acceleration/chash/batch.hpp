@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+/**
+ *  Planning for the batched operations of the hash sets.  A batch is applied
+ *  one bucket at a time, so we first sort the positions of its keys by the
+ *  bucket each key falls in.  An entry of the plan is (bucket << 32) | pos,
+ *  so one integer sort groups the keys by bucket and keeps them in input
+ *  order within a group.
+ *
+ *  A plan is made for one table size.  If the table resizes partway through
+ *  a batch, the set re-plans the part of the batch it has not applied yet.
+ */
+
+/*** How many plan entries ahead of the current group we prefetch bucket slots */
+#define BATCH_PREFETCH_DIST 8
+
+static inline int batch_bucket(uint64_t e) { return (int)(e >> 32); }
+
+static inline int batch_pos(uint64_t e) { return (int)(uint32_t)e; }
+
+/*** Sort the entries ord[0..n) by bucket of a table of /size/ buckets */
+template<class HP>
+static void batch_plan(const int * keys, uint64_t * ord, int n, int size)
+{
+    for (int j = 0; j < n; j++) {
+        int p = batch_pos(ord[j]);
+        ord[j] = ((uint64_t)(HP::hash(keys[p]) & (size - 1)) << 32) | (uint32_t)p;
+    }
+    std::sort(ord, ord + n);
+}
+
+/**
+ *  Plan a batch of /n/ keys for a table of /size/ buckets.  The plan lives in
+ *  a buffer private to the calling thread, which is reused by its next batch,
+ *  so a batch does not call the allocator once the buffer is big enough.
+ */
+template<class HP>
+static uint64_t * batch_order(const int * keys, int n, int size)
+{
+    static thread_local std::vector<uint64_t> ord;
+    ord.resize(n);
+    for (int j = 0; j < n; j++)
+        ord[j] = (uint32_t)j;
+    batch_plan<HP>(keys, ord.data(), n, size);
+    return ord.data();
+}
+
+/*** Index one past the last entry of the group that starts at /g/ */
+static inline int batch_group_end(const uint64_t * ord, int n, int g)
+{
+    int e = g + 1;
+    while (e < n && batch_bucket(ord[e]) == batch_bucket(ord[g]))
+        e++;
+    return e;
+}
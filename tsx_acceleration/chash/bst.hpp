@@ -7,143 +7,236 @@
 #include <atomic>
 
 #include "common.hpp"
-#include "mm.hpp"
+#include "reclaim.hpp"
+#include "bst_range.hpp"
 
 using std::atomic;
 using std::stringstream;
 using std::string;
 using std::endl;
 
+/**
+ *  The lock-free external BST of Ellen, Fatourou, Ruppert and van Breugel
+ *  (PODC 2010), laid out to keep the bytes per key and the lines a lookup
+ *  touches down:
+ *
+ *  - A leaf is just a key.  Only internal nodes have children and an info
+ *    word.
+ *  - An insert's new internal node, new leaf, and copy of the old leaf
+ *    come in one block_t, so a parent and its first two leaves share a
+ *    cache line or two.
+ *  - The state of an info word (clean, flagged for an insert or delete,
+ *    or marked) is in the low bits of the record pointer, as in the paper.
+ *    So marks and clean words need no records of their own.  A clean word
+ *    keeps pointing to the record of the update that finished, so no word
+ *    ever repeats, and that record is freed when the word is next
+ *    replaced.
+ *  - Each operation allocates its block and record once, and reuses them
+ *    across failed attempts.  They come from the per-thread pools of
+ *    mm.hpp, which also recycle retired records once they are safe.
+ */
+template<class RP = wbmm_policy_t>
 class bstset_t
 {
+    /**
+     *  What every node has, and all that a leaf has.  /slot/ is where the
+     *  node sits in its block_t: 0 for the internal node, 1 and 2 for the
+     *  leaves, or NO_BLOCK for a node allocated alone.  Only an internal
+     *  node's /live/ is used: it counts the nodes of its block that are
+     *  still in the tree.
+     */
     struct bstnode_t
     {
-        int32_t             key;
+        int32_t           key;
+        uint8_t           leaf;
+        uint8_t           slot;
+        atomic<uint16_t>  live;
+    };
+
+    struct inode_t : bstnode_t
+    {
         atomic<bstnode_t *> left;
         atomic<bstnode_t *> right;
-        atomic<void *>      info;
+        atomic<uintptr_t>   info;
     };
 
-    enum infotype_t {
-        DINFO,
-        IINFO,
-        MARK,
-        CLEAN
+    /*** The nodes an insert adds; they leave the tree one at a time */
+    struct block_t
+    {
+        inode_t    in;
+        bstnode_t  leaves[2];
     };
 
-    struct dinfo_t
-    {
-        infotype_t  type;
-        bstnode_t * l;
-        bstnode_t * p;
-        bstnode_t * gp;
-        void *      pinfo;
+    static const uint8_t NO_BLOCK = 0xFF;
+
+    /*** The state of an info word, in the low bits of its record pointer */
+    enum infotype_t {
+        CLEAN = 0,
+        IINFO = 1,
+        DINFO = 2,
+        MARK  = 3
     };
 
+    static const uintptr_t INFO_TYPE_MASK = 3;
+
+    /**
+     *  An insert record.  Its node p is the one whose info word points
+     *  here, so the record does not keep it.
+     */
     struct iinfo_t
     {
-        infotype_t  type;
         bstnode_t * l;
-        bstnode_t * p;
-        bstnode_t * newInternal;
+        inode_t *   newInternal;
     };
 
-    struct mark_t
+    /*** A delete record; gp's info word is DINFO, and p's becomes MARK */
+    struct dinfo_t
     {
-        infotype_t  type;
-        dinfo_t *   dinfo;
+        inode_t *   gp;
+        inode_t *   p;
+        bstnode_t * l;
+        uintptr_t   pinfo;
     };
 
-    struct clean_t
+    static inline infotype_t GET_INFO_TYPE(uintptr_t info) {
+        return (infotype_t)(info & INFO_TYPE_MASK);
+    }
+
+    static inline bool INFO_IS_CLEAN(uintptr_t info) {
+        return GET_INFO_TYPE(info) == CLEAN;
+    }
+
+    template<class T>
+    static inline T * INFO_RECORD(uintptr_t info) {
+        return (T *)(info & ~INFO_TYPE_MASK);
+    }
+
+    static inline uintptr_t INFO_WORD(void * record, infotype_t type) {
+        return (uintptr_t)record | type;
+    }
+
+    static inline inode_t * inner(bstnode_t * n) {
+        return static_cast<inode_t *>(n);
+    }
+
+    /** The walks of bst_range.hpp find these by argument-dependent lookup. */
+    friend bool bst_is_leaf(bstnode_t * n)
     {
-        infotype_t  type;
-    };
+        return n->leaf;
+    }
 
-    static inline infotype_t GET_INFO_TYPE(void * ptr) {
-        return (*(infotype_t *)(ptr));
+    friend atomic<bstnode_t *> * bst_left_of(bstnode_t * n)
+    {
+        return &static_cast<inode_t *>(n)->left;
     }
 
-    static inline bool INFO_IS_CLEAN(void * ptr) {
-        return ((ptr) == NULL || GET_INFO_TYPE(ptr) == CLEAN);
+    friend atomic<bstnode_t *> * bst_right_of(bstnode_t * n)
+    {
+        return &static_cast<inode_t *>(n)->right;
     }
 
-    /** Allocate a leaf node. */
+    /** Allocate a leaf node on its own, for the sentinels. */
     static bstnode_t * alloc_bstnode(int32_t key)
     {
-        bstnode_t * l = (bstnode_t *)wbmm_alloc(sizeof(bstnode_t));
+        bstnode_t * l = (bstnode_t *)RP::alloc(sizeof(bstnode_t));
         l->key = key;
-        l->left = NULL;
-        l->right = NULL;
-        l->info = NULL;
+        l->leaf = true;
+        l->slot = NO_BLOCK;
         return l;
     }
 
-    /** Allocate an internal node. */
-    static bstnode_t * alloc_bstnode(int32_t key, bstnode_t * left, bstnode_t * right)
+    /** Allocate an internal node on its own, for the root. */
+    static inode_t * alloc_bstnode(int32_t key, bstnode_t * left, bstnode_t * right)
     {
-        bstnode_t * i = (bstnode_t *)wbmm_alloc(sizeof(bstnode_t));
+        inode_t * i = (inode_t *)RP::alloc(sizeof(inode_t));
         i->key = key;
+        i->leaf = false;
+        i->slot = NO_BLOCK;
         i->left = left;
         i->right = right;
-        i->info = NULL;
-        return i;
-    }
-
-    static iinfo_t * alloc_iinfo(bstnode_t * l, bstnode_t * p, bstnode_t * newInternal)
-    {
-        iinfo_t * i = (iinfo_t *)wbmm_alloc(sizeof(iinfo_t));
-        *i = {IINFO, l, p, newInternal};
+        i->info = 0;
         return i;
     }
 
-    static dinfo_t * alloc_dinfo(bstnode_t * l, bstnode_t * p, bstnode_t * gp, void * pinfo)
+    static block_t * alloc_block()
     {
-        dinfo_t * d = (dinfo_t *)wbmm_alloc(sizeof(dinfo_t));
-        *d = {DINFO, l, p, gp, pinfo};
-        return d;
+        block_t * b = (block_t *)RP::alloc(sizeof(block_t));
+        b->in.leaf = false;
+        b->in.slot = 0;
+        b->in.info = 0;
+        for (int i = 0; i < 2; i++) {
+            b->leaves[i].leaf = true;
+            b->leaves[i].slot = i + 1;
+        }
+        return b;
     }
 
-    static mark_t * alloc_mark(dinfo_t * dinfo)
+    /**
+     *  Set up /b/ to replace a leaf holding /lkey/ by an internal node over
+     *  a new leaf for /key/ and a copy of the old one, and return the
+     *  internal node.
+     */
+    static inode_t * fill_block(block_t * b, int32_t key, int32_t lkey)
     {
-        mark_t * m = (mark_t *)wbmm_alloc(sizeof(mark_t));
-        *m = {MARK, dinfo};
-        return m;
+        bstnode_t * newNode = &b->leaves[0];
+        bstnode_t * newSibling = &b->leaves[1];
+        newNode->key = key;
+        newSibling->key = lkey;
+        b->in.live = 3;
+        if (key < lkey) {
+            b->in.key = lkey;
+            b->in.left = newNode;
+            b->in.right = newSibling;
+        }
+        else {
+            b->in.key = key;
+            b->in.left = newSibling;
+            b->in.right = newNode;
+        }
+        return &b->in;
     }
 
-    static clean_t * alloc_clean()
+    static block_t * block_of(bstnode_t * n)
     {
-        clean_t * c = (clean_t *)wbmm_alloc(sizeof(clean_t));
-        *c = {CLEAN};
-        return c;
+        if (n->slot == 0)
+            return (block_t *)n;
+        return (block_t *)((char *)n - sizeof(inode_t) - (n->slot - 1) * sizeof(bstnode_t));
     }
 
+    /** /n/ has left the tree; the last node of a block to go retires it. */
     static void free_bstnode_safe(bstnode_t * n)
     {
-        if (n->info) wbmm_free_safe(n->info);
-        wbmm_free_safe(n);
+        if (n->slot == NO_BLOCK) {
+            RP::free_safe(n);
+            return;
+        }
+        block_t * b = block_of(n);
+        if (b->in.live.fetch_sub(1) == 1)
+            RP::free_safe(b);
     }
 
-    static void free_bstnode_unsafe(bstnode_t * n)
+    static iinfo_t * alloc_iinfo()
     {
-        if (n->info) wbmm_free_unsafe(n->info);
-        wbmm_free_unsafe(n);
+        return (iinfo_t *)RP::alloc(sizeof(iinfo_t));
     }
 
-    static void free_info_safe(void * info)
+    static dinfo_t * alloc_dinfo()
     {
-        if (info) wbmm_free_safe(info);
+        return (dinfo_t *)RP::alloc(sizeof(dinfo_t));
     }
 
-    static void free_info_unsafe(void * info)
+    /** Free the record of an info word that was just replaced. */
+    static void free_info_safe(uintptr_t info)
     {
-        if (info) wbmm_free_unsafe(info);
+        void * r = INFO_RECORD<void>(info);
+        if (r) RP::free_safe(r);
     }
 
   private:
 
     static const int32_t INF = std::numeric_limits<int32_t>::max();
 
-    bstnode_t * root;
+    inode_t * root;
 
   public:
     bstset_t()
@@ -155,36 +248,84 @@ class bstset_t
 
     bool contains(int key)
     {
-        wbmm_begin();
+        RP::begin();
         bstnode_t * l = root->left;
-        while (l->left != NULL) {
-            l = (key < l->key) ? l->left : l->right;
+        while (!l->leaf) {
+            l = (key < l->key) ? inner(l)->left : inner(l)->right;
         }
         bool result = key == l->key;
-        wbmm_end();
+        RP::end();
         return result;
     }
 
+    /**
+     *  Put the keys in [lo, hi] in /out/, in ascending order, as one atomic
+     *  snapshot (see bst_range.hpp), and return how many there are.
+     */
+    int rangeQuery(int lo, int hi, std::vector<int> & out)
+    {
+        RP::begin();
+        int r = bst_range_query(&root->left, lo, hi, INF, out);
+        RP::end();
+        return r;
+    }
+
+    /** Find the least key >= /key/; false if there is none.  Linearizable. */
+    bool lowerBound(int key, int & out)
+    {
+        RP::begin();
+        bool r = bst_range_first<bstnode_t>(&root->left, key, INT_MAX, INF, out);
+        RP::end();
+        return r;
+    }
+
+    /** Find the least key > /key/; false if there is none.  Linearizable. */
+    bool successor(int key, int & out)
+    {
+        return key != INT_MAX && lowerBound(key + 1, out);
+    }
+
+    /** Find the greatest key < /key/; false if there is none.  Linearizable. */
+    bool predecessor(int key, int & out)
+    {
+        if (key == INT_MIN)
+            return false;
+        RP::begin();
+        bool r = bst_range_first<bstnode_t, true>(&root->left, INT_MIN, key - 1, INF, out);
+        RP::end();
+        return r;
+    }
+
+    /**
+     *  Copy up to /max/ keys >= /key/ into /buf/, in ascending order, and
+     *  return how many; weakly consistent.  ordered_iter_t is built on this.
+     */
+    int scan(int key, int * buf, int max)
+    {
+        RP::begin();
+        int r = bst_range_scan<bstnode_t>(&root->left, key, INF, buf, max);
+        RP::end();
+        return r;
+    }
+
     bool insert(int key)
     {
-        wbmm_begin();
+        RP::begin();
 
-        bstnode_t * newNode = alloc_bstnode(key);
-        bstnode_t * newSibling;
-        bstnode_t * newInternal;
-        bstnode_t * p;
+        block_t * newBlock = NULL;
+        iinfo_t * newPInfo = NULL;
+        inode_t * p;
         bstnode_t * l;
-        void * pinfo;
+        uintptr_t pinfo;
         bool result;
 
         while (true) {
             /** SEARCH **/
             p = root;
-            pinfo = p->info;
             l = p->left;
-            while (l->left != NULL) {
-                p = l;
-                l = (key < l->key) ? l->left : l->right;
+            while (!l->leaf) {
+                p = inner(l);
+                l = (key < l->key) ? p->left : p->right;
             }
             pinfo = p->info;
             if (l != p->left && l != p->right)
@@ -196,58 +337,64 @@ class bstset_t
                 break;
             }
             else if (!INFO_IS_CLEAN(pinfo))
-                help(pinfo);
+                help(p, pinfo);
             else {
-                newSibling = alloc_bstnode(l->key);
-                newInternal = (key < l->key)
-                    ? alloc_bstnode(l->key, newNode, newSibling)
-                    : alloc_bstnode(key, newSibling, newNode);
-
-                void * newPInfo = alloc_iinfo(l, p, newInternal);
+                // a failed attempt leaves these private, so keep them
+                if (newBlock == NULL) {
+                    newBlock = alloc_block();
+                    newPInfo = alloc_iinfo();
+                }
+                newPInfo->l = l;
+                newPInfo->newInternal = fill_block(newBlock, key, l->key);
 
                 // try to IFlag parent
-                if (bcas(&p->info, &pinfo, newPInfo)) {
+                if (bcas(&p->info, &pinfo, INFO_WORD(newPInfo, IINFO))) {
                     free_info_safe(pinfo); // reclaim old info object
-                    helpInsert((iinfo_t *)newPInfo);
+                    helpInsert(p, newPInfo);
+                    newBlock = NULL;
+                    newPInfo = NULL;
                     result = true;
                     break;
                 }
                 else {
-                    // free local objects
-                    free_info_unsafe(newPInfo);
-                    free_bstnode_unsafe(newSibling);
-                    free_bstnode_unsafe(newInternal);
-                    help(p->info);
+                    help(p, p->info);
                 }
             }
         }
 
-        wbmm_end();
+        // free local objects
+        if (newBlock != NULL) {
+            RP::free_unsafe(newBlock);
+            RP::free_unsafe(newPInfo);
+        }
+
+        RP::end();
         return result;
     }
 
     bool remove(int key)
     {
-        wbmm_begin();
+        RP::begin();
 
-        void * gpinfo;
-        void * pinfo;
-        bstnode_t * gp;
-        bstnode_t * p;
+        dinfo_t * newGPInfo = NULL;
+        uintptr_t gpinfo;
+        uintptr_t pinfo;
+        inode_t * gp;
+        inode_t * p;
         bstnode_t * l;
         bool result;
 
         while (true) {
             /** SEARCH **/
             gp = NULL;
-            gpinfo = NULL;
+            gpinfo = 0;
             p = root;
             pinfo = p->info;
             l = p->left;
-            while (l->left != NULL) {
+            while (!l->leaf) {
                 gp = p;
-                p = l;
-                l = (key < l->key) ? l->left : l->right;
+                p = inner(l);
+                l = (key < l->key) ? p->left : p->right;
             }
 
             if (gp != NULL) {
@@ -265,28 +412,35 @@ class bstset_t
                 break;
             }
             else if (!INFO_IS_CLEAN(gpinfo))
-                help(gpinfo);
+                help(gp, gpinfo);
             else if (!INFO_IS_CLEAN(pinfo))
-                help(pinfo);
+                help(p, pinfo);
             else {
                 // try to DFlag grandparent
-                void * newGPInfo = alloc_dinfo(l, p, gp, pinfo);
-                void * oldGPInfo = gpinfo;
-                if (bcas(&gp->info, &oldGPInfo, newGPInfo)) {
-                    free_info_safe(oldGPInfo); // free old info object
-                    if (helpDelete((dinfo_t *)newGPInfo)) {
+                if (newGPInfo == NULL)
+                    newGPInfo = alloc_dinfo();
+                *newGPInfo = {gp, p, l, pinfo};
+                uintptr_t oldGPInfo = gpinfo;
+                if (bcas(&gp->info, &oldGPInfo, INFO_WORD(newGPInfo, DINFO))) {
+                    free_info_safe(gpinfo); // free old info object
+                    // gp's info word owns the record now, even on a backtrack
+                    dinfo_t * info = newGPInfo;
+                    newGPInfo = NULL;
+                    if (helpDelete(info)) {
                         result = true;
                         break;
                     }
                 }
                 else {
-                    free_info_unsafe(newGPInfo); // free local object
-                    help(gp->info);
+                    help(gp, gp->info);
                 }
             }
         }
 
-        wbmm_end();
+        if (newGPInfo != NULL)
+            RP::free_unsafe(newGPInfo); // free local object
+
+        RP::end();
         return result;
     }
 
@@ -295,78 +449,65 @@ class bstset_t
 
   private:
 
-    void help(void * info)
+    /** Help the update whose record /info/ was read from /n/'s info word */
+    void help(inode_t * n, uintptr_t info)
     {
         if (GET_INFO_TYPE(info) == IINFO)
-            helpInsert((iinfo_t *)info);
+            helpInsert(n, INFO_RECORD<iinfo_t>(info));
         else if (GET_INFO_TYPE(info) == DINFO)
-            helpDelete((dinfo_t *)info);
+            helpDelete(INFO_RECORD<dinfo_t>(info));
         else if (GET_INFO_TYPE(info) == MARK)
-            helpMarked(((mark_t *)info)->dinfo);
+            helpMarked(INFO_RECORD<dinfo_t>(info));
     }
 
-    void helpInsert(iinfo_t * info)
+    void helpInsert(inode_t * p, iinfo_t * info)
     {
         bstnode_t * l = info->l;
-        bstnode_t * p = info->p;
         atomic<bstnode_t *> * ptr = (p->left == l) ? &p->left : &p->right;
-        if (bcas(ptr, &l, info->newInternal))
+        if (bcas(ptr, &l, (bstnode_t *)info->newInternal))
             free_bstnode_safe(l);
-        void * c = alloc_clean();
-        if (bcas(&p->info, (void **)&info, c))
-            free_info_safe(info);
-        else
-            free_info_unsafe(c);
+        // the clean word keeps the record, so that it differs from all before
+        uintptr_t flagged = INFO_WORD(info, IINFO);
+        bcas(&p->info, &flagged, INFO_WORD(info, CLEAN));
     }
 
     bool helpDelete(dinfo_t * info)
     {
-        bstnode_t * p = info->p;
-        bstnode_t * gp = info->gp;
-        void * pinfo = info->pinfo;
-
-        void * m = alloc_mark(info);
+        inode_t * p = info->p;
+        uintptr_t pinfo = info->pinfo;
+        uintptr_t marked = INFO_WORD(info, MARK);
 
-        if (bcas(&p->info, &pinfo, m)) {
-            free_info_safe(pinfo); // reclaim old pinfo
+        if (bcas(&p->info, &pinfo, marked)) {
+            free_info_safe(info->pinfo); // reclaim old pinfo
+            helpMarked(info);
+            return true;
+        }
+        else if (pinfo == marked) {
             helpMarked(info);
             return true;
         }
         else {
-            free_info_unsafe(m); // free local object
-            void * currentPInfo = info->p->info;
-            if (GET_INFO_TYPE(currentPInfo) == MARK && ((mark_t *)currentPInfo)->dinfo == info) {
-                helpMarked(info);
-                return true;
-            }
-            else {
-                help(currentPInfo);
-                void * c = alloc_clean();
-                if (bcas(&gp->info, (void **)&info, c))
-                    free_info_safe(info); // reclaim old gpinfo
-                else
-                    free_info_unsafe(c); // free local object
-                return false;
-            }
+            help(p, pinfo);
+            uintptr_t flagged = INFO_WORD(info, DINFO);
+            bcas(&info->gp->info, &flagged, INFO_WORD(info, CLEAN));
+            return false;
         }
     }
 
     void helpMarked(dinfo_t * info)
     {
         bstnode_t * l = info->l;
-        bstnode_t * p = info->p;
-        bstnode_t * gp = info->gp;
+        inode_t * p = info->p;
+        inode_t * gp = info->gp;
 
         bstnode_t * other = (p->right == l) ? p->left : p->right;
         atomic<bstnode_t *> * ptr = (gp->left == p) ? &gp->left : &gp->right;
-        if (bcas(ptr, &p, other)) {
+        bstnode_t * expected = p;
+        if (bcas(ptr, &expected, other)) {
             free_bstnode_safe(l); // reclaim l
-            free_bstnode_safe(p); // reclaim p
+            free_bstnode_safe(p); // reclaim p; its MARK word belongs to gp's record
         }
-        void * c = alloc_clean();
-        if (bcas(&gp->info, (void **)&info, c))
-            free_info_safe(info); // reclaim old gpinfo
-        else
-            free_info_unsafe(c); // free local object
+        uintptr_t flagged = INFO_WORD(info, DINFO);
+        bcas(&gp->info, &flagged, INFO_WORD(info, CLEAN));
     }
 };
@@ -8,13 +8,15 @@
 #include <x86intrin.h>
 
 #include "common.hpp"
-#include "mm.hpp"
+#include "reclaim.hpp"
+#include "bst_range.hpp"
 
 using std::atomic;
 using std::stringstream;
 using std::string;
 using std::endl;
 
+template<class RP = wbmm_policy_t>
 class bstset_cptr_t
 {
   private:
@@ -26,7 +28,7 @@ class bstset_cptr_t
         int32_t             key;
         atomic<bstnode_t *> left;
         atomic<bstnode_t *> right;
-        atomic<uint64_t>    info;
+        cptr_atomic_t       info;
     };
 
     enum infotype_t {
@@ -75,7 +77,7 @@ class bstset_cptr_t
     /** Allocate a leaf node. */
     static bstnode_t * alloc_bstnode(int32_t key)
     {
-        bstnode_t * l = (bstnode_t *)wbmm_alloc(sizeof(bstnode_t));
+        bstnode_t * l = (bstnode_t *)RP::alloc(sizeof(bstnode_t));
         l->key = key;
         l->left = NULL;
         l->right = NULL;
@@ -86,7 +88,7 @@ class bstset_cptr_t
     /** Allocate an internal node. */
     static bstnode_t * alloc_bstnode(int32_t key, bstnode_t * left, bstnode_t * right)
     {
-        bstnode_t * i = (bstnode_t *)wbmm_alloc(sizeof(bstnode_t));
+        bstnode_t * i = (bstnode_t *)RP::alloc(sizeof(bstnode_t));
         i->key = key;
         i->left = left;
         i->right = right;
@@ -96,52 +98,51 @@ class bstset_cptr_t
 
     static iinfo_t * alloc_iinfo(bstnode_t * l, bstnode_t * p, bstnode_t * newInternal)
     {
-        iinfo_t * i = (iinfo_t *)wbmm_alloc(sizeof(iinfo_t));
+        iinfo_t * i = (iinfo_t *)RP::alloc(sizeof(iinfo_t));
         *i = {IINFO, l, p, newInternal};
         return i;
     }
 
     static dinfo_t * alloc_dinfo(bstnode_t * l, bstnode_t * p, bstnode_t * gp, cptr_t<void> pinfo)
     {
-        dinfo_t * d = (dinfo_t *)wbmm_alloc(sizeof(dinfo_t));
+        dinfo_t * d = (dinfo_t *)RP::alloc(sizeof(dinfo_t));
         *d = {DINFO, l, p, gp, pinfo};
         return d;
     }
 
     static mark_t * alloc_mark(cptr_t<void> dinfo)
     {
-        mark_t * m = (mark_t *)wbmm_alloc(sizeof(mark_t));
+        mark_t * m = (mark_t *)RP::alloc(sizeof(mark_t));
         *m = {MARK, dinfo};
         return m;
     }
 
     static void free_bstnode_safe(bstnode_t * n)
     {
-        wbmm_free_safe(n);
+        RP::free_safe(n);
     }
 
     static void free_bstnode_unsafe(bstnode_t * n)
     {
         // assumes info == null
-        wbmm_free_unsafe(n);
+        RP::free_unsafe(n);
     }
 
     static void free_info_safe(void * info)
     {
-        wbmm_free_safe(info);
+        RP::free_safe(info);
     }
 
     static void free_info_unsafe(void * info)
     {
-        wbmm_free_unsafe(info);
+        RP::free_unsafe(info);
     }
 
   public:
     bstset_cptr_t()
     {
         // make sure pointer size is 32bit since we are using 64bit counted pointers
-        assert(sizeof(uintptr_t) == sizeof(uint32_t));
-        assert(sizeof(cptr_t<int>) == sizeof(uint64_t));
+        assert(sizeof(cptr_t<int>) == sizeof(cptr_word_t));
         bstnode_t * l1 = alloc_bstnode(INF);
         bstnode_t * l2 = alloc_bstnode(INF);
         root = alloc_bstnode(INF, l1, l2);
@@ -149,19 +150,31 @@ class bstset_cptr_t
 
     bool contains(int key)
     {
-        wbmm_begin();
+        RP::begin();
         bstnode_t * l = root->left;
         while (l->left != NULL) {
             l = (key < l->key) ? l->left : l->right;
         }
         bool result = key == l->key;
-        wbmm_end();
+        RP::end();
         return result;
     }
 
+    /**
+     *  Put the keys in [lo, hi] in /out/, in ascending order, as one atomic
+     *  snapshot (see bst_range.hpp), and return how many there are.
+     */
+    int rangeQuery(int lo, int hi, std::vector<int> & out)
+    {
+        RP::begin();
+        int r = bst_range_query(&root->left, lo, hi, INF, out);
+        RP::end();
+        return r;
+    }
+
     bool insert(int key)
     {
-        wbmm_begin();
+        RP::begin();
 
         bstnode_t * newNode = alloc_bstnode(key);
         bstnode_t * newSibling;
@@ -218,13 +231,13 @@ class bstset_cptr_t
             }
         }
 
-        wbmm_end();
+        RP::end();
         return result;
     }
 
     bool remove(int key)
     {
-        wbmm_begin();
+        RP::begin();
 
         bstnode_t * gp;
         bstnode_t * p;
@@ -285,7 +298,7 @@ class bstset_cptr_t
             }
         }
 
-        wbmm_end();
+        RP::end();
         return result;
     }
 
@@ -8,18 +8,15 @@
 #include <x86intrin.h>
 
 #include "common.hpp"
-#include "mm.hpp"
+#include "reclaim.hpp"
+#include "bst_range.hpp"
 
 using std::atomic;
 using std::stringstream;
 using std::string;
 using std::endl;
 
-#define MAX_ATTEMPT_NUM_INSERT 2
-#define MAX_ATTEMPT_NUM_REMOVE 2
-#define MAX_ATTEMPT_NUM_LOOKUP 4
-#define MAX_ATTEMPT_NUM_MICRO  16
-
+template<class RP = wbmm_policy_t>
 class bstset_htm2_t
 {
   private:
@@ -28,7 +25,7 @@ class bstset_htm2_t
         int32_t             key;
         atomic<bstnode_t *> left;
         atomic<bstnode_t *> right;
-        atomic<uint64_t>    info;
+        cptr_atomic_t       info;
     };
 
     enum infotype_t {
@@ -86,7 +83,7 @@ class bstset_htm2_t
     /** Allocate a leaf node. */
     static bstnode_t * alloc_bstnode(int32_t key)
     {
-        bstnode_t * l = (bstnode_t *)wbmm_alloc(sizeof(bstnode_t));
+        bstnode_t * l = (bstnode_t *)RP::alloc(sizeof(bstnode_t));
         l->key = key;
         l->left = NULL;
         l->right = NULL;
@@ -97,7 +94,7 @@ class bstset_htm2_t
     /** Allocate an internal node. */
     static bstnode_t * alloc_bstnode(int32_t key, bstnode_t * left, bstnode_t * right)
     {
-        bstnode_t * i = (bstnode_t *)wbmm_alloc(sizeof(bstnode_t));
+        bstnode_t * i = (bstnode_t *)RP::alloc(sizeof(bstnode_t));
         i->key = key;
         i->left = left;
         i->right = right;
@@ -107,52 +104,51 @@ class bstset_htm2_t
 
     static iinfo_t * alloc_iinfo(bstnode_t * l, bstnode_t * p, bstnode_t * newInternal)
     {
-        iinfo_t * i = (iinfo_t *)wbmm_alloc(sizeof(iinfo_t));
+        iinfo_t * i = (iinfo_t *)RP::alloc(sizeof(iinfo_t));
         *i = {IINFO, l, p, newInternal};
         return i;
     }
 
     static dinfo_t * alloc_dinfo(bstnode_t * l, bstnode_t * p, bstnode_t * gp, cptr_t<void> pinfo)
     {
-        dinfo_t * d = (dinfo_t *)wbmm_alloc(sizeof(dinfo_t));
+        dinfo_t * d = (dinfo_t *)RP::alloc(sizeof(dinfo_t));
         *d = {DINFO, l, p, gp, pinfo};
         return d;
     }
 
     static mark_t * alloc_mark(cptr_t<void> dinfo)
     {
-        mark_t * m = (mark_t *)wbmm_alloc(sizeof(mark_t));
+        mark_t * m = (mark_t *)RP::alloc(sizeof(mark_t));
         *m = {MARK, dinfo};
         return m;
     }
 
     static void free_bstnode_safe(bstnode_t * n)
     {
-        wbmm_free_safe(n);
+        RP::free_safe(n);
     }
 
     static void free_bstnode_unsafe(bstnode_t * n)
     {
         // assumes info == null
-        wbmm_free_unsafe(n);
+        RP::free_unsafe(n);
     }
 
     static void free_info_safe(void * info)
     {
-        wbmm_free_safe(info);
+        RP::free_safe(info);
     }
 
     static void free_info_unsafe(void * info)
     {
-        wbmm_free_unsafe(info);
+        RP::free_unsafe(info);
     }
 
   public:
     bstset_htm2_t()
     {
         // make sure pointer size is 32bit since we are using 64bit counted pointers
-        assert(sizeof(uintptr_t) == sizeof(uint32_t));
-        assert(sizeof(cptr_t<int>) == sizeof(uint64_t));
+        assert(sizeof(cptr_t<int>) == sizeof(cptr_word_t));
         bstnode_t * l1 = alloc_bstnode(INF);
         bstnode_t * l2 = alloc_bstnode(INF);
         root = alloc_bstnode(INF, l1, l2);
@@ -161,41 +157,77 @@ class bstset_htm2_t
 
     bool contains(int key)
     {
+        HTM_SITE(site, "bstset_htm2_t::contains");
         uint32_t status;
-        uint32_t attempts = 0;
       retry:
-        status = _xbegin();
-        if(status == _XBEGIN_STARTED) {
+        status = htm_begin(site, 42);
+        if(status == HTM_STARTED) {
             bstnode_t * l = root->left;
             while (l->left != NULL) {
                 l = (key < l->key) ? l->left : l->right;
             }
             bool result = key == l->key;
-            _xend();
+            htm_end(site);
             return result;
         }
         else {
-            if ((status & _XABORT_EXPLICIT) && _XABORT_CODE(status) == 42) {
+            if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
                 // try slow path
             }
-            else if (++attempts < MAX_ATTEMPT_NUM_LOOKUP) {
+            else if (htm_retry(site, status)) {
                 goto retry;
             }
+            htm_fallback(site);
         }
 
-        wbmm_begin();
+        RP::begin();
         bstnode_t * l = root->left;
         while (l->left != NULL) {
             l = (key < l->key) ? l->left : l->right;
         }
         bool result = key == l->key;
-        wbmm_end();
+        RP::end();
         return result;
     }
 
+    /**
+     *  Put the keys in [lo, hi] in /out/, in ascending order, as one atomic
+     *  snapshot, and return how many there are.  A short range is read in
+     *  one transaction; otherwise see bst_range.hpp.
+     */
+    int rangeQuery(int lo, int hi, std::vector<int> & out)
+    {
+        HTM_SITE(site, "bstset_htm2_t::rangeQuery");
+        int buf[BST_RANGE_TX_MAX];
+        uint32_t status;
+      retry:
+        status = htm_begin(site, 42);
+        if(status == HTM_STARTED) {
+            int n = bst_range_tx<bstnode_t, false>(&root->left, lo, hi, INF, buf);
+            htm_end(site);
+            out.assign(buf, buf + n);
+            return n;
+        }
+        else {
+            if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
+                // try slow path
+            }
+            else if (htm_retry(site, status)) {
+                goto retry;
+            }
+            htm_fallback(site);
+        }
+
+        RP::begin();
+        int r = bst_range_query(&root->left, lo, hi, INF, out);
+        RP::end();
+        return r;
+    }
+
     bool insert(int key)
     {
-        wbmm_begin();
+        HTM_SITE(site, "bstset_htm2_t::insert");
+        RP::begin();
 
         bstnode_t * newNode = alloc_bstnode(key);
         bstnode_t * newSibling;
@@ -232,27 +264,27 @@ class bstset_htm2_t
                     : alloc_bstnode(key, newSibling, newNode);
 
                 uint32_t status;
-                uint32_t attempts = 0;
               retry:
-                status = _xbegin();
-                if(status == _XBEGIN_STARTED) {
+                status = htm_begin(site, 42);
+                if(status == HTM_STARTED) {
                     if (p->info != pinfo.all)
-                        _xabort(42);
+                        htm_abort(42);
                     (p->left == l) ? p->left = newInternal : p->right = newInternal;
                     pinfo.fields.ctr++;
                     p->info = pinfo.all;
-                    _xend();
+                    htm_end(site);
                     free_bstnode_safe(l);
                     result = true;
                     break;
                 }
                 else {
-                    if ((status & _XABORT_EXPLICIT) && _XABORT_CODE(status) == 42) {
+                    if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
                         // try slow path
                     }
-                    else if (++attempts < MAX_ATTEMPT_NUM_MICRO) {
+                    else if (htm_retry(site, status)) {
                         goto retry;
                     }
+                    htm_fallback(site);
                 }
 
                 void * newPInfo = alloc_iinfo(l, p, newInternal);
@@ -276,13 +308,14 @@ class bstset_htm2_t
             }
         }
 
-        wbmm_end();
+        RP::end();
         return result;
     }
 
     bool remove(int key)
     {
-        wbmm_begin();
+        HTM_SITE(site, "bstset_htm2_t::remove");
+        RP::begin();
 
         bstnode_t * gp;
         bstnode_t * p;
@@ -325,31 +358,31 @@ class bstset_htm2_t
                 help(pinfo);
             else {
                 uint32_t status;
-                uint32_t attempts = 0;
               retry:
-                status = _xbegin();
-                if (status == _XBEGIN_STARTED) {
+                status = htm_begin(site, 42);
+                if (status == HTM_STARTED) {
                     if (gp->info != gpinfo.all || p->info != pinfo.all)
-                        _xabort(42);
+                        htm_abort(42);
                     bstnode_t * other = (p->right == l) ? p->left : p->right;
                     (gp->left == p) ? gp->left = other : gp->right = other;
                     pinfo.fields.ptr = &dummy_txmark;
                     p->info = pinfo.all;
                     gpinfo.fields.ctr++;
                     gp->info = gpinfo.all;
-                    _xend();
+                    htm_end(site);
                     free_bstnode_safe(l); // reclaim l
                     free_bstnode_safe(p); // reclaim p
                     result = true;
                     break;
                 }
                 else {
-                    if ((status & _XABORT_EXPLICIT) && _XABORT_CODE(status) == 42) {
+                    if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
                         // try slow path
                     }
-                    else if (++attempts < MAX_ATTEMPT_NUM_MICRO) {
+                    else if (htm_retry(site, status)) {
                         goto retry;
                     }
+                    htm_fallback(site);
                 }
 
                 // try to DFlag grandparent
@@ -371,7 +404,7 @@ class bstset_htm2_t
             }
         }
 
-        wbmm_end();
+        RP::end();
         return result;
     }
 
@@ -472,8 +505,3 @@ class bstset_htm2_t
             free_info_safe(info); // reclaim old gpinfo
     }
 };
-
-#undef MAX_ATTEMPT_NUM_INSERT
-#undef MAX_ATTEMPT_NUM_REMOVE
-#undef MAX_ATTEMPT_NUM_LOOKUP
-#undef MAX_ATTEMPT_NUM_MICRO
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <cstdint>
+#include <climits>
+#include <atomic>
+#include <vector>
+#include <utility>
+
+#include "common.hpp"
+
+using std::atomic;
+using std::memory_order;
+
+/**
+ *  Range queries for the leaf-oriented BSTs.  A query walks the subtrees
+ *  that can hold keys in [lo, hi], left to right, so it finds the keys in
+ *  ascending order.
+ *
+ *  The walk alone is not a snapshot, since updates land while it runs.  So
+ *  the lock-free query remembers every child pointer it read, and then
+ *  reads them all again.  A child pointer never goes back to a value it
+ *  had: an insert installs a new internal node, a delete promotes a
+ *  subtree that was lower down, and the nodes they replace are retired,
+ *  so their addresses are not reused while the query is in its epoch.  So
+ *  if every pointer still holds what the walk saw, none of them changed in
+ *  between, and at the end of the walk the tree really held those keys.
+ *  Otherwise some update finished, and the query starts over.
+ *
+ *  In a transaction, the walk is atomic by itself, and needs no second
+ *  pass.
+ */
+
+/*** Most keys a range query collects in one transaction */
+#define BST_RANGE_TX_MAX 64
+
+/*** Deepest walk a range query makes in one transaction */
+#define BST_RANGE_TX_DEPTH 128
+
+/**
+ *  How a walk reads a node.  These fit trees whose leaves are nodes with
+ *  NULL children.  A tree with a leaf type of its own declares overloads
+ *  as friends, which the walks find by argument-dependent lookup.
+ */
+template<class N>
+static inline bool bst_is_leaf(N * n)
+{
+    return n->left == NULL;
+}
+
+template<class N>
+static inline atomic<N *> * bst_left_of(N * n)
+{
+    return &n->left;
+}
+
+template<class N>
+static inline atomic<N *> * bst_right_of(N * n)
+{
+    return &n->right;
+}
+
+/**
+ *  Walk the subtree under /from/ into /out/, and record the child pointers
+ *  read in /reads/ unless it is NULL.  Leaves with key /inf/ are sentinels.
+ *  The walk stops once it has /max/ keys; with DESC, it goes right to left,
+ *  so those are the largest keys in range rather than the smallest.
+ */
+template<class N, bool DESC = false>
+static void bst_range_collect(atomic<N *> * from, int lo, int hi, int32_t inf,
+                              std::vector<int> & out,
+                              std::vector<std::pair<atomic<N *> *, N *> > * reads,
+                              size_t max = SIZE_MAX)
+{
+    static thread_local std::vector<atomic<N *> *> todo;
+    todo.clear();
+    todo.push_back(from);
+    while (!todo.empty() && out.size() < max) {
+        atomic<N *> * e = todo.back();
+        todo.pop_back();
+        N * n = *e;
+        if (reads != NULL)
+            reads->push_back(std::make_pair(e, n));
+        if (bst_is_leaf(n)) {
+            if (n->key >= lo && n->key <= hi && n->key != inf)
+                out.push_back(n->key);
+        }
+        else if (!DESC) {
+            // keys below n->key go left, so visit the left subtree first
+            if (hi >= n->key)
+                todo.push_back(bst_right_of(n));
+            if (lo < n->key)
+                todo.push_back(bst_left_of(n));
+        }
+        else {
+            if (lo < n->key)
+                todo.push_back(bst_left_of(n));
+            if (hi >= n->key)
+                todo.push_back(bst_right_of(n));
+        }
+    }
+}
+
+/*** Check that no child pointer read by a walk has changed since */
+template<class N>
+static bool bst_range_validate(const std::vector<std::pair<atomic<N *> *, N *> > & reads)
+{
+    for (size_t i = 0; i < reads.size(); i++)
+        if (reads[i].first->load() != reads[i].second)
+            return false;
+    return true;
+}
+
+/**
+ *  The lock-free range query: collect and validate until a walk validates.
+ *  A walk that stops early at /max/ keys validates just the same, since
+ *  the pointers it read decide which keys come first.  Call between
+ *  RP::begin() and RP::end().
+ */
+template<class N, bool DESC = false>
+static int bst_range_query(atomic<N *> * from, int lo, int hi, int32_t inf,
+                           std::vector<int> & out, size_t max = SIZE_MAX)
+{
+    static thread_local std::vector<std::pair<atomic<N *> *, N *> > reads;
+    do {
+        out.clear();
+        reads.clear();
+        bst_range_collect<N, DESC>(from, lo, hi, inf, out, &reads, max);
+    } while (!bst_range_validate(reads));
+    return out.size();
+}
+
+/**
+ *  The least key in [lo, hi] (the greatest, with DESC), as a linearizable
+ *  query; false if there is none.  Call between RP::begin() and RP::end().
+ */
+template<class N, bool DESC = false>
+static bool bst_range_first(atomic<N *> * from, int lo, int hi, int32_t inf, int & key)
+{
+    static thread_local std::vector<int> out;
+    if (lo > hi)
+        return false;
+    if (bst_range_query<N, DESC>(from, lo, hi, inf, out, 1) == 0)
+        return false;
+    key = out[0];
+    return true;
+}
+
+/**
+ *  Copy up to /max/ keys >= /lo/ into /buf/, in ascending order, and return
+ *  how many.  This is one unvalidated walk, so it is only weakly
+ *  consistent: it finds every key that is in the tree throughout, since
+ *  nodes that a walk has reached keep their children when they are
+ *  unlinked.  Call between RP::begin() and RP::end().
+ */
+template<class N>
+static int bst_range_scan(atomic<N *> * from, int lo, int32_t inf, int * buf, int max)
+{
+    static thread_local std::vector<int> out;
+    out.clear();
+    bst_range_collect<N>(from, lo, INT_MAX, inf, out, NULL, max);
+    for (size_t i = 0; i < out.size(); i++)
+        buf[i] = out[i];
+    return out.size();
+}
+
+/**
+ *  Walk the subtree under /from/ into /buf/ inside a transaction, and return
+ *  how many keys it found.  Aborts with code 42 if they do not fit in
+ *  BST_RANGE_TX_MAX keys or the walk gets too deep.  With RELAXED, loads
+ *  are relaxed, as in the *ff variants.
+ */
+template<class N, bool RELAXED>
+static int bst_range_tx(atomic<N *> * from, int lo, int hi, int32_t inf, int * buf)
+{
+    atomic<N *> * todo[BST_RANGE_TX_DEPTH];
+    int depth = 0, count = 0;
+    todo[depth++] = from;
+    while (depth > 0) {
+        atomic<N *> * e = todo[--depth];
+        N * n = RELAXED ? xld(e) : e->load();
+        N * left = RELAXED ? xld(&n->left) : n->left.load();
+        if (left == NULL) {
+            if (n->key >= lo && n->key <= hi && n->key != inf) {
+                if (count == BST_RANGE_TX_MAX)
+                    htm_abort(42);
+                buf[count++] = n->key;
+            }
+        }
+        else {
+            if (depth + 2 > BST_RANGE_TX_DEPTH)
+                htm_abort(42);
+            if (hi >= n->key)
+                todo[depth++] = &n->right;
+            if (lo < n->key)
+                todo[depth++] = &n->left;
+        }
+    }
+    return count;
+}
@@ -0,0 +1,638 @@
+#pragma once
+
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <x86intrin.h>
+
+#include "common.hpp"
+#include "counter.hpp"
+#include "reclaim.hpp"
+
+using std::atomic;
+using std::stringstream;
+using std::string;
+using std::endl;
+
+/**
+ *  A balanced lock-free external BST: a scapegoat tree whose updates are
+ *  LLX/SCX operations (Brown, Ellen and Ruppert, PODC 2013).  Insert and
+ *  remove are the usual leaf-oriented ones.  Rebalancing is one more kind
+ *  of SCX: when an insert lands deeper than log_{4/3} of the size, it finds
+ *  the lowest ancestor whose height is more than log_{4/3} of its own
+ *  subtree's size (a scapegoat), and replaces that subtree's internal nodes
+ *  by a perfectly balanced set of new ones over the same leaves.  So sorted
+ *  inserts keep the depth logarithmic, at an amortized O(log n) per insert.
+ *
+ *  Rebalancing is best effort: a rebuild that an update beats is dropped,
+ *  and the next deep insert tries again.  It never affects correctness.
+ *
+ *  With FAST, insert and remove first try to make their change, and put a
+ *  fresh committed SCX record in the info fields they touch, in one
+ *  transaction.  An SCX in progress aborts it, and the new info fields make
+ *  any older LLX of those nodes fail, so the two paths mix freely.
+ */
+template<class RP = wbmm_policy_t, bool FAST = false>
+class bstset_sg_t
+{
+  private:
+
+    struct scx_t;
+
+    struct node_t
+    {
+        int32_t           key;
+        atomic<bool>      marked;
+        atomic<node_t *>  left;
+        atomic<node_t *>  right;
+        cptr_atomic_t     info;
+    };
+
+    /*** SCX states; an aborted state also holds how many nodes it froze */
+    static const uintptr_t SCX_IN_PROGRESS = 0;
+    static const uintptr_t SCX_COMMITTED   = 1;
+    static const uintptr_t SCX_ABORTED     = 2;
+
+    /**
+     *  An SCX record.  V[0] holds /fld/ and stays in the tree, and V[1..n)
+     *  are all finalized, which covers every update of this tree, so there
+     *  is no separate R.  Each V[i] after the first is a child of an earlier
+     *  one.  /infos/ are the info words the LLXs of V saw.
+     *
+     *  Info fields are counted pointers, and every change to one bumps its
+     *  counter.  A record can be retired while a slow helper of an SCX that
+     *  is about to abort still expects it in some info field, and then come
+     *  back at the same address in that field; the counter keeps the
+     *  helper's freezing CAS from succeeding anyway.
+     *
+     *  /refs/ counts the live nodes that may point here.  It starts at n.  A
+     *  node stops counting when a later SCX (or a fast path) replaces this
+     *  record in its info field, and the ones this record never froze, or
+     *  finalized, stop counting when it ends: an aborted SCX froze V[0..k)
+     *  and no more, and a committed one leaves only V[0] in the tree.  The
+     *  last to stop counting retires the record.
+     */
+    struct alignas(sizeof(cptr_word_t)) scx_t
+    {
+        atomic<uintptr_t>   state;
+        atomic<bool>        allFrozen;
+        atomic<intptr_t>    refs;
+        atomic<node_t *> *  fld;
+        node_t *            old;
+        node_t *            nw;
+        int                 n;
+        cptr_word_t *       infos;
+        node_t **           V;
+    };
+
+    enum llx_t {
+        LLX_OK,
+        LLX_FAIL,
+        LLX_FINALIZED
+    };
+
+    static node_t * alloc_node(int32_t key, node_t * left, node_t * right)
+    {
+        node_t * n = (node_t *)RP::alloc(sizeof(node_t));
+        n->key = key;
+        n->marked = false;
+        n->left = left;
+        n->right = right;
+        cptr_t<scx_t> i;
+        MAKE_CPTR(i, NULL, 0);
+        n->info = i.all;
+        return n;
+    }
+
+    static void free_node_safe(node_t * n)
+    {
+        RP::free_safe(n);
+    }
+
+    static void free_node_unsafe(node_t * n)
+    {
+        RP::free_unsafe(n);
+    }
+
+    /** The arrays of infos and V follow the record in the same block */
+    static scx_t * alloc_scx(int n, uintptr_t state)
+    {
+        scx_t * s = (scx_t *)RP::alloc(sizeof(scx_t) + n * (sizeof(cptr_word_t) + sizeof(node_t *)));
+        s->state = state;
+        s->allFrozen = state == SCX_COMMITTED;
+        s->refs = n;
+        s->n = n;
+        s->infos = (cptr_word_t *)(s + 1);
+        s->V = (node_t **)(s->infos + n);
+        return s;
+    }
+
+    static scx_t * recordOf(cptr_word_t w)
+    {
+        cptr_t<scx_t> c;
+        c.all = w;
+        return c.fields.ptr;
+    }
+
+    /** The info word that freezes (or commits) a node whose info was /w/ */
+    static cptr_word_t infoWord(cptr_word_t w, scx_t * s)
+    {
+        cptr_t<scx_t> c;
+        c.all = w;
+        MAKE_CPTR(c, s, c.fields.ctr + 1);
+        return c.all;
+    }
+
+    /** /d/ nodes stopped counting toward /s/; free it with the last */
+    static void release(scx_t * s, intptr_t d)
+    {
+        if (s != NULL && d > 0 && s->refs.fetch_sub(d) == d)
+            RP::free_safe(s);
+    }
+
+    /** Nodes that no SCX has frozen yet look like ones an SCX aborted on */
+    static uintptr_t stateOf(scx_t * s)
+    {
+        return (s == NULL) ? SCX_ABORTED : s->state.load();
+    }
+
+  private:
+
+    static const int32_t INF = std::numeric_limits<int32_t>::max();
+
+    /*** Edges above the keys: root, and the internal node made by the first insert */
+    static const int SG_SENTINEL_DEPTH = 2;
+
+    node_t * root;
+
+    /*** Approximate number of keys, which bounds the depth */
+    approx_counter_t count;
+
+  public:
+
+    bstset_sg_t()
+    {
+        root = alloc_node(INF, alloc_node(INF, NULL, NULL), alloc_node(INF, NULL, NULL));
+    }
+
+    bool contains(int key)
+    {
+        RP::begin();
+        node_t * l = root->left;
+        while (l->left != NULL)
+            l = (key < l->key) ? l->left : l->right;
+        bool result = key == l->key;
+        RP::end();
+        return result;
+    }
+
+    bool insert(int key)
+    {
+        RP::begin();
+
+        node_t * leaf = alloc_node(key, NULL, NULL);
+        node_t * gp, * p, * l;
+        int depth;
+        bool result;
+
+        while (true) {
+            depth = search(key, gp, p, l);
+            if (key == l->key) {
+                result = false;
+                break;
+            }
+
+            // l leaves the tree for a copy, since p's pointer must never
+            // go back to a value it had, or a late helper could redo the SCX
+            node_t * sib = alloc_node(l->key, NULL, NULL);
+            node_t * in = (key < l->key)
+                ? alloc_node(l->key, leaf, sib)
+                : alloc_node(key, sib, leaf);
+
+            if (FAST && txInsert(p, l, in)) {
+                free_node_safe(l);
+                result = true;
+                break;
+            }
+
+            node_t * pl, * pr, * ll, * lr;
+            cptr_word_t pi, li;
+            if (llx(p, pl, pr, pi) == LLX_OK && (pl == l || pr == l) &&
+                llx(l, ll, lr, li) == LLX_OK) {
+                node_t *    V[] = {p, l};
+                cptr_word_t I[] = {pi, li};
+                if (scx(V, I, 2, (pl == l) ? &p->left : &p->right, l, in)) {
+                    free_node_safe(l);
+                    result = true;
+                    break;
+                }
+            }
+            free_node_unsafe(sib);
+            free_node_unsafe(in);
+        }
+
+        if (!result)
+            free_node_unsafe(leaf);
+        else {
+            count.add(RP::get_tid(), 1);
+            if (depth + 1 > maxDepth(count.get()))
+                rebalance(key);
+        }
+
+        RP::end();
+        return result;
+    }
+
+    bool remove(int key)
+    {
+        RP::begin();
+
+        node_t * gp, * p, * l;
+        bool result;
+
+        while (true) {
+            search(key, gp, p, l);
+            if (key != l->key) {
+                result = false;
+                break;
+            }
+
+            if (FAST && txRemove(gp, p, l)) {
+                result = true;
+                break;
+            }
+
+            node_t * gl, * gr, * pl, * pr, * ll, * lr;
+            cptr_word_t gi, pi, li;
+            if (llx(gp, gl, gr, gi) != LLX_OK || (gl != p && gr != p))
+                continue;
+            if (llx(p, pl, pr, pi) != LLX_OK || (pl != l && pr != l))
+                continue;
+            if (llx(l, ll, lr, li) != LLX_OK)
+                continue;
+
+            // p and l leave the tree; l's sibling takes p's place
+            node_t *    V[] = {gp, p, l};
+            cptr_word_t I[] = {gi, pi, li};
+            if (scx(V, I, 3, (gl == p) ? &gp->left : &gp->right, p, (pl == l) ? pr : pl)) {
+                free_node_safe(p);
+                free_node_safe(l);
+                result = true;
+                break;
+            }
+        }
+
+        if (result)
+            count.add(RP::get_tid(), -1);
+
+        RP::end();
+        return result;
+    }
+
+    bool grow() { return false; }
+    bool shrink() { return false; }
+
+  private:
+
+    /** Find the leaf /l/ for /key/, its parent and grandparent; returns l's depth */
+    int search(int key, node_t *& gp, node_t *& p, node_t *& l)
+    {
+        int depth = 1;
+        gp = NULL;
+        p = root;
+        l = p->left;
+        while (l->left != NULL) {
+            gp = p;
+            p = l;
+            l = (key < l->key) ? l->left : l->right;
+            depth++;
+        }
+        return depth;
+    }
+
+    /** Greatest height of a subtree of /n/ leaves that is not unbalanced */
+    static int maxHeight(intptr_t n)
+    {
+        return (int)(std::log((double)std::max<intptr_t>(n, 1)) / std::log(4.0 / 3.0));
+    }
+
+    static int maxDepth(intptr_t n)
+    {
+        return maxHeight(n) + SG_SENTINEL_DEPTH;
+    }
+
+    /**
+     *  Load-link /r/: on LLX_OK, /l/ and /rt/ are its children, and /info/
+     *  is what an SCX must still find in r->info to change them.
+     */
+    llx_t llx(node_t * r, node_t *& l, node_t *& rt, cptr_word_t & info)
+    {
+        bool marked1 = r->marked;
+        cptr_word_t w = r->info;
+        scx_t * rinfo = recordOf(w);
+        uintptr_t state = stateOf(rinfo);
+        bool marked2 = r->marked;
+        if ((state & SCX_ABORTED) || (state == SCX_COMMITTED && !marked2)) {
+            l = r->left;
+            rt = r->right;
+            if (r->info.load() == w) {
+                info = w;
+                return LLX_OK;
+            }
+        }
+        if (marked1 && (stateOf(rinfo) == SCX_COMMITTED ||
+                        (stateOf(rinfo) == SCX_IN_PROGRESS && help(rinfo))))
+            return LLX_FINALIZED;
+        scx_t * cur = recordOf(r->info);
+        if (stateOf(cur) == SCX_IN_PROGRESS)
+            help(cur);
+        return LLX_FAIL;
+    }
+
+    /**
+     *  Store-conditional: swing /fld/ from /old/ to /nw/ and finalize
+     *  V[1..n), if no node of V has changed since the LLX that saw infos[i].
+     */
+    bool scx(node_t ** V, cptr_word_t * infos, int n, atomic<node_t *> * fld,
+             node_t * old, node_t * nw)
+    {
+        scx_t * s = alloc_scx(n, SCX_IN_PROGRESS);
+        s->fld = fld;
+        s->old = old;
+        s->nw = nw;
+        for (int i = 0; i < n; i++) {
+            s->V[i] = V[i];
+            s->infos[i] = infos[i];
+        }
+        return help(s);
+    }
+
+    bool help(scx_t * s)
+    {
+        // freeze the nodes of V, in order
+        for (int i = 0; i < s->n; i++) {
+            // while s is in progress, V[0..i) are frozen, so V[i], a child of
+            // one of them, is still in the tree and cannot be reclaimed under
+            // us; once s is over, it may already be gone
+            uintptr_t cur = s->state;
+            if (cur != SCX_IN_PROGRESS)
+                return cur == SCX_COMMITTED;
+            cptr_word_t exp = s->infos[i];
+            if (bcas(&s->V[i]->info, &exp, infoWord(s->infos[i], s))) {
+                release(recordOf(exp), 1);
+            }
+            else if (recordOf(exp) != s) {
+                if (s->allFrozen)
+                    return true;
+                uintptr_t st = SCX_IN_PROGRESS;
+                if (bcas(&s->state, &st, SCX_ABORTED | ((uintptr_t)i << 2)))
+                    release(s, s->n - i);
+                return false;
+            }
+        }
+        s->allFrozen = true;
+        for (int i = 1; i < s->n; i++)
+            s->V[i]->marked = true;
+        node_t * o = s->old;
+        bcas(s->fld, &o, s->nw);
+        uintptr_t st = SCX_IN_PROGRESS;
+        if (bcas(&s->state, &st, SCX_COMMITTED))
+            release(s, s->n - 1);
+        return true;
+    }
+
+    /**
+     *  The fast path of insert: swing p's pointer to /l/ over to /in/ and
+     *  finalize /l/, in a transaction.  False if the slow path must do it.
+     */
+    bool txInsert(node_t * p, node_t * l, node_t * in)
+    {
+        HTM_SITE(site, "bstset_sg_t::insert");
+        scx_t * r = alloc_scx(1, SCX_COMMITTED);
+        r->V[0] = p;
+        cptr_word_t op, ol;
+
+        uint32_t status;
+      retry:
+        status = htm_begin(site, 42);
+        if (status == HTM_STARTED) {
+            op = p->info;
+            ol = l->info;
+            if (p->marked || l->marked ||
+                stateOf(recordOf(op)) == SCX_IN_PROGRESS ||
+                stateOf(recordOf(ol)) == SCX_IN_PROGRESS)
+                htm_abort(42);
+            if (p->left == l)
+                p->left = in;
+            else if (p->right == l)
+                p->right = in;
+            else
+                htm_abort(42);
+            l->marked = true;
+            p->info = infoWord(op, r);
+            l->info = infoWord(ol, r);
+            htm_end(site);
+            release(recordOf(op), 1);
+            release(recordOf(ol), 1);
+            return true;
+        }
+        else {
+            if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
+                // try slow path
+            }
+            else if (htm_retry(site, status)) {
+                goto retry;
+            }
+            htm_fallback(site);
+        }
+        RP::free_unsafe(r);
+        return false;
+    }
+
+    /**
+     *  The fast path of remove: unlink /p/ and /l/ and finalize them, in a
+     *  transaction.  False if the slow path must do it.
+     */
+    bool txRemove(node_t * gp, node_t * p, node_t * l)
+    {
+        HTM_SITE(site, "bstset_sg_t::remove");
+        scx_t * r = alloc_scx(1, SCX_COMMITTED);
+        r->V[0] = gp;
+        cptr_word_t og, op, ol;
+
+        uint32_t status;
+      retry:
+        status = htm_begin(site, 42);
+        if (status == HTM_STARTED) {
+            og = gp->info;
+            op = p->info;
+            ol = l->info;
+            if (gp->marked || p->marked || l->marked ||
+                stateOf(recordOf(og)) == SCX_IN_PROGRESS ||
+                stateOf(recordOf(op)) == SCX_IN_PROGRESS ||
+                stateOf(recordOf(ol)) == SCX_IN_PROGRESS)
+                htm_abort(42);
+            node_t * s;
+            if (p->left == l)
+                s = p->right;
+            else if (p->right == l)
+                s = p->left;
+            else
+                htm_abort(42);
+            if (gp->left == p)
+                gp->left = s;
+            else if (gp->right == p)
+                gp->right = s;
+            else
+                htm_abort(42);
+            p->marked = true;
+            l->marked = true;
+            gp->info = infoWord(og, r);
+            p->info = infoWord(op, r);
+            l->info = infoWord(ol, r);
+            htm_end(site);
+            release(recordOf(og), 1);
+            release(recordOf(op), 1);
+            release(recordOf(ol), 1);
+            free_node_safe(p);
+            free_node_safe(l);
+            return true;
+        }
+        else {
+            if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
+                // try slow path
+            }
+            else if (htm_retry(site, status)) {
+                goto retry;
+            }
+            htm_fallback(site);
+        }
+        RP::free_unsafe(r);
+        return false;
+    }
+
+    /*** Number of leaves under /n/ */
+    static intptr_t countLeaves(node_t * n)
+    {
+        static thread_local std::vector<node_t *> todo;
+        intptr_t c = 0;
+        todo.clear();
+        todo.push_back(n);
+        while (!todo.empty()) {
+            node_t * y = todo.back();
+            todo.pop_back();
+            node_t * yl = y->left;
+            if (yl == NULL)
+                c++;
+            else {
+                todo.push_back(yl);
+                todo.push_back(y->right);
+            }
+        }
+        return c;
+    }
+
+    /**
+     *  The leaf for /key/ is too deep: walk up from it to the lowest
+     *  ancestor x whose height is more than maxHeight() of its subtree's
+     *  size, and rebuild x.  The sizes are counted without any
+     *  synchronization, since they only guide the choice of x.
+     */
+    void rebalance(int key)
+    {
+        static thread_local std::vector<node_t *> path;
+        path.clear();
+        node_t * n = root;
+        while (n->left != NULL) {
+            path.push_back(n);
+            n = (key < n->key) ? n->left : n->right;
+        }
+        intptr_t size = 1;
+        node_t * child = n;
+        for (int i = (int)path.size() - 1; i >= 1; i--) {
+            node_t * x = path[i];
+            node_t * sib = (x->left == child) ? x->right : x->left;
+            size += countLeaves(sib);
+            if ((int)path.size() - i > maxHeight(size)) {
+                rebuild(path[i - 1], x);
+                return;
+            }
+            child = x;
+        }
+    }
+
+    /** A balanced tree of new internal nodes over leaves[lo, hi) */
+    static node_t * build(const std::vector<node_t *> & leaves, int lo, int hi)
+    {
+        if (hi - lo == 1)
+            return leaves[lo];
+        int mid = (lo + hi) / 2;
+        return alloc_node(leaves[mid]->key, build(leaves, lo, mid), build(leaves, mid, hi));
+    }
+
+    /** Free the internal nodes made by build(), which nobody has seen */
+    static void unbuild(node_t * n)
+    {
+        if (n->left == NULL)
+            return;
+        unbuild(n->left);
+        unbuild(n->right);
+        free_node_unsafe(n);
+    }
+
+    /**
+     *  Replace the internal nodes of the subtree /x/, a child of /q/, by a
+     *  balanced tree over the same leaves, in one SCX.  The leaves stay, so
+     *  they need no LLX: they never change, and leave the tree only when an
+     *  internal node of V does.
+     */
+    bool rebuild(node_t * q, node_t * x)
+    {
+        static thread_local std::vector<node_t *> V, leaves, todo;
+        static thread_local std::vector<cptr_word_t> I;
+        V.clear();
+        I.clear();
+        leaves.clear();
+        todo.clear();
+
+        node_t * ql, * qr;
+        cptr_word_t qi;
+        if (llx(q, ql, qr, qi) != LLX_OK || (ql != x && qr != x))
+            return false;
+        V.push_back(q);
+        I.push_back(qi);
+
+        // visit left before right, so the leaves come out in key order
+        todo.push_back(x);
+        while (!todo.empty()) {
+            node_t * y = todo.back();
+            todo.pop_back();
+            if (y->left == NULL) {
+                leaves.push_back(y);
+                continue;
+            }
+            node_t * yl, * yr;
+            cptr_word_t yi;
+            if (llx(y, yl, yr, yi) != LLX_OK)
+                return false;
+            V.push_back(y);
+            I.push_back(yi);
+            todo.push_back(yr);
+            todo.push_back(yl);
+        }
+
+        node_t * nw = build(leaves, 0, leaves.size());
+        if (scx(V.data(), I.data(), V.size(), (ql == x) ? &q->left : &q->right, x, nw)) {
+            for (size_t i = 1; i < V.size(); i++)
+                free_node_safe(V[i]);
+            return true;
+        }
+        unbuild(nw);
+        return false;
+    }
+};
@@ -0,0 +1,730 @@
+#pragma once
+
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <cstdint>
+#include <atomic>
+#include <functional>
+#include <type_traits>
+#include <x86intrin.h>
+
+#include "common.hpp"
+#include "reclaim.hpp"
+
+using std::atomic;
+using std::stringstream;
+using std::string;
+using std::endl;
+
+/**
+ *  An ordered map from K to V, in the order of CMP.  It is bstset_t, with
+ *  its layout and tagged info words, and a value in every leaf.  With FAST
+ *  it also takes the fast paths of bstset_htm3_t: get() runs in one
+ *  transaction, and an insert or remove that finds its nodes clean makes
+ *  its change in one transaction instead of flagging them.  The
+ *  transaction leaves the info words it touched as a finished update
+ *  would, so the two paths mix freely.
+ *
+ *  The int sets route with a key of INT_MAX above the real ones, and so
+ *  cannot store it.  Here the two sentinel leaves, and every internal node
+ *  that routes to them, have /inf/ set, which orders them after every key,
+ *  so all of K is usable.
+ *
+ *  A leaf points to its value, and the first value lives in the leaf
+ *  itself, so a lookup of a key that was never updated reads no other
+ *  line.  put() and replace() of a present key swap that pointer for a new
+ *  value with one CAS, and leave the tree alone.
+ *
+ *  The pointer's low bit freezes it.  An insert replaces the leaf it lands
+ *  on with a copy, and a remove unlinks its leaf.  Both freeze that leaf
+ *  once they have flagged the tree, so no update can land on a leaf on its
+ *  way out.  An insert whose copy holds a value that changed before the
+ *  freeze gives up and copies the frozen one.  A leaf left frozen by a
+ *  remove that gave up is replaced by a fresh copy at the next update of
+ *  its key.
+ *
+ *  K and V must be trivially copyable.
+ */
+template<class K, class V, class RP = wbmm_policy_t, class CMP = std::less<K>, bool FAST = false>
+class bstmap_t
+{
+    static_assert(std::is_trivially_copyable<K>::value, "keys are copied between leaves");
+    static_assert(std::is_trivially_copyable<V>::value, "values are copied between leaves");
+
+    /**
+     *  What every node has.  /inf/ orders the node after every key.  /slot/
+     *  and /live/ are as in bstset_t.
+     */
+    struct bstnode_t
+    {
+        K                 key;
+        uint8_t           leaf;
+        uint8_t           inf;
+        uint8_t           slot;
+        atomic<uint16_t>  live;
+    };
+
+    struct inode_t : bstnode_t
+    {
+        atomic<bstnode_t *> left;
+        atomic<bstnode_t *> right;
+        atomic<uintptr_t>   info;
+    };
+
+    /*** /val/ points to /first/ until the first update of the key */
+    struct lnode_t : bstnode_t
+    {
+        atomic<V *> val;
+        V           first;
+    };
+
+    /*** The nodes an insert adds; they leave the tree one at a time */
+    struct block_t
+    {
+        inode_t  in;
+        lnode_t  leaves[2];
+    };
+
+    static_assert(sizeof(inode_t) % alignof(lnode_t) == 0, "block_of() assumes no padding");
+
+    static const uint8_t NO_BLOCK = 0xFF;
+
+    /*** The state of an info word, in the low bits of its record pointer */
+    enum infotype_t {
+        CLEAN = 0,
+        IINFO = 1,
+        DINFO = 2,
+        MARK  = 3
+    };
+
+    static const uintptr_t INFO_TYPE_MASK = 3;
+
+    /**
+     *  An insert record: replace the leaf l by newChild, which copied l's
+     *  value /lval/.  That is a new internal node for an insert, and a copy
+     *  of l for an update that finds l frozen.
+     */
+    struct iinfo_t
+    {
+        lnode_t *   l;
+        bstnode_t * newChild;
+        V *         lval;
+    };
+
+    /*** A delete record; gp's info word is DINFO, and p's becomes MARK */
+    struct dinfo_t
+    {
+        inode_t *   gp;
+        inode_t *   p;
+        lnode_t *   l;
+        uintptr_t   pinfo;
+    };
+
+    static inline infotype_t GET_INFO_TYPE(uintptr_t info) {
+        return (infotype_t)(info & INFO_TYPE_MASK);
+    }
+
+    static inline bool INFO_IS_CLEAN(uintptr_t info) {
+        return GET_INFO_TYPE(info) == CLEAN;
+    }
+
+    template<class T>
+    static inline T * INFO_RECORD(uintptr_t info) {
+        return (T *)(info & ~INFO_TYPE_MASK);
+    }
+
+    static inline uintptr_t INFO_WORD(void * record, infotype_t type) {
+        return (uintptr_t)record | type;
+    }
+
+    static inline V * VAL_OF(V * w) {
+        return (V *)REF_UNMARKED(w);
+    }
+
+    static inline inode_t * inner(bstnode_t * n) {
+        return static_cast<inode_t *>(n);
+    }
+
+    static inline lnode_t * leaf(bstnode_t * n) {
+        return static_cast<lnode_t *>(n);
+    }
+
+    static void init_leaf(lnode_t * l, const K & key, bool inf, const V & val)
+    {
+        l->key = key;
+        l->inf = inf;
+        l->first = val;
+        l->val = &l->first;
+    }
+
+    /** Allocate a leaf node on its own, for the sentinels and copies. */
+    static lnode_t * alloc_bstnode(const K & key, bool inf, const V & val)
+    {
+        lnode_t * l = (lnode_t *)RP::alloc(sizeof(lnode_t));
+        l->leaf = true;
+        l->slot = NO_BLOCK;
+        init_leaf(l, key, inf, val);
+        return l;
+    }
+
+    /** Allocate an internal node on its own, for the root. */
+    static inode_t * alloc_bstnode(bstnode_t * left, bstnode_t * right)
+    {
+        inode_t * i = (inode_t *)RP::alloc(sizeof(inode_t));
+        i->inf = true;
+        i->leaf = false;
+        i->slot = NO_BLOCK;
+        i->left = left;
+        i->right = right;
+        i->info = 0;
+        return i;
+    }
+
+    static block_t * alloc_block()
+    {
+        block_t * b = (block_t *)RP::alloc(sizeof(block_t));
+        b->in.leaf = false;
+        b->in.slot = 0;
+        b->in.info = 0;
+        for (int i = 0; i < 2; i++) {
+            b->leaves[i].leaf = true;
+            b->leaves[i].slot = i + 1;
+        }
+        return b;
+    }
+
+    /**
+     *  Set up /b/ to replace the leaf /l/ by an internal node over a new
+     *  leaf for /key/ and a copy of l with the value /lval/, and return the
+     *  internal node.
+     */
+    inode_t * fill_block(block_t * b, const K & key, const V & val, lnode_t * l, V * lval)
+    {
+        lnode_t * newNode = &b->leaves[0];
+        lnode_t * newSibling = &b->leaves[1];
+        init_leaf(newNode, key, false, val);
+        init_leaf(newSibling, l->key, l->inf, *lval);
+        b->in.live = 3;
+        if (goesLeft(key, l)) {
+            b->in.key = l->key;
+            b->in.inf = l->inf;
+            b->in.left = newNode;
+            b->in.right = newSibling;
+        }
+        else {
+            b->in.key = key;
+            b->in.inf = false;
+            b->in.left = newSibling;
+            b->in.right = newNode;
+        }
+        return &b->in;
+    }
+
+    static block_t * block_of(bstnode_t * n)
+    {
+        if (n->slot == 0)
+            return (block_t *)n;
+        return (block_t *)((char *)n - sizeof(inode_t) - (n->slot - 1) * sizeof(lnode_t));
+    }
+
+    static V * alloc_val(const V & val)
+    {
+        V * v = (V *)RP::alloc(sizeof(V));
+        *v = val;
+        return v;
+    }
+
+    /** Retire /v/, a value of the leaf /l/, unless it lives in l */
+    static void free_val_safe(lnode_t * l, V * v)
+    {
+        if (v != &l->first)
+            RP::free_safe(v);
+    }
+
+    /**
+     *  /n/ has left the tree; the last node of a block to go retires it.  A
+     *  leaf leaves frozen, so its value goes with it.
+     */
+    static void free_bstnode_safe(bstnode_t * n)
+    {
+        if (n->leaf)
+            free_val_safe(leaf(n), VAL_OF(leaf(n)->val));
+        if (n->slot == NO_BLOCK) {
+            RP::free_safe(n);
+            return;
+        }
+        block_t * b = block_of(n);
+        if (b->in.live.fetch_sub(1) == 1)
+            RP::free_safe(b);
+    }
+
+    static iinfo_t * alloc_iinfo()
+    {
+        return (iinfo_t *)RP::alloc(sizeof(iinfo_t));
+    }
+
+    static dinfo_t * alloc_dinfo()
+    {
+        return (dinfo_t *)RP::alloc(sizeof(dinfo_t));
+    }
+
+    /** Free the record of an info word that was just replaced. */
+    static void free_info_safe(uintptr_t info)
+    {
+        void * r = INFO_RECORD<void>(info);
+        if (r) RP::free_safe(r);
+    }
+
+    /** Freeze the value pointer of /l/, and return the value it froze */
+    static V * freeze(lnode_t * l)
+    {
+        V * w = l->val;
+        while (!IS_MARKED(w) && !bcas(&l->val, &w, (V *)REF_MARKED(w)))
+            ;
+        return VAL_OF(w);
+    }
+
+  private:
+
+    inode_t * root;
+
+    CMP cmp;
+
+    /** Keys below an internal node's key go left, and every key is below inf */
+    bool goesLeft(const K & key, bstnode_t * n) const
+    {
+        return n->inf || cmp(key, n->key);
+    }
+
+    bool matches(const K & key, bstnode_t * l) const
+    {
+        return !l->inf && !cmp(key, l->key) && !cmp(l->key, key);
+    }
+
+  public:
+    bstmap_t()
+    {
+        lnode_t * l1 = alloc_bstnode(K(), true, V());
+        lnode_t * l2 = alloc_bstnode(K(), true, V());
+        root = alloc_bstnode(l1, l2);
+    }
+
+    /** Copy the value of /key/ into /val/, if the key is present */
+    bool get(K key, V & val)
+    {
+        if (FAST) {
+            HTM_SITE(site, "bstmap_t::get");
+            uint32_t status;
+          retry:
+            status = htm_begin(site, 42);
+            if (status == HTM_STARTED) {
+                bstnode_t * l = root->left;
+                while (!l->leaf)
+                    l = goesLeft(key, l) ? inner(l)->left : inner(l)->right;
+                bool result = matches(key, l);
+                if (result)
+                    val = *VAL_OF(leaf(l)->val);
+                htm_end(site);
+                return result;
+            }
+            else {
+                if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
+                    // try slow path
+                }
+                else if (htm_retry(site, status)) {
+                    goto retry;
+                }
+                htm_fallback(site);
+            }
+        }
+
+        RP::begin();
+        bstnode_t * l = root->left;
+        while (!l->leaf)
+            l = goesLeft(key, l) ? inner(l)->left : inner(l)->right;
+        bool result = matches(key, l);
+        // a frozen leaf keeps the value it had when it froze, while it was
+        // still in the tree
+        if (result)
+            val = *VAL_OF(leaf(l)->val);
+        RP::end();
+        return result;
+    }
+
+    bool contains(K key)
+    {
+        V v;
+        return get(key, v);
+    }
+
+    /** Map /key/ to /val/.  Returns true if the key was not present */
+    bool put(K key, V val)
+    {
+        return !update(key, val, true, true);
+    }
+
+    /** Map /key/ to /val/ unless it is present.  Returns true if it was not */
+    bool putIfAbsent(K key, V val)
+    {
+        return !update(key, val, true, false);
+    }
+
+    /** Give /key/ the value /val/ only if it is present */
+    bool replace(K key, V val)
+    {
+        return update(key, val, false, true);
+    }
+
+    bool remove(K key)
+    {
+        RP::begin();
+
+        dinfo_t * newGPInfo = NULL;
+        uintptr_t gpinfo;
+        uintptr_t pinfo;
+        inode_t * gp;
+        inode_t * p;
+        bstnode_t * l;
+        bool result;
+
+        while (true) {
+            /** SEARCH **/
+            gp = NULL;
+            gpinfo = 0;
+            p = root;
+            pinfo = p->info;
+            l = p->left;
+            while (!l->leaf) {
+                gp = p;
+                p = inner(l);
+                l = goesLeft(key, l) ? p->left : p->right;
+            }
+
+            if (gp != NULL) {
+                gpinfo = gp->info;
+                if (p != gp->left && p != gp->right)
+                    continue;
+                pinfo = p->info;
+                if (l != p->left && l != p->right)
+                    continue;
+            }
+            /** END SEARCH **/
+
+            if (!matches(key, l)) {
+                result = false;
+                break;
+            }
+            else if (!INFO_IS_CLEAN(gpinfo))
+                help(gp, gpinfo);
+            else if (!INFO_IS_CLEAN(pinfo))
+                help(p, pinfo);
+            else {
+                if (newGPInfo == NULL)
+                    newGPInfo = alloc_dinfo();
+                *newGPInfo = {gp, p, leaf(l), pinfo};
+
+                if (FAST && txRemove(newGPInfo, gpinfo)) {
+                    newGPInfo = NULL;
+                    result = true;
+                    break;
+                }
+
+                // try to DFlag grandparent
+                uintptr_t oldGPInfo = gpinfo;
+                if (bcas(&gp->info, &oldGPInfo, INFO_WORD(newGPInfo, DINFO))) {
+                    free_info_safe(gpinfo); // free old info object
+                    // gp's info word owns the record now, even on a backtrack
+                    dinfo_t * info = newGPInfo;
+                    newGPInfo = NULL;
+                    if (helpDelete(info)) {
+                        result = true;
+                        break;
+                    }
+                }
+                else {
+                    help(gp, gp->info);
+                }
+            }
+        }
+
+        if (newGPInfo != NULL)
+            RP::free_unsafe(newGPInfo); // free local object
+
+        RP::end();
+        return result;
+    }
+
+    bool grow() { return false; }
+    bool shrink() { return false; }
+
+  private:
+
+    /**
+     *  Give /key/ the value /val/ if it is absent and /ifAbsent/, or if it
+     *  is present and /ifPresent/.  Returns true if the key was present.
+     */
+    bool update(const K & key, const V & val, bool ifAbsent, bool ifPresent)
+    {
+        RP::begin();
+
+        block_t * newBlock = NULL;
+        iinfo_t * newPInfo = NULL;
+        V * newVal = NULL;
+        inode_t * p;
+        bstnode_t * l;
+        uintptr_t pinfo;
+        bool found;
+
+        while (true) {
+            /** SEARCH **/
+            p = root;
+            l = p->left;
+            while (!l->leaf) {
+                p = inner(l);
+                l = goesLeft(key, l) ? p->left : p->right;
+            }
+            pinfo = p->info;
+            if (l != p->left && l != p->right)
+                continue;
+            /** END SEARCH **/
+
+            found = matches(key, l);
+            if (found ? !ifPresent : !ifAbsent)
+                break;
+
+            if (found) {
+                // an unfrozen leaf is in the tree, so the swap is the update
+                V * w = leaf(l)->val;
+                if (!IS_MARKED(w)) {
+                    if (newVal == NULL)
+                        newVal = alloc_val(val);
+                    while (!IS_MARKED(w)) {
+                        if (bcas(&leaf(l)->val, &w, newVal)) {
+                            free_val_safe(leaf(l), w);
+                            newVal = NULL;
+                            goto exit;
+                        }
+                    }
+                }
+                if (!INFO_IS_CLEAN(pinfo)) {
+                    help(p, pinfo);
+                    continue;
+                }
+                // nobody is taking l out, so swap in a copy to update
+                if (newPInfo == NULL)
+                    newPInfo = alloc_iinfo();
+                lnode_t * copy = alloc_bstnode(l->key, false, *VAL_OF(w));
+                if (!replaceLeaf(p, leaf(l), pinfo, copy, VAL_OF(w), newPInfo))
+                    RP::free_unsafe(copy);
+                continue;
+            }
+
+            if (!INFO_IS_CLEAN(pinfo)) {
+                help(p, pinfo);
+                continue;
+            }
+
+            // a failed attempt leaves these private, so keep them
+            if (newBlock == NULL)
+                newBlock = alloc_block();
+            if (newPInfo == NULL)
+                newPInfo = alloc_iinfo();
+            V * lval = VAL_OF(leaf(l)->val);
+            inode_t * in = fill_block(newBlock, key, val, leaf(l), lval);
+            if (replaceLeaf(p, leaf(l), pinfo, in, lval, newPInfo)) {
+                newBlock = NULL;
+                break;
+            }
+        }
+
+      exit:
+        // free local objects
+        if (newBlock != NULL)
+            RP::free_unsafe(newBlock);
+        if (newPInfo != NULL)
+            RP::free_unsafe(newPInfo);
+        if (newVal != NULL)
+            RP::free_unsafe(newVal);
+        RP::end();
+        return found;
+    }
+
+    /**
+     *  Replace the leaf /l/, a child of /p/ whose info word was /pinfo/, by
+     *  /n/, which holds a copy of l's value /lval/.  Returns false if p
+     *  changed first, or l's value did; n stays private then.  /r/ is the
+     *  record to flag p with, and is NULL after if p's info word took it.
+     */
+    bool replaceLeaf(inode_t * p, lnode_t * l, uintptr_t pinfo, bstnode_t * n, V * lval,
+                     iinfo_t *& r)
+    {
+        r->l = l;
+        r->newChild = n;
+        r->lval = lval;
+
+        if (FAST && txInsert(p, r, pinfo)) {
+            r = NULL;
+            return true;
+        }
+
+        // try to IFlag parent
+        if (bcas(&p->info, &pinfo, INFO_WORD(r, IINFO))) {
+            free_info_safe(pinfo); // reclaim old info object
+            iinfo_t * info = r;
+            r = NULL;
+            return helpInsert(p, info);
+        }
+        help(p, pinfo);
+        return false;
+    }
+
+    /**
+     *  Carry out the insert /r/ at /p/ in one transaction, and leave p's
+     *  info word clean, as helpInsert() would.  False if that fails.
+     */
+    bool txInsert(inode_t * p, iinfo_t * r, uintptr_t pinfo)
+    {
+        HTM_SITE(site, "bstmap_t::insert");
+        lnode_t * l = r->l;
+        uint32_t status;
+      retry:
+        status = htm_begin(site, 42);
+        if (status == HTM_STARTED) {
+            V * w = l->val;
+            if (p->info != pinfo || VAL_OF(w) != r->lval)
+                htm_abort(42);
+            (p->left == l) ? p->left = r->newChild : p->right = r->newChild;
+            l->val = (V *)REF_MARKED(w);
+            p->info = INFO_WORD(r, CLEAN);
+            htm_end(site);
+            free_info_safe(pinfo);
+            free_bstnode_safe(l);
+            return true;
+        }
+        else {
+            if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
+                // try slow path
+            }
+            else if (htm_retry(site, status)) {
+                goto retry;
+            }
+            htm_fallback(site);
+        }
+        return false;
+    }
+
+    /**
+     *  Carry out the delete /r/ in one transaction, and leave gp's and p's
+     *  info words as helpMarked() would.  False if that fails.
+     */
+    bool txRemove(dinfo_t * r, uintptr_t gpinfo)
+    {
+        HTM_SITE(site, "bstmap_t::remove");
+        inode_t * gp = r->gp;
+        inode_t * p = r->p;
+        lnode_t * l = r->l;
+        uint32_t status;
+      retry:
+        status = htm_begin(site, 42);
+        if (status == HTM_STARTED) {
+            if (gp->info != gpinfo || p->info != r->pinfo)
+                htm_abort(42);
+            bstnode_t * other = (p->right == l) ? p->left : p->right;
+            (gp->left == p) ? gp->left = other : gp->right = other;
+            l->val = (V *)REF_MARKED(l->val.load());
+            p->info = INFO_WORD(r, MARK);
+            gp->info = INFO_WORD(r, CLEAN);
+            htm_end(site);
+            free_info_safe(gpinfo);
+            free_info_safe(r->pinfo);
+            free_bstnode_safe(l);
+            free_bstnode_safe(p);
+            return true;
+        }
+        else {
+            if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
+                // try slow path
+            }
+            else if (htm_retry(site, status)) {
+                goto retry;
+            }
+            htm_fallback(site);
+        }
+        return false;
+    }
+
+    /** Help the update whose record /info/ was read from /n/'s info word */
+    void help(inode_t * n, uintptr_t info)
+    {
+        if (GET_INFO_TYPE(info) == IINFO)
+            helpInsert(n, INFO_RECORD<iinfo_t>(info));
+        else if (GET_INFO_TYPE(info) == DINFO)
+            helpDelete(INFO_RECORD<dinfo_t>(info));
+        else if (GET_INFO_TYPE(info) == MARK)
+            helpMarked(INFO_RECORD<dinfo_t>(info));
+    }
+
+    /**
+     *  Every helper freezes l first, and so sees the same frozen value.  The
+     *  insert links its copy only if that is the value it copied.
+     */
+    bool helpInsert(inode_t * p, iinfo_t * info)
+    {
+        lnode_t * l = info->l;
+        bool result = freeze(l) == info->lval;
+        if (result) {
+            bstnode_t * expected = l;
+            atomic<bstnode_t *> * ptr = (p->left == l) ? &p->left : &p->right;
+            if (bcas(ptr, &expected, info->newChild))
+                free_bstnode_safe(l);
+        }
+        // the clean word keeps the record, so that it differs from all before
+        uintptr_t flagged = INFO_WORD(info, IINFO);
+        bcas(&p->info, &flagged, INFO_WORD(info, CLEAN));
+        return result;
+    }
+
+    bool helpDelete(dinfo_t * info)
+    {
+        inode_t * p = info->p;
+        uintptr_t pinfo = info->pinfo;
+        uintptr_t marked = INFO_WORD(info, MARK);
+
+        // no update may land on l once the mark removes its key
+        freeze(info->l);
+
+        if (bcas(&p->info, &pinfo, marked)) {
+            free_info_safe(info->pinfo); // reclaim old pinfo
+            helpMarked(info);
+            return true;
+        }
+        else if (pinfo == marked) {
+            helpMarked(info);
+            return true;
+        }
+        else {
+            help(p, pinfo);
+            uintptr_t flagged = INFO_WORD(info, DINFO);
+            bcas(&info->gp->info, &flagged, INFO_WORD(info, CLEAN));
+            return false;
+        }
+    }
+
+    void helpMarked(dinfo_t * info)
+    {
+        lnode_t * l = info->l;
+        inode_t * p = info->p;
+        inode_t * gp = info->gp;
+
+        bstnode_t * other = (p->right == l) ? p->left : p->right;
+        atomic<bstnode_t *> * ptr = (gp->left == p) ? &gp->left : &gp->right;
+        bstnode_t * expected = p;
+        if (bcas(ptr, &expected, other)) {
+            free_bstnode_safe(l); // reclaim l
+            free_bstnode_safe(p); // reclaim p; its MARK word belongs to gp's record
+        }
+        uintptr_t flagged = INFO_WORD(info, DINFO);
+        bcas(&gp->info, &flagged, INFO_WORD(info, CLEAN));
+    }
+};
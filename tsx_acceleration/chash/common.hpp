@@ -1,17 +1,19 @@
 #pragma once
 
 #include <atomic>
+#include <cstdint>
 
-#define bcas(p, o, n)   std::atomic_compare_exchange_strong((p), (o), (n))
+#include "../common/htm.hpp"
+
+#define bcas(p, o, n)   ((p)->compare_exchange_strong(*(o), (n)))
 #define faiu(c)         std::atomic_fetch_add((c), (uint32_t)1)
-#define xld(a)          std::atomic_load_explicit((a), memory_order::memory_order_relaxed)
-#define xst(a, v)       std::atomic_store_explicit((a), (v), memory_order::memory_order_relaxed)
+#define xld(a)          ((a)->load(std::memory_order_relaxed))
+#define xst(a, v)       ((a)->store((v), std::memory_order_relaxed))
 
 #define IS_MARKED(x)     ((uintptr_t)(x) & 0x1)
 #define REF_MARKED(x)    ((uintptr_t)(x) | 0x1)
 #define REF_UNMARKED(x)  ((uintptr_t)(x) & ~0x1)
 
-static const uintptr_t MAX_THREADS = 64;
 static const uintptr_t CACHELINE_BYTES = 64;
 
 struct pad_word_t {
@@ -19,19 +21,106 @@ struct pad_word_t {
     char pad[CACHELINE_BYTES-sizeof(uintptr_t)];
 };
 
+/**
+ *  A counted pointer is a pointer and a counter that are read and CAS'd as
+ *  one word.  On 32-bit targets that word is a uint64_t; on 64-bit targets it
+ *  is 128 bits wide and relies on cmpxchg16b (build with -mcx16).  The
+ *  counter is always pointer-sized, so the fields cover the whole word and
+ *  comparisons of .all never see uninitialized padding.  A shared word is a
+ *  cptr_atomic_t.
+ */
+#if UINTPTR_MAX == 0xFFFFFFFFu
+typedef uint64_t cptr_word_t;
+typedef cptr_atomic_t cptr_atomic_t;
+#else
+typedef unsigned __int128 cptr_word_t;
+
+/**
+ *  GCC's std::atomic of a 128-bit word is not lock-free: every access,
+ *  loads included, is a call into libatomic, which does a locked cmpxchg16b
+ *  (and in a transaction, turns a read into a write).  So the shared word is
+ *  kept plain instead.  CAS is an inline cmpxchg16b, from the __sync
+ *  builtins.  A load reads the counter half, then the pointer half, then the
+ *  counter half again, and retries if it moved: every CAS changes the
+ *  counter half, and x86 does not reorder loads with loads.
+ *
+ *  A store is plain, too, so it is only for a word that no other thread can
+ *  see yet, or for a transaction.
+ */
+struct alignas(2*sizeof(void*)) cptr_atomic_t
+{
+    cptr_word_t word;
+
+    cptr_word_t load(std::memory_order = std::memory_order_seq_cst) const
+    {
+        const volatile uint64_t * h = (const volatile uint64_t *)&word;
+        while (true) {
+            uint64_t ctr = h[1];
+            uint64_t ptr = h[0];
+            if (h[1] == ctr)
+                return ((cptr_word_t)ctr << 64) | ptr;
+        }
+    }
+
+    void store(cptr_word_t v, std::memory_order = std::memory_order_seq_cst)
+    {
+        volatile uint64_t * h = (volatile uint64_t *)&word;
+        h[0] = (uint64_t)v;
+        h[1] = (uint64_t)(v >> 64);
+    }
+
+    bool compare_exchange_strong(cptr_word_t & expected, cptr_word_t desired)
+    {
+        cptr_word_t prev = __sync_val_compare_and_swap(&word, expected, desired);
+        if (prev == expected)
+            return true;
+        expected = prev;
+        return false;
+    }
+
+    operator cptr_word_t() const { return load(); }
+
+    cptr_word_t operator=(cptr_word_t v)
+    {
+        store(v);
+        return v;
+    }
+};
+#endif
+
 template<typename T>
-union alignas(8) cptr_t
+union alignas(2*sizeof(void*)) cptr_t
 {
     struct
     {
-        T *      ptr;
-        uint32_t ctr;
+        T *       ptr;
+        uintptr_t ctr;
     } fields;
-    uint64_t all;
+    cptr_word_t all;
 };
 
 #define MAKE_CPTR(w, p, c) { (w).fields.ptr = p; (w).fields.ctr = (c); }
 
+/**
+ *  Largest bucket array of the hash sets and the hash map, as a power of
+ *  two.  The load factor decides when a table resizes (see counter.hpp), so
+ *  this is only a backstop.  Sizes are ints that double, so 30 is the most
+ *  that cannot overflow.
+ *
+ *  The default comes from -DCHASH_MAX_BUCKET_BITS=n (or make BUCKET_BITS=n).
+ */
+#ifndef CHASH_MAX_BUCKET_BITS
+#define CHASH_MAX_BUCKET_BITS 30
+#endif
+static_assert(CHASH_MAX_BUCKET_BITS <= 30, "hash table sizes are ints");
+
+static int chash_max_bucket_bits = CHASH_MAX_BUCKET_BITS;
+
+static inline int chash_max_buckets()
+{
+    return 1 << chash_max_bucket_bits;
+}
+
 #define nop()               asm volatile("nop")
 
 /** Issue 64 nops to provide a little busy waiting */
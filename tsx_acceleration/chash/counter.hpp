@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "common.hpp"
+#include "mm.hpp"
+
+/**
+ *  An approximate, scalable element count for the hash sets and the hash
+ *  map.  Each thread adds its inserts (+1) and removes (-1) to a padded word
+ *  of its own, indexed by its reclamation slot, and folds that word into the
+ *  shared total only once it has drifted COUNTER_BATCH away from zero.  So
+ *  the shared line is written once per COUNTER_BATCH updates per thread, and
+ *  get() is off by less than COUNTER_BATCH per thread slot.
+ *
+ *  A pending delta belongs to the slot, not the thread, so a thread that
+ *  takes over a slot picks it up, and nothing is lost when threads come and
+ *  go.
+ */
+class approx_counter_t
+{
+    /*** Largest pending delta a thread may hold back from the total */
+    static const intptr_t COUNTER_BATCH = 16;
+
+    atomic<intptr_t> total;
+    char pad[CACHELINE_BYTES - sizeof(atomic<intptr_t>)];
+
+    /*** Pending deltas; chunks are added on first use by some slot in them */
+    atomic<pad_word_t *> chunks[WBMM_MAX_CHUNKS];
+
+    pad_word_t & slot(uintptr_t tid)
+    {
+        atomic<pad_word_t *> & c = chunks[tid / WBMM_SLOT_CHUNK];
+        pad_word_t * p = c.load(std::memory_order_acquire);
+        if (p == NULL) {
+            pad_word_t * n = new pad_word_t[WBMM_SLOT_CHUNK]();
+            if (bcas(&c, &p, n))
+                p = n;
+            else
+                delete [] n;
+        }
+        return p[tid % WBMM_SLOT_CHUNK];
+    }
+
+  public:
+
+    approx_counter_t() : total(0)
+    {
+        for (uintptr_t i = 0; i < WBMM_MAX_CHUNKS; i++)
+            chunks[i] = NULL;
+    }
+
+    ~approx_counter_t()
+    {
+        for (uintptr_t i = 0; i < WBMM_MAX_CHUNKS; i++)
+            delete [] chunks[i].load();
+    }
+
+    void add(uintptr_t tid, intptr_t delta)
+    {
+        pad_word_t & w = slot(tid);
+        intptr_t v = (intptr_t)w.val.load(std::memory_order_relaxed) + delta;
+        if (v >= COUNTER_BATCH || v <= -COUNTER_BATCH) {
+            total.fetch_add(v);
+            v = 0;
+        }
+        w.val.store((uintptr_t)v, std::memory_order_relaxed);
+    }
+
+    intptr_t get()
+    {
+        return total.load(std::memory_order_relaxed);
+    }
+};
+
+/**
+ *  The load-factor policy of the hash tables.  A table doubles once it holds
+ *  more than CHASH_GROW_LOAD keys per bucket, and halves once it holds fewer
+ *  than 1 / CHASH_SHRINK_LOAD.  Either change leaves the load at 1, so it
+ *  takes a 2x change in the number of keys to resize again; one hot bucket
+ *  never resizes the table by itself.
+ */
+static const intptr_t CHASH_GROW_LOAD   = 2;
+static const intptr_t CHASH_SHRINK_LOAD = 2;
+
+static inline bool chash_should_grow(intptr_t keys, int size)
+{
+    return keys > CHASH_GROW_LOAD * size;
+}
+
+static inline bool chash_should_shrink(intptr_t keys, int size)
+{
+    return keys * CHASH_SHRINK_LOAD < size;
+}
@@ -0,0 +1,401 @@
+#pragma once
+
+#include <cstdint>
+#include <immintrin.h>
+
+/**
+ *  Kernels for the flat sets (fsets) that hold one hash bucket.  An fset is
+ *  an int array: o[0] is the number of keys, and o[1..o[0]] are the keys, in
+ *  no particular order.  Buckets hold only a few keys, so the kernels compare
+ *  a whole vector of keys per instruction.  They never read past the end of
+ *  the array, because a partial vector is read with a masked load.
+ *
+ *  We pick the widest instruction set the CPU supports once, at startup.
+ *  Each kernel also has a scalar version, which is the fallback.  For short
+ *  buckets, the vector setup costs more than the compares it saves, so the
+ *  scalar loop also handles any bucket of at most FSET_SCALAR_MAX keys.
+ *
+ *  These run inside HTM fast paths too.  None of them call into the
+ *  allocator or touch memory outside the arrays they are given.
+ */
+
+enum fset_isa_t { FSET_SCALAR, FSET_SSE2, FSET_AVX2, FSET_AVX512 };
+
+static inline fset_isa_t fset_detect_isa()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return FSET_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return FSET_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return FSET_SSE2;
+    return FSET_SCALAR;
+}
+
+/*** Probed once at startup; never changes afterward */
+static const fset_isa_t fset_isa = fset_detect_isa();
+
+/*** Longest bucket that the scalar loop scans faster than a vector kernel */
+#define FSET_SCALAR_MAX 8
+
+/***  Return the index of /key/ in /o/ (1-based), or 0 if it is not there */
+static inline int fset_find_scalar(const int * o, int key)
+{
+    for (int i = 1; i <= o[0]; i++)
+        if (o[i] == key)
+            return i;
+    return 0;
+}
+
+__attribute__((target("sse2")))
+static int fset_find_sse2(const int * o, int key)
+{
+    const int * p = o + 1;
+    int len = o[0], i = 0;
+    __m128i k = _mm_set1_epi32(key);
+    for (; i + 4 <= len; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        int m = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, k)));
+        if (m)
+            return i + __builtin_ctz(m) + 1;
+    }
+    for (; i < len; i++)
+        if (p[i] == key)
+            return i + 1;
+    return 0;
+}
+
+__attribute__((target("avx2")))
+static int fset_find_avx2(const int * o, int key)
+{
+    const int * p = o + 1;
+    int len = o[0];
+    __m256i k = _mm256_set1_epi32(key);
+    __m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    for (int i = 0; i < len; i += 8) {
+        // lanes at or past the end read as 0, so mask them out of the match
+        __m256i lanes = _mm256_cmpgt_epi32(_mm256_set1_epi32(len - i), idx);
+        __m256i v = _mm256_maskload_epi32(p + i, lanes);
+        __m256i eq = _mm256_and_si256(_mm256_cmpeq_epi32(v, k), lanes);
+        int m = _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+        if (m)
+            return i + __builtin_ctz(m) + 1;
+    }
+    return 0;
+}
+
+__attribute__((target("avx512f")))
+static int fset_find_avx512(const int * o, int key)
+{
+    const int * p = o + 1;
+    int len = o[0];
+    __m512i k = _mm512_set1_epi32(key);
+    for (int i = 0; i < len; i += 16) {
+        __mmask16 lanes = (len - i >= 16) ? 0xFFFF : (__mmask16)((1u << (len - i)) - 1);
+        __m512i v = _mm512_maskz_loadu_epi32(lanes, p + i);
+        __mmask16 m = _mm512_mask_cmpeq_epi32_mask(lanes, v, k);
+        if (m)
+            return i + __builtin_ctz(m) + 1;
+    }
+    return 0;
+}
+
+/***  Vector dispatch for fset_find; kept out of line so fset_find inlines */
+static int fset_find_wide(const int * o, int key)
+{
+    switch (fset_isa) {
+      case FSET_AVX512: return fset_find_avx512(o, key);
+      case FSET_AVX2:   return fset_find_avx2(o, key);
+      case FSET_SSE2:   return fset_find_sse2(o, key);
+      default:          return fset_find_scalar(o, key);
+    }
+}
+
+__attribute__((always_inline))
+static inline int fset_find(const int * o, int key)
+{
+    if (o[0] > FSET_SCALAR_MAX)
+        return fset_find_wide(o, key);
+    return fset_find_scalar(o, key);
+}
+
+/**
+ *  Copy the keys of /o/ with (key & mask) == rem into n[1...], and return how
+ *  many there were.  When /n/ is NULL, only count them.  With a power-of-two
+ *  table size and non-negative keys, this is the key % size == rem test of a
+ *  bucket split.
+ */
+static inline int fset_filter_scalar(const int * o, int * n, int mask, int rem)
+{
+    int j = 0;
+    for (int i = 1; i <= o[0]; i++)
+        if ((o[i] & mask) == rem) {
+            if (n)
+                n[j + 1] = o[i];
+            j++;
+        }
+    return j;
+}
+
+__attribute__((target("sse2")))
+static int fset_filter_sse2(const int * o, int * n, int mask, int rem)
+{
+    const int * p = o + 1;
+    int len = o[0], i = 0, j = 0;
+    __m128i vm = _mm_set1_epi32(mask), vr = _mm_set1_epi32(rem);
+    for (; i + 4 <= len; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        int m = _mm_movemask_ps(_mm_castsi128_ps(
+                    _mm_cmpeq_epi32(_mm_and_si128(v, vm), vr)));
+        if (!n) {
+            j += __builtin_popcount(m);
+            continue;
+        }
+        for (; m; m &= m - 1)
+            n[++j] = p[i + __builtin_ctz(m)];
+    }
+    for (; i < len; i++)
+        if ((p[i] & mask) == rem) {
+            if (n)
+                n[j + 1] = p[i];
+            j++;
+        }
+    return j;
+}
+
+__attribute__((target("avx2")))
+static int fset_filter_avx2(const int * o, int * n, int mask, int rem)
+{
+    const int * p = o + 1;
+    int len = o[0], j = 0;
+    __m256i vm = _mm256_set1_epi32(mask), vr = _mm256_set1_epi32(rem);
+    __m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    for (int i = 0; i < len; i += 8) {
+        __m256i lanes = _mm256_cmpgt_epi32(_mm256_set1_epi32(len - i), idx);
+        __m256i v = _mm256_maskload_epi32(p + i, lanes);
+        __m256i eq = _mm256_and_si256(
+            _mm256_cmpeq_epi32(_mm256_and_si256(v, vm), vr), lanes);
+        int m = _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+        if (!n) {
+            j += __builtin_popcount(m);
+            continue;
+        }
+        for (; m; m &= m - 1)
+            n[++j] = p[i + __builtin_ctz(m)];
+    }
+    return j;
+}
+
+__attribute__((target("avx512f")))
+static int fset_filter_avx512(const int * o, int * n, int mask, int rem)
+{
+    const int * p = o + 1;
+    int len = o[0], j = 0;
+    __m512i vm = _mm512_set1_epi32(mask), vr = _mm512_set1_epi32(rem);
+    for (int i = 0; i < len; i += 16) {
+        __mmask16 lanes = (len - i >= 16) ? 0xFFFF : (__mmask16)((1u << (len - i)) - 1);
+        __m512i v = _mm512_maskz_loadu_epi32(lanes, p + i);
+        __mmask16 m = _mm512_mask_cmpeq_epi32_mask(lanes, _mm512_and_si512(v, vm), vr);
+        if (n)
+            _mm512_mask_compressstoreu_epi32(n + j + 1, m, v);
+        j += __builtin_popcount(m);
+    }
+    return j;
+}
+
+/***  Vector dispatch for fset_filter */
+static int fset_filter_wide(const int * o, int * n, int mask, int rem)
+{
+    switch (fset_isa) {
+      case FSET_AVX512: return fset_filter_avx512(o, n, mask, rem);
+      case FSET_AVX2:   return fset_filter_avx2(o, n, mask, rem);
+      case FSET_SSE2:   return fset_filter_sse2(o, n, mask, rem);
+      default:          return fset_filter_scalar(o, n, mask, rem);
+    }
+}
+
+__attribute__((always_inline))
+static inline int fset_filter(const int * o, int * n, int mask, int rem)
+{
+    if (o[0] > FSET_SCALAR_MAX)
+        return fset_filter_wide(o, n, mask, rem);
+    return fset_filter_scalar(o, n, mask, rem);
+}
+
+/***  Copy the /len/ keys at /src/ to /dst/ */
+static inline void fset_copy_scalar(int * dst, const int * src, int len)
+{
+    for (int i = 0; i < len; i++)
+        dst[i] = src[i];
+}
+
+__attribute__((target("sse2")))
+static void fset_copy_sse2(int * dst, const int * src, int len)
+{
+    int i = 0;
+    for (; i + 4 <= len; i += 4)
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         _mm_loadu_si128((const __m128i *)(src + i)));
+    for (; i < len; i++)
+        dst[i] = src[i];
+}
+
+__attribute__((target("avx2")))
+static void fset_copy_avx2(int * dst, const int * src, int len)
+{
+    __m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    for (int i = 0; i < len; i += 8) {
+        __m256i lanes = _mm256_cmpgt_epi32(_mm256_set1_epi32(len - i), idx);
+        _mm256_maskstore_epi32(dst + i, lanes, _mm256_maskload_epi32(src + i, lanes));
+    }
+}
+
+__attribute__((target("avx512f")))
+static void fset_copy_avx512(int * dst, const int * src, int len)
+{
+    for (int i = 0; i < len; i += 16) {
+        __mmask16 lanes = (len - i >= 16) ? 0xFFFF : (__mmask16)((1u << (len - i)) - 1);
+        _mm512_mask_storeu_epi32(dst + i, lanes, _mm512_maskz_loadu_epi32(lanes, src + i));
+    }
+}
+
+/***  Vector dispatch for fset_copy */
+static void fset_copy_wide(int * dst, const int * src, int len)
+{
+    switch (fset_isa) {
+      case FSET_AVX512: fset_copy_avx512(dst, src, len); break;
+      case FSET_AVX2:   fset_copy_avx2(dst, src, len); break;
+      case FSET_SSE2:   fset_copy_sse2(dst, src, len); break;
+      default:          fset_copy_scalar(dst, src, len); break;
+    }
+}
+
+__attribute__((always_inline))
+static inline void fset_copy(int * dst, const int * src, int len)
+{
+    if (len > FSET_SCALAR_MAX)
+        fset_copy_wide(dst, src, len);
+    else
+        fset_copy_scalar(dst, src, len);
+}
+
+/**
+ *  Copy the keys o[1..len], except the one at index /k/, into n[1...].  The
+ *  keys of an fset are distinct, so this is the filter that drops one key,
+ *  once fset_find has found it: the keys on either side of it are copied
+ *  whole.
+ */
+__attribute__((always_inline))
+static inline void fset_erase(const int * o, int len, int k, int * n)
+{
+    fset_copy(n + 1, o + 1, k - 1);
+    fset_copy(n + k, o + k + 1, len - k);
+}
+
+/***  Copy the keys of /p/ and then those of /q/ into n[1...] */
+__attribute__((always_inline))
+static inline void fset_concat(const int * p, const int * q, int * n)
+{
+    fset_copy(n + 1, p + 1, p[0]);
+    fset_copy(n + 1 + p[0], q + 1, q[0]);
+}
+
+/***  Return the index of /key/ in keys[0..len), or -1 if it is not there */
+static inline int fset_find64_scalar(const uint64_t * keys, int len, uint64_t key)
+{
+    for (int i = 0; i < len; i++)
+        if (keys[i] == key)
+            return i;
+    return -1;
+}
+
+__attribute__((target("sse2")))
+static int fset_find64_sse2(const uint64_t * keys, int len, uint64_t key)
+{
+    __m128i k = _mm_set1_epi64x(key);
+    int i = 0;
+    for (; i + 2 <= len; i += 2) {
+        // SSE2 has no 64-bit compare: both halves of a lane must match
+        __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(keys + i)), k);
+        eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, 0xB1));
+        int m = _mm_movemask_pd(_mm_castsi128_pd(eq));
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+    return (i < len && keys[i] == key) ? i : -1;
+}
+
+__attribute__((target("avx2")))
+static int fset_find64_avx2(const uint64_t * keys, int len, uint64_t key)
+{
+    __m256i k = _mm256_set1_epi64x(key);
+    int i = 0;
+    for (; i + 4 <= len; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(keys + i));
+        int m = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(v, k)));
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+    for (; i < len; i++)
+        if (keys[i] == key)
+            return i;
+    return -1;
+}
+
+__attribute__((target("avx512f")))
+static int fset_find64_avx512(const uint64_t * keys, int len, uint64_t key)
+{
+    __m512i k = _mm512_set1_epi64(key);
+    for (int i = 0; i < len; i += 8) {
+        __mmask8 lanes = (len - i >= 8) ? 0xFF : (__mmask8)((1u << (len - i)) - 1);
+        __m512i v = _mm512_maskz_loadu_epi64(lanes, keys + i);
+        __mmask8 m = _mm512_mask_cmpeq_epi64_mask(lanes, v, k);
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+    return -1;
+}
+
+/***  Vector dispatch for fset_find64 */
+static int fset_find64_wide(const uint64_t * keys, int len, uint64_t key)
+{
+    switch (fset_isa) {
+      case FSET_AVX512: return fset_find64_avx512(keys, len, key);
+      case FSET_AVX2:   return fset_find64_avx2(keys, len, key);
+      case FSET_SSE2:   return fset_find64_sse2(keys, len, key);
+      default:          return fset_find64_scalar(keys, len, key);
+    }
+}
+
+/**
+ *  The 64-bit key scan of the hash map, whose buckets keep their keys in an
+ *  array of their own, apart from the values.
+ */
+__attribute__((always_inline))
+static inline int fset_find64(const uint64_t * keys, int len, uint64_t key)
+{
+    if (len > FSET_SCALAR_MAX)
+        return fset_find64_wide(keys, len, key);
+    return fset_find64_scalar(keys, len, key);
+}
+
+/**
+ *  fset_filter for a hash policy /HP/ (see hashfn.hpp): keep the keys with
+ *  (HP::hash(key) & mask) == rem.  Only the identity hash can use the vector
+ *  kernels, since they compare the keys themselves.
+ */
+template<class HP>
+static inline int fset_filter_hashed(const int * o, int * n, int mask, int rem)
+{
+    if (HP::identity)
+        return fset_filter(o, n, mask, rem);
+    int j = 0;
+    for (int i = 1; i <= o[0]; i++)
+        if ((int)(HP::hash(o[i]) & mask) == rem) {
+            if (n)
+                n[j + 1] = o[i];
+            j++;
+        }
+    return j;
+}
@@ -6,14 +6,19 @@
 #include <cstdint>
 #include <atomic>
 
+#include "batch.hpp"
 #include "common.hpp"
-#include "mm.hpp"
+#include "counter.hpp"
+#include "fset.hpp"
+#include "hashfn.hpp"
+#include "reclaim.hpp"
 
 using std::atomic;
 using std::stringstream;
 using std::string;
 using std::endl;
 
+template<class RP = wbmm_policy_t, class HP = identity_hash_t>
 class hashset_t
 {
   private:
@@ -27,10 +32,14 @@ class hashset_t
 
     static hnode_t * alloc_hnode(hnode_t * o, int s)
     {
-        hnode_t * t = (hnode_t *)wbmm_alloc(sizeof(hnode_t));
+        // allocate the bucket array first: interval-based reclamation relies
+        // on an object never pointing to anything younger than itself
+        atomic<int *> * buckets =
+            (atomic<int *> *)RP::alloc(sizeof(atomic<int *>) * s);
+        hnode_t * t = (hnode_t *)RP::alloc(sizeof(hnode_t));
         t->old = o;
         t->size = s;
-        t->buckets = (atomic<int *> *)wbmm_alloc(sizeof(atomic<int *>) * s);
+        t->buckets = buckets;
         for (int i = 0; i < s; i++) t->buckets[i] = NULL;
         return t;
     }
@@ -38,41 +47,49 @@ class hashset_t
     static void free_hnode_safe(hnode_t * t)
     {
         for (int i = 0; i < t->size; i++)
-            wbmm_free_safe((void *)REF_UNMARKED(t->buckets[i].load()));
-        wbmm_free_safe(t->buckets);
-        wbmm_free_safe(t);
+            RP::free_safe((void *)REF_UNMARKED(t->buckets[i].load()));
+        RP::free_safe(t->buckets);
+        RP::free_safe(t);
     }
 
     static void free_hnode_unsafe(hnode_t * t)
     {
-        wbmm_free_unsafe(t->buckets);
-        wbmm_free_unsafe(t);
+        RP::free_unsafe(t->buckets);
+        RP::free_unsafe(t);
     }
 
     static int * alloc_fset(int len)
     {
-        int * arr = (int *)wbmm_alloc(sizeof(int) * (len + 1));
+        int * arr = (int *)RP::alloc(sizeof(int) * (len + 1));
         arr[0] = len;
         return arr;
     }
 
     static void free_fset_safe(int * arr)
     {
-        wbmm_free_safe(arr);
+        RP::free_safe(arr);
     }
 
     static void free_fset_unsafe(int * arr)
     {
-        wbmm_free_unsafe(arr);
+        RP::free_unsafe(arr);
+    }
+
+    /** Sizes are powers of two, so the mask keeps the low bits of the hash */
+    static int bucketOf(int key, int size)
+    {
+        return HP::hash(key) & (size - 1);
     }
 
   private:
 
     static const int MIN_BUCKET_NUM = 1;
-    static const int MAX_BUCKET_NUM = 1 << 16;
 
     atomic<hnode_t *> head;
 
+    /*** Approximate number of keys, which drives resizing */
+    approx_counter_t  count;
+
   public:
 
     hashset_t()
@@ -84,55 +101,99 @@ class hashset_t
 
     bool insert(int key)
     {
-        wbmm_begin();
-        hnode_t * h = head;
+        RP::begin();
+        hnode_t * h = RP::read(head);
         int result = apply(true, key);
-        if (abs(result) > 2)
-            resize(h, true);
-        wbmm_end();
+        if (result > 0)
+            account(h, 1);
+        RP::end();
         return result > 0;
     }
 
     bool remove(int key)
     {
-        wbmm_begin();
+        RP::begin();
+        hnode_t * h = RP::read(head);
         int result = apply(false, key);
-        wbmm_end();
+        if (result > 0)
+            account(h, -1);
+        RP::end();
         return result > 0;
     }
 
     bool contains(int key)
     {
-        wbmm_begin();
-        hnode_t * t = head;
-        int     * b = t->buckets[key % t->size];
-        // if the b is empty, use old table
-        if (b == NULL) {
-            hnode_t * s = t->old;
-            b = (s == NULL)
-                ? t->buckets[key % t->size]
-                : s->buckets[key % s->size];
-        }
-        bool r = arrayContains((int *)REF_UNMARKED(b), key);
-        wbmm_end();
+        RP::begin();
+        bool r = lookup(RP::read(head), key);
+        RP::end();
         return r;
     }
 
+    /**
+     *  The batched operations take /n/ keys at once, and return how many of
+     *  them were found (inserted, removed).  If /done/ is not NULL, done[j]
+     *  says whether keys[j] was.  A batch is one operation for the
+     *  reclamation policy, and keys that share a bucket are applied with one
+     *  copy-on-write of it.  Each key is still its own linearizable
+     *  operation: the batch as a whole is not atomic.
+     */
+    int containsBatch(const int * keys, int n, bool * done = NULL)
+    {
+        RP::begin();
+        hnode_t  * t = RP::read(head);
+        int     size = t->size;
+        uint64_t * ord = batch_order<HP>(keys, n, size);
+        int    found = 0;
+        for (int g = 0; g < n; ) {
+            t = RP::read(head);
+            if (t->size != size) {
+                // the table resized under us: re-plan the rest of the batch
+                size = t->size;
+                batch_plan<HP>(keys, ord + g, n - g, size);
+            }
+            int e = batch_group_end(ord, n, g);
+            prefetchBatch(t, ord, n, e);
+            int * b = RP::read(t->buckets[batch_bucket(ord[g])]);
+            for (int j = g; j < e; j++) {
+                int p = batch_pos(ord[j]);
+                // an empty bucket is mid-resize, so take the one-key path
+                bool r = (b == NULL) ? lookup(t, keys[p])
+                                     : arrayContains((int *)REF_UNMARKED(b), keys[p]);
+                if (done)
+                    done[p] = r;
+                found += r;
+            }
+            g = e;
+        }
+        RP::end();
+        return found;
+    }
+
+    int insertBatch(const int * keys, int n, bool * done = NULL)
+    {
+        return applyBatch(true, keys, n, done);
+    }
+
+    int removeBatch(const int * keys, int n, bool * done = NULL)
+    {
+        return applyBatch(false, keys, n, done);
+    }
+
     bool grow()
     {
-        wbmm_begin();
-        hnode_t * h = head;
+        RP::begin();
+        hnode_t * h = RP::read(head);
         bool r = resize(h, true);
-        wbmm_end();
+        RP::end();
         return r;
     }
 
     bool shrink()
     {
-        wbmm_begin();
-        hnode_t * h = head;
+        RP::begin();
+        hnode_t * h = RP::read(head);
         bool r = resize(h, false);
-        wbmm_end();
+        RP::end();
         return r;
     }
 
@@ -160,12 +221,25 @@ class hashset_t
 
   private:
 
+    bool lookup(hnode_t * t, int key)
+    {
+        int * b = RP::read(t->buckets[bucketOf(key, t->size)]);
+        // if the b is empty, use old table
+        if (b == NULL) {
+            hnode_t * s = RP::read(t->old);
+            b = (s == NULL)
+                ? RP::read(t->buckets[bucketOf(key, t->size)])
+                : RP::read(s->buckets[bucketOf(key, s->size)]);
+        }
+        return arrayContains((int *)REF_UNMARKED(b), key);
+    }
+
     int apply(bool insert, int key)
     {
         while (true) {
-            hnode_t * t = head;
-            int       i = key % t->size;
-            int     * b = t->buckets[i];
+            hnode_t * t = RP::read(head);
+            int       i = bucketOf(key, t->size);
+            int     * b = RP::read(t->buckets[i]);
 
             // if the b is empty, help finish resize
             if (b == NULL)
@@ -180,16 +254,107 @@ class hashset_t
                         free_fset_safe(b); // reclaim b
                         return n[0] + 1;
                     }
-                    b = t->buckets[i];
+                    b = RP::read(t->buckets[i]);
+                    free_fset_unsafe(n); // reclaim n
+                }
+            }
+        }
+    }
+
+    int applyBatch(bool insert, const int * keys, int n, bool * done)
+    {
+        RP::begin();
+        hnode_t  * t = RP::read(head);
+        int     size = t->size;
+        uint64_t * ord = batch_order<HP>(keys, n, size);
+        int  changed = 0;
+        for (int g = 0; g < n; ) {
+            int e = batch_group_end(ord, n, g);
+            prefetchBatch(t, ord, n, e);
+            int r = applyGroup(insert, keys, ord + g, e - g, size, done);
+            if (r < 0) {
+                // the table resized under us: re-plan the rest of the batch
+                t = RP::read(head);
+                size = t->size;
+                batch_plan<HP>(keys, ord + g, n - g, size);
+                continue;
+            }
+            if (r > 0) {
+                changed += r;
+                account(t, insert ? r : -r);
+            }
+            g = e;
+        }
+        RP::end();
+        return changed;
+    }
+
+    /**
+     *  Insert (remove) the /m/ keys of one plan group, which all fall in one
+     *  bucket of a table of /size/ buckets, with a single CAS on that bucket.
+     *  Returns how many keys changed, or -1 if the table is no longer that
+     *  size and the group must be re-planned.
+     */
+    int applyGroup(bool insert, const int * keys, const uint64_t * ord, int m,
+                   int size, bool * done)
+    {
+        while (true) {
+            hnode_t * t = RP::read(head);
+            if (t->size != size)
+                return -1;
+            int       i = batch_bucket(ord[0]);
+            int     * b = RP::read(t->buckets[i]);
+
+            // if the b is empty, help finish resize
+            if (b == NULL)
+                helpResize(t, i);
+            // otherwise enlist at b
+            else {
+                while (!IS_MARKED(b)) {
+                    int * n = insert ? arrayInsertMany(b, keys, ord, m, done)
+                                     : arrayRemoveMany(b, keys, ord, m, done);
+                    if (n == b)
+                        return 0;
+                    int r = insert ? n[0] - b[0] : b[0] - n[0];
+                    if (bcas(&t->buckets[i], &b, n)) {
+                        free_fset_safe(b); // reclaim b
+                        return r;
+                    }
+                    b = RP::read(t->buckets[i]);
                     free_fset_unsafe(n); // reclaim n
                 }
             }
         }
     }
 
+    /**
+     *  Prefetch the bucket slot BATCH_PREFETCH_DIST plan entries past /e/,
+     *  and the bucket of the group at /e/, whose slot we prefetched earlier.
+     *  A prefetch never faults, so the slot need not be protected.
+     */
+    void prefetchBatch(hnode_t * t, const uint64_t * ord, int n, int e)
+    {
+        if (e + BATCH_PREFETCH_DIST < n)
+            __builtin_prefetch(&t->buckets[batch_bucket(ord[e + BATCH_PREFETCH_DIST])]);
+        if (e < n) {
+            int * b = t->buckets[batch_bucket(ord[e])].load(std::memory_order_relaxed);
+            __builtin_prefetch((int *)REF_UNMARKED(b));
+        }
+    }
+
+    /** Count /delta/ inserts (> 0) or removes (< 0), and resize /t/ if the load calls for it */
+    void account(hnode_t * t, int delta)
+    {
+        count.add(RP::get_tid(), delta);
+        if (delta > 0 && chash_should_grow(count.get(), t->size))
+            resize(t, true);
+        else if (delta < 0 && chash_should_shrink(count.get(), t->size))
+            resize(t, false);
+    }
+
     bool resize(hnode_t * t, bool grow)
     {
-        if ((t->size == MAX_BUCKET_NUM && grow) ||
+        if ((t->size >= chash_max_buckets() && grow) ||
             (t->size == MIN_BUCKET_NUM && !grow))
             return false;
 
@@ -200,7 +365,7 @@ class hashset_t
                     helpResize(t, i);
             }
             // deprecate t's predecessor
-            hnode_t * o = t->old;
+            hnode_t * o = RP::read(t->old);
             if (o && bcas(&(t->old), &o, (hnode_t *)NULL))
                 free_hnode_safe(o);
 
@@ -218,12 +383,12 @@ class hashset_t
 
     void helpResize(hnode_t * t, int i)
     {
-        int     * b = t->buckets[i];
-        hnode_t * s = t->old;
+        int     * b = RP::read(t->buckets[i]);
+        hnode_t * s = RP::read(t->old);
         if (b == NULL && s != NULL) {
             int * set;
             if (s->size * 2 == t->size) /* growing */ {
-                int * p = freezeBucket(s, i % s->size);
+                int * p = freezeBucket(s, i & (s->size - 1));
                 set = split(p, t->size, i);
             }
             else /* shrinking */ {
@@ -244,38 +409,26 @@ class hashset_t
         return ss.str();
     }
 
+    /** Keep the keys of /o/ that land in bucket /remainder/ of /size/ */
     int * split(int * o, int size, int remainder)
     {
-        int count = 0;
-        for (int i = 1; i <= o[0]; i++)
-            if (o[i] % size == remainder)
-                count++;
+        int count = fset_filter_hashed<HP>(o, NULL, size - 1, remainder);
         int * n = alloc_fset(count);
-        n[0] = count;
-        int j = 1;
-        for (int i = 1; i <= o[0]; i++) {
-            if (o[i] % size == remainder)
-                n[j++] = o[i];
-        }
+        fset_filter_hashed<HP>(o, n, size - 1, remainder);
         return n;
     }
 
     int * merge(int * p, int * q)
     {
         int * n = alloc_fset(p[0] + q[0]);
-        n[0] = p[0] + q[0];
-        int j = 1;
-        for (int i = 1; i <= p[0]; i++)
-            n[j++] = p[i];
-        for (int i = 1; i <= q[0]; i++)
-            n[j++] = q[i];
+        fset_concat(p, q, n);
         return n;
     }
 
     int * freezeBucket(hnode_t * t, int i)
     {
         while (true) {
-            int * h = t->buckets[i];
+            int * h = RP::read(t->buckets[i]);
             if (IS_MARKED(h))
                 return (int *)REF_UNMARKED(h);
             if (bcas(&t->buckets[i], &h, (int *)REF_MARKED(h)))
@@ -285,11 +438,7 @@ class hashset_t
 
     bool arrayContains(int * o, int key)
     {
-        for (int i = 1; i <= o[0]; i++) {
-            if (o[i] == key)
-                return true;
-        }
-        return false;
+        return fset_find(o, key) != 0;
     }
 
     int * arrayInsert(int * o, int key)
@@ -305,13 +454,65 @@ class hashset_t
 
     int * arrayRemove(int * o, int key)
     {
-        if (!arrayContains(o, key))
+        int k = fset_find(o, key);
+        if (k == 0)
             return o;
         int * n = alloc_fset(o[0] - 1);
-        int j = 1;
-        for (int i = 1; i <= o[0]; i++) {
-            if (o[i] != key)
-                n[j++] = o[i];
+        fset_erase(o, o[0], k, n);
+        return n;
+    }
+
+    /** Copy /o/ plus whichever keys of the group it lacks, or return /o/ if it has them all */
+    int * arrayInsertMany(int * o, const int * keys, const uint64_t * ord, int m, bool * done)
+    {
+        int add = 0;
+        for (int j = 0; j < m; j++)
+            add += !arrayContains(o, keys[batch_pos(ord[j])]);
+        if (add == 0) {
+            if (done)
+                for (int j = 0; j < m; j++)
+                    done[batch_pos(ord[j])] = false;
+            return o;
+        }
+        // the group may repeat a key, so the length is set as keys go in
+        int * n = alloc_fset(o[0] + add);
+        n[0] = o[0];
+        for (int i = 1; i <= o[0]; i++)
+            n[i] = o[i];
+        for (int j = 0; j < m; j++) {
+            int p = batch_pos(ord[j]);
+            bool r = !arrayContains(n, keys[p]);
+            if (r)
+                n[++n[0]] = keys[p];
+            if (done)
+                done[p] = r;
+        }
+        return n;
+    }
+
+    /** Copy /o/ less the keys of the group, or return /o/ if it has none of them */
+    int * arrayRemoveMany(int * o, const int * keys, const uint64_t * ord, int m, bool * done)
+    {
+        int hit = 0;
+        for (int j = 0; j < m; j++)
+            hit += arrayContains(o, keys[batch_pos(ord[j])]);
+        if (hit == 0) {
+            if (done)
+                for (int j = 0; j < m; j++)
+                    done[batch_pos(ord[j])] = false;
+            return o;
+        }
+        int * n = alloc_fset(o[0]);
+        for (int i = 1; i <= o[0]; i++)
+            n[i] = o[i];
+        for (int j = 0; j < m; j++) {
+            int p = batch_pos(ord[j]);
+            int k = fset_find(n, keys[p]);
+            // keys are in no particular order, so the last one fills the hole
+            if (k != 0)
+                n[k] = n[n[0]--];
+            if (done)
+                done[p] = (k != 0);
         }
         return n;
     }
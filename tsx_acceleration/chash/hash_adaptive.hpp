@@ -0,0 +1,619 @@
+#pragma once
+
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <cstdint>
+#include <atomic>
+
+#include "common.hpp"
+#include "counter.hpp"
+#include "fset.hpp"
+#include "hashfn.hpp"
+#include "reclaim.hpp"
+
+using std::atomic;
+using std::stringstream;
+using std::string;
+using std::endl;
+
+/**
+ *  Tunables of the adaptive hash set.  An update makes up to
+ *  chash_adaptive_trials lock-free attempts, each a single try at installing
+ *  itself on its bucket, before it escalates: it takes a priority, announces
+ *  itself, and finishes wait-free with the help of the other threads.  Every chash_adaptive_help_delay updates, each thread
+ *  checks one other thread's announcement, and helps it if it has not moved
+ *  since the last check.
+ */
+static int chash_adaptive_trials     = 256;
+static int chash_adaptive_help_delay = 128;
+
+/**
+ *  The adaptive freezable-array hash set (hash/AdaptiveArrayHashSetOpt.java).
+ *  Buckets hold fset versions directly, as in hash.hpp, except that each
+ *  version also carries at most one installed operation, which says how to
+ *  build the next version; a FREEZE operation makes it final, for resizing.
+ *  An update installs itself on the head version of its bucket and finishes
+ *  by swinging the bucket to the next version, which anyone may do for it.
+ *
+ *  An operation descriptor is reachable from the one version it gets
+ *  installed on and, once escalated, from its owner's announcement slot, so
+ *  it counts those references and goes to free_safe when they are gone.
+ */
+template<class RP = wbmm_policy_t, class HP = identity_hash_t>
+class hashset_adaptive_t
+{
+  private:
+
+    /*** Operation types (WFArrayOp) */
+    static const int WF_INSERT = 2;
+    static const int WF_REMOVE = 3;
+    static const int WF_FREEZE = 4;
+
+    /*** Priority of an operation that has taken effect */
+    static const uint64_t WF_DONE = UINT64_MAX;
+
+    struct wfop_t
+    {
+        int              key;
+        int              type;
+        atomic<int>      resp;
+        atomic<uint64_t> priority;
+        atomic<int>      refs;
+    };
+
+    /*** One version of a bucket; keys[] is an fset (keys[0] is the length) */
+    struct fnode_t
+    {
+        atomic<wfop_t *> op;
+        int              keys[1];
+    };
+
+    struct hnode_t
+    {
+        atomic<hnode_t *>   old;
+        atomic<fnode_t *> * buckets;
+        atomic<bool>      * fflags;
+        int                 size;
+    };
+
+    /**
+     *  Per-slot state: the announcement (the Java A[]), the help record,
+     *  which only the owner touches, and the escalation count.
+     */
+    struct slot_t
+    {
+        atomic<wfop_t *>  op;
+        uintptr_t         curTid;
+        uint64_t          lastPhase;
+        intptr_t          nextCheck;
+        atomic<uint64_t>  escalated;
+        char pad[CACHELINE_BYTES - 5 * sizeof(uint64_t)];
+    };
+
+    static hnode_t * alloc_hnode(hnode_t * o, int s)
+    {
+        // allocate the bucket arrays first: interval-based reclamation relies
+        // on an object never pointing to anything younger than itself
+        atomic<fnode_t *> * buckets =
+            (atomic<fnode_t *> *)RP::alloc(sizeof(atomic<fnode_t *>) * s);
+        atomic<bool> * fflags = (atomic<bool> *)RP::alloc(sizeof(atomic<bool>) * s);
+        hnode_t * t = (hnode_t *)RP::alloc(sizeof(hnode_t));
+        t->old = o;
+        t->size = s;
+        t->buckets = buckets;
+        t->fflags = fflags;
+        for (int i = 0; i < s; i++) {
+            t->buckets[i] = NULL;
+            t->fflags[i] = false;
+        }
+        return t;
+    }
+
+    /** Reclaim an old table, whose buckets are all frozen */
+    static void free_hnode_safe(hnode_t * t)
+    {
+        for (int i = 0; i < t->size; i++) {
+            fnode_t * n = t->buckets[i];
+            RP::free_safe(n->op.load());
+            RP::free_safe(n);
+        }
+        RP::free_safe(t->buckets);
+        RP::free_safe(t->fflags);
+        RP::free_safe(t);
+    }
+
+    static void free_hnode_unsafe(hnode_t * t)
+    {
+        RP::free_unsafe(t->buckets);
+        RP::free_unsafe(t->fflags);
+        RP::free_unsafe(t);
+    }
+
+    static fnode_t * alloc_fnode(int len)
+    {
+        fnode_t * n = (fnode_t *)RP::alloc(sizeof(fnode_t) + sizeof(int) * len);
+        n->op = NULL;
+        n->keys[0] = len;
+        return n;
+    }
+
+    static wfop_t * alloc_op(int key, int type)
+    {
+        wfop_t * op = (wfop_t *)RP::alloc(sizeof(wfop_t));
+        op->key = key;
+        op->type = type;
+        op->resp = 0;
+        op->priority = 0;
+        op->refs = 1;
+        return op;
+    }
+
+    /** Drop one reference to an update descriptor */
+    static void release_op(wfop_t * op)
+    {
+        if (op->refs.fetch_sub(1) == 1)
+            RP::free_safe(op);
+    }
+
+    static bool immutable(fnode_t * n)
+    {
+        wfop_t * op = n->op;
+        return op != NULL && op->type == WF_FREEZE;
+    }
+
+    /** Sizes are powers of two, so the mask keeps the low bits of the hash */
+    static int bucketOf(int key, int size)
+    {
+        return HP::hash(key) & (size - 1);
+    }
+
+  private:
+
+    static const int MIN_BUCKET_NUM = 1;
+
+    atomic<hnode_t *> head;
+
+    /*** Approximate number of keys, which drives resizing */
+    approx_counter_t  count;
+
+    /*** Source of priorities for escalated updates */
+    atomic<uint64_t>  counter;
+    char pad[CACHELINE_BYTES - sizeof(atomic<uint64_t>)];
+
+    /*** One more than the highest slot that has used the set */
+    atomic<uintptr_t> nslots;
+
+    /*** Per-slot state, added a chunk at a time */
+    atomic<slot_t *>  chunks[WBMM_MAX_CHUNKS];
+
+    slot_t * slot(uintptr_t tid)
+    {
+        slot_t * c = chunks[tid / WBMM_SLOT_CHUNK].load(std::memory_order_acquire);
+        return (c == NULL) ? NULL : &c[tid % WBMM_SLOT_CHUNK];
+    }
+
+    /** Make the caller's slot exist, and be covered by scans */
+    slot_t * mySlot(uintptr_t tid)
+    {
+        atomic<slot_t *> & c = chunks[tid / WBMM_SLOT_CHUNK];
+        slot_t * p = c.load(std::memory_order_acquire);
+        if (p == NULL) {
+            slot_t * n = new slot_t[WBMM_SLOT_CHUNK]();
+            for (uintptr_t i = 0; i < WBMM_SLOT_CHUNK; i++)
+                n[i].nextCheck = chash_adaptive_help_delay;
+            if (bcas(&c, &p, n))
+                p = n;
+            else
+                delete [] n;
+        }
+        uintptr_t s = nslots;
+        while (s <= tid && !bcas(&nslots, &s, tid + 1));
+        return &p[tid % WBMM_SLOT_CHUNK];
+    }
+
+    /** Priority of the update announced in slot /tid/, or WF_DONE if none */
+    uint64_t phaseOf(uintptr_t tid)
+    {
+        slot_t * s = slot(tid);
+        wfop_t * op = (s == NULL) ? NULL : s->op.load();
+        return (op == NULL) ? WF_DONE : op->priority.load();
+    }
+
+  public:
+
+    hashset_adaptive_t() : counter(1), nslots(0)
+    {
+        for (uintptr_t i = 0; i < WBMM_MAX_CHUNKS; i++)
+            chunks[i] = NULL;
+        hnode_t * t = alloc_hnode(NULL, MIN_BUCKET_NUM);
+        t->buckets[0] = alloc_fnode(0);
+        head = t;
+    }
+
+    bool insert(int key)
+    {
+        RP::begin();
+        hnode_t * h = head;
+        int result = apply(WF_INSERT, key);
+        if (result > 0)
+            account(h, 1);
+        RP::end();
+        return result > 0;
+    }
+
+    bool remove(int key)
+    {
+        RP::begin();
+        hnode_t * h = head;
+        int result = apply(WF_REMOVE, key);
+        if (result > 0)
+            account(h, -1);
+        RP::end();
+        return result > 0;
+    }
+
+    bool contains(int key)
+    {
+        RP::begin();
+        hnode_t * t = head;
+        fnode_t * b = t->buckets[bucketOf(key, t->size)];
+        // if the b is empty, use old table
+        if (b == NULL) {
+            hnode_t * s = t->old;
+            b = (s == NULL)
+                ? t->buckets[bucketOf(key, t->size)]
+                : s->buckets[bucketOf(key, s->size)];
+        }
+        bool r = hasMember(b, key);
+        RP::end();
+        return r;
+    }
+
+    bool grow()
+    {
+        RP::begin();
+        hnode_t * h = head;
+        bool r = resize(h, true);
+        RP::end();
+        return r;
+    }
+
+    bool shrink()
+    {
+        RP::begin();
+        hnode_t * h = head;
+        bool r = resize(h, false);
+        RP::end();
+        return r;
+    }
+
+    /** How many updates have escalated to the wait-free path so far */
+    uint64_t escalations()
+    {
+        uint64_t sum = 0;
+        uintptr_t n = nslots;
+        for (uintptr_t tid = 0; tid < n; tid++) {
+            slot_t * s = slot(tid);
+            if (s != NULL)
+                sum += s->escalated.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+    string toString()
+    {
+        stringstream ss;
+        hnode_t * curr = head;
+        int age = 0;
+        while (curr != NULL) {
+            ss << "HashTableNode #" << age++ << endl;
+            for (int i = 0; i < curr->size; i++) {
+                ss << "  Bucket " << i << ": ";
+                fnode_t * b = curr->buckets[i];
+                if (b != NULL) {
+                    if (immutable(b))
+                        ss << "(F) ";
+                    ss << bucketToString(b->keys);
+                }
+                ss << endl;
+            }
+            curr = curr->old;
+        }
+        return ss.str();
+    }
+
+
+  private:
+
+    /** Every so often, help a thread whose announced update has not moved */
+    void helpIfNeeded(slot_t * rec)
+    {
+        if (rec->nextCheck-- == 0) {
+            slot_t * s = slot(rec->curTid);
+            wfop_t * op = (s == NULL) ? NULL : s->op.load();
+            if (op != NULL && op->priority != WF_DONE && op->priority == rec->lastPhase) {
+                while (op->priority <= rec->lastPhase) {
+                    hnode_t * t = head;
+                    int       i = bucketOf(op->key, t->size);
+                    fnode_t * b = t->buckets[i];
+                    if (b == NULL)
+                        helpResize(t, i);
+                    else if (invoke(t, i, op))
+                        break;
+                }
+            }
+            rec->curTid = (rec->curTid + 1) % nslots;
+            rec->lastPhase = phaseOf(rec->curTid);
+            rec->nextCheck = chash_adaptive_help_delay;
+        }
+    }
+
+    int apply(int type, int key)
+    {
+        slot_t * me = mySlot(RP::get_tid());
+        helpIfNeeded(me);
+
+        wfop_t * myop = alloc_op(key, type);
+
+        for (int trial = 0; trial < chash_adaptive_trials; trial++) {
+            hnode_t * t = head;
+            int       i = bucketOf(myop->key, t->size);
+            fnode_t * b = t->buckets[i];
+            if (b == NULL)
+                helpResize(t, i);
+            else if (tryInvoke(t, i, myop))
+                return myop->resp;
+        }
+
+        return applySlow(me, myop);
+    }
+
+    int applySlow(slot_t * me, wfop_t * myop)
+    {
+        me->escalated.store(me->escalated.load(std::memory_order_relaxed) + 1,
+                            std::memory_order_relaxed);
+
+        // myop is not installed anywhere yet, so the slot's reference can be
+        // added without a race
+        uint64_t prio = counter.fetch_add(1);
+        myop->priority = prio;
+        myop->refs = 2;
+        wfop_t * prev = me->op.exchange(myop);
+        if (prev != NULL)
+            release_op(prev);
+
+        // help every announced update that is older than ours, then ours
+        uintptr_t n = nslots;
+        for (uintptr_t tid = 0; tid < n; tid++) {
+            slot_t * s = slot(tid);
+            wfop_t * op = (s == NULL) ? NULL : s->op.load();
+            while (op != NULL && op->priority <= prio) {
+                hnode_t * t = head;
+                int       i = bucketOf(op->key, t->size);
+                fnode_t * b = t->buckets[i];
+                if (b == NULL)
+                    helpResize(t, i);
+                else if (invoke(t, i, op))
+                    break;
+            }
+        }
+        return myop->resp;
+    }
+
+    /**
+     *  One lock-free trial: try once to install /op/ on the head version of
+     *  bucket /i/ of /t/, and finish it.  If the CAS fails, or the version
+     *  already carries an operation, help that one along and return false,
+     *  so that contention counts against chash_adaptive_trials.
+     */
+    bool tryInvoke(hnode_t * t, int i, wfop_t * op)
+    {
+        fnode_t * set = t->buckets[i];
+        if (immutable(set))
+            return false;
+        if (t->fflags[i]) {
+            doFreeze(t, i);
+            return false;
+        }
+        wfop_t * pred = set->op;
+        if (pred == NULL && bcas(&set->op, &pred, op)) {
+            helpFinish(t, i, set);
+            return true;
+        }
+        helpFinish(t, i, set);
+        return false;
+    }
+
+    /** Install /op/ on the head version of bucket /i/ of /t/ and finish it */
+    bool invoke(hnode_t * t, int i, wfop_t * op)
+    {
+        fnode_t * set = t->buckets[i];
+        while (!immutable(set) && op->priority != WF_DONE) {
+            if (t->fflags[i]) {
+                doFreeze(t, i);
+                return op->priority == WF_DONE;
+            }
+            wfop_t * pred = set->op;
+            if (pred == NULL) {
+                if (op->priority != WF_DONE) {
+                    if (bcas(&set->op, &pred, op)) {
+                        helpFinish(t, i, set);
+                        return true;
+                    }
+                }
+            }
+            else {
+                helpFinish(t, i, set);
+            }
+            set = t->buckets[i];
+        }
+        return op->priority == WF_DONE;
+    }
+
+    int * freezeBucket(hnode_t * t, int i)
+    {
+        t->fflags[i] = true;
+        return doFreeze(t, i);
+    }
+
+    int * doFreeze(hnode_t * t, int i)
+    {
+        wfop_t * h = alloc_op(-1, WF_FREEZE);
+        h->priority = WF_DONE;
+        fnode_t * set = t->buckets[i];
+        while (!immutable(set)) {
+            wfop_t * pred = set->op;
+            if (pred == NULL) {
+                if (bcas(&set->op, &pred, h))
+                    return set->keys;
+            }
+            else {
+                helpFinish(t, i, set);
+            }
+            set = t->buckets[i];
+        }
+        RP::free_unsafe(h);
+        return set->keys;
+    }
+
+    /** Build the version after /set/ from its operation, and swing bucket /i/ to it */
+    void helpFinish(hnode_t * t, int i, fnode_t * set)
+    {
+        wfop_t * op = set->op;
+        if (op != NULL && op->type != WF_FREEZE) {
+            fnode_t * n = (op->type == WF_INSERT) ? arrayInsert(set->keys, op->key)
+                                                  : arrayRemove(set->keys, op->key);
+            if (n == NULL) {
+                op->resp = -(set->keys[0] + 1);
+                n = alloc_fnode(set->keys[0]);
+                for (int j = 1; j <= set->keys[0]; j++)
+                    n->keys[j] = set->keys[j];
+            }
+            else
+                op->resp = n->keys[0] + 1;
+            op->priority = WF_DONE;
+            if (bcas(&t->buckets[i], &set, n)) {
+                RP::free_safe(set);
+                release_op(op);
+            }
+            else
+                RP::free_unsafe(n);
+        }
+    }
+
+    bool hasMember(fnode_t * set, int key)
+    {
+        // must be aware of the linearized operation if exists
+        wfop_t * op = set->op;
+        if (op != NULL && op->key == key && op->type != WF_FREEZE)
+            return op->type == WF_INSERT;
+        return fset_find(set->keys, key) != 0;
+    }
+
+    /** Count an insert (+1) or remove (-1), and resize /t/ if the load calls for it */
+    void account(hnode_t * t, int delta)
+    {
+        count.add(RP::get_tid(), delta);
+        if (delta > 0 && chash_should_grow(count.get(), t->size))
+            resize(t, true);
+        else if (delta < 0 && chash_should_shrink(count.get(), t->size))
+            resize(t, false);
+    }
+
+    bool resize(hnode_t * t, bool grow)
+    {
+        if ((t->size >= chash_max_buckets() && grow) ||
+            (t->size == MIN_BUCKET_NUM && !grow))
+            return false;
+
+        if (t == head) {
+            // make sure we can deprecate t's predecessor
+            for (int i = 0; i < t->size; i++) {
+                if (t->buckets[i] == NULL)
+                    helpResize(t, i);
+            }
+            // deprecate t's predecessor
+            hnode_t * o = t->old;
+            if (o && bcas(&(t->old), &o, (hnode_t *)NULL))
+                free_hnode_safe(o);
+
+            // switch to fresh bucket array
+            if (t == head) {
+                hnode_t * n = alloc_hnode(t, grow ? t->size * 2 : t->size / 2);
+                if (!bcas(&head, &t, n)) {
+                    free_hnode_unsafe(n); // free n
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void helpResize(hnode_t * t, int i)
+    {
+        fnode_t * b = t->buckets[i];
+        hnode_t * s = t->old;
+        if (b == NULL && s != NULL) {
+            fnode_t * set;
+            if (s->size * 2 == t->size) /* growing */ {
+                int * p = freezeBucket(s, i & (s->size - 1));
+                set = split(p, t->size, i);
+            }
+            else /* shrinking */ {
+                int * p = freezeBucket(s, i);
+                int * q = freezeBucket(s, i + t->size);
+                set = merge(p, q);
+            }
+            if (!bcas(&t->buckets[i], &b, set))
+                RP::free_unsafe(set);
+        }
+    }
+
+    string bucketToString(int * b)
+    {
+        stringstream ss;
+        for (int i = 1; i <= b[0]; i++)
+            ss << b[i] << " ";
+        return ss.str();
+    }
+
+    /** Keep the keys of /o/ that land in bucket /remainder/ of /size/ */
+    fnode_t * split(int * o, int size, int remainder)
+    {
+        int count = fset_filter_hashed<HP>(o, NULL, size - 1, remainder);
+        fnode_t * n = alloc_fnode(count);
+        fset_filter_hashed<HP>(o, n->keys, size - 1, remainder);
+        return n;
+    }
+
+    fnode_t * merge(int * p, int * q)
+    {
+        fnode_t * n = alloc_fnode(p[0] + q[0]);
+        fset_concat(p, q, n->keys);
+        return n;
+    }
+
+    /** A new version of /o/ with /key/ added, or NULL if /o/ has it */
+    fnode_t * arrayInsert(int * o, int key)
+    {
+        if (fset_find(o, key) != 0)
+            return NULL;
+        fnode_t * n = alloc_fnode(o[0] + 1);
+        for (int i = 1; i <= o[0]; i++)
+            n->keys[i] = o[i];
+        n->keys[n->keys[0]] = key;
+        return n;
+    }
+
+    /** A new version of /o/ with /key/ removed, or NULL if /o/ lacks it */
+    fnode_t * arrayRemove(int * o, int key)
+    {
+        int k = fset_find(o, key);
+        if (k == 0)
+            return NULL;
+        fnode_t * n = alloc_fnode(o[0] - 1);
+        fset_erase(o, o[0], k, n->keys);
+        return n;
+    }
+};
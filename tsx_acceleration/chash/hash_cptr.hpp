@@ -8,19 +8,22 @@
 #include <atomic>
 
 #include "common.hpp"
-#include "mm.hpp"
+#include "counter.hpp"
+#include "fset.hpp"
+#include "hashfn.hpp"
+#include "reclaim.hpp"
 
 using std::atomic;
 using std::stringstream;
 using std::string;
 using std::endl;
 
+template<class RP = wbmm_policy_t, class HP = identity_hash_t>
 class hashset_cptr_t
 {
   private:
 
     static const int MIN_BUCKET_NUM = 1;
-    static const int MAX_BUCKET_NUM = 1 << 16;
 
     static const int MAX_ATTEMPT_NUM = 32;
 
@@ -29,16 +32,16 @@ class hashset_cptr_t
     struct hnode_t
     {
         atomic<hnode_t *>  old;
-        atomic<uint64_t> * buckets;
+        cptr_atomic_t *    buckets;
         int                size;
     };
 
     static hnode_t * alloc_hnode(hnode_t * o, int s)
     {
-        hnode_t * t = (hnode_t *)wbmm_alloc(sizeof(hnode_t));
+        hnode_t * t = (hnode_t *)RP::alloc(sizeof(hnode_t));
         t->old = o;
         t->size = s;
-        t->buckets = (atomic<uint64_t> *)wbmm_alloc(sizeof(atomic<uint64_t>) * s);
+        t->buckets = (cptr_atomic_t *)RP::alloc(sizeof(cptr_atomic_t) * s);
         for (int i = 0; i < s; i++) t->buckets[i] = 0;
         return t;
     }
@@ -48,34 +51,40 @@ class hashset_cptr_t
         for (int i = 0; i < t->size; i++) {
             cptr_t<int> p;
             p.all = t->buckets[i];
-            wbmm_free_safe((void *)REF_UNMARKED(p.fields.ptr));
+            RP::free_safe((void *)REF_UNMARKED(p.fields.ptr));
         }
-        wbmm_free_safe(t->buckets);
-        wbmm_free_safe(t);
+        RP::free_safe(t->buckets);
+        RP::free_safe(t);
     }
 
     static void free_hnode_unsafe(hnode_t * t)
     {
-        wbmm_free_unsafe(t->buckets);
-        wbmm_free_unsafe(t);
+        RP::free_unsafe(t->buckets);
+        RP::free_unsafe(t);
     }
 
     static int * alloc_fset(int len)
     {
         int alloc_len = len + 1;
-        int * arr = (int *)wbmm_alloc(sizeof(int) * alloc_len);
+        int * arr = (int *)RP::alloc(sizeof(int) * alloc_len);
         arr[0] = len;
         return arr;
     }
 
     static void free_fset_safe(int * arr)
     {
-        wbmm_free_safe(arr);
+        RP::free_safe(arr);
     }
 
     static void free_fset_unsafe(int * arr)
     {
-        wbmm_free_unsafe(arr);
+        RP::free_unsafe(arr);
+    }
+
+    /** Sizes are powers of two, so the mask keeps the low bits of the hash */
+    static int bucketOf(int key, int size)
+    {
+        return HP::hash(key) & (size - 1);
     }
 
 
@@ -83,13 +92,15 @@ class hashset_cptr_t
 
     atomic<hnode_t *> head;
 
+    /*** Approximate number of keys, which drives resizing */
+    approx_counter_t  count;
+
   public:
 
     hashset_cptr_t()
     {
         // make sure pointer size is 32bit since we are using 64bit counted pointers
-        assert(sizeof(uintptr_t) == sizeof(uint32_t));
-        assert(sizeof(cptr_t<int>) == sizeof(uint64_t));
+        assert(sizeof(cptr_t<int>) == sizeof(cptr_word_t));
         hnode_t * t = alloc_hnode(NULL, MIN_BUCKET_NUM);
         int * b = alloc_fset(0);
         cptr_t<int> w;
@@ -102,61 +113,65 @@ class hashset_cptr_t
     {
         hnode_t * t;
         int result;
-        wbmm_begin();
+        RP::begin();
         t = head;
         result = apply(true, key);
-        if (abs(result) > 2)
-            resize(t, true);
-        wbmm_end();
+        if (result > 0)
+            account(t, 1);
+        RP::end();
         return result > 0;
     }
 
     bool remove(int key)
     {
+        hnode_t * t;
         int result;
-        wbmm_begin();
+        RP::begin();
+        t = head;
         result = apply(false, key);
-        wbmm_end();
+        if (result > 0)
+            account(t, -1);
+        RP::end();
         return result > 0;
     }
 
     bool contains(int key)
     {
-        wbmm_begin();
+        RP::begin();
 
         hnode_t * t = head;
         cptr_t<int> w;
-        w.all = t->buckets[key % t->size];
+        w.all = t->buckets[bucketOf(key, t->size)];
         int     * b = w.fields.ptr;
         // if the b is empty, use old table
         if (b == NULL) {
             hnode_t * s = t->old;
             w.all = (s == NULL)
-                ? t->buckets[key % t->size]
-                : s->buckets[key % s->size];
+                ? t->buckets[bucketOf(key, t->size)]
+                : s->buckets[bucketOf(key, s->size)];
             b = w.fields.ptr;
         }
         bool r = arrayContains((int *)REF_UNMARKED(b), key);
 
-        wbmm_end();
+        RP::end();
         return r;
     }
 
     bool grow()
     {
-        wbmm_begin();
+        RP::begin();
         hnode_t * h = head;
         bool r = resize(h, true);
-        wbmm_end();
+        RP::end();
         return r;
     }
 
     bool shrink()
     {
-        wbmm_begin();
+        RP::begin();
         hnode_t * h = head;
         bool r = resize(h, false);
-        wbmm_end();
+        RP::end();
         return r;
     }
 
@@ -192,7 +207,7 @@ class hashset_cptr_t
     {
         while (true) {
             hnode_t * t = head;
-            int       i = key % t->size;
+            int       i = bucketOf(key, t->size);
 
             int     * b;
             cptr_t<int> w;
@@ -224,9 +239,19 @@ class hashset_cptr_t
         }
     }
 
+    /** Count an insert (+1) or remove (-1), and resize /t/ if the load calls for it */
+    void account(hnode_t * t, int delta)
+    {
+        count.add(RP::get_tid(), delta);
+        if (delta > 0 && chash_should_grow(count.get(), t->size))
+            resize(t, true);
+        else if (delta < 0 && chash_should_shrink(count.get(), t->size))
+            resize(t, false);
+    }
+
     bool resize(hnode_t * t, bool grow)
     {
-        if ((t->size == MAX_BUCKET_NUM && grow) ||
+        if ((t->size >= chash_max_buckets() && grow) ||
             (t->size == MIN_BUCKET_NUM && !grow))
             return false;
 
@@ -266,7 +291,7 @@ class hashset_cptr_t
         if (b == NULL && s != NULL) {
             int * set;
             if (s->size * 2 == t->size) /* growing */ {
-                int * p = freezeBucket(s, i % s->size);
+                int * p = freezeBucket(s, i & (s->size - 1));
                 set = split(p, t->size, i);
             }
             else /* shrinking */ {
@@ -289,31 +314,19 @@ class hashset_cptr_t
         return ss.str();
     }
 
+    /** Keep the keys of /o/ that land in bucket /remainder/ of /size/ */
     int * split(int * o, int size, int remainder)
     {
-        int count = 0;
-        for (int i = 1; i <= o[0]; i++)
-            if (o[i] % size == remainder)
-                count++;
+        int count = fset_filter_hashed<HP>(o, NULL, size - 1, remainder);
         int * n = alloc_fset(count);
-        n[0] = count;
-        int j = 1;
-        for (int i = 1; i <= o[0]; i++) {
-            if (o[i] % size == remainder)
-                n[j++] = o[i];
-        }
+        fset_filter_hashed<HP>(o, n, size - 1, remainder);
         return n;
     }
 
     int * merge(int * p, int * q)
     {
         int * n = alloc_fset(p[0] + q[0]);
-        n[0] = p[0] + q[0];
-        int j = 1;
-        for (int i = 1; i <= p[0]; i++)
-            n[j++] = p[i];
-        for (int i = 1; i <= q[0]; i++)
-            n[j++] = q[i];
+        fset_concat(p, q, n);
         return n;
     }
 
@@ -338,11 +351,7 @@ class hashset_cptr_t
 
     bool arrayContains(int * o, int key)
     {
-        for (int i = 1; i <= o[0]; i++) {
-            if (o[i] == key)
-                return true;
-        }
-        return false;
+        return fset_find(o, key) != 0;
     }
 
     int * arrayInsert(int * o, int key)
@@ -358,14 +367,11 @@ class hashset_cptr_t
 
     int * arrayRemove(int * o, int key)
     {
-        if (!arrayContains(o, key))
+        int k = fset_find(o, key);
+        if (k == 0)
             return o;
         int * n = alloc_fset(o[0] - 1);
-        int j = 1;
-        for (int i = 1; i <= o[0]; i++) {
-            if (o[i] != key)
-                n[j++] = o[i];
-        }
+        fset_erase(o, o[0], k, n);
         return n;
     }
 };
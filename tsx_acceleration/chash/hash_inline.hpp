@@ -0,0 +1,589 @@
+#pragma once
+
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <cstdint>
+#include <cassert>
+#include <atomic>
+#include <x86intrin.h>
+
+#include "common.hpp"
+#include "counter.hpp"
+#include "fset.hpp"
+#include "hashfn.hpp"
+#include "reclaim.hpp"
+
+using std::atomic;
+using std::stringstream;
+using std::string;
+using std::endl;
+
+/**
+ *  hashset_inplace_t with each bucket in one cache line.  A slot is the
+ *  bucket's counted pointer followed by an inline fset (keys[0] is the
+ *  length).  The pointer either points at the slot's own inline fset, or at
+ *  an overflow fset elsewhere, or is NULL while the bucket is being made by
+ *  a resize; its low bit freezes the bucket, as before.  So a lookup in a
+ *  bucket whose keys are inline touches only the slot.
+ *
+ *  Only transactions write inline keys.  The fast path edits them in place,
+ *  and moves the keys of an overflow fset inline whenever they fit.  The
+ *  lock-free slow path never writes a slot's keys: it copies the bucket to
+ *  a new overflow fset and CASes the pointer, and the counter tells a
+ *  reader of inline keys that they changed under it.  Without HTM, every
+ *  bucket ends up in an overflow fset, as in hashset_inplace_t.
+ */
+template<class RP = wbmm_policy_t, class HP = identity_hash_t>
+class hashset_inline_t
+{
+  private:
+
+    static const int MIN_BUCKET_NUM = 1;
+
+    /*** Ints in a slot's inline fset, including the length */
+    static const int INLINE_INTS = (CACHELINE_BYTES - sizeof(cptr_word_t)) / sizeof(int);
+
+    /*** Most keys a slot holds inline */
+    static const int INLINE_MAX = INLINE_INTS - 1;
+
+  private:
+
+    struct slot_t
+    {
+        cptr_atomic_t       word;
+        int                 keys[INLINE_INTS];
+    };
+
+    struct hnode_t
+    {
+        atomic<hnode_t *> old;
+        slot_t *          buckets;
+        void *            raw;
+        int               size;
+    };
+
+    /** The bucket array is cache-line aligned, so each slot is one line */
+    static hnode_t * alloc_hnode(hnode_t * o, int s)
+    {
+        void * raw = RP::alloc(sizeof(slot_t) * s + CACHELINE_BYTES);
+        hnode_t * t = (hnode_t *)RP::alloc(sizeof(hnode_t));
+        t->old = o;
+        t->size = s;
+        t->raw = raw;
+        t->buckets = (slot_t *)(((uintptr_t)raw + CACHELINE_BYTES - 1) & ~(CACHELINE_BYTES - 1));
+        for (int i = 0; i < s; i++) t->buckets[i].word = 0;
+        return t;
+    }
+
+    static void free_hnode_safe(hnode_t * t)
+    {
+        for (int i = 0; i < t->size; i++) {
+            cptr_t<int> p;
+            p.all = t->buckets[i].word;
+            int * b = (int *)REF_UNMARKED(p.fields.ptr);
+            if (b != t->buckets[i].keys)
+                RP::free_safe(b);
+        }
+        RP::free_safe(t->raw);
+        RP::free_safe(t);
+    }
+
+    static void free_hnode_unsafe(hnode_t * t)
+    {
+        RP::free_unsafe(t->raw);
+        RP::free_unsafe(t);
+    }
+
+    static int * alloc_fset(int len)
+    {
+        int * arr = (int *)RP::alloc(sizeof(int) * (len + 1));
+        arr[0] = len;
+        return arr;
+    }
+
+    static void free_fset_safe(int * arr)
+    {
+        RP::free_safe(arr);
+    }
+
+    static void free_fset_unsafe(int * arr)
+    {
+        RP::free_unsafe(arr);
+    }
+
+    /** Sizes are powers of two, so the mask keeps the low bits of the hash */
+    static int bucketOf(int key, int size)
+    {
+        return HP::hash(key) & (size - 1);
+    }
+
+
+  private:
+
+    atomic<hnode_t *> head;
+
+    /*** Approximate number of keys, which drives resizing */
+    approx_counter_t  count;
+
+  public:
+
+    hashset_inline_t()
+    {
+        static_assert(sizeof(slot_t) == CACHELINE_BYTES, "a slot is one cache line");
+        hnode_t * t = alloc_hnode(NULL, MIN_BUCKET_NUM);
+        slot_t * s = &t->buckets[0];
+        s->keys[0] = 0;
+        cptr_t<int> w;
+        MAKE_CPTR(w, s->keys, 0);
+        s->word = w.all;
+        head = t;
+    }
+
+    bool insert(int key)
+    {
+        HTM_SITE(site, "hashset_inline_t::insert");
+        hnode_t * t;
+        int result;
+
+        uint32_t status;
+      retry:
+        status = htm_begin(site, 42);
+        if (status == HTM_STARTED) {
+            t = head;
+            result = updateInline(&t->buckets[bucketOf(key, t->size)], true, key);
+            htm_end(site); // commit fast path
+            if (result > 0) {
+                RP::begin();
+                account(t, 1);
+                RP::end();
+            }
+            return result > 0;
+        }
+        else {
+            if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
+                // try slow path
+            }
+            else if (htm_retry(site, status)) {
+                goto retry;
+            }
+            htm_fallback(site);
+        }
+
+        RP::begin();
+        t = head;
+        result = apply(true, key);
+        if (result > 0)
+            account(t, 1);
+        RP::end();
+        return result > 0;
+    }
+
+    bool remove(int key)
+    {
+        HTM_SITE(site, "hashset_inline_t::remove");
+        hnode_t * t;
+        int result;
+
+        uint32_t status;
+      retry:
+        status = htm_begin(site, 42);
+        if (status == HTM_STARTED) {
+            t = head;
+            result = updateInline(&t->buckets[bucketOf(key, t->size)], false, key);
+            htm_end(site); // commit fast path
+            if (result > 0) {
+                RP::begin();
+                account(t, -1);
+                RP::end();
+            }
+            return result > 0;
+        }
+        else {
+            if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
+                // try slow path
+            }
+            else if (htm_retry(site, status)) {
+                goto retry;
+            }
+            htm_fallback(site);
+        }
+
+        RP::begin();
+        t = head;
+        result = apply(false, key);
+        if (result > 0)
+            account(t, -1);
+        RP::end();
+        return result > 0;
+    }
+
+    bool contains(int key)
+    {
+        HTM_SITE(site, "hashset_inline_t::contains");
+        uint32_t status;
+      retry:
+        status = htm_begin(site, 42);
+        if (status == HTM_STARTED) {
+            hnode_t * t = head;
+            cptr_t<int> w;
+            w.all = t->buckets[bucketOf(key, t->size)].word;
+            int * b = w.fields.ptr;
+            if (b == NULL) {
+                hnode_t * s = t->old;
+                w.all = s->buckets[bucketOf(key, s->size)].word;
+                b = w.fields.ptr;
+            }
+            bool r = arrayContains((int *)REF_UNMARKED(b), key);
+            htm_end(site);
+            return r;
+        }
+        else {
+            if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
+                // try slow path
+            }
+            else if (htm_retry(site, status)) {
+                goto retry;
+            }
+            htm_fallback(site);
+        }
+
+        RP::begin();
+
+      retry_slow:
+        hnode_t * t = head;
+        cptr_atomic_t * ptr;
+        cptr_t<int> w, w2;
+        ptr = &t->buckets[bucketOf(key, t->size)].word;
+        w.all = *ptr;
+        int     * b = w.fields.ptr;
+        // if the b is empty, use old table
+        if (b == NULL) {
+            hnode_t * s = t->old;
+            ptr = (s == NULL)
+                ? &t->buckets[bucketOf(key, t->size)].word
+                : &s->buckets[bucketOf(key, s->size)].word;
+            w.all = *ptr;
+            b = w.fields.ptr;
+        }
+        bool r = arrayContains((int *)REF_UNMARKED(b), key);
+        // inline keys may have changed while we read them
+        w2.all = *ptr;
+        if (w2.fields.ctr != w.fields.ctr)
+            goto retry_slow;
+
+        RP::end();
+        return r;
+    }
+
+    bool grow()
+    {
+        RP::begin();
+        hnode_t * h = head;
+        bool r = resize(h, true);
+        RP::end();
+        return r;
+    }
+
+    bool shrink()
+    {
+        RP::begin();
+        hnode_t * h = head;
+        bool r = resize(h, false);
+        RP::end();
+        return r;
+    }
+
+    string toString()
+    {
+        stringstream ss;
+        hnode_t * curr = head;
+        int age = 0;
+        while (curr != NULL) {
+            ss << "HashTableNode #" << age++ << endl;
+            for (int i = 0; i < curr->size; i++) {
+                ss << "  Bucket " << i << ": ";
+
+                cptr_t<int> w;
+                w.all = curr->buckets[i].word;
+                int * b = w.fields.ptr;
+
+                if (IS_MARKED(b))
+                    ss << "* ";
+                if ((int *)REF_UNMARKED(b) == curr->buckets[i].keys)
+                    ss << "(inline) ";
+                if (b != NULL)
+                    ss << bucketToString((int *)REF_UNMARKED(b));
+                ss << endl;
+            }
+            curr = curr->old;
+        }
+        return ss.str();
+    }
+
+
+  private:
+
+    /**
+     *  The body of the fast path: insert (remove) /key/ in slot /s/, leaving
+     *  the keys inline, or abort if they do not fit or the bucket is frozen
+     *  or not made yet.  Call only inside a transaction.
+     */
+    int updateInline(slot_t * s, bool insert, int key)
+    {
+        cptr_t<int> w;
+        w.all = s->word;
+        int * b = w.fields.ptr;
+        if (b == NULL || IS_MARKED(b))
+            htm_abort(42);
+
+        int k = fset_find(b, key);
+        if (insert ? (k != 0) : (k == 0))
+            return -(b[0] + 1);
+
+        int len = insert ? b[0] + 1 : b[0] - 1;
+        if (len > INLINE_MAX)
+            htm_abort(42);
+
+        if (b == s->keys) {
+            if (insert)
+                b[len] = key;
+            else
+                b[k] = b[b[0]];
+            b[0] = len;
+        }
+        else {
+            // the keys fit now, so bring them back from overflow
+            int j = 1;
+            for (int i = 1; i <= b[0]; i++)
+                if (i != k || insert)
+                    s->keys[j++] = b[i];
+            if (insert)
+                s->keys[j] = key;
+            s->keys[0] = len;
+            free_fset_safe(b);
+            w.fields.ptr = s->keys;
+        }
+        w.fields.ctr++;
+        s->word = w.all;
+        return len + 1;
+    }
+
+    int apply(bool insert, int key)
+    {
+        while (true) {
+            hnode_t * t = head;
+            int       i = bucketOf(key, t->size);
+            slot_t  * s = &t->buckets[i];
+
+            int     * b;
+            cptr_t<int> w;
+            w.all = s->word;
+            b = w.fields.ptr;
+
+            // if the b is empty, help finish resize
+            if (b == NULL)
+                helpResize(t, i);
+            // otherwise enlist at b
+            else {
+                while (!IS_MARKED(b)) {
+                    // inline keys may change as we copy them; the CAS on the
+                    // counter catches that
+                    int * n = insert ? arrayInsert(b, key) : arrayRemove(b, key);
+                    if (n == b) {
+                        // an unchanged read of inline keys must be validated
+                        cptr_t<int> w2;
+                        w2.all = s->word;
+                        if (w2.all == w.all)
+                            return -(n[0] + 1);
+                    }
+                    else {
+                        cptr_t<int> nw;
+                        MAKE_CPTR(nw, n, w.fields.ctr + 1);
+                        if (bcas(&s->word, &w.all, nw.all)) {
+                            if (b != s->keys)
+                                free_fset_safe(b); // reclaim b
+                            return n[0] + 1;
+                        }
+                        free_fset_unsafe(n); // reclaim n
+                    }
+                    w.all = s->word;
+                    b = w.fields.ptr;
+                }
+            }
+        }
+    }
+
+    /** Count an insert (+1) or remove (-1), and resize /t/ if the load calls for it */
+    void account(hnode_t * t, int delta)
+    {
+        count.add(RP::get_tid(), delta);
+        if (delta > 0 && chash_should_grow(count.get(), t->size))
+            resize(t, true);
+        else if (delta < 0 && chash_should_shrink(count.get(), t->size))
+            resize(t, false);
+    }
+
+    bool resize(hnode_t * t, bool grow)
+    {
+        if ((t->size >= chash_max_buckets() && grow) ||
+            (t->size == MIN_BUCKET_NUM && !grow))
+            return false;
+
+        if (t == head) {
+            // make sure we can deprecate t's predecessor
+            for (int i = 0; i < t->size; i++) {
+                cptr_t<int> w;
+                w.all = t->buckets[i].word;
+                if (w.fields.ptr == NULL)
+                    helpResize(t, i);
+            }
+            // deprecate t's predecessor
+            hnode_t * o = t->old;
+            if (o && bcas(&(t->old), &o, (hnode_t *)NULL))
+                free_hnode_safe(o);
+
+            // switch to fresh bucket array
+            if (t == head) {
+                hnode_t * n = alloc_hnode(t, grow ? t->size * 2 : t->size / 2);
+                if (!bcas(&head, &t, n)) {
+                    free_hnode_unsafe(n); // free n
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void helpResize(hnode_t * t, int i)
+    {
+        HTM_SITE(site, "hashset_inline_t::helpResize");
+        slot_t * slot = &t->buckets[i];
+        cptr_t<int> w;
+        w.all = slot->word;
+
+        hnode_t * s = t->old;
+        if (w.fields.ptr == NULL && s != NULL) {
+            int * set;
+            if (s->size * 2 == t->size) /* growing */ {
+                int * p = freezeBucket(s, i & (s->size - 1));
+                set = split(p, t->size, i);
+            }
+            else /* shrinking */ {
+                int * p = freezeBucket(s, i);
+                int * q = freezeBucket(s, i + t->size);
+                set = merge(p, q);
+            }
+
+            // publish the keys inline if they fit, which takes a transaction
+            if (set[0] <= INLINE_MAX) {
+                uint32_t status;
+              retry:
+                status = htm_begin(site, 42);
+                if (status == HTM_STARTED) {
+                    cptr_t<int> cur;
+                    cur.all = slot->word;
+                    if (cur.fields.ptr == NULL) {
+                        for (int j = 0; j <= set[0]; j++)
+                            slot->keys[j] = set[j];
+                        MAKE_CPTR(cur, slot->keys, w.fields.ctr + 1);
+                        slot->word = cur.all;
+                    }
+                    htm_end(site);
+                    free_fset_unsafe(set);
+                    return;
+                }
+                else {
+                    if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
+                        // try slow path
+                    }
+                    else if (htm_retry(site, status)) {
+                        goto retry;
+                    }
+                    htm_fallback(site);
+                }
+            }
+
+            cptr_t<int> nw;
+            MAKE_CPTR(nw, set, w.fields.ctr + 1);
+            if (!bcas(&slot->word, &w.all, nw.all))
+                free_fset_unsafe(set);
+        }
+    }
+
+    string bucketToString(int * b)
+    {
+        stringstream ss;
+        for (int i = 1; i <= b[0]; i++)
+            ss << b[i] << " ";
+        return ss.str();
+    }
+
+    /** Keep the keys of /o/ that land in bucket /remainder/ of /size/ */
+    int * split(int * o, int size, int remainder)
+    {
+        int count = fset_filter_hashed<HP>(o, NULL, size - 1, remainder);
+        int * n = alloc_fset(count);
+        fset_filter_hashed<HP>(o, n, size - 1, remainder);
+        return n;
+    }
+
+    int * merge(int * p, int * q)
+    {
+        int * n = alloc_fset(p[0] + q[0]);
+        fset_concat(p, q, n);
+        return n;
+    }
+
+    int * freezeBucket(hnode_t * t, int i)
+    {
+        while (true) {
+            int     * b;
+            cptr_t<int> w;
+            w.all = t->buckets[i].word;
+            b = w.fields.ptr;
+
+            if (IS_MARKED(b))
+                return (int *)REF_UNMARKED(b);
+
+            cptr_t<int> nw;
+            MAKE_CPTR(nw, (int *)REF_MARKED(b), w.fields.ctr + 1);
+
+            if (bcas(&t->buckets[i].word, &w.all, nw.all))
+                return b;
+        }
+    }
+
+    bool arrayContains(int * o, int key)
+    {
+        return fset_find(o, key) != 0;
+    }
+
+    int * arrayInsert(int * o, int key)
+    {
+        if (arrayContains(o, key))
+            return o;
+        // read the length once: o may be inline keys that a transaction is
+        // changing, in which case the caller's CAS fails
+        int len = o[0];
+        int * n = alloc_fset(len + 1);
+        for (int i = 1; i <= len; i++)
+            n[i] = o[i];
+        n[n[0]] = key;
+        return n;
+    }
+
+    int * arrayRemove(int * o, int key)
+    {
+        // read the length once, as arrayInsert does: if a transaction
+        // shrinks the inline keys under us, we must not size n from a second
+        // read; returning o makes the caller re-validate the slot
+        int k = fset_find(o, key);
+        int len = o[0];
+        if (k == 0 || k > len)
+            return o;
+        int * n = alloc_fset(len - 1);
+        fset_erase(o, len, k, n);
+        return n;
+    }
+};
@@ -8,22 +8,25 @@
 #include <atomic>
 #include <x86intrin.h>
 
+#include "batch.hpp"
 #include "common.hpp"
-#include "mm.hpp"
+#include "counter.hpp"
+#include "fset.hpp"
+#include "hashfn.hpp"
+#include "reclaim.hpp"
 
 using std::atomic;
 using std::stringstream;
 using std::string;
 using std::endl;
 
+template<class RP = wbmm_policy_t, class HP = identity_hash_t>
 class hashset_inplace_t
 {
   private:
 
     static const int MIN_BUCKET_NUM = 1;
-    static const int MAX_BUCKET_NUM = 1 << 16;
 
-    static const int MAX_ATTEMPT_NUM = 32;
     static const int MIN_ALLOC_LEN = 4;
 
   private:
@@ -31,16 +34,16 @@ class hashset_inplace_t
     struct hnode_t
     {
         atomic<hnode_t *>  old;
-        atomic<uint64_t> * buckets;
+        cptr_atomic_t *    buckets;
         int                size;
     };
 
     static hnode_t * alloc_hnode(hnode_t * o, int s)
     {
-        hnode_t * t = (hnode_t *)wbmm_alloc(sizeof(hnode_t));
+        hnode_t * t = (hnode_t *)RP::alloc(sizeof(hnode_t));
         t->old = o;
         t->size = s;
-        t->buckets = (atomic<uint64_t> *)wbmm_alloc(sizeof(atomic<uint64_t>) * s);
+        t->buckets = (cptr_atomic_t *)RP::alloc(sizeof(cptr_atomic_t) * s);
         for (int i = 0; i < s; i++) t->buckets[i] = 0;
         return t;
     }
@@ -50,34 +53,40 @@ class hashset_inplace_t
         for (int i = 0; i < t->size; i++) {
             cptr_t<int> p;
             p.all = t->buckets[i];
-            wbmm_free_safe((void *)REF_UNMARKED(p.fields.ptr));
+            RP::free_safe((void *)REF_UNMARKED(p.fields.ptr));
         }
-        wbmm_free_safe(t->buckets);
-        wbmm_free_safe(t);
+        RP::free_safe(t->buckets);
+        RP::free_safe(t);
     }
 
     static void free_hnode_unsafe(hnode_t * t)
     {
-        wbmm_free_unsafe(t->buckets);
-        wbmm_free_unsafe(t);
+        RP::free_unsafe(t->buckets);
+        RP::free_unsafe(t);
     }
 
     static int * alloc_fset(int len)
     {
         int alloc_len = std::max(MIN_ALLOC_LEN + 1, len + 1);
-        int * arr = (int *)wbmm_alloc(sizeof(int) * alloc_len);
+        int * arr = (int *)RP::alloc(sizeof(int) * alloc_len);
         arr[0] = len;
         return arr;
     }
 
     static void free_fset_safe(int * arr)
     {
-        wbmm_free_safe(arr);
+        RP::free_safe(arr);
     }
 
     static void free_fset_unsafe(int * arr)
     {
-        wbmm_free_unsafe(arr);
+        RP::free_unsafe(arr);
+    }
+
+    /** Sizes are powers of two, so the mask keeps the low bits of the hash */
+    static int bucketOf(int key, int size)
+    {
+        return HP::hash(key) & (size - 1);
     }
 
 
@@ -85,13 +94,15 @@ class hashset_inplace_t
 
     atomic<hnode_t *> head;
 
+    /*** Approximate number of keys, which drives resizing */
+    approx_counter_t  count;
+
   public:
 
     hashset_inplace_t()
     {
         // make sure pointer size is 32bit since we are using 64bit counted pointers
-        assert(sizeof(uintptr_t) == sizeof(uint32_t));
-        assert(sizeof(cptr_t<int>) == sizeof(uint64_t));
+        assert(sizeof(cptr_t<int>) == sizeof(cptr_word_t));
         hnode_t * t = alloc_hnode(NULL, MIN_BUCKET_NUM);
         int * b = alloc_fset(0);
         cptr_t<int> w;
@@ -102,75 +113,79 @@ class hashset_inplace_t
 
     bool insert(int key)
     {
+        HTM_SITE(site, "hashset_inplace_t::insert");
         hnode_t * t;
         int result;
 
         uint32_t status;
-        uint32_t attempts = 0;
       retry:
         t = head;
-        int i = key % t->size;
-        status = _xbegin();
-        if (status == _XBEGIN_STARTED) {
+        int i = bucketOf(key, t->size);
+        status = htm_begin(site, 42);
+        if (status == HTM_STARTED) {
             int     * b;
             cptr_t<int> w;
             w.all = t->buckets[i];
             b = w.fields.ptr;
             // if the b is empty, goto slow path
-            if (b == NULL || IS_MARKED(b)) _xabort(42);
+            if (b == NULL || IS_MARKED(b)) htm_abort(42);
             for (int i = 1; i <= b[0]; i++) {
                 if (b[i] == key) {
                     result = -(b[0] + 1);
                     goto commit;
                 }
             }
-            if (b[0] >= MIN_ALLOC_LEN) _xabort(42);
+            if (b[0] >= MIN_ALLOC_LEN) htm_abort(42);
             b[0]++;
             b[b[0]] = key;
             w.fields.ctr++;
             t->buckets[i] = w.all;
             result = b[0] + 1;
           commit:
-            _xend(); // commit fast path
-            if (abs(result) > 2)
-                resize(t, true);
+            htm_end(site); // commit fast path
+            if (result > 0) {
+                RP::begin();
+                account(t, 1);
+                RP::end();
+            }
             return result > 0;
         }
         else {
-            if ((status & _XABORT_EXPLICIT) && _XABORT_CODE(status) == 42) {
+            if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
                 // try slow path
             }
-            else if (++attempts < MAX_ATTEMPT_NUM) {
+            else if (htm_retry(site, status)) {
                 goto retry;
             }
+            htm_fallback(site);
         }
 
-        wbmm_begin();
+        RP::begin();
         t = head;
         result = apply(true, key);
-        if (abs(result) > 2)
-            resize(t, true);
-        wbmm_end();
+        if (result > 0)
+            account(t, 1);
+        RP::end();
         return result > 0;
     }
 
     bool remove(int key)
     {
+        HTM_SITE(site, "hashset_inplace_t::remove");
         int result;
 
         uint32_t status;
-        uint32_t attempts = 0;
       retry:
         hnode_t * t = head;
-        int       i = key % t->size;
-        status = _xbegin();
-        if (status == _XBEGIN_STARTED) {
+        int       i = bucketOf(key, t->size);
+        status = htm_begin(site, 42);
+        if (status == HTM_STARTED) {
             int     * b;
             cptr_t<int> w;
             w.all = t->buckets[i];
             b = w.fields.ptr;
             // if the b is empty, goto slow path
-            if (b == NULL || IS_MARKED(b)) _xabort(42);
+            if (b == NULL || IS_MARKED(b)) htm_abort(42);
             int j = 0;
             for (int i = 1; i <= b[0]; i++) {
                 if (b[i] != key)
@@ -184,95 +199,127 @@ class hashset_inplace_t
                 t->buckets[i] = w.all;
                 result = b[0] + 1;
             }
-            _xend(); // commit fast path
+            htm_end(site); // commit fast path
+            if (result > 0) {
+                RP::begin();
+                account(t, -1);
+                RP::end();
+            }
             return result > 0;
         }
         else {
-            if ((status & _XABORT_EXPLICIT) && _XABORT_CODE(status) == 42) {
+            if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
                 // try slow path
             }
-            else if (++attempts < MAX_ATTEMPT_NUM) {
+            else if (htm_retry(site, status)) {
                 goto retry;
             }
+            htm_fallback(site);
         }
 
-        wbmm_begin();
+        RP::begin();
+        t = head;
         result = apply(false, key);
-        wbmm_end();
+        if (result > 0)
+            account(t, -1);
+        RP::end();
         return result > 0;
     }
 
     bool contains(int key)
     {
+        HTM_SITE(site, "hashset_inplace_t::contains");
         uint32_t status;
-        uint32_t attempts = 0;
       retry:
-        status = _xbegin();
-        if (status == _XBEGIN_STARTED) {
+        status = htm_begin(site, 42);
+        if (status == HTM_STARTED) {
             hnode_t * t = head;
             cptr_t<int> w;
-            w.all = t->buckets[key % t->size];
+            w.all = t->buckets[bucketOf(key, t->size)];
             int * b = w.fields.ptr;
             if (b == NULL) {
                 hnode_t * s = t->old;
-                w.all = s->buckets[key % s->size];
+                w.all = s->buckets[bucketOf(key, s->size)];
                 b = w.fields.ptr;
             }
             bool r = arrayContains((int *)REF_UNMARKED(b), key);
-            _xend();
+            htm_end(site);
             return r;
         }
         else {
-            if ((status & _XABORT_EXPLICIT) && _XABORT_CODE(status) == 42) {
+            if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
                 // try slow path
             }
-            else if (++attempts < MAX_ATTEMPT_NUM) {
+            else if (htm_retry(site, status)) {
                 goto retry;
             }
+            htm_fallback(site);
         }
 
-        wbmm_begin();
+        RP::begin();
+        bool r = lookup(key);
+        RP::end();
+        return r;
+    }
 
-      retry_slow:
-        hnode_t * t = head;
-        atomic<uint64_t> * ptr;
-        cptr_t<int> w, w2;
-        ptr = &t->buckets[key % t->size];
-        w.all = *ptr;
-        int     * b = w.fields.ptr;
-        // if the b is empty, use old table
-        if (b == NULL) {
-            hnode_t * s = t->old;
-            ptr = (s == NULL)
-                ? &t->buckets[key % t->size]
-                : &s->buckets[key % s->size];
-            w.all = *ptr;
-            b = w.fields.ptr;
+    /**
+     *  The batched operations take /n/ keys at once, and return how many of
+     *  them were found (inserted, removed).  If /done/ is not NULL, done[j]
+     *  says whether keys[j] was.  Keys that share a bucket are applied in
+     *  one transaction, or failing that with one copy-on-write of the
+     *  bucket.  Each key is still its own linearizable operation: the batch
+     *  as a whole is not atomic.
+     */
+    int containsBatch(const int * keys, int n, bool * done = NULL)
+    {
+        RP::begin();
+        hnode_t  * t = head;
+        int     size = t->size;
+        uint64_t * ord = batch_order<HP>(keys, n, size);
+        int    found = 0;
+        for (int g = 0; g < n; ) {
+            int e = batch_group_end(ord, n, g);
+            prefetchBatch(t, ord, n, e);
+            int r = containsGroup(keys, ord + g, e - g, size, done);
+            if (r < 0) {
+                // the table resized under us: re-plan the rest of the batch
+                t = head;
+                size = t->size;
+                batch_plan<HP>(keys, ord + g, n - g, size);
+                continue;
+            }
+            found += r;
+            g = e;
         }
-        bool r = arrayContains((int *)REF_UNMARKED(b), key);
-        w2.all = *ptr;
-        if (w2.fields.ctr != w.fields.ctr)
-            goto retry_slow;
+        RP::end();
+        return found;
+    }
 
-        wbmm_end();
-        return r;
+    int insertBatch(const int * keys, int n, bool * done = NULL)
+    {
+        return applyBatch(true, keys, n, done);
+    }
+
+    int removeBatch(const int * keys, int n, bool * done = NULL)
+    {
+        return applyBatch(false, keys, n, done);
     }
 
     bool grow()
     {
-        wbmm_begin();
+        RP::begin();
         hnode_t * h = head;
         bool r = resize(h, true);
-        wbmm_end();
+        RP::end();
         return r;
     }
 
     bool shrink()
     {
-        wbmm_begin();
+        RP::begin();
         hnode_t * h = head;
         bool r = resize(h, false);
-        wbmm_end();
+        RP::end();
         return r;
     }
 
@@ -304,11 +351,36 @@ class hashset_inplace_t
 
   private:
 
+    bool lookup(int key)
+    {
+      retry_slow:
+        hnode_t * t = head;
+        cptr_atomic_t * ptr;
+        cptr_t<int> w, w2;
+        ptr = &t->buckets[bucketOf(key, t->size)];
+        w.all = *ptr;
+        int     * b = w.fields.ptr;
+        // if the b is empty, use old table
+        if (b == NULL) {
+            hnode_t * s = t->old;
+            ptr = (s == NULL)
+                ? &t->buckets[bucketOf(key, t->size)]
+                : &s->buckets[bucketOf(key, s->size)];
+            w.all = *ptr;
+            b = w.fields.ptr;
+        }
+        bool r = arrayContains((int *)REF_UNMARKED(b), key);
+        w2.all = *ptr;
+        if (w2.fields.ctr != w.fields.ctr)
+            goto retry_slow;
+        return r;
+    }
+
     int apply(bool insert, int key)
     {
         while (true) {
             hnode_t * t = head;
-            int       i = key % t->size;
+            int       i = bucketOf(key, t->size);
 
             int     * b;
             cptr_t<int> w;
@@ -340,9 +412,212 @@ class hashset_inplace_t
         }
     }
 
+    /**
+     *  Look up the /m/ keys of one plan group, which all fall in one bucket
+     *  of a table of /size/ buckets, in a single transaction.  Returns how
+     *  many were found, or -1 if the table is no longer that size.
+     */
+    int containsGroup(const int * keys, const uint64_t * ord, int m, int size,
+                      bool * done)
+    {
+        HTM_SITE(site, "hashset_inplace_t::containsGroup");
+        int found;
+
+        uint32_t status;
+      retry:
+        hnode_t * t = head;
+        if (t->size != size)
+            return -1;
+        int i = batch_bucket(ord[0]);
+        status = htm_begin(site, 42);
+        if (status == HTM_STARTED) {
+            cptr_t<int> w;
+            w.all = t->buckets[i];
+            int * b = w.fields.ptr;
+            // a bucket that is mid-resize takes the slow path
+            if (b == NULL) htm_abort(42);
+            b = (int *)REF_UNMARKED(b);
+            found = 0;
+            for (int j = 0; j < m; j++) {
+                int  p = batch_pos(ord[j]);
+                bool r = arrayContains(b, keys[p]);
+                if (done)
+                    done[p] = r;
+                found += r;
+            }
+            htm_end(site);
+            return found;
+        }
+        else {
+            if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
+                // try slow path
+            }
+            else if (htm_retry(site, status)) {
+                goto retry;
+            }
+            htm_fallback(site);
+        }
+
+        found = 0;
+        for (int j = 0; j < m; j++) {
+            int  p = batch_pos(ord[j]);
+            bool r = lookup(keys[p]);
+            if (done)
+                done[p] = r;
+            found += r;
+        }
+        return found;
+    }
+
+    int applyBatch(bool insert, const int * keys, int n, bool * done)
+    {
+        RP::begin();
+        hnode_t  * t = head;
+        int     size = t->size;
+        uint64_t * ord = batch_order<HP>(keys, n, size);
+        int  changed = 0;
+        for (int g = 0; g < n; ) {
+            int e = batch_group_end(ord, n, g);
+            prefetchBatch(t, ord, n, e);
+            int r = applyGroup(insert, keys, ord + g, e - g, size, done);
+            if (r < 0) {
+                // the table resized under us: re-plan the rest of the batch
+                t = head;
+                size = t->size;
+                batch_plan<HP>(keys, ord + g, n - g, size);
+                continue;
+            }
+            if (r > 0) {
+                changed += r;
+                account(t, insert ? r : -r);
+            }
+            g = e;
+        }
+        RP::end();
+        return changed;
+    }
+
+    /**
+     *  Insert (remove) the /m/ keys of one plan group, which all fall in one
+     *  bucket of a table of /size/ buckets.  The fast path edits the bucket
+     *  in place in one transaction, as long as it has room for the whole
+     *  group; the slow path makes one copy of the bucket.  Returns how many
+     *  keys changed, or -1 if the table is no longer that size.
+     */
+    int applyGroup(bool insert, const int * keys, const uint64_t * ord, int m,
+                   int size, bool * done)
+    {
+        HTM_SITE(site, "hashset_inplace_t::applyGroup");
+        int result;
+
+        uint32_t status;
+      retry:
+        hnode_t * t = head;
+        if (t->size != size)
+            return -1;
+        int i = batch_bucket(ord[0]);
+        status = htm_begin(site, 42);
+        if (status == HTM_STARTED) {
+            cptr_t<int> w;
+            w.all = t->buckets[i];
+            int * b = w.fields.ptr;
+            // if the b is empty, goto slow path
+            if (b == NULL || IS_MARKED(b)) htm_abort(42);
+            int before = b[0];
+            for (int j = 0; j < m; j++) {
+                int p = batch_pos(ord[j]);
+                int k = fset_find(b, keys[p]);
+                if (insert && k == 0) {
+                    if (b[0] >= MIN_ALLOC_LEN) htm_abort(42);
+                    b[++b[0]] = keys[p];
+                }
+                else if (!insert && k != 0)
+                    b[k] = b[b[0]--];
+                if (done)
+                    done[p] = insert ? (k == 0) : (k != 0);
+            }
+            result = insert ? b[0] - before : before - b[0];
+            if (result > 0) {
+                w.fields.ctr++;
+                t->buckets[i] = w.all;
+            }
+            htm_end(site); // commit fast path
+            return result;
+        }
+        else {
+            if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
+                // try slow path
+            }
+            else if (htm_retry(site, status)) {
+                goto retry;
+            }
+            htm_fallback(site);
+        }
+
+        while (true) {
+            t = head;
+            if (t->size != size)
+                return -1;
+
+            int     * b;
+            cptr_t<int> w;
+            w.all = t->buckets[i];
+            b = w.fields.ptr;
+
+            // if the b is empty, help finish resize
+            if (b == NULL)
+                helpResize(t, i);
+            // otherwise enlist at b
+            else {
+                while (!IS_MARKED(b)) {
+                    int * n = insert ? arrayInsertMany(b, keys, ord, m, done)
+                                     : arrayRemoveMany(b, keys, ord, m, done);
+                    if (n == b)
+                        return 0;
+                    result = insert ? n[0] - b[0] : b[0] - n[0];
+                    cptr_t<int> nw;
+                    MAKE_CPTR(nw, n, w.fields.ctr + 1);
+                    if (bcas(&t->buckets[i], &w.all, nw.all)) {
+                        free_fset_safe(b); // reclaim b
+                        return result;
+                    }
+                    w.all = t->buckets[i];
+                    b = w.fields.ptr;
+                    free_fset_unsafe(n); // reclaim n
+                }
+            }
+        }
+    }
+
+    /**
+     *  Prefetch the bucket slot BATCH_PREFETCH_DIST plan entries past /e/,
+     *  and the bucket of the group at /e/, whose slot we prefetched earlier.
+     *  A prefetch never faults, so the slot need not be protected.
+     */
+    void prefetchBatch(hnode_t * t, const uint64_t * ord, int n, int e)
+    {
+        if (e + BATCH_PREFETCH_DIST < n)
+            __builtin_prefetch(&t->buckets[batch_bucket(ord[e + BATCH_PREFETCH_DIST])]);
+        if (e < n) {
+            cptr_t<int> w;
+            w.all = t->buckets[batch_bucket(ord[e])].load(std::memory_order_relaxed);
+            __builtin_prefetch((int *)REF_UNMARKED(w.fields.ptr));
+        }
+    }
+
+    /** Count /delta/ inserts (> 0) or removes (< 0), and resize /t/ if the load calls for it */
+    void account(hnode_t * t, int delta)
+    {
+        count.add(RP::get_tid(), delta);
+        if (delta > 0 && chash_should_grow(count.get(), t->size))
+            resize(t, true);
+        else if (delta < 0 && chash_should_shrink(count.get(), t->size))
+            resize(t, false);
+    }
+
     bool resize(hnode_t * t, bool grow)
     {
-        if ((t->size == MAX_BUCKET_NUM && grow) ||
+        if ((t->size >= chash_max_buckets() && grow) ||
             (t->size == MIN_BUCKET_NUM && !grow))
             return false;
 
@@ -382,7 +657,7 @@ class hashset_inplace_t
         if (b == NULL && s != NULL) {
             int * set;
             if (s->size * 2 == t->size) /* growing */ {
-                int * p = freezeBucket(s, i % s->size);
+                int * p = freezeBucket(s, i & (s->size - 1));
                 set = split(p, t->size, i);
             }
             else /* shrinking */ {
@@ -405,31 +680,19 @@ class hashset_inplace_t
         return ss.str();
     }
 
+    /** Keep the keys of /o/ that land in bucket /remainder/ of /size/ */
     int * split(int * o, int size, int remainder)
     {
-        int count = 0;
-        for (int i = 1; i <= o[0]; i++)
-            if (o[i] % size == remainder)
-                count++;
+        int count = fset_filter_hashed<HP>(o, NULL, size - 1, remainder);
         int * n = alloc_fset(count);
-        n[0] = count;
-        int j = 1;
-        for (int i = 1; i <= o[0]; i++) {
-            if (o[i] % size == remainder)
-                n[j++] = o[i];
-        }
+        fset_filter_hashed<HP>(o, n, size - 1, remainder);
         return n;
     }
 
     int * merge(int * p, int * q)
     {
         int * n = alloc_fset(p[0] + q[0]);
-        n[0] = p[0] + q[0];
-        int j = 1;
-        for (int i = 1; i <= p[0]; i++)
-            n[j++] = p[i];
-        for (int i = 1; i <= q[0]; i++)
-            n[j++] = q[i];
+        fset_concat(p, q, n);
         return n;
     }
 
@@ -454,11 +717,7 @@ class hashset_inplace_t
 
     bool arrayContains(int * o, int key)
     {
-        for (int i = 1; i <= o[0]; i++) {
-            if (o[i] == key)
-                return true;
-        }
-        return false;
+        return fset_find(o, key) != 0;
     }
 
     int * arrayInsert(int * o, int key)
@@ -474,13 +733,65 @@ class hashset_inplace_t
 
     int * arrayRemove(int * o, int key)
     {
-        if (!arrayContains(o, key))
+        int k = fset_find(o, key);
+        if (k == 0)
             return o;
         int * n = alloc_fset(o[0] - 1);
-        int j = 1;
-        for (int i = 1; i <= o[0]; i++) {
-            if (o[i] != key)
-                n[j++] = o[i];
+        fset_erase(o, o[0], k, n);
+        return n;
+    }
+
+    /** Copy /o/ plus whichever keys of the group it lacks, or return /o/ if it has them all */
+    int * arrayInsertMany(int * o, const int * keys, const uint64_t * ord, int m, bool * done)
+    {
+        int add = 0;
+        for (int j = 0; j < m; j++)
+            add += !arrayContains(o, keys[batch_pos(ord[j])]);
+        if (add == 0) {
+            if (done)
+                for (int j = 0; j < m; j++)
+                    done[batch_pos(ord[j])] = false;
+            return o;
+        }
+        // the group may repeat a key, so the length is set as keys go in
+        int * n = alloc_fset(o[0] + add);
+        n[0] = o[0];
+        for (int i = 1; i <= o[0]; i++)
+            n[i] = o[i];
+        for (int j = 0; j < m; j++) {
+            int p = batch_pos(ord[j]);
+            bool r = !arrayContains(n, keys[p]);
+            if (r)
+                n[++n[0]] = keys[p];
+            if (done)
+                done[p] = r;
+        }
+        return n;
+    }
+
+    /** Copy /o/ less the keys of the group, or return /o/ if it has none of them */
+    int * arrayRemoveMany(int * o, const int * keys, const uint64_t * ord, int m, bool * done)
+    {
+        int hit = 0;
+        for (int j = 0; j < m; j++)
+            hit += arrayContains(o, keys[batch_pos(ord[j])]);
+        if (hit == 0) {
+            if (done)
+                for (int j = 0; j < m; j++)
+                    done[batch_pos(ord[j])] = false;
+            return o;
+        }
+        int * n = alloc_fset(o[0]);
+        for (int i = 1; i <= o[0]; i++)
+            n[i] = o[i];
+        for (int j = 0; j < m; j++) {
+            int p = batch_pos(ord[j]);
+            int k = fset_find(n, keys[p]);
+            // keys are in no particular order, so the last one fills the hole
+            if (k != 0)
+                n[k] = n[n[0]--];
+            if (done)
+                done[p] = (k != 0);
         }
         return n;
     }
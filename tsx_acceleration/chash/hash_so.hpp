@@ -0,0 +1,392 @@
+#pragma once
+
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <x86intrin.h>
+
+#include "common.hpp"
+#include "counter.hpp"
+#include "hashfn.hpp"
+#include "reclaim.hpp"
+
+using std::atomic;
+using std::stringstream;
+using std::string;
+using std::endl;
+
+/**
+ *  The split-ordered list hash set of Shalev and Shavit (hash/SOHashSet.java).
+ *  Every key lives in one sorted lock-free list, ordered by its hash with the
+ *  bits reversed.  A bucket is a pointer to a dummy node in that list, which
+ *  starts the run of keys whose hash ends in the bucket's bits.  So resizing
+ *  only changes how many low bits of the hash we use: no key ever moves, and
+ *  a new bucket is made, on first use, by inserting one dummy node after its
+ *  parent's.
+ *
+ *  Removal marks the low bit of the victim's next pointer and then unlinks
+ *  it, as in skip.hpp; the Java code allocates a Marker node instead, since
+ *  it cannot mark a reference.  Whoever unlinks a node retires it.  Dummy
+ *  nodes are never removed, so shrinking just uses fewer bits.
+ *
+ *  Split-order keys must be unique, which holds because every hash policy
+ *  in hashfn.hpp is a bijection on 32-bit values.
+ *
+ *  With FAST, a remove marks and unlinks in one transaction, and a new
+ *  bucket's dummy node is linked into the list and published in the bucket
+ *  array in one transaction, in the style of skip_htm.hpp.
+ */
+template<class RP = wbmm_policy_t, class HP = identity_hash_t, bool FAST = false>
+class hashset_so_t
+{
+  private:
+
+    struct node_t
+    {
+        uint64_t          so;
+        int               key;
+        atomic<node_t *>  next;
+    };
+
+    /*** Buckets are allocated a segment at a time */
+    static const int SO_SEG_BITS = 12;
+    static const int SO_SEG_SIZE = 1 << SO_SEG_BITS;
+
+    static node_t * alloc_node(uint64_t so, int key, node_t * next)
+    {
+        node_t * n = (node_t *)RP::alloc(sizeof(node_t));
+        n->so = so;
+        n->key = key;
+        n->next = next;
+        return n;
+    }
+
+    static void free_node_safe(node_t * n)
+    {
+        RP::free_safe(n);
+    }
+
+    static void free_node_unsafe(node_t * n)
+    {
+        RP::free_unsafe(n);
+    }
+
+    static uint32_t reverse(uint32_t x)
+    {
+        x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+        x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+        x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+        return __builtin_bswap32(x);
+    }
+
+    /** Regular keys sort after the dummy of their bucket, since their low bit is 1 */
+    static uint64_t regularKey(int key)
+    {
+        return ((uint64_t)reverse(HP::hash(key)) << 1) | 1;
+    }
+
+    static uint64_t dummyKey(int bucket)
+    {
+        return (uint64_t)reverse((uint32_t)bucket) << 1;
+    }
+
+    /** A bucket's parent is the bucket with its highest set bit cleared */
+    static int parentOf(int bucket)
+    {
+        return bucket & ~(1 << (31 - __builtin_clz(bucket)));
+    }
+
+  private:
+
+    /*** The first dummy node (bucket 0), and the tail sentinel */
+    node_t * head;
+    node_t * tail;
+
+    /*** # buckets in use; a power of two */
+    atomic<int> size;
+
+    /*** Approximate number of keys, which drives resizing */
+    approx_counter_t count;
+
+    /**
+     *  Segment directory, big enough for the largest table.  It comes from
+     *  calloc, so the pages of segments that are never used are never
+     *  touched.
+     */
+    atomic<atomic<node_t *> *> * dir;
+
+    atomic<node_t *> * segment(int bucket)
+    {
+        atomic<atomic<node_t *> *> & d = dir[bucket >> SO_SEG_BITS];
+        atomic<node_t *> * s = d.load(std::memory_order_acquire);
+        if (s == NULL) {
+            atomic<node_t *> * n =
+                (atomic<node_t *> *)RP::alloc(sizeof(atomic<node_t *>) * SO_SEG_SIZE);
+            memset((void *)n, 0, sizeof(atomic<node_t *>) * SO_SEG_SIZE);
+            if (bcas(&d, &s, n))
+                s = n;
+            else
+                RP::free_unsafe(n);
+        }
+        return s;
+    }
+
+    atomic<node_t *> & bucketRef(int bucket)
+    {
+        return segment(bucket)[bucket & (SO_SEG_SIZE - 1)];
+    }
+
+    /** The dummy node of the bucket of /key/, made now if it is new */
+    node_t * bucketOf(int key)
+    {
+        int b = HP::hash(key) & (size.load() - 1);
+        node_t * h = bucketRef(b);
+        return (h == NULL) ? initBucket(b) : h;
+    }
+
+  public:
+
+    hashset_so_t() : size(1)
+    {
+        size_t n = ((size_t)1 << chash_max_bucket_bits) / SO_SEG_SIZE + 1;
+        dir = (atomic<atomic<node_t *> *> *)calloc(n, sizeof(atomic<node_t *> *));
+        tail = alloc_node(UINT64_MAX, 0, NULL);
+        head = alloc_node(0, 0, tail);
+        bucketRef(0) = head;
+    }
+
+    bool insert(int key)
+    {
+        RP::begin();
+        uint64_t so = regularKey(key);
+        node_t * h = bucketOf(key);
+        node_t * n = NULL;
+        bool result;
+        while (true) {
+            node_t * pred;
+            node_t * curr = find(h, so, &pred);
+            if (curr->so == so) {
+                result = false;
+                break;
+            }
+            if (n == NULL)
+                n = alloc_node(so, key, curr);
+            else
+                n->next = curr;
+            if (bcas(&pred->next, &curr, n)) {
+                n = NULL;
+                result = true;
+                break;
+            }
+        }
+        if (n != NULL)
+            free_node_unsafe(n);
+        if (result)
+            account(1);
+        RP::end();
+        return result;
+    }
+
+    bool remove(int key)
+    {
+        RP::begin();
+        uint64_t so = regularKey(key);
+        node_t * h = bucketOf(key);
+        bool result = listRemove(h, so);
+        if (result)
+            account(-1);
+        RP::end();
+        return result;
+    }
+
+    bool contains(int key)
+    {
+        RP::begin();
+        uint64_t so = regularKey(key);
+        node_t * curr = bucketOf(key);
+        while (curr->so < so)
+            curr = (node_t *)REF_UNMARKED(curr->next.load());
+        bool result = curr->so == so && !IS_MARKED(curr->next.load());
+        RP::end();
+        return result;
+    }
+
+    bool grow()
+    {
+        int s = size;
+        return s < chash_max_buckets() && bcas(&size, &s, s * 2);
+    }
+
+    bool shrink()
+    {
+        int s = size;
+        return s > 1 && bcas(&size, &s, s / 2);
+    }
+
+    string toString()
+    {
+        stringstream ss;
+        ss << "Buckets: " << size << endl;
+        for (node_t * curr = head; curr != tail;
+             curr = (node_t *)REF_UNMARKED(curr->next.load())) {
+            if (curr->so & 1)
+                ss << curr->key << (IS_MARKED(curr->next.load()) ? "* " : " ");
+            else
+                ss << "| ";
+        }
+        ss << endl;
+        return ss.str();
+    }
+
+  private:
+
+    /** Count an insert (+1) or remove (-1), and resize if the load calls for it */
+    void account(int delta)
+    {
+        count.add(RP::get_tid(), delta);
+        int s = size;
+        if (delta > 0 && chash_should_grow(count.get(), s))
+            grow();
+        else if (delta < 0 && chash_should_shrink(count.get(), s))
+            shrink();
+    }
+
+    /**
+     *  Find the first node at or after /so/ in the list from /h/, and its
+     *  predecessor, unlinking (and retiring) the marked nodes on the way.
+     */
+    node_t * find(node_t * h, uint64_t so, node_t ** predp)
+    {
+      retry:
+        node_t * pred = h;
+        node_t * curr = pred->next;
+        while (true) {
+            node_t * succ = curr->next;
+            while (IS_MARKED(succ)) {
+                succ = (node_t *)REF_UNMARKED(succ);
+                if (!bcas(&pred->next, &curr, succ))
+                    goto retry;
+                free_node_safe(curr);
+                curr = succ;
+                succ = curr->next;
+            }
+            if (curr->so >= so) {
+                *predp = pred;
+                return curr;
+            }
+            pred = curr;
+            curr = succ;
+        }
+    }
+
+    bool listRemove(node_t * h, uint64_t so)
+    {
+        HTM_SITE(site, "hashset_so_t::listRemove");
+        while (true) {
+            node_t * pred;
+            node_t * curr = find(h, so, &pred);
+            if (curr->so != so)
+                return false;
+            node_t * succ = curr->next;
+            if (IS_MARKED(succ))
+                continue;
+
+            if (FAST) {
+                uint32_t status;
+              retry_htm:
+                status = htm_begin(site, 42);
+                if (status == HTM_STARTED) {
+                    // mark and unlink at once, so nobody sees curr half-removed
+                    if (pred->next.load(std::memory_order_relaxed) != curr ||
+                        curr->next.load(std::memory_order_relaxed) != succ)
+                        htm_abort(42);
+                    curr->next = (node_t *)REF_MARKED(succ);
+                    pred->next = succ;
+                    htm_end(site);
+                    free_node_safe(curr);
+                    return true;
+                }
+                else {
+                    if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
+                        // try slow path
+                    }
+                    else if (htm_retry(site, status)) {
+                        goto retry_htm;
+                    }
+                    htm_fallback(site);
+                }
+            }
+
+            // the mark is the linearization point; the unlink is cleanup
+            if (!bcas(&curr->next, &succ, (node_t *)REF_MARKED(succ)))
+                continue;
+            if (bcas(&pred->next, &curr, succ))
+                free_node_safe(curr);
+            else
+                find(h, so, &pred);
+            return true;
+        }
+    }
+
+    /** Make the dummy node of /bucket/, and those of its missing ancestors */
+    node_t * initBucket(int bucket)
+    {
+        HTM_SITE(site, "hashset_so_t::initBucket");
+        int p = parentOf(bucket);
+        node_t * ph = bucketRef(p);
+        if (ph == NULL)
+            ph = initBucket(p);
+
+        uint64_t so = dummyKey(bucket);
+        atomic<node_t *> & slot = bucketRef(bucket);
+        node_t * d = NULL;
+        while (true) {
+            node_t * pred;
+            node_t * curr = find(ph, so, &pred);
+            if (curr->so == so) {
+                // somebody else linked it in first
+                if (d != NULL)
+                    free_node_unsafe(d);
+                slot = curr;
+                return curr;
+            }
+            if (d == NULL)
+                d = alloc_node(so, 0, curr);
+            else
+                d->next = curr;
+
+            if (FAST) {
+                uint32_t status;
+              retry_htm:
+                status = htm_begin(site, 42);
+                if (status == HTM_STARTED) {
+                    // link the dummy and publish the bucket at once
+                    if (slot.load(std::memory_order_relaxed) != NULL ||
+                        pred->next.load(std::memory_order_relaxed) != curr)
+                        htm_abort(42);
+                    pred->next = d;
+                    slot = d;
+                    htm_end(site);
+                    return d;
+                }
+                else {
+                    if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
+                        // try slow path
+                    }
+                    else if (htm_retry(site, status)) {
+                        goto retry_htm;
+                    }
+                    htm_fallback(site);
+                }
+            }
+
+            if (bcas(&pred->next, &curr, d)) {
+                slot = d;
+                return d;
+            }
+        }
+    }
+};
@@ -0,0 +1,609 @@
+#pragma once
+
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <cstdint>
+#include <atomic>
+#include <x86intrin.h>
+
+#include "common.hpp"
+#include "counter.hpp"
+#include "fset.hpp"
+#include "hashfn.hpp"
+#include "reclaim.hpp"
+
+using std::atomic;
+using std::stringstream;
+using std::string;
+using std::endl;
+
+/**
+ *  The wait-free freezable-array hash set (hash/WFArrayHashSet.java, with
+ *  WFArrayFSet and WFArrayOp).  Every update takes a priority from a shared
+ *  counter and announces itself in a per-thread slot, then helps every
+ *  announced update of equal or higher priority (lower number) to finish
+ *  before returning.  So an update takes a bounded number of steps whatever
+ *  the other threads do.
+ *
+ *  A bucket is a chain of versions.  Each version holds its keys and at most
+ *  one operation, which is installed by CAS and which says how to build the
+ *  next version; a FREEZE operation makes the version final, for resizing.
+ *
+ *  An operation descriptor is reachable from its owner's announcement slot
+ *  and from the one version it gets installed on, so it carries a count of
+ *  two references, and goes to free_safe when both are gone.
+ *
+ *  With FAST, updates first try to replace the head version in one
+ *  transaction, as in hash_htm.hpp.  A transaction aborts if any thread is
+ *  on the announced (slow) path, so while one is, every update takes the
+ *  slow path and the step bound still holds.
+ */
+template<class RP = wbmm_policy_t, class HP = identity_hash_t, bool FAST = false>
+class hashset_wf_t
+{
+  private:
+
+    /*** Operation types (WFArrayOp) */
+    static const int WF_INSERT = 2;
+    static const int WF_REMOVE = 3;
+    static const int WF_FREEZE = 4;
+    /*** Type of the marker left on a version that the fast path replaced */
+    static const int WF_REPLACED = 5;
+
+    /*** Priority of an operation that has taken effect */
+    static const uint64_t WF_DONE = UINT64_MAX;
+
+    struct wfop_t
+    {
+        int              key;
+        int              type;
+        atomic<int>      resp;
+        atomic<uint64_t> priority;
+        atomic<int>      refs;
+    };
+
+    /*** One version of a bucket; keys[] is an fset (keys[0] is the length) */
+    struct fnode_t
+    {
+        atomic<wfop_t *> op;
+        int              keys[1];
+    };
+
+    struct wfset_t
+    {
+        atomic<fnode_t *> head;
+        atomic<bool>      fflag;
+    };
+
+    struct hnode_t
+    {
+        atomic<hnode_t *>   old;
+        atomic<wfset_t *> * buckets;
+        int                 size;
+    };
+
+    static hnode_t * alloc_hnode(hnode_t * o, int s)
+    {
+        // allocate the bucket array first: interval-based reclamation relies
+        // on an object never pointing to anything younger than itself
+        atomic<wfset_t *> * buckets =
+            (atomic<wfset_t *> *)RP::alloc(sizeof(atomic<wfset_t *>) * s);
+        hnode_t * t = (hnode_t *)RP::alloc(sizeof(hnode_t));
+        t->old = o;
+        t->size = s;
+        t->buckets = buckets;
+        for (int i = 0; i < s; i++) t->buckets[i] = NULL;
+        return t;
+    }
+
+    /** Reclaim an old table, whose buckets are all frozen */
+    static void free_hnode_safe(hnode_t * t)
+    {
+        for (int i = 0; i < t->size; i++) {
+            wfset_t * b = t->buckets[i];
+            fnode_t * n = b->head;
+            RP::free_safe(n->op.load());
+            RP::free_safe(n);
+            RP::free_safe(b);
+        }
+        RP::free_safe(t->buckets);
+        RP::free_safe(t);
+    }
+
+    static void free_hnode_unsafe(hnode_t * t)
+    {
+        RP::free_unsafe(t->buckets);
+        RP::free_unsafe(t);
+    }
+
+    static fnode_t * alloc_fnode(int len)
+    {
+        fnode_t * n = (fnode_t *)RP::alloc(sizeof(fnode_t) + sizeof(int) * len);
+        n->op = NULL;
+        n->keys[0] = len;
+        return n;
+    }
+
+    static wfset_t * alloc_wfset(fnode_t * n)
+    {
+        wfset_t * b = (wfset_t *)RP::alloc(sizeof(wfset_t));
+        b->head = n;
+        b->fflag = false;
+        return b;
+    }
+
+    static wfop_t * alloc_op(int key, int type, uint64_t prio)
+    {
+        wfop_t * op = (wfop_t *)RP::alloc(sizeof(wfop_t));
+        op->key = key;
+        op->type = type;
+        op->resp = 0;
+        op->priority = prio;
+        op->refs = 2;
+        return op;
+    }
+
+    /** Drop one of the two references to an update descriptor */
+    static void release_op(wfop_t * op)
+    {
+        if (op->refs.fetch_sub(1) == 1)
+            RP::free_safe(op);
+    }
+
+    /** The marker the fast path leaves on the version it replaces */
+    static wfop_t * replaced()
+    {
+        static wfop_t marker = { -1, WF_REPLACED, {0}, {WF_DONE}, {0} };
+        return &marker;
+    }
+
+    static bool immutable(fnode_t * n)
+    {
+        wfop_t * op = n->op;
+        return op != NULL && op->type == WF_FREEZE;
+    }
+
+    /** Sizes are powers of two, so the mask keeps the low bits of the hash */
+    static int bucketOf(int key, int size)
+    {
+        return HP::hash(key) & (size - 1);
+    }
+
+  private:
+
+    static const int MIN_BUCKET_NUM = 1;
+
+    atomic<hnode_t *> head;
+
+    /*** Approximate number of keys, which drives resizing */
+    approx_counter_t  count;
+
+    /*** Source of operation priorities */
+    atomic<uint64_t>  counter;
+    char pad1[CACHELINE_BYTES - sizeof(atomic<uint64_t>)];
+
+    /*** # threads on the announced path; the fast path waits for zero */
+    atomic<intptr_t>  slow;
+    char pad2[CACHELINE_BYTES - sizeof(atomic<intptr_t>)];
+
+    /*** One more than the highest slot that has announced anything */
+    atomic<uintptr_t> nslots;
+
+    /*** Announcement slots (the Java A[]), added a chunk at a time */
+    atomic<pad_word_t *> chunks[WBMM_MAX_CHUNKS];
+
+    pad_word_t * announce(uintptr_t tid)
+    {
+        pad_word_t * c = chunks[tid / WBMM_SLOT_CHUNK].load(std::memory_order_acquire);
+        return (c == NULL) ? NULL : &c[tid % WBMM_SLOT_CHUNK];
+    }
+
+    /** Make the caller's announcement slot exist, and be covered by scans */
+    pad_word_t * myAnnounce(uintptr_t tid)
+    {
+        atomic<pad_word_t *> & c = chunks[tid / WBMM_SLOT_CHUNK];
+        pad_word_t * p = c.load(std::memory_order_acquire);
+        if (p == NULL) {
+            pad_word_t * n = new pad_word_t[WBMM_SLOT_CHUNK]();
+            if (bcas(&c, &p, n))
+                p = n;
+            else
+                delete [] n;
+        }
+        uintptr_t s = nslots;
+        while (s <= tid && !bcas(&nslots, &s, tid + 1));
+        return &p[tid % WBMM_SLOT_CHUNK];
+    }
+
+  public:
+
+    hashset_wf_t() : counter(0), slow(0), nslots(0)
+    {
+        for (uintptr_t i = 0; i < WBMM_MAX_CHUNKS; i++)
+            chunks[i] = NULL;
+        hnode_t * t = alloc_hnode(NULL, MIN_BUCKET_NUM);
+        t->buckets[0] = alloc_wfset(alloc_fnode(0));
+        head = t;
+    }
+
+    bool insert(int key)
+    {
+        int result;
+        if (FAST && fastApply(WF_INSERT, key, result))
+            return result > 0;
+
+        RP::begin();
+        hnode_t * h = head;
+        result = apply(WF_INSERT, key);
+        if (result > 0)
+            account(h, 1);
+        RP::end();
+        return result > 0;
+    }
+
+    bool remove(int key)
+    {
+        int result;
+        if (FAST && fastApply(WF_REMOVE, key, result))
+            return result > 0;
+
+        RP::begin();
+        hnode_t * h = head;
+        result = apply(WF_REMOVE, key);
+        if (result > 0)
+            account(h, -1);
+        RP::end();
+        return result > 0;
+    }
+
+    bool contains(int key)
+    {
+        RP::begin();
+        hnode_t * t = head;
+        wfset_t * b = t->buckets[bucketOf(key, t->size)];
+        // if the b is empty, use old table
+        if (b == NULL) {
+            hnode_t * s = t->old;
+            b = (s == NULL)
+                ? t->buckets[bucketOf(key, t->size)]
+                : s->buckets[bucketOf(key, s->size)];
+        }
+        bool r = hasMember(b, key);
+        RP::end();
+        return r;
+    }
+
+    bool grow()
+    {
+        RP::begin();
+        hnode_t * h = head;
+        bool r = resize(h, true);
+        RP::end();
+        return r;
+    }
+
+    bool shrink()
+    {
+        RP::begin();
+        hnode_t * h = head;
+        bool r = resize(h, false);
+        RP::end();
+        return r;
+    }
+
+    string toString()
+    {
+        stringstream ss;
+        hnode_t * curr = head;
+        int age = 0;
+        while (curr != NULL) {
+            ss << "HashTableNode #" << age++ << endl;
+            for (int i = 0; i < curr->size; i++) {
+                ss << "  Bucket " << i << ": ";
+                wfset_t * b = curr->buckets[i];
+                if (b != NULL) {
+                    fnode_t * n = b->head;
+                    if (immutable(n))
+                        ss << "(F) ";
+                    ss << bucketToString(n->keys);
+                }
+                ss << endl;
+            }
+            curr = curr->old;
+        }
+        return ss.str();
+    }
+
+
+  private:
+
+    /**
+     *  Try the update in one transaction.  Returns false if it must take the
+     *  announced path; otherwise sets /result/ as apply() would.
+     */
+    bool fastApply(int type, int key, int & result)
+    {
+        HTM_SITE(site, "hashset_wf_t::fastApply");
+        hnode_t * t;
+
+        uint32_t status;
+      retry:
+        status = htm_begin(site, 42);
+        if (status == HTM_STARTED) {
+            // subscribe to the slow-path count: an announced update aborts us
+            if (slow.load(std::memory_order_relaxed) != 0)
+                htm_abort(42);
+            t = head;
+            wfset_t * b = t->buckets[bucketOf(key, t->size)];
+            if (b == NULL)
+                htm_abort(42);
+            fnode_t * o = b->head;
+            // a pending operation or a freeze goes through the slow path
+            if (o->op.load(std::memory_order_relaxed) != NULL || b->fflag)
+                htm_abort(42);
+            fnode_t * n = (type == WF_INSERT) ? arrayInsert(o->keys, key)
+                                              : arrayRemove(o->keys, key);
+            if (n == NULL)
+                result = -(o->keys[0] + 1);
+            else {
+                o->op = replaced();
+                b->head = n;
+                RP::free_safe(o);
+                result = n->keys[0] + 1;
+            }
+            htm_end(site); // commit fast path
+            if (result > 0) {
+                RP::begin();
+                account(t, (type == WF_INSERT) ? 1 : -1);
+                RP::end();
+            }
+            return true;
+        }
+        else {
+            if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
+                // try slow path
+            }
+            else if (htm_retry(site, status)) {
+                goto retry;
+            }
+            htm_fallback(site);
+        }
+        return false;
+    }
+
+    int apply(int type, int key)
+    {
+        if (FAST)
+            slow.fetch_add(1);
+
+        uintptr_t    me = RP::get_tid();
+        pad_word_t * my = myAnnounce(me);
+        uint64_t   prio = counter.fetch_add(1);
+        wfop_t   * myop = alloc_op(key, type, prio);
+        wfop_t   * prev = (wfop_t *)my->val.exchange((uintptr_t)myop);
+        if (prev != NULL)
+            release_op(prev);
+
+        // help every announced update that is older than ours, then ours
+        uintptr_t n = nslots;
+        for (uintptr_t tid = 0; tid < n; tid++) {
+            pad_word_t * a = announce(tid);
+            if (a == NULL)
+                continue;
+            wfop_t * op = (wfop_t *)a->val.load();
+            while (op != NULL && op->priority <= prio) {
+                hnode_t * t = head;
+                int       i = bucketOf(op->key, t->size);
+                wfset_t * b = t->buckets[i];
+                if (b == NULL)
+                    helpResize(t, i);
+                else if (invoke(b, op))
+                    break;
+            }
+        }
+        int r = myop->resp;
+
+        if (FAST)
+            slow.fetch_sub(1);
+        return r;
+    }
+
+    /** Install /op/ on the head version of /set/ and finish it; WFArrayFSet.invoke */
+    bool invoke(wfset_t * set, wfop_t * op)
+    {
+        fnode_t * node = set->head;
+        while (!immutable(node) && op->priority != WF_DONE) {
+            if (set->fflag) {
+                doFreeze(set);
+                return op->priority == WF_DONE;
+            }
+            wfop_t * pred = node->op;
+            if (pred == NULL) {
+                if (op->priority != WF_DONE) {
+                    if (bcas(&node->op, &pred, op)) {
+                        helpFinish(set, node);
+                        return true;
+                    }
+                }
+            }
+            else {
+                helpFinish(set, node);
+            }
+            node = set->head;
+        }
+        return op->priority == WF_DONE;
+    }
+
+    void freeze(wfset_t * set)
+    {
+        set->fflag = true;
+        doFreeze(set);
+    }
+
+    void doFreeze(wfset_t * set)
+    {
+        wfop_t * h = alloc_op(-1, WF_FREEZE, WF_DONE);
+        fnode_t * node = set->head;
+        while (!immutable(node)) {
+            wfop_t * pred = node->op;
+            if (pred == NULL) {
+                if (bcas(&node->op, &pred, h))
+                    return;
+            }
+            else {
+                helpFinish(set, node);
+            }
+            node = set->head;
+        }
+        RP::free_unsafe(h);
+    }
+
+    /** Build the version after /node/ from its operation, and swing the head to it */
+    void helpFinish(wfset_t * set, fnode_t * node)
+    {
+        wfop_t * op = node->op;
+        if (op != NULL && (op->type == WF_INSERT || op->type == WF_REMOVE)) {
+            fnode_t * n = (op->type == WF_INSERT) ? arrayInsert(node->keys, op->key)
+                                                  : arrayRemove(node->keys, op->key);
+            if (n == NULL) {
+                op->resp = -(node->keys[0] + 1);
+                n = alloc_fnode(node->keys[0]);
+                for (int i = 1; i <= node->keys[0]; i++)
+                    n->keys[i] = node->keys[i];
+            }
+            else
+                op->resp = n->keys[0] + 1;
+            op->priority = WF_DONE;
+            if (bcas(&set->head, &node, n)) {
+                RP::free_safe(node);
+                release_op(op);
+            }
+            else
+                RP::free_unsafe(n);
+        }
+    }
+
+    bool hasMember(wfset_t * set, int key)
+    {
+        fnode_t * node = set->head;
+        // must be aware of the linearized operation if exists
+        wfop_t * op = node->op;
+        if (op != NULL && op->key == key &&
+            (op->type == WF_INSERT || op->type == WF_REMOVE))
+            return op->type == WF_INSERT;
+        return fset_find(node->keys, key) != 0;
+    }
+
+    /** Count an insert (+1) or remove (-1), and resize /t/ if the load calls for it */
+    void account(hnode_t * t, int delta)
+    {
+        count.add(RP::get_tid(), delta);
+        if (delta > 0 && chash_should_grow(count.get(), t->size))
+            resize(t, true);
+        else if (delta < 0 && chash_should_shrink(count.get(), t->size))
+            resize(t, false);
+    }
+
+    bool resize(hnode_t * t, bool grow)
+    {
+        if ((t->size >= chash_max_buckets() && grow) ||
+            (t->size == MIN_BUCKET_NUM && !grow))
+            return false;
+
+        if (t == head) {
+            // make sure we can deprecate t's predecessor
+            for (int i = 0; i < t->size; i++) {
+                if (t->buckets[i] == NULL)
+                    helpResize(t, i);
+            }
+            // deprecate t's predecessor
+            hnode_t * o = t->old;
+            if (o && bcas(&(t->old), &o, (hnode_t *)NULL))
+                free_hnode_safe(o);
+
+            // switch to fresh bucket array
+            if (t == head) {
+                hnode_t * n = alloc_hnode(t, grow ? t->size * 2 : t->size / 2);
+                if (!bcas(&head, &t, n)) {
+                    free_hnode_unsafe(n); // free n
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void helpResize(hnode_t * t, int i)
+    {
+        wfset_t * b = t->buckets[i];
+        hnode_t * s = t->old;
+        if (b == NULL && s != NULL) {
+            fnode_t * set;
+            if (s->size * 2 == t->size) /* growing */ {
+                wfset_t * p = s->buckets[i & (s->size - 1)];
+                freeze(p);
+                set = split(p->head.load()->keys, t->size, i);
+            }
+            else /* shrinking */ {
+                wfset_t * p = s->buckets[i];
+                wfset_t * q = s->buckets[i + t->size];
+                freeze(p);
+                freeze(q);
+                set = merge(p->head.load()->keys, q->head.load()->keys);
+            }
+            wfset_t * n = alloc_wfset(set);
+            if (!bcas(&t->buckets[i], &b, n)) {
+                RP::free_unsafe(set);
+                RP::free_unsafe(n);
+            }
+        }
+    }
+
+    string bucketToString(int * b)
+    {
+        stringstream ss;
+        for (int i = 1; i <= b[0]; i++)
+            ss << b[i] << " ";
+        return ss.str();
+    }
+
+    /** Keep the keys of /o/ that land in bucket /remainder/ of /size/ */
+    fnode_t * split(int * o, int size, int remainder)
+    {
+        int count = fset_filter_hashed<HP>(o, NULL, size - 1, remainder);
+        fnode_t * n = alloc_fnode(count);
+        fset_filter_hashed<HP>(o, n->keys, size - 1, remainder);
+        return n;
+    }
+
+    fnode_t * merge(int * p, int * q)
+    {
+        fnode_t * n = alloc_fnode(p[0] + q[0]);
+        fset_concat(p, q, n->keys);
+        return n;
+    }
+
+    /** A new version of /o/ with /key/ added, or NULL if /o/ has it */
+    fnode_t * arrayInsert(int * o, int key)
+    {
+        if (fset_find(o, key) != 0)
+            return NULL;
+        fnode_t * n = alloc_fnode(o[0] + 1);
+        for (int i = 1; i <= o[0]; i++)
+            n->keys[i] = o[i];
+        n->keys[n->keys[0]] = key;
+        return n;
+    }
+
+    /** A new version of /o/ with /key/ removed, or NULL if /o/ lacks it */
+    fnode_t * arrayRemove(int * o, int key)
+    {
+        int k = fset_find(o, key);
+        if (k == 0)
+            return NULL;
+        fnode_t * n = alloc_fnode(o[0] - 1);
+        fset_erase(o, o[0], k, n->keys);
+        return n;
+    }
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ *  Hash policies for the chash hash sets.  Every hash set is a template
+ *  over one of these, and finds a key's bucket as hash(key) & (size - 1).
+ *  Table sizes are always powers of two, and a table that doubles splits
+ *  bucket i into buckets i and i + size.  So a policy must put its
+ *  well-mixed bits at the bottom of the word, not the top.
+ *
+ *  /identity/ tells the bucket kernels that the key is its own hash, so
+ *  they may filter keys without hashing them.  hash64() is the same
+ *  function for the 64-bit keys of the hash map.
+ */
+
+/**
+ *  The key is its own hash.  This matches the behavior of the original
+ *  code, and is the fastest choice when keys are spread uniformly.
+ */
+struct identity_hash_t
+{
+    static const bool identity = true;
+
+    static uint32_t hash(int key) { return (uint32_t)key; }
+
+    static uint32_t hash64(uint64_t key) { return (uint32_t)key; }
+};
+
+/**
+ *  Fibonacci (multiplicative) hashing.  The product's well-mixed bits are
+ *  the high ones, so we fold them into the low half, which is what the
+ *  bucket mask keeps.  The fold is invertible, so distinct keys keep
+ *  distinct hashes.
+ */
+struct fib_hash_t
+{
+    static const bool identity = false;
+
+    static uint32_t hash(int key)
+    {
+        uint32_t h = (uint32_t)key * 2654435769u;
+        return h ^ (h >> 16);
+    }
+
+    static uint32_t hash64(uint64_t key)
+    {
+        uint64_t h = key * 11400714819323198485ull;
+        return (uint32_t)(h ^ (h >> 32));
+    }
+};
+
+/**
+ *  The finalizers (fmix32 and fmix64) from MurmurHash3.  Every input bit
+ *  affects every output bit, so this is the safe choice for keys with
+ *  structure, at a cost of two multiplies per lookup.
+ */
+struct murmur_hash_t
+{
+    static const bool identity = false;
+
+    static uint32_t hash(int key)
+    {
+        uint32_t h = (uint32_t)key;
+        h ^= h >> 16;
+        h *= 0x85ebca6bu;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35u;
+        h ^= h >> 16;
+        return h;
+    }
+
+    static uint32_t hash64(uint64_t key)
+    {
+        uint64_t h = key;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+        return (uint32_t)h;
+    }
+};
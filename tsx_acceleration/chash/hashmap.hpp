@@ -0,0 +1,633 @@
+#pragma once
+
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+#include <atomic>
+
+#include "common.hpp"
+#include "counter.hpp"
+#include "fset.hpp"
+#include "hashfn.hpp"
+#include "reclaim.hpp"
+
+using std::atomic;
+using std::stringstream;
+using std::string;
+using std::endl;
+
+/**
+ *  A concurrent hash map from K to V.  It is hashset_inplace_t with a value
+ *  next to every key: the same counted bucket pointers, the same lock-free
+ *  resize (freezeBucket/helpResize), and the same HTM fast path, which
+ *  updates a bucket in place when it has room.
+ *
+ *  A bucket keeps its keys and its values in two separate arrays, so a
+ *  lookup scans only the keys, and 64-bit keys use the fset_find64 kernels.
+ *  K must be an integer or pointer type of at most 64 bits, and V must be
+ *  trivially copyable.
+ *
+ *  compute(key, f) calls f(found, val).  On entry, /val/ holds the current
+ *  value when /found/ is true.  f may change /val/, and returns true to
+ *  store it or false to remove the key (or leave it absent).  f may run
+ *  more than once, inside a transaction, and on a bucket that another
+ *  thread is changing.  So it must not have side effects, and any result
+ *  it computes from a stale value is thrown away.
+ */
+template<class K, class V, class RP = wbmm_policy_t, class HP = identity_hash_t>
+class hashmap_t
+{
+  private:
+
+    static const int MIN_BUCKET_NUM = 1;
+
+    static const int MIN_ALLOC_LEN = 4;
+
+    /**
+     *  Bucket header.  cap keys follow it, and then cap values, starting at
+     *  the first offset that is aligned for V.
+     */
+    struct kvb_t
+    {
+        uint32_t len;
+        uint32_t cap;
+    };
+
+  private:
+
+    struct hnode_t
+    {
+        atomic<hnode_t *>  old;
+        cptr_atomic_t *    buckets;
+        int                size;
+    };
+
+    static hnode_t * alloc_hnode(hnode_t * o, int s)
+    {
+        hnode_t * t = (hnode_t *)RP::alloc(sizeof(hnode_t));
+        t->old = o;
+        t->size = s;
+        t->buckets = (cptr_atomic_t *)RP::alloc(sizeof(cptr_atomic_t) * s);
+        for (int i = 0; i < s; i++) t->buckets[i] = 0;
+        return t;
+    }
+
+    static void free_hnode_safe(hnode_t * t)
+    {
+        for (int i = 0; i < t->size; i++) {
+            cptr_t<kvb_t> p;
+            p.all = t->buckets[i];
+            RP::free_safe((void *)REF_UNMARKED(p.fields.ptr));
+        }
+        RP::free_safe(t->buckets);
+        RP::free_safe(t);
+    }
+
+    static void free_hnode_unsafe(hnode_t * t)
+    {
+        RP::free_unsafe(t->buckets);
+        RP::free_unsafe(t);
+    }
+
+    static size_t vals_offset(uint32_t cap)
+    {
+        size_t off = sizeof(kvb_t) + sizeof(K) * cap;
+        return (off + alignof(V) - 1) & ~(alignof(V) - 1);
+    }
+
+    static K * keysOf(kvb_t * b) { return (K *)(b + 1); }
+
+    static V * valsOf(kvb_t * b) { return (V *)((char *)b + vals_offset(b->cap)); }
+
+    static kvb_t * alloc_bucket(int len)
+    {
+        uint32_t cap = len > MIN_ALLOC_LEN ? len : MIN_ALLOC_LEN;
+        kvb_t * b = (kvb_t *)RP::alloc(vals_offset(cap) + sizeof(V) * cap);
+        b->len = len;
+        b->cap = cap;
+        return b;
+    }
+
+    static void free_bucket_safe(kvb_t * b)
+    {
+        RP::free_safe(b);
+    }
+
+    static void free_bucket_unsafe(kvb_t * b)
+    {
+        RP::free_unsafe(b);
+    }
+
+    /** Sizes are powers of two, so the mask keeps the low bits of the hash */
+    static int bucketOf(K key, int size)
+    {
+        return HP::hash64((uint64_t)key) & (size - 1);
+    }
+
+    /** Index of /key/ in /b/, or -1 */
+    static int findKey(kvb_t * b, K key)
+    {
+        if (sizeof(K) == sizeof(uint64_t))
+            return fset_find64((const uint64_t *)keysOf(b), b->len, (uint64_t)key);
+        K * keys = keysOf(b);
+        for (uint32_t i = 0; i < b->len; i++)
+            if (keys[i] == key)
+                return i;
+        return -1;
+    }
+
+  private:
+
+    atomic<hnode_t *> head;
+
+    /*** Approximate number of keys, which drives resizing */
+    approx_counter_t  count;
+
+  public:
+
+    hashmap_t()
+    {
+        assert(sizeof(cptr_t<kvb_t>) == sizeof(cptr_word_t));
+        hnode_t * t = alloc_hnode(NULL, MIN_BUCKET_NUM);
+        kvb_t * b = alloc_bucket(0);
+        cptr_t<kvb_t> w;
+        MAKE_CPTR(w, b, 0);
+        t->buckets[0] = w.all;
+        head = t;
+    }
+
+    /** Copy the value of /key/ into /val/, if the key is present */
+    bool get(K key, V & val)
+    {
+        HTM_SITE(site, "hashmap_t::get");
+        uint32_t status;
+      retry:
+        status = htm_begin(site, 42);
+        if (status == HTM_STARTED) {
+            hnode_t * t = head;
+            cptr_t<kvb_t> w;
+            w.all = t->buckets[bucketOf(key, t->size)];
+            kvb_t * b = w.fields.ptr;
+            if (b == NULL) {
+                hnode_t * s = t->old;
+                if (s == NULL) htm_abort(42);
+                w.all = s->buckets[bucketOf(key, s->size)];
+                b = w.fields.ptr;
+            }
+            b = (kvb_t *)REF_UNMARKED(b);
+            int idx = findKey(b, key);
+            if (idx >= 0)
+                val = valsOf(b)[idx];
+            htm_end(site);
+            return idx >= 0;
+        }
+        else {
+            if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
+                // try slow path
+            }
+            else if (htm_retry(site, status)) {
+                goto retry;
+            }
+            htm_fallback(site);
+        }
+
+        RP::begin();
+
+      retry_slow:
+        hnode_t * t = head;
+        cptr_atomic_t * ptr;
+        cptr_t<kvb_t> w, w2;
+        ptr = &t->buckets[bucketOf(key, t->size)];
+        w.all = *ptr;
+        kvb_t * b = w.fields.ptr;
+        // if the b is empty, use old table
+        if (b == NULL) {
+            hnode_t * s = t->old;
+            ptr = (s == NULL)
+                ? &t->buckets[bucketOf(key, t->size)]
+                : &s->buckets[bucketOf(key, s->size)];
+            w.all = *ptr;
+            b = w.fields.ptr;
+            if (b == NULL)
+                goto retry_slow;
+        }
+        b = (kvb_t *)REF_UNMARKED(b);
+        int idx = findKey(b, key);
+        V v;
+        if (idx >= 0)
+            v = valsOf(b)[idx];
+        // an in-place update bumps the counter, so a torn read retries
+        w2.all = *ptr;
+        if (w2.fields.ctr != w.fields.ctr)
+            goto retry_slow;
+
+        RP::end();
+        if (idx >= 0)
+            val = v;
+        return idx >= 0;
+    }
+
+    bool contains(K key)
+    {
+        V v;
+        return get(key, v);
+    }
+
+    /** Map /key/ to /val/.  Returns true if the key was not present */
+    bool put(K key, V val)
+    {
+        bool found;
+        update(key, [&](bool, V & v) { v = val; return true; }, found);
+        return !found;
+    }
+
+    /** Map /key/ to /val/ unless it is present.  Returns true if it was not */
+    bool putIfAbsent(K key, V val)
+    {
+        bool found;
+        update(key, [&](bool f, V & v) { if (!f) v = val; return true; },
+               found);
+        return !found;
+    }
+
+    /** Give /key/ the value /val/ only if it is present */
+    bool replace(K key, V val)
+    {
+        bool found;
+        update(key, [&](bool f, V & v) { v = val; return f; }, found);
+        return found;
+    }
+
+    bool remove(K key)
+    {
+        bool found;
+        update(key, [](bool, V &) { return false; }, found);
+        return found;
+    }
+
+    /** See the class comment.  Returns true if the key is present after */
+    template<class F>
+    bool compute(K key, F f)
+    {
+        bool found;
+        bool keep = false;
+        update(key, [&](bool fd, V & val) { keep = f(fd, val); return keep; },
+               found);
+        return keep;
+    }
+
+    bool grow()
+    {
+        RP::begin();
+        hnode_t * h = head;
+        bool r = resize(h, true);
+        RP::end();
+        return r;
+    }
+
+    bool shrink()
+    {
+        RP::begin();
+        hnode_t * h = head;
+        bool r = resize(h, false);
+        RP::end();
+        return r;
+    }
+
+    string toString()
+    {
+        stringstream ss;
+        hnode_t * curr = head;
+        int age = 0;
+        while (curr != NULL) {
+            ss << "HashTableNode #" << age++ << endl;
+            for (int i = 0; i < curr->size; i++) {
+                ss << "  Bucket " << i << ": ";
+
+                cptr_t<kvb_t> w;
+                w.all = curr->buckets[i];
+                kvb_t * b = w.fields.ptr;
+
+                if (IS_MARKED(b))
+                    ss << "* ";
+                if (b != NULL)
+                    ss << bucketToString((kvb_t *)REF_UNMARKED(b));
+                ss << endl;
+            }
+            curr = curr->old;
+        }
+        return ss.str();
+    }
+
+
+  private:
+
+    /**
+     *  Run /f/ on /key/, and apply its result.  Like the sets' insert and
+     *  remove, this returns (new length + 1) if the bucket changed, and
+     *  -(length + 1) if it did not.
+     */
+    template<class F>
+    int update(K key, F f, bool & found)
+    {
+        HTM_SITE(site, "hashmap_t::update");
+        hnode_t * t;
+        int result;
+
+        uint32_t status;
+      retry:
+        t = head;
+        int i = bucketOf(key, t->size);
+        status = htm_begin(site, 42);
+        if (status == HTM_STARTED) {
+            cptr_t<kvb_t> w;
+            w.all = t->buckets[i];
+            kvb_t * b = w.fields.ptr;
+            // if the b is empty, goto slow path
+            if (b == NULL || IS_MARKED(b)) htm_abort(42);
+            int before = b->len;
+            result = updateInPlace(b, key, f, found);
+            // no room for a new pair: the slow path copies the bucket
+            if (result == 0) htm_abort(42);
+            if (result > 0) {
+                w.fields.ctr++;
+                t->buckets[i] = w.all;
+            }
+            htm_end(site); // commit fast path
+            if (result > 0 && result - 1 != before) {
+                RP::begin();
+                account(t, result - 1 - before);
+                RP::end();
+            }
+            return result;
+        }
+        else {
+            if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
+                // try slow path
+            }
+            else if (htm_retry(site, status)) {
+                goto retry;
+            }
+            htm_fallback(site);
+        }
+
+        RP::begin();
+        t = head;
+        int delta = 0;
+        result = apply(key, f, found, delta);
+        if (delta != 0)
+            account(t, delta);
+        RP::end();
+        return result;
+    }
+
+    /** The fast path's half of update(); returns 0 if /b/ is full */
+    template<class F>
+    static int updateInPlace(kvb_t * b, K key, F & f, bool & found)
+    {
+        K * keys = keysOf(b);
+        V * vals = valsOf(b);
+        int idx = findKey(b, key);
+        found = idx >= 0;
+        V v = found ? vals[idx] : V();
+        V old = v;
+        bool keep = f(found, v);
+        if (found && keep) {
+            if (!memcmp(&v, &old, sizeof(V)))
+                return -(b->len + 1);
+            vals[idx] = v;
+        }
+        else if (found) {
+            // move the last pair into the hole
+            b->len--;
+            keys[idx] = keys[b->len];
+            vals[idx] = vals[b->len];
+        }
+        else if (keep) {
+            if (b->len >= b->cap)
+                return 0;
+            keys[b->len] = key;
+            vals[b->len] = v;
+            b->len++;
+        }
+        else
+            return -(b->len + 1);
+        return b->len + 1;
+    }
+
+    template<class F>
+    int apply(K key, F & f, bool & found, int & delta)
+    {
+        while (true) {
+            hnode_t * t = head;
+            int       i = bucketOf(key, t->size);
+
+            cptr_t<kvb_t> w;
+            w.all = t->buckets[i];
+            kvb_t * b = w.fields.ptr;
+
+            // if the b is empty, help finish resize
+            if (b == NULL)
+                helpResize(t, i);
+            // otherwise enlist at b
+            else {
+                while (!IS_MARKED(b)) {
+                    kvb_t * n = bucketUpdate(b, key, f, found);
+                    if (n == b) {
+                        // the fast path edits buckets in place, so a read
+                        // that changed nothing must be validated
+                        cptr_t<kvb_t> w2;
+                        w2.all = t->buckets[i];
+                        if (w2.all == w.all)
+                            return -(n->len + 1);
+                    }
+                    else {
+                        cptr_t<kvb_t> nw;
+                        MAKE_CPTR(nw, n, w.fields.ctr + 1);
+                        if (bcas(&t->buckets[i], &w.all, nw.all)) {
+                            delta = (int)n->len - (int)b->len;
+                            free_bucket_safe(b); // reclaim b
+                            return n->len + 1;
+                        }
+                        free_bucket_unsafe(n); // reclaim n
+                    }
+                    w.all = t->buckets[i];
+                    b = w.fields.ptr;
+                }
+            }
+        }
+    }
+
+    /** Count an insert (+1) or remove (-1), and resize /t/ if the load calls for it */
+    void account(hnode_t * t, int delta)
+    {
+        count.add(RP::get_tid(), delta);
+        if (delta > 0 && chash_should_grow(count.get(), t->size))
+            resize(t, true);
+        else if (delta < 0 && chash_should_shrink(count.get(), t->size))
+            resize(t, false);
+    }
+
+    bool resize(hnode_t * t, bool grow)
+    {
+        if ((t->size >= chash_max_buckets() && grow) ||
+            (t->size == MIN_BUCKET_NUM && !grow))
+            return false;
+
+        if (t == head) {
+            // make sure we can deprecate t's predecessor
+            for (int i = 0; i < t->size; i++) {
+                cptr_t<kvb_t> w;
+                w.all = t->buckets[i];
+                if (w.fields.ptr == NULL)
+                    helpResize(t, i);
+            }
+            // deprecate t's predecessor
+            hnode_t * o = t->old;
+            if (o && bcas(&(t->old), &o, (hnode_t *)NULL))
+                free_hnode_safe(o);
+
+            // switch to fresh bucket array
+            if (t == head) {
+                hnode_t * n = alloc_hnode(t, grow ? t->size * 2 : t->size / 2);
+                if (!bcas(&head, &t, n)) {
+                    free_hnode_unsafe(n); // free n
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void helpResize(hnode_t * t, int i)
+    {
+        cptr_t<kvb_t> w;
+        w.all = t->buckets[i];
+        kvb_t * b = w.fields.ptr;
+
+        hnode_t * s = t->old;
+        if (b == NULL && s != NULL) {
+            kvb_t * set;
+            if (s->size * 2 == t->size) /* growing */ {
+                kvb_t * p = freezeBucket(s, i & (s->size - 1));
+                set = split(p, t->size, i);
+            }
+            else /* shrinking */ {
+                kvb_t * p = freezeBucket(s, i);
+                kvb_t * q = freezeBucket(s, i + t->size);
+                set = merge(p, q);
+            }
+            cptr_t<kvb_t> nw;
+            MAKE_CPTR(nw, set, w.fields.ctr + 1);
+            if (!bcas(&t->buckets[i], &w.all, nw.all))
+                free_bucket_unsafe(set);
+        }
+    }
+
+    string bucketToString(kvb_t * b)
+    {
+        stringstream ss;
+        for (uint32_t i = 0; i < b->len; i++)
+            ss << keysOf(b)[i] << ":" << valsOf(b)[i] << " ";
+        return ss.str();
+    }
+
+    /** Keep the pairs of /o/ that land in bucket /remainder/ of /size/ */
+    kvb_t * split(kvb_t * o, int size, int remainder)
+    {
+        int count = 0;
+        for (uint32_t i = 0; i < o->len; i++)
+            if (bucketOf(keysOf(o)[i], size) == remainder)
+                count++;
+        kvb_t * n = alloc_bucket(count);
+        int j = 0;
+        for (uint32_t i = 0; i < o->len; i++) {
+            if (bucketOf(keysOf(o)[i], size) == remainder) {
+                keysOf(n)[j] = keysOf(o)[i];
+                valsOf(n)[j++] = valsOf(o)[i];
+            }
+        }
+        return n;
+    }
+
+    kvb_t * merge(kvb_t * p, kvb_t * q)
+    {
+        kvb_t * n = alloc_bucket(p->len + q->len);
+        copyPairs(n, 0, p);
+        copyPairs(n, p->len, q);
+        return n;
+    }
+
+    /** Copy every pair of /o/ into /n/, starting at index /at/ */
+    static void copyPairs(kvb_t * n, uint32_t at, kvb_t * o)
+    {
+        K * nk = keysOf(n), * ok = keysOf(o);
+        V * nv = valsOf(n), * ov = valsOf(o);
+        for (uint32_t i = 0; i < o->len; i++) {
+            nk[at + i] = ok[i];
+            nv[at + i] = ov[i];
+        }
+    }
+
+    kvb_t * freezeBucket(hnode_t * t, int i)
+    {
+        while (true) {
+            cptr_t<kvb_t> w;
+            w.all = t->buckets[i];
+            kvb_t * b = w.fields.ptr;
+
+            if (IS_MARKED(b))
+                return (kvb_t *)REF_UNMARKED(b);
+
+            cptr_t<kvb_t> nw;
+            MAKE_CPTR(nw, (kvb_t *)REF_MARKED(b), w.fields.ctr + 1);
+
+            if (bcas(&t->buckets[i], &w.all, nw.all))
+                return b;
+        }
+    }
+
+    /**
+     *  The slow path's half of update(): return a new bucket with f's
+     *  result applied, or /o/ itself if nothing changes.
+     */
+    template<class F>
+    kvb_t * bucketUpdate(kvb_t * o, K key, F & f, bool & found)
+    {
+        int idx = findKey(o, key);
+        found = idx >= 0;
+        V v = found ? valsOf(o)[idx] : V();
+        V old = v;
+        bool keep = f(found, v);
+        kvb_t * n;
+        if (found && keep) {
+            if (!memcmp(&v, &old, sizeof(V)))
+                return o;
+            n = alloc_bucket(o->len);
+            copyPairs(n, 0, o);
+            valsOf(n)[idx] = v;
+        }
+        else if (found) {
+            n = alloc_bucket(o->len - 1);
+            int j = 0;
+            for (uint32_t i = 0; i < o->len; i++) {
+                if ((int)i != idx) {
+                    keysOf(n)[j] = keysOf(o)[i];
+                    valsOf(n)[j++] = valsOf(o)[i];
+                }
+            }
+        }
+        else if (keep) {
+            n = alloc_bucket(o->len + 1);
+            copyPairs(n, 0, o);
+            keysOf(n)[o->len] = key;
+            valsOf(n)[o->len] = v;
+        }
+        else
+            return o;
+        return n;
+    }
+};
@@ -2,6 +2,10 @@
 
 #include <atomic>
 #include <cassert>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <sys/mman.h>
 
 #include "common.hpp"
 
@@ -14,25 +18,104 @@ struct limbo_t
     static const uintptr_t POOL_SIZE   = 32;
     /*** Set of void*s */
     void*     pool[POOL_SIZE];
-    /*** Timestamp when last void* was added */
-    uintptr_t  ts[MAX_THREADS];
-    /*** # valid timestamps in ts, or # elements in pool */
+    /*** Timestamp when last void* was added, one entry per thread slot */
+    uintptr_t* ts;
+    /*** # valid timestamps in ts */
+    uintptr_t  ts_len;
+    /*** # timestamps that ts has room for */
+    uintptr_t  ts_cap;
+    /*** # elements in pool, or # left to release */
     uintptr_t  length;
     /*** NehelperMin pointer for the limbo list */
     limbo_t*  older;
+    /*** Thread whose pools receive the blocks once they expire */
+    uintptr_t owner;
     /*** The constructor for the limbo_t just zeroes out everything */
-    limbo_t() : length(0), older(NULL) { }
+    limbo_t()
+        : ts(NULL), ts_len(0), ts_cap(0), length(0), older(NULL), owner(0) { }
+    ~limbo_t() { free(ts); }
 };
 
-// forward declaration
+/*** A cache-line padded lock-free stack of limbo_t's, linked by /older/ */
+struct limbo_stack_t
+{
+    atomic<limbo_t *> top;
+    char pad[CACHELINE_BYTES-sizeof(limbo_t *)];
+
+    void push(limbo_t * l)
+    {
+        limbo_t * t = top;
+        do {
+            l->older = t;
+        } while (!bcas(&top, &t, l));
+    }
+
+    limbo_t * take_all()
+    {
+        return (top.load() == NULL) ? NULL : top.exchange(NULL);
+    }
+};
+
+/*** Thread slots are added in chunks of this many */
+static const uintptr_t WBMM_SLOT_CHUNK  = 64;
+/*** Most chunks a slot array can have, i.e. at most 64K threads at once */
+static const uintptr_t WBMM_MAX_CHUNKS  = 1024;
+
+/**
+ *  An array indexed by thread slot that can grow while other threads read
+ *  it.  Chunks are zero-filled when they are added, and are never moved or
+ *  freed, so a reader that knows a slot exists needs no synchronization.
+ */
+template <typename T>
+struct slot_array_t
+{
+    atomic<T *> chunks[WBMM_MAX_CHUNKS];
+
+    T & operator[](uintptr_t i)
+    {
+        return chunks[i / WBMM_SLOT_CHUNK].load(std::memory_order_acquire)
+            [i % WBMM_SLOT_CHUNK];
+    }
+
+    /*** Add chunks until slot /i/ exists (caller holds the slot lock) */
+    void ensure(uintptr_t i)
+    {
+        assert(i / WBMM_SLOT_CHUNK < WBMM_MAX_CHUNKS);
+        for (uintptr_t c = 0; c <= i / WBMM_SLOT_CHUNK; c++)
+            if (chunks[c].load() == NULL)
+                chunks[c].store(new T[WBMM_SLOT_CHUNK]());
+    }
+};
+
+// forward declarations
 static void schedForReclaim(void* ptr);
+static void reclaimer_run();
 
 // array of per thread timestamp counters
-static pad_word_t                       trans_nums[MAX_THREADS];
+static slot_array_t<pad_word_t>         trans_nums;
 
-// number of threads
+// one more than the highest slot in use; scans stop here
 static pad_word_t                       threadcount;
 
+/**
+ *  Thread registration.  wbmm_register hands out the lowest free slot, and
+ *  wbmm_deregister gives it back and lowers /threadcount/ past any free
+ *  slots at the top, so scans cost O(live threads) rather than O(capacity).
+ *  A slot's counter is left alone when it is recycled, so it only ever
+ *  grows, and a timestamp taken under the old owner can never be mistaken
+ *  for one taken under the new owner.
+ */
+static std::mutex                       slot_lock;
+static slot_array_t<pad_word_t>         slot_used;
+/*** # slots whose chunks exist */
+static pad_word_t                       slot_cap;
+
+/**
+ *  A second per-slot word for reclamation policies other than wbmm: EBR
+ *  keeps its epoch announcement here, IBR its lower reservation.
+ */
+static slot_array_t<pad_word_t>         slot_aux;
+
 // thread id
 static thread_local uintptr_t           my_id;
 
@@ -45,33 +128,340 @@ static thread_local limbo_t *           prelimbo;
 /*** sorted list of timestamped reclaimables */
 static thread_local limbo_t *           limbo;
 
+/**
+ *  Expired limbo_t's whose blocks have not been handed back to the pools
+ *  yet.  /length/ counts the blocks still to be released from the head.
+ */
+static thread_local limbo_t *           expired;
+
+/*** Empty limbo_t's, kept so that we never have to call new/delete */
+static thread_local limbo_t *           spare;
+
+/*** Blocks released from /expired/ on each call to wbmm_alloc */
+static const uintptr_t WBMM_DRAIN_BATCH = 2;
+
+/**
+ *  When background reclamation is on, full prelimbos are pushed onto
+ *  /handoff/ and a dedicated reclaimer thread stamps them, waits for them to
+ *  expire, and pushes them back onto /returned[owner]/.
+ */
+static bool                             background;
+static limbo_stack_t                    handoff;
+static slot_array_t<limbo_stack_t>      returned;
+static std::thread *                    reclaimer;
+static atomic<bool>                     reclaimer_stop;
 
-/** Initialize the memory manager. */
-void wbmm_init(uintptr_t tn)
+/**
+ *  Per-thread count of blocks passed to free_safe and not yet handed back to
+ *  a pool.  Only the owner writes its slot; every reclamation policy keeps it
+ *  so that benchmarks can compare how much memory each one holds on to.
+ */
+static slot_array_t<pad_word_t>         unreclaimed;
+
+/*** Adjust the calling thread's unreclaimed count */
+static inline void wbmm_count_unreclaimed(intptr_t delta)
 {
-    threadcount.val = tn;
-    for (uintptr_t i = 0; i < MAX_THREADS; i++) trans_nums[i].val = 0;
+    atomic<uintptr_t> & c = unreclaimed[my_id].val;
+    c.store(c.load(std::memory_order_relaxed) + delta,
+            std::memory_order_relaxed);
+}
+
+/*** Approximate number of retired blocks not yet reclaimed, over all threads */
+static inline uintptr_t wbmm_unreclaimed()
+{
+    uintptr_t sum = 0;
+    for (uintptr_t i = 0, e = slot_cap.val; i < e; i++)
+        sum += unreclaimed[i].val.load(std::memory_order_relaxed);
+    return sum;
+}
+
+/**
+ *  Limbo_t's left behind by threads that deregistered.  Whoever next
+ *  handles a full prelimbo adopts the ones that have expired.
+ */
+static limbo_stack_t                    orphans;
+
+/*** Get an empty limbo_t, recycling a retired one if we have it */
+static limbo_t * limbo_get()
+{
+    limbo_t * l = spare;
+    if (l == NULL)
+        return new limbo_t();
+    spare = l->older;
+    l->length = 0;
+    l->older = NULL;
+    return l;
+}
+
+/*** Record the current value of every live slot's counter in /l/ */
+static void limbo_stamp(limbo_t * l)
+{
+    uintptr_t n = threadcount.val;
+    if (l->ts_cap < n) {
+        free(l->ts);
+        l->ts_cap = n + WBMM_SLOT_CHUNK;
+        l->ts = (uintptr_t *)malloc(l->ts_cap * sizeof(uintptr_t));
+        assert(l->ts);
+    }
+    l->ts_len = n;
+    for (uintptr_t i = 0; i < n; ++i)
+        l->ts[i] = trans_nums[i].val;
+}
+
+
+/**
+ *  Initialize the memory manager.  If /bg/ is set, the timestamp scans and
+ *  the expiry of limbo lists are done by a dedicated reclaimer thread, and
+ *  worker threads only enqueue full prelimbos.
+ */
+void wbmm_init(bool bg = false)
+{
+    background = bg;
+    if (background) {
+        reclaimer_stop = false;
+        reclaimer = new std::thread(reclaimer_run);
+    }
+}
+
+/** Stop the reclaimer thread, if there is one. */
+void wbmm_shutdown()
+{
+    if (reclaimer) {
+        reclaimer_stop = true;
+        reclaimer->join();
+        delete reclaimer;
+        reclaimer = NULL;
+    }
+}
+
+/**
+ *  Claim a thread slot for the caller.  /aux/ is the value the slot's
+ *  policy word must hold while nobody is using it.
+ */
+uintptr_t wbmm_register(uintptr_t aux = 0)
+{
+    std::lock_guard<std::mutex> guard(slot_lock);
+    uintptr_t n = threadcount.val, i = 0;
+    while (i < n && slot_used[i].val)
+        i++;
+    if (i == slot_cap.val) {
+        trans_nums.ensure(i);
+        slot_used.ensure(i);
+        slot_aux.ensure(i);
+        returned.ensure(i);
+        unreclaimed.ensure(i);
+        slot_cap.val = (i / WBMM_SLOT_CHUNK + 1) * WBMM_SLOT_CHUNK;
+    }
+    slot_used[i].val = 1;
+    slot_aux[i].val = aux;
+    // the slot must be fully set up before scans can see it
+    if (i == n)
+        threadcount.val = n + 1;
+    my_id = i;
+    my_ts = &trans_nums[i].val;
+    return i;
+}
+
+/*** Give the caller's slot back */
+void wbmm_deregister()
+{
+    std::lock_guard<std::mutex> guard(slot_lock);
+    slot_used[my_id].val = 0;
+    uintptr_t n = threadcount.val;
+    while (n > 0 && !slot_used[n - 1].val)
+        n--;
+    threadcount.val = n;
 }
 
 /** Initialize thread local data (called by each thread). */
-void wbmm_thread_init(uintptr_t id)
+void wbmm_thread_init()
 {
-    my_id = id;
-    my_ts = &trans_nums[id].val;
-    prelimbo = new limbo_t();
+    wbmm_register();
+    prelimbo = limbo_get();
     limbo = NULL;
 }
 
+/**
+ *  Every block handed out by wbmm_alloc is preceded by a two-word header that
+ *  records its size class.  Two words keeps the payload aligned for counted
+ *  pointers on both 32-bit and 64-bit builds.
+ */
+struct wbmm_hdr_t
+{
+    /*** size class, or WBMM_LARGE / WBMM_HUGE for blocks that bypass the pools */
+    uintptr_t sc;
+    /*** free for the reclamation policy (EBR chains retired blocks here) */
+    uintptr_t pad;
+};
+
+/*** A free block, linked through its first payload word */
+struct wbmm_block_t
+{
+    wbmm_block_t * next;
+};
+
+/*** Size classes are multiples of this many bytes, header included */
+static const uintptr_t WBMM_CLASS_BYTES = 16;
+/*** Number of size classes; anything larger goes to malloc */
+static const uintptr_t WBMM_NUM_CLASSES = 32;
+/*** Size class tag for blocks that bypass the pools */
+static const uintptr_t WBMM_LARGE       = WBMM_NUM_CLASSES;
+/*** Size class tag for blocks that have a mapping of their own */
+static const uintptr_t WBMM_HUGE        = WBMM_NUM_CLASSES + 1;
+/**
+ *  Blocks of at least this many bytes (in practice, the bucket arrays of
+ *  big hash tables) are mapped directly and backed by transparent huge
+ *  pages, which saves a TLB miss on nearly every random bucket access.
+ */
+static const uintptr_t WBMM_HUGE_BYTES  = 2 << 20;
+/*** Bytes requested from malloc each time a pool runs dry */
+static const uintptr_t WBMM_SLAB_BYTES  = 16384;
+
+/*** Per-thread free lists, one per size class */
+static thread_local wbmm_block_t *      freelists[WBMM_NUM_CLASSES];
+
+/*** Free lists left behind by threads that deregistered, one per class */
+static atomic<wbmm_block_t *>           orphan_blocks[WBMM_NUM_CLASSES];
+
+static inline wbmm_hdr_t * wbmm_header(void * ptr)
+{
+    return ((wbmm_hdr_t *)ptr) - 1;
+}
+
+/*** Carve a fresh slab into blocks of class /sc/ and put them on my list */
+static void wbmm_refill(uintptr_t sc)
+{
+    // adopt a list that a departed thread left behind, if there is one
+    if (orphan_blocks[sc].load() != NULL) {
+        freelists[sc] = orphan_blocks[sc].exchange(NULL);
+        if (freelists[sc] != NULL)
+            return;
+    }
+    uintptr_t bytes = (sc + 1) * WBMM_CLASS_BYTES;
+    char * slab = (char *)malloc(WBMM_SLAB_BYTES);
+    assert(slab);
+    for (uintptr_t off = 0; off + bytes <= WBMM_SLAB_BYTES; off += bytes) {
+        wbmm_hdr_t * h = (wbmm_hdr_t *)(slab + off);
+        h->sc = sc;
+        wbmm_block_t * b = (wbmm_block_t *)(h + 1);
+        b->next = freelists[sc];
+        freelists[sc] = b;
+    }
+}
+
+/**
+ *  Hand my free lists to whichever threads next need a block of the same
+ *  class.  Every policy calls this on its way out, before giving the slot
+ *  back.
+ */
+static void wbmm_orphan_freelists()
+{
+    for (uintptr_t sc = 0; sc < WBMM_NUM_CLASSES; sc++) {
+        wbmm_block_t * head = freelists[sc];
+        if (head == NULL)
+            continue;
+        wbmm_block_t * tail = head;
+        while (tail->next != NULL)
+            tail = tail->next;
+        wbmm_block_t * top = orphan_blocks[sc];
+        do {
+            tail->next = top;
+        } while (!bcas(&orphan_blocks[sc], &top, head));
+        freelists[sc] = NULL;
+    }
+}
+
+/**
+ *  Map a huge block.  The mapping starts with its own length, two words
+ *  ahead of the usual header, and is a whole number of huge pages.
+ */
+static void * wbmm_huge_alloc(size_t size)
+{
+    uintptr_t bytes = size + 2 * sizeof(uintptr_t) + sizeof(wbmm_hdr_t);
+    bytes = (bytes + WBMM_HUGE_BYTES - 1) & ~(WBMM_HUGE_BYTES - 1);
+    void * m = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(m != MAP_FAILED);
+#ifdef MADV_HUGEPAGE
+    // only a hint: without THP support we still get ordinary pages
+    madvise(m, bytes, MADV_HUGEPAGE);
+#endif
+    uintptr_t * len = (uintptr_t *)m;
+    len[0] = bytes;
+    wbmm_hdr_t * h = (wbmm_hdr_t *)(len + 2);
+    h->sc = WBMM_HUGE;
+    return h + 1;
+}
+
+/*** Return a block to the pool of the calling thread */
+static inline void wbmm_release(void * ptr)
+{
+    if (ptr == NULL)
+        return;
+    wbmm_hdr_t * h = wbmm_header(ptr);
+    if (h->sc == WBMM_LARGE) {
+        free(h);
+        return;
+    }
+    if (h->sc == WBMM_HUGE) {
+        uintptr_t * len = ((uintptr_t *)h) - 2;
+        munmap(len, len[0]);
+        return;
+    }
+    wbmm_block_t * b = (wbmm_block_t *)ptr;
+    b->next = freelists[h->sc];
+    freelists[h->sc] = b;
+}
+
+/**
+ *  Hand up to /n/ expired blocks back to the pools.  Containers that become
+ *  empty go to the spare list.  Returns false once nothing is left.
+ */
+static bool wbmm_drain(uintptr_t n)
+{
+    while (n > 0) {
+        limbo_t * e = expired;
+        if (e == NULL && background)
+            e = expired = returned[my_id].take_all();
+        if (e == NULL)
+            return false;
+        if (e->length == 0) {
+            expired = e->older;
+            e->older = spare;
+            spare = e;
+            continue;
+        }
+        wbmm_release(e->pool[--e->length]);
+        wbmm_count_unreclaimed(-1);
+        n--;
+    }
+    return true;
+}
+
 void * wbmm_alloc(size_t size)
 {
-    void * buf = malloc(size);
-    assert (buf);
-    return buf;
+    wbmm_drain(WBMM_DRAIN_BATCH);
+    uintptr_t sc = (size + sizeof(wbmm_hdr_t) - 1) / WBMM_CLASS_BYTES;
+    if (size >= WBMM_HUGE_BYTES)
+        return wbmm_huge_alloc(size);
+    if (sc >= WBMM_NUM_CLASSES) {
+        wbmm_hdr_t * h = (wbmm_hdr_t *)malloc(size + sizeof(wbmm_hdr_t));
+        assert(h);
+        h->sc = WBMM_LARGE;
+        return h + 1;
+    }
+    // prefer recycling expired blocks over carving a new slab
+    while (freelists[sc] == NULL && wbmm_drain(WBMM_DRAIN_BATCH)) { }
+    if (freelists[sc] == NULL)
+        wbmm_refill(sc);
+    wbmm_block_t * b = freelists[sc];
+    freelists[sc] = b->next;
+    return b;
 }
 
 void wbmm_free_unsafe(void * ptr)
 {
-    free(ptr);
+    wbmm_release(ptr);
 }
 
 void wbmm_free_safe(void * ptr)
@@ -99,15 +489,39 @@ inline uintptr_t wbmm_get_epoch()
     return *my_ts;
 }
 
-/*** figure out if one timestamp is strictly dominated by another */
-static bool is_strictly_older(uintptr_t* newer, uintptr_t* older, uintptr_t old_len)
+/**
+ *  figure out if one timestamp is strictly dominated by another.  Slots
+ *  past the end of /older/ were claimed after it was taken, and slots past
+ *  the end of /newer/ were free when it was taken, so neither can hold
+ *  /older/ back.
+ */
+static bool is_strictly_older(limbo_t* newer, limbo_t* older)
 {
-    for (uintptr_t i = 0; i < old_len; ++i)
-        if ((newer[i] <= older[i]) && (newer[i] & 1))
+    uintptr_t len = (newer->ts_len < older->ts_len)
+        ? newer->ts_len : older->ts_len;
+    for (uintptr_t i = 0; i < len; ++i)
+        if ((newer->ts[i] <= older->ts[i]) && (newer->ts[i] & 1))
             return false;
     return true;
 }
 
+/*** Move every orphaned limbo_t that /now/ dominates to my expired list */
+static void adopt_orphans(limbo_t* now)
+{
+    limbo_t* o = orphans.take_all();
+    while (o != NULL) {
+        limbo_t* next = o->older;
+        if (is_strictly_older(now, o)) {
+            o->older = expired;
+            expired = o;
+        }
+        else {
+            orphans.push(o);
+        }
+        o = next;
+    }
+}
+
 /**
  *  This code is the cornerstone of the WBMMPolicy.  We buffer lots of
  *  frees onto a prelimbo list, and then, at some point, we must give
@@ -116,11 +530,16 @@ static bool is_strictly_older(uintptr_t* newer, uintptr_t* older, uintptr_t old_
  */
 static void handle_full_prelimbo()
 {
-    // get the current timestamp from the epoch
-    prelimbo->length = threadcount.val;
+    // in background mode the reclaimer does everything below
+    if (background) {
+        prelimbo->owner = my_id;
+        handoff.push(prelimbo);
+        prelimbo = limbo_get();
+        return;
+    }
 
-    for (uintptr_t i = 0, e = prelimbo->length; i < e; ++i)
-        prelimbo->ts[i] = trans_nums[i].val;
+    // get the current timestamp from the epoch
+    limbo_stamp(prelimbo);
 
     // push prelimbo onto the front of the limbo list:
     prelimbo->older = limbo;
@@ -134,7 +553,7 @@ static void handle_full_prelimbo()
     limbo_t* current = limbo->older;
     limbo_t* prev = limbo;
     while (current != NULL) {
-        if (is_strictly_older(limbo->ts, current->ts, current->length))
+        if (is_strictly_older(limbo, current))
             break;
         prev = current;
         current = current->older;
@@ -143,18 +562,73 @@ static void handle_full_prelimbo()
     if (current) {
         // detach /current/ from the list
         prev->older = NULL;
-        // free all blocks in each node's pool and free the node
+        // Don't release the blocks now: move the whole chain to the expired
+        // cache, and let subsequent calls to wbmm_alloc drain it a few
+        // blocks at a time.
+        limbo_t * tail = current;
+        while (tail->older != NULL)
+            tail = tail->older;
+        tail->older = expired;
+        expired = current;
+    }
+    // batches left behind by departed threads may have expired too
+    if (orphans.top.load() != NULL)
+        adopt_orphans(limbo);
+    prelimbo = limbo_get();
+}
+
+/**
+ *  Main loop of the background reclaimer.  It keeps its own limbo list,
+ *  newest first, and stamps each batch when it dequeues it.  That is later
+ *  than the moment the worker retired the blocks, so the stamp is only more
+ *  conservative.  Expired batches go back to their owners' /returned/
+ *  stacks, and the owners drain them from wbmm_alloc.
+ */
+static void reclaimer_run()
+{
+    limbo_t * pending = NULL;
+    limbo_t now;
+
+    while (!reclaimer_stop) {
+        limbo_t * batch = handoff.take_all();
+        while (batch != NULL) {
+            limbo_t * next = batch->older;
+            limbo_stamp(batch);
+            batch->older = pending;
+            pending = batch;
+            batch = next;
+        }
+
+        if (pending == NULL) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        // take a fresh timestamp and find the newest batch it dominates
+        limbo_stamp(&now);
+        limbo_t * current = pending;
+        limbo_t * prev = NULL;
         while (current != NULL) {
-            // free blocks in current's pool
-            for (unsigned long i = 0; i < current->POOL_SIZE; i++)
-                free(current->pool[i]);
-            // free the node and move on
-            limbo_t* old = current;
+            if (is_strictly_older(&now, current))
+                break;
+            prev = current;
             current = current->older;
-            free(old);
+        }
+        if (current == NULL) {
+            std::this_thread::yield();
+            continue;
+        }
+        if (prev)
+            prev->older = NULL;
+        else
+            pending = NULL;
+        // everything from /current/ on has expired
+        while (current != NULL) {
+            limbo_t * next = current->older;
+            returned[current->owner].push(current);
+            current = next;
         }
     }
-    prelimbo = new limbo_t();
 }
 
 /**
@@ -164,6 +638,7 @@ static void handle_full_prelimbo()
 static void schedForReclaim(void* ptr)
 {
     // insert /ptr/ into the prelimbo pool and increment the pool size
+    wbmm_count_unreclaimed(1);
     prelimbo->pool[prelimbo->length++] = ptr;
     // if prelimbo is not full, we're done
     if (prelimbo->length != prelimbo->POOL_SIZE)
@@ -171,3 +646,41 @@ static void schedForReclaim(void* ptr)
     // if prelimbo is full, we have a lot more work to do
     handle_full_prelimbo();
 }
+
+/**
+ *  Called by each thread before it exits.  Anything still waiting to expire
+ *  is left for other threads to adopt, my free lists are handed to
+ *  whichever threads next need a block of the same class, and my slot is
+ *  given back.
+ */
+void wbmm_thread_fini()
+{
+    // stamp the partial prelimbo; it expires like any other batch
+    if (prelimbo->length > 0) {
+        if (background) {
+            prelimbo->owner = my_id;
+            handoff.push(prelimbo);
+        }
+        else {
+            limbo_stamp(prelimbo);
+            orphans.push(prelimbo);
+        }
+    }
+    else {
+        delete prelimbo;
+    }
+    prelimbo = NULL;
+    while (limbo != NULL) {
+        limbo_t * next = limbo->older;
+        orphans.push(limbo);
+        limbo = next;
+    }
+    wbmm_drain(UINTPTR_MAX);
+    while (spare != NULL) {
+        limbo_t * next = spare->older;
+        delete spare;
+        spare = next;
+    }
+    wbmm_orphan_freelists();
+    wbmm_deregister();
+}
@@ -7,13 +7,14 @@
 #include <atomic>
 
 #include "common.hpp"
-#include "mm.hpp"
+#include "reclaim.hpp"
 
 using std::atomic;
 using std::stringstream;
 using std::string;
 using std::endl;
 
+template<class RP = wbmm_policy_t>
 class moundpq_t
 {
   private:
@@ -28,14 +29,14 @@ class moundpq_t
         mound_list_t * next;
     };
 
-    union alignas(8) mound_word_t {
+    union alignas(2*sizeof(void*)) mound_word_t {
         struct {
-            void *   ptr;
-            uint32_t owned   : 1;  // which pointer we should use
-            uint32_t cavity  : 1;  // whether node is cavity
-            uint32_t version : 30; // monotonic timestamp
+            void *    ptr;
+            uintptr_t owned   : 1;  // which pointer we should use
+            uintptr_t cavity  : 1;  // whether node is cavity
+            uintptr_t version : 8*sizeof(uintptr_t)-2; // monotonic timestamp
         } fields;
-        uint64_t all;   // read 64-bit at once
+        cptr_word_t all; // read the whole word at once
     };
 
     enum mound_owner_status_t {
@@ -53,10 +54,10 @@ class moundpq_t
 
     /** Ownership record for mound. */
     struct mound_owner_t {
-        atomic<uint64_t> * a;
+        cptr_atomic_t * a;
         mound_word_t a_old;
         mound_word_t a_new;
-        atomic<uint64_t> * b;
+        cptr_atomic_t * b;
         mound_word_t b_old;
         mound_word_t b_new;
         atomic<uint32_t> status;
@@ -70,13 +71,13 @@ class moundpq_t
 
     static mound_list_t * alloc_list()
     {
-        auto * list = (mound_list_t*)wbmm_alloc(sizeof(mound_list_t));
+        auto * list = (mound_list_t*)RP::alloc(sizeof(mound_list_t));
         return list;
     }
 
     static void free_list(mound_list_t * ptr)
     {
-        wbmm_free_safe(ptr);
+        RP::free_safe(ptr);
     }
 
     static inline void MAKE_MOUND_NODE(mound_word_t & _var, void * _l, uint32_t _c, uint32_t _v)
@@ -107,15 +108,15 @@ class moundpq_t
 
     // We implement mound as an array of levels. Level i holds
     // 2^i elements.
-    atomic<atomic<uint64_t> *> levels[32];
+    atomic<cptr_atomic_t *> levels[32];
 
     // The index of the level that currently is the leaves
     atomic<uint32_t> bottom;
 
   private:
 
-    bool C2S2(atomic<uint64_t> * a, mound_word_t a_old, mound_word_t a_new,
-              atomic<uint64_t> * b, mound_word_t b_old, mound_word_t b_new)
+    bool C2S2(cptr_atomic_t * a, mound_word_t a_old, mound_word_t a_new,
+              cptr_atomic_t * b, mound_word_t b_old, mound_word_t b_new)
     {
         // make orec: copy parameters
         mound_owner_t * o = &my_tx;
@@ -141,7 +142,7 @@ class moundpq_t
         s_fail.fields.s = FAIL_C2S2;
         s_fail.fields.v = os.fields.v + 1;
 
-        uint64_t temp;
+        cptr_word_t temp;
         mound_word_t x;
 
         // op is invisible until I install A
@@ -199,7 +200,7 @@ class moundpq_t
     void C2S2_HELPER(mound_owner_t * o, mound_owner_t & cache)
     {
         // we can recover the parameters of c2s2 from the cache of orec
-        atomic<uint64_t>
+        cptr_atomic_t
             * a = cache.a, * b = cache.b;
         mound_word_t
             a_old = cache.a_old, a_new = cache.a_new,
@@ -218,7 +219,7 @@ class moundpq_t
 
         /*** The following piece of code is copied from the second part of C2S2 ***/
         bool succ; // whether the C2S2 can succeed
-        uint64_t temp;
+        cptr_word_t temp;
         mound_word_t x;
 
         //return; // temp
@@ -253,7 +254,7 @@ class moundpq_t
     }
 
     __attribute__((noinline))
-    uint64_t READ_HELPMODE(atomic<uint64_t> * addr)
+    cptr_word_t READ_HELPMODE(cptr_atomic_t * addr)
     {
         while (true) {
             spin64();
@@ -283,9 +284,9 @@ class moundpq_t
         }
     }
 
-    inline uint64_t ATOMIC_READ(mound_pos_t pos)
+    inline cptr_word_t ATOMIC_READ(mound_pos_t pos)
     {
-        atomic<uint64_t> * addr = &levels[pos.level][pos.index];
+        cptr_atomic_t * addr = &levels[pos.level][pos.index];
         mound_word_t v;
         v.all = *addr;
         if (__builtin_expect(!v.fields.owned, true)) return v.all;
@@ -360,12 +361,12 @@ class moundpq_t
     void grow(uint32_t btm)
     {
         if (bottom != btm) return;
-        atomic<uint64_t> * oldlevel = levels[btm + 1];
+        cptr_atomic_t * oldlevel = levels[btm + 1];
 
         if (oldlevel == NULL) {
             uint32_t size = 1 << (btm + 1);
-            atomic<uint64_t> * newlevel = (atomic<uint64_t> *)malloc(size * sizeof(atomic<uint64_t>));
-            memset(newlevel, 0, size * sizeof(atomic<uint64_t>));
+            cptr_atomic_t * newlevel = (cptr_atomic_t *)malloc(size * sizeof(cptr_atomic_t));
+            memset(newlevel, 0, size * sizeof(cptr_atomic_t));
             if (!bcas(&levels[btm + 1], &oldlevel, newlevel))
                 free(newlevel);
         }
@@ -408,7 +409,7 @@ class moundpq_t
         bottom = 0;
         my_seed = 0;
 
-        levels[0] = (atomic<uint64_t> *)malloc(sizeof(atomic<uint64_t>));
+        levels[0] = (cptr_atomic_t *)malloc(sizeof(cptr_atomic_t));
         levels[0][0] = 0;
 
         for (int i = 1; i < 32; i++) levels[i] = NULL;
@@ -416,7 +417,7 @@ class moundpq_t
 
     void add(int32_t n)
     {
-        wbmm_begin();
+        RP::begin();
         mound_pos_t C, P, M;
         mound_word_t CC, PP, MM;
 
@@ -461,12 +462,12 @@ class moundpq_t
             }
         }
       exit:
-        wbmm_end();
+        RP::end();
     }
 
     int32_t remove()
     {
-        wbmm_begin();
+        RP::begin();
 
         int32_t ret;
         mound_pos_t N;
@@ -499,11 +500,11 @@ class moundpq_t
         }
 
       exit:
-        wbmm_end();
+        RP::end();
         return ret;
     }
 
-    uint64_t fill_cavity(mound_pos_t N)
+    cptr_word_t fill_cavity(mound_pos_t N)
     {
         // for caching timestamps etc
         mound_word_t NN, LL, RR;
@@ -575,5 +576,7 @@ class moundpq_t
     }
 };
 
-thread_local moundpq_t::mound_owner_t moundpq_t::my_tx = {0};
-thread_local uint32_t moundpq_t::my_seed = 0;
+template<class RP>
+thread_local typename moundpq_t<RP>::mound_owner_t moundpq_t<RP>::my_tx = {0};
+template<class RP>
+thread_local uint32_t moundpq_t<RP>::my_seed = 0;
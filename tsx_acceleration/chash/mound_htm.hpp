@@ -8,7 +8,7 @@
 #include <x86intrin.h>
 
 #include "common.hpp"
-#include "mm.hpp"
+#include "reclaim.hpp"
 
 using std::atomic;
 using std::stringstream;
@@ -16,8 +16,7 @@ using std::string;
 using std::endl;
 using std::memory_order;
 
-#define MAX_ATTEMPT_NUM_MICRO 4
-
+template<class RP = wbmm_policy_t>
 class moundpq_htm_t
 {
   private:
@@ -32,14 +31,14 @@ class moundpq_htm_t
         mound_list_t * next;
     };
 
-    union alignas(8) mound_word_t {
+    union alignas(2*sizeof(void*)) mound_word_t {
         struct {
-            void *   ptr;
-            uint32_t owned   : 1;  // which pointer we should use
-            uint32_t cavity  : 1;  // whether node is cavity
-            uint32_t version : 30; // monotonic timestamp
+            void *    ptr;
+            uintptr_t owned   : 1;  // which pointer we should use
+            uintptr_t cavity  : 1;  // whether node is cavity
+            uintptr_t version : 8*sizeof(uintptr_t)-2; // monotonic timestamp
         } fields;
-        uint64_t all;   // read 64-bit at once
+        cptr_word_t all; // read the whole word at once
     };
 
     enum mound_owner_status_t {
@@ -57,10 +56,10 @@ class moundpq_htm_t
 
     /** Ownership record for mound. */
     struct mound_owner_t {
-        atomic<uint64_t> * a;
+        cptr_atomic_t * a;
         mound_word_t a_old;
         mound_word_t a_new;
-        atomic<uint64_t> * b;
+        cptr_atomic_t * b;
         mound_word_t b_old;
         mound_word_t b_new;
         atomic<uint32_t> status;
@@ -74,13 +73,13 @@ class moundpq_htm_t
 
     static mound_list_t * alloc_list()
     {
-        auto * list = (mound_list_t*)wbmm_alloc(sizeof(mound_list_t));
+        auto * list = (mound_list_t*)RP::alloc(sizeof(mound_list_t));
         return list;
     }
 
     static void free_list(mound_list_t * ptr)
     {
-        wbmm_free_safe(ptr);
+        RP::free_safe(ptr);
     }
 
     static inline void MAKE_MOUND_NODE(mound_word_t & _var, void * _l, uint32_t _c, uint32_t _v)
@@ -111,15 +110,15 @@ class moundpq_htm_t
 
     // We implement mound as an array of levels. Level i holds
     // 2^i elements.
-    atomic<atomic<uint64_t> *> levels[32];
+    atomic<cptr_atomic_t *> levels[32];
 
     // The index of the level that currently is the leaves
     atomic<uint32_t> bottom;
 
   private:
 
-    bool C2S2(atomic<uint64_t> * a, mound_word_t a_old, mound_word_t a_new,
-              atomic<uint64_t> * b, mound_word_t b_old, mound_word_t b_new)
+    bool C2S2(cptr_atomic_t * a, mound_word_t a_old, mound_word_t a_new,
+              cptr_atomic_t * b, mound_word_t b_old, mound_word_t b_new)
     {
         // make orec: copy parameters
         mound_owner_t * o = &my_tx;
@@ -145,7 +144,7 @@ class moundpq_htm_t
         s_fail.fields.s = FAIL_C2S2;
         s_fail.fields.v = os.fields.v + 1;
 
-        uint64_t temp;
+        cptr_word_t temp;
         mound_word_t x;
 
         // op is invisible until I install A
@@ -202,7 +201,7 @@ class moundpq_htm_t
     void C2S2_HELPER(mound_owner_t * o, mound_owner_t & cache)
     {
         // we can recover the parameters of c2s2 from the cache of orec
-        atomic<uint64_t>
+        cptr_atomic_t
             * a = cache.a, * b = cache.b;
         mound_word_t
             a_old = cache.a_old, a_new = cache.a_new,
@@ -221,7 +220,7 @@ class moundpq_htm_t
 
         /*** The following piece of code is copied from the second part of C2S2 ***/
         bool succ; // whether the C2S2 can succeed
-        uint64_t temp;
+        cptr_word_t temp;
         mound_word_t x;
 
         //return; // temp
@@ -256,7 +255,7 @@ class moundpq_htm_t
     }
 
     __attribute__((noinline))
-    uint64_t READ_HELPMODE(atomic<uint64_t> * addr)
+    cptr_word_t READ_HELPMODE(cptr_atomic_t * addr)
     {
         while (true) {
             spin64();
@@ -286,9 +285,9 @@ class moundpq_htm_t
         }
     }
 
-    inline uint64_t ATOMIC_READ(mound_pos_t pos)
+    inline cptr_word_t ATOMIC_READ(mound_pos_t pos)
     {
-        atomic<uint64_t> * addr = &levels[pos.level][pos.index];
+        cptr_atomic_t * addr = &levels[pos.level][pos.index];
         mound_word_t v;
         v.all = *addr;
         if (__builtin_expect(!v.fields.owned, true)) return v.all;
@@ -305,26 +304,27 @@ class moundpq_htm_t
     bool ATOMIC_C2S1(mound_pos_t C, mound_word_t CC, mound_word_t CC_new,
                             mound_pos_t P, mound_word_t PP)
     {
+        HTM_SITE(site, "moundpq_htm_t::ATOMIC_C2S1");
         auto child = &levels[C.level][C.index];
         auto parent = &levels[P.level][P.index];
 
-        uint32_t attempts = 0;
         uint32_t status;
         bool ok = false;
       retry:
-        status = _xbegin();
-        if (status == _XBEGIN_STARTED) {
+        status = htm_begin(site, 42);
+        if (status == HTM_STARTED) {
             if (levels[C.level][C.index] == CC.all && levels[P.level][P.index] == PP.all) {
                 levels[C.level][C.index] = CC_new.all;
                 ok = true;
             }
-            _xend();
+            htm_end(site);
             return ok;
         }
         else {
-            if (++attempts < MAX_ATTEMPT_NUM_MICRO) {
+            if (htm_retry(site, status)) {
                 goto retry;
             }
+            htm_fallback(site);
         }
         return C2S2(child, CC, CC_new, parent, PP, PP);
     }
@@ -333,26 +333,27 @@ class moundpq_htm_t
     bool ATOMIC_C2S2(mound_pos_t P, mound_word_t PP, mound_word_t PP_new,
                      mound_pos_t C, mound_word_t CC, mound_word_t CC_new)
     {
+        HTM_SITE(site, "moundpq_htm_t::ATOMIC_C2S2");
         auto child = &levels[C.level][C.index];
         auto parent = &levels[P.level][P.index];
 
-        uint32_t attempts = 0;
         uint32_t status;
         bool ok = false;
       retry1:
-        status = _xbegin();
-        if (status == _XBEGIN_STARTED) {
+        status = htm_begin(site, 42);
+        if (status == HTM_STARTED) {
             if (levels[C.level][C.index] == CC.all && levels[P.level][P.index] == PP.all) {
                 levels[C.level][C.index] = CC_new.all;
                 levels[P.level][P.index] = PP_new.all;
                 ok = true;
             }
-            _xend();
+            htm_end(site);
         }
         else {
-            if (++attempts < MAX_ATTEMPT_NUM_MICRO) {
+            if (htm_retry(site, status)) {
                 goto retry1;
             }
+            htm_fallback(site);
             ok = C2S2(child, CC, CC_new, parent, PP, PP_new);
         }
         return ok;
@@ -403,12 +404,12 @@ class moundpq_htm_t
     void grow(uint32_t btm)
     {
         if (bottom != btm) return;
-        atomic<uint64_t> * oldlevel = levels[btm + 1];
+        cptr_atomic_t * oldlevel = levels[btm + 1];
 
         if (oldlevel == NULL) {
             uint32_t size = 1 << (btm + 1);
-            atomic<uint64_t> * newlevel = (atomic<uint64_t> *)malloc(size * sizeof(atomic<uint64_t>));
-            memset(newlevel, 0, size * sizeof(atomic<uint64_t>));
+            cptr_atomic_t * newlevel = (cptr_atomic_t *)malloc(size * sizeof(cptr_atomic_t));
+            memset(newlevel, 0, size * sizeof(cptr_atomic_t));
             if (!bcas(&levels[btm + 1], &oldlevel, newlevel))
                 free(newlevel);
         }
@@ -451,7 +452,7 @@ class moundpq_htm_t
         bottom = 0;
         my_seed = 0;
 
-        levels[0] = (atomic<uint64_t> *)malloc(sizeof(atomic<uint64_t>));
+        levels[0] = (cptr_atomic_t *)malloc(sizeof(cptr_atomic_t));
         levels[0][0] = 0;
 
         for (int i = 1; i < 32; i++) levels[i] = NULL;
@@ -459,7 +460,7 @@ class moundpq_htm_t
 
     void add(int32_t n)
     {
-        wbmm_begin();
+        RP::begin();
         mound_pos_t C, P, M;
         mound_word_t CC, PP, MM;
 
@@ -503,12 +504,12 @@ class moundpq_htm_t
             }
         }
       exit:
-        wbmm_end();
+        RP::end();
     }
 
     int32_t remove()
     {
-        wbmm_begin();
+        RP::begin();
 
         int32_t ret;
         mound_pos_t N;
@@ -541,11 +542,11 @@ class moundpq_htm_t
         }
 
       exit:
-        wbmm_end();
+        RP::end();
         return ret;
     }
 
-    uint64_t fill_cavity(mound_pos_t N)
+    cptr_word_t fill_cavity(mound_pos_t N)
     {
         // for caching timestamps etc
         mound_word_t NN, LL, RR;
@@ -617,7 +618,7 @@ class moundpq_htm_t
     }
 };
 
-thread_local moundpq_htm_t::mound_owner_t moundpq_htm_t::my_tx = {0};
-thread_local uint32_t moundpq_htm_t::my_seed = 0;
-
-#undef MAX_ATTEMPT_NUM_MICRO
+template<class RP>
+thread_local typename moundpq_htm_t<RP>::mound_owner_t moundpq_htm_t<RP>::my_tx = {0};
+template<class RP>
+thread_local uint32_t moundpq_htm_t<RP>::my_seed = 0;
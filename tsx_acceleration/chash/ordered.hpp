@@ -0,0 +1,54 @@
+#pragma once
+
+#include <climits>
+
+/**
+ *  A weakly consistent iterator over the keys of an ordered set (bstset_t,
+ *  slset_t), in ascending order from a starting key.  It returns every key
+ *  that is in the set for the whole iteration, no key that is absent for
+ *  the whole iteration, and may or may not return the others.
+ *
+ *  It holds no node between calls.  It copies keys a chunk at a time with
+ *  SET::scan(), and each chunk starts just after the last key of the one
+ *  before.  So it needs no reclamation epoch of its own, and the thread may
+ *  use the set while it iterates.
+ */
+template<class SET>
+class ordered_iter_t
+{
+  private:
+
+    /*** Keys copied per call to SET::scan() */
+    static const int ITER_CHUNK = 32;
+
+    SET * set;
+    int   buf[ITER_CHUNK];
+    int   pos;
+    int   len;
+    int   from;
+    bool  last;
+
+  public:
+
+    ordered_iter_t(SET * s, int key = INT_MIN)
+        : set(s), pos(0), len(0), from(key), last(false)
+    {
+    }
+
+    /** Put the next key in /key/; false once there are no more. */
+    bool next(int & key)
+    {
+        if (pos == len) {
+            if (last)
+                return false;
+            len = set->scan(from, buf, ITER_CHUNK);
+            pos = 0;
+            if (len == 0)
+                return false;
+            last = len < ITER_CHUNK || buf[len - 1] == INT_MAX;
+            from = buf[len - 1] + (last ? 0 : 1);
+        }
+        key = buf[pos++];
+        return true;
+    }
+};
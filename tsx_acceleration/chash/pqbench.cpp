@@ -11,7 +11,7 @@
 #include <unistd.h>
 
 #include "alt-license/rand_r_32.h"
-#include "mm.hpp"
+#include "reclaim.hpp"
 
 #include "mound.hpp"
 #include "mound_htm.hpp"
@@ -31,6 +31,8 @@ static uint32_t INIT_SIZE    = 65536;
 static uint32_t DELAY        = 0;
 static string ALG_NAME  = "";
 static bool SANITY_MODE = false;
+static bool BG_RECLAIM  = false;
+static string RECLAIMER = "wbmm";
 
 static std::atomic<bool> bench_begin;
 static std::atomic<bool> bench_stop;
@@ -44,12 +46,14 @@ static void printHelp()
     cout << "  -I     initial size" << endl;
     cout << "  -l     delay" << endl;
     cout << "  -c     sanity mode" << endl;
+    cout << "  -b     background reclamation thread (wbmm only)" << endl;
+    cout << "  -r     reclamation policy (wbmm, ebr, leak)" << endl;
 }
 
 static bool parseArgs(int argc, char** argv)
 {
     int c;
-    while ((c = getopt(argc, argv, "a:p:d:M:I:l:hc")) != -1)
+    while ((c = getopt(argc, argv, "a:p:d:M:I:l:r:hcb")) != -1)
     {
         switch(c)
         {
@@ -74,6 +78,12 @@ static bool parseArgs(int argc, char** argv)
           case 'c':
             SANITY_MODE = true;
             break;
+          case 'b':
+            BG_RECLAIM = true;
+            break;
+          case 'r':
+            RECLAIMER = string(optarg);
+            break;
           case 'h':
             printHelp();
             return false;
@@ -91,10 +101,10 @@ struct bench_ops_thread_arg_t
     uint64_t  ops;
 };
 
-template<class PQ>
+template<class RP, class PQ>
 void benchOpsThread(bench_ops_thread_arg_t * arg)
 {
-    wbmm_thread_init(arg->tid);
+    RP::thread_init();
 
     uint32_t seed1 = arg->tid;
     uint32_t seed2 = seed1 + 1;
@@ -117,9 +127,10 @@ void benchOpsThread(bench_ops_thread_arg_t * arg)
         ops++;
     }
     arg->ops = ops;
+    RP::thread_fini();
 }
 
-template<class PQ>
+template<class RP, class PQ>
 static void runBench()
 {
     PQ set;
@@ -130,6 +141,9 @@ static void runBench()
         set.add(key);
     }
 
+    // the main thread sits idle while the workers run
+    RP::thread_fini();
+
     bench_begin = false;
     bench_stop = false;
 
@@ -141,7 +155,7 @@ static void runBench()
         arg.tid = j + 1;
         arg.set = &set;
         arg.ops = 0;
-        thrs[j] = new thread(benchOpsThread<PQ>, &arg);
+        thrs[j] = new thread(benchOpsThread<RP, PQ>, &arg);
     }
 
     // broadcast begin signal
@@ -154,6 +168,9 @@ static void runBench()
     for (uint32_t j = 0; j < NUM_THREADS; j++)
         thrs[j]->join();
 
+    // the main thread takes a slot again now that the workers are done
+    RP::thread_init();
+
     uint64_t totalOps = 0;
     for (uint32_t j = 0; j < NUM_THREADS; j++) {
         totalOps += args[j].ops;
@@ -162,6 +179,9 @@ static void runBench()
     cout << ("Throughput(ops/ms): ")
          << std::setprecision(6)
          << (double)totalOps / DURATION / 1000 << endl;
+
+    // per-site HTM outcomes, summed over all threads (nothing if no HTM ran)
+    htm_stats_print();
 }
 
 
@@ -172,10 +192,10 @@ struct sanity_thread_arg_t
     uint64_t  ops;
 };
 
-template<class PQ>
+template<class RP, class PQ>
 void sanityThread(sanity_thread_arg_t * arg)
 {
-    wbmm_thread_init(arg->tid);
+    RP::thread_init();
 
     uint32_t seed1 = arg->tid;
     uint32_t seed2 = seed1 + 1;
@@ -192,9 +212,10 @@ void sanityThread(sanity_thread_arg_t * arg)
         ops++;
     }
     arg->ops = ops;
+    RP::thread_fini();
 }
 
-template<class PQ>
+template<class RP, class PQ>
 static bool sanityCheck()
 {
     PQ set;
@@ -205,6 +226,9 @@ static bool sanityCheck()
         set.add(key);
     }
 
+    // the main thread sits idle while the workers run
+    RP::thread_fini();
+
     bench_begin = false;
     bench_stop = false;
 
@@ -216,7 +240,7 @@ static bool sanityCheck()
         arg.tid = j + 1;
         arg.set = &set;
         arg.ops = 0;
-        thrs[j] = new thread(sanityThread<PQ>, &arg);
+        thrs[j] = new thread(sanityThread<RP, PQ>, &arg);
     }
 
     // broadcast begin signal
@@ -226,6 +250,9 @@ static bool sanityCheck()
 
     for (uint32_t j = 0; j < NUM_THREADS; j++) thrs[j]->join();
 
+    // the main thread takes a slot again to check the result
+    RP::thread_init();
+
     uint32_t old = 0;
     for (uint32_t i = 0; i < INIT_SIZE; i++) {
         uint32_t num = set.remove();
@@ -254,7 +281,7 @@ struct pqcompare {
     bool operator() (const int& l, const int& r) { return l > r; }
 };
 
-template<class PQ>
+template<class RP, class PQ>
 bool sanityCheckSequential()
 {
     const int max = 10000;
@@ -280,41 +307,57 @@ bool sanityCheckSequential()
     return true;
 }
 
-template<typename PQ>
+template<class RP, class PQ>
 void run()
 {
     if (SANITY_MODE) {
-        sanityCheckSequential<PQ>();
-        sanityCheck<PQ>();
+        sanityCheckSequential<RP, PQ>();
+        sanityCheck<RP, PQ>();
     }
     else
-        runBench<PQ>();
+        runBench<RP, PQ>();
 }
 
-int main(int argc, char** argv)
+template<class RP>
+void dispatch()
 {
-    if (!parseArgs(argc, argv)) {
-        return 0;
-    }
-
-    wbmm_init(NUM_THREADS + 1);
-    wbmm_thread_init(0);
+    RP::init(BG_RECLAIM);
+    RP::thread_init();
 
     if (ALG_NAME == "Mound")
-        run<moundpq_t>();
+        run<RP, moundpq_t<RP> >();
     else if (ALG_NAME == "MoundHTM")
-        run<moundpq_htm_t>();
+        run<RP, moundpq_htm_t<RP> >();
     else if (ALG_NAME == "MoundHTMFF")
-        run<moundpq_htmff_t>();
+        run<RP, moundpq_htmff_t<RP> >();
     else if (ALG_NAME == "Skip")
-        run<slpq_t>();
+        run<RP, slpq_t<RP> >();
     else if (ALG_NAME == "SkipHTM")
-        run<slpq_htm_t>();
+        run<RP, slpq_htm_t<RP> >();
     else if (ALG_NAME == "SkipHTMFF")
-        run<slpq_htmff_t>();
+        run<RP, slpq_htmff_t<RP> >();
     else {
         cout << "Algorithm not found." << endl;
     }
 
+    RP::thread_fini();
+    RP::shutdown();
+}
+
+int main(int argc, char** argv)
+{
+    if (!parseArgs(argc, argv)) {
+        return 0;
+    }
+
+    if (RECLAIMER == "wbmm")
+        dispatch<wbmm_policy_t>();
+    else if (RECLAIMER == "ebr")
+        dispatch<ebr_policy_t>();
+    else if (RECLAIMER == "leak")
+        dispatch<leak_policy_t>();
+    else
+        cout << "Reclamation policy not found." << endl;
+
     return 0;
 }
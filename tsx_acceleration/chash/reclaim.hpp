@@ -0,0 +1,532 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "common.hpp"
+#include "mm.hpp"
+
+/**
+ *  Reclamation policies.  Every chash data structure is a template over one
+ *  of these, and only ever talks to memory through the static functions
+ *  below.  All policies share the per-thread pool allocator from mm.hpp; they
+ *  differ in when a block passed to free_safe may go back to the pools.
+ *
+ *  Loads of shared pointers that a thread will dereference go through
+ *  read().  Only interval-based reclamation needs the hook; the other
+ *  policies compile it down to a plain load.
+ */
+
+/**
+ *  The timestamp-vector scheme from mm.hpp.  Every operation writes the
+ *  thread's counter twice, and retired blocks expire once every thread that
+ *  was inside an operation has left it.
+ */
+struct wbmm_policy_t
+{
+    static void init(bool bg) { wbmm_init(bg); }
+    static void shutdown() { wbmm_shutdown(); }
+    static void thread_init() { wbmm_thread_init(); }
+    static void thread_fini() { wbmm_thread_fini(); }
+
+    static void * alloc(size_t size) { return wbmm_alloc(size); }
+    static void free_unsafe(void * ptr) { wbmm_free_unsafe(ptr); }
+    static void free_safe(void * ptr) { wbmm_free_safe(ptr); }
+
+    static void begin() { wbmm_begin(); }
+    static void end() { wbmm_end(); }
+
+    template <typename T>
+    static T read(const std::atomic<T> & a) { return a.load(); }
+
+    static uintptr_t get_tid() { return wbmm_get_tid(); }
+    static uintptr_t get_epoch() { return wbmm_get_epoch(); }
+};
+
+/**
+ *  Classic three-epoch EBR.  A thread announces the global epoch when it
+ *  begins an operation, but only writes its announcement when the epoch has
+ *  changed since its last operation, and end() writes nothing.  Between
+ *  operations a thread therefore still looks active in the epoch it last
+ *  saw, which is conservative but safe: it can delay an epoch change by at
+ *  most one operation.  Threads that go idle must call thread_fini() so that
+ *  they stop holding the epoch back.
+ *
+ *  Retired blocks are chained through the spare word of their wbmm header
+ *  into one of three per-thread bags, indexed by local epoch.  Announcements
+ *  live in the per-slot policy word, slot_aux.  A thread that leaves puts
+ *  its bags on a global orphan list, which whoever next advances the epoch
+ *  empties once they have expired.
+ */
+struct ebr_policy_t
+{
+    /*** Announcement of a thread that is not running any operation */
+    static const uintptr_t INACTIVE = UINTPTR_MAX;
+    /*** Try to advance the epoch after this many retirements */
+    static const uintptr_t ADVANCE_FREQ = 64;
+
+    /*** The bags of a departed thread, chained, and its last local epoch */
+    struct orphan_t
+    {
+        void *     bag;
+        uintptr_t  epoch;
+        orphan_t * next;
+    };
+
+    static pad_word_t                   epoch;
+    static atomic<orphan_t *>           orphans;
+
+    static thread_local uintptr_t       local_epoch;
+    static thread_local void *          bags[3];
+    static thread_local uintptr_t       retired;
+
+    static void init(bool)
+    {
+        epoch.val = 0;
+    }
+
+    static void shutdown() { }
+
+    static void thread_init()
+    {
+        wbmm_register(INACTIVE);
+        local_epoch = epoch.val;
+        bags[0] = bags[1] = bags[2] = NULL;
+        retired = 0;
+    }
+
+    /**
+     *  Everything in our bags was retired in local epoch /local_epoch/ or
+     *  earlier, so the lot can be freed together, by whoever first sees the
+     *  epoch three past it.
+     */
+    static void thread_fini()
+    {
+        slot_aux[my_id].val = INACTIVE;
+        void * chain = NULL;
+        for (int b = 0; b < 3; b++) {
+            void * p = bags[b];
+            while (p != NULL) {
+                void * next = (void *)wbmm_header(p)->pad;
+                wbmm_header(p)->pad = (uintptr_t)chain;
+                chain = p;
+                p = next;
+            }
+            bags[b] = NULL;
+        }
+        if (chain != NULL) {
+            orphan_t * o = new orphan_t();
+            o->bag = chain;
+            o->epoch = local_epoch;
+            push_orphan(o);
+        }
+        wbmm_orphan_freelists();
+        wbmm_deregister();
+    }
+
+    static void * alloc(size_t size) { return wbmm_alloc(size); }
+    static void free_unsafe(void * ptr) { wbmm_free_unsafe(ptr); }
+
+    static void free_safe(void * ptr)
+    {
+        if (ptr == NULL)
+            return;
+        // the HTM fast paths retire without begin(), so our local epoch can
+        // lag the global one; the bag must be that of an epoch no earlier
+        // than the unlink
+        uintptr_t e = epoch.val;
+        if (e != local_epoch)
+            enter(e);
+        uintptr_t b = local_epoch % 3;
+        wbmm_header(ptr)->pad = (uintptr_t)bags[b];
+        bags[b] = ptr;
+        wbmm_count_unreclaimed(1);
+        if (++retired % ADVANCE_FREQ == 0)
+            try_advance();
+    }
+
+    static void begin()
+    {
+        uintptr_t e = epoch.val;
+        if (slot_aux[my_id].val != e) {
+            slot_aux[my_id].val = e;
+            // the announcement must be visible before we read shared data
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            // re-read in case the epoch moved while we were announcing
+            e = epoch.val;
+            slot_aux[my_id].val = e;
+            enter(e);
+        }
+    }
+
+    static void end() { }
+
+    template <typename T>
+    static T read(const std::atomic<T> & a) { return a.load(); }
+
+    static uintptr_t get_tid() { return my_id; }
+    static uintptr_t get_epoch() { return local_epoch; }
+
+  private:
+
+    /*** Release every block in the chain that starts at /p/ */
+    static void release_chain(void * p)
+    {
+        while (p != NULL) {
+            void * next = (void *)wbmm_header(p)->pad;
+            wbmm_release(p);
+            wbmm_count_unreclaimed(-1);
+            p = next;
+        }
+    }
+
+    /*** Release every block in a bag */
+    static void empty_bag(uintptr_t b)
+    {
+        release_chain(bags[b]);
+        bags[b] = NULL;
+    }
+
+    static void push_orphan(orphan_t * o)
+    {
+        orphan_t * top = orphans;
+        do {
+            o->next = top;
+        } while (!bcas(&orphans, &top, o));
+    }
+
+    /*** Free the orphaned bags that have expired now that the epoch is /e/ */
+    static void adopt_orphans(uintptr_t e)
+    {
+        if (orphans.load() == NULL)
+            return;
+        orphan_t * o = orphans.exchange(NULL);
+        while (o != NULL) {
+            orphan_t * next = o->next;
+            if (e - o->epoch >= 3) {
+                release_chain(o->bag);
+                delete o;
+            }
+            else {
+                push_orphan(o);
+            }
+            o = next;
+        }
+    }
+
+    /**
+     *  free_safe() catches up with the global epoch before it picks a bag,
+     *  so blocks retired while our local epoch was L were unlinked while the
+     *  global epoch was at most L, and are safe once it reaches L+3.  On
+     *  the way from L to /e/ we empty the bag of every epoch up to e-3; the
+     *  bag of epoch x-3 is the one that epoch x is about to reuse.
+     */
+    static void enter(uintptr_t e)
+    {
+        if (e == local_epoch)
+            return;
+        if (e - local_epoch >= 3) {
+            empty_bag(0);
+            empty_bag(1);
+            empty_bag(2);
+        }
+        else {
+            for (uintptr_t x = local_epoch + 1; x <= e; x++)
+                empty_bag(x % 3);
+        }
+        local_epoch = e;
+    }
+
+    /*** Advance the epoch if every active thread has seen the current one */
+    static void try_advance()
+    {
+        uintptr_t e = epoch.val;
+        for (uintptr_t i = 0, n = threadcount.val; i < n; i++) {
+            uintptr_t a = slot_aux[i].val;
+            if (a != e && a != INACTIVE)
+                return;
+        }
+        if (bcas(&epoch.val, &e, e + 1))
+            adopt_orphans(e + 1);
+    }
+};
+
+pad_word_t                   ebr_policy_t::epoch;
+atomic<ebr_policy_t::orphan_t *> ebr_policy_t::orphans;
+thread_local uintptr_t       ebr_policy_t::local_epoch;
+thread_local void *          ebr_policy_t::bags[3];
+thread_local uintptr_t       ebr_policy_t::retired;
+
+/**
+ *  Two-global-era interval-based reclamation (2GEIBR).  Every block records
+ *  the era in which it was allocated, and every retired block the era in
+ *  which it was retired.  A thread in an operation reserves the interval of
+ *  eras [lower, upper]: /lower/ is fixed by begin(), and read() raises
+ *  /upper/ whenever it sees that the global era has moved.  A retired block
+ *  can be reclaimed once its [birth, retire] interval overlaps no thread's
+ *  reservation.
+ *
+ *  Unlike the timestamp vector and EBR, a thread that stalls mid-operation
+ *  only pins blocks that were alive during its reservation; everything
+ *  allocated after its last read() is still reclaimed, so the amount of
+ *  unreclaimed memory stays bounded.
+ *
+ *  The upper reservations live in the trans_nums array from mm.hpp, the
+ *  lower ones in slot_aux, and the birth era in the spare word of the wbmm
+ *  header.  A thread that leaves puts what it could not free on a global
+ *  orphan list, and every later scan() also sweeps that list.
+ *
+ *  A structure can only use this policy if it routes its shared-pointer
+ *  loads through read(), and if a block is unreachable by the time it is
+ *  retired.  The grace-period schemes above also tolerate a retired block
+ *  that is briefly reachable (e.g. through a descriptor, or re-linked by a
+ *  late snip CAS), because everyone who can still find it started before it
+ *  was retired.  IBR does not: such a block is freed as soon as it was born
+ *  after every such reader's last read().  Of our sets, only the hash meets
+ *  both requirements today.
+ */
+struct ibr_policy_t
+{
+    /*** Advance the global era after this many allocations by one thread */
+    static const uintptr_t ERA_FREQ = 64;
+    /*** Initial capacity of the retired list, which is scanned when full */
+    static const uintptr_t RETIRED_INIT = 128;
+    /*** Lower reservation of a thread that is not running any operation */
+    static const uintptr_t INACTIVE = UINTPTR_MAX;
+
+    /*** A retired block and the era in which it was retired */
+    struct retired_t
+    {
+        void *    ptr;
+        uintptr_t retire;
+    };
+
+    /*** The retired list of a departed thread, which it now owns */
+    struct orphan_t
+    {
+        retired_t * list;
+        uintptr_t   count;
+        orphan_t *  next;
+    };
+
+    static pad_word_t                   era;
+    static atomic<orphan_t *>           orphans;
+
+    static thread_local retired_t *     retired;
+    static thread_local uintptr_t       retired_count;
+    static thread_local uintptr_t       retired_cap;
+    static thread_local uintptr_t       allocs;
+
+    static void init(bool)
+    {
+        era.val = 1;
+    }
+
+    static void shutdown() { }
+
+    static void thread_init()
+    {
+        wbmm_register(INACTIVE);
+        retired_cap = RETIRED_INIT;
+        retired = (retired_t *)malloc(retired_cap * sizeof(retired_t));
+        retired_count = 0;
+        allocs = 0;
+    }
+
+    static void thread_fini()
+    {
+        end();
+        scan();
+        if (retired_count > 0) {
+            orphan_t * o = new orphan_t();
+            o->list = retired;
+            o->count = retired_count;
+            push_orphan(o);
+        }
+        else {
+            free(retired);
+        }
+        retired = NULL;
+        retired_count = 0;
+        wbmm_orphan_freelists();
+        wbmm_deregister();
+    }
+
+    static void * alloc(size_t size)
+    {
+        if (++allocs % ERA_FREQ == 0)
+            era.val.fetch_add(1);
+        void * ptr = wbmm_alloc(size);
+        uintptr_t birth = era.val;
+        wbmm_header(ptr)->pad = birth;
+        // we may use the block after another thread retires it, so our own
+        // reservation must cover its birth, before anyone else can see it
+        if (slot_aux[my_id].val != INACTIVE && trans_nums[my_id].val < birth)
+            trans_nums[my_id].val = birth;
+        return ptr;
+    }
+
+    static void free_unsafe(void * ptr) { wbmm_free_unsafe(ptr); }
+
+    static void free_safe(void * ptr)
+    {
+        if (ptr == NULL)
+            return;
+        // when the list is full, scan it, and only grow it if the scan could
+        // not free at least half of it
+        if (retired_count == retired_cap) {
+            scan();
+            if (retired_count > retired_cap / 2) {
+                retired_cap *= 2;
+                retired = (retired_t *)realloc(retired,
+                                               retired_cap * sizeof(retired_t));
+                assert(retired);
+            }
+        }
+        retired[retired_count].ptr = ptr;
+        retired[retired_count].retire = era.val;
+        retired_count++;
+        wbmm_count_unreclaimed(1);
+    }
+
+    static void begin()
+    {
+        uintptr_t e = era.val;
+        slot_aux[my_id].val = e;
+        trans_nums[my_id].val = e;
+    }
+
+    static void end()
+    {
+        slot_aux[my_id].val = INACTIVE;
+        trans_nums[my_id].val = 0;
+    }
+
+    /**
+     *  Load a shared pointer, extending our upper reservation until it
+     *  covers the era in which the load happened.  Anything reachable from
+     *  the result was born no later than that era.
+     */
+    template <typename T>
+    static T read(const std::atomic<T> & a)
+    {
+        atomic<uintptr_t> & upper = trans_nums[my_id].val;
+        uintptr_t prev = upper.load(std::memory_order_relaxed);
+        while (true) {
+            T v = a.load();
+            uintptr_t e = era.val;
+            if (e == prev)
+                return v;
+            upper = e;
+            prev = e;
+        }
+    }
+
+    static uintptr_t get_tid() { return my_id; }
+    static uintptr_t get_epoch() { return era.val; }
+
+  private:
+
+    static void push_orphan(orphan_t * o)
+    {
+        orphan_t * top = orphans;
+        do {
+            o->next = top;
+        } while (!bcas(&orphans, &top, o));
+    }
+
+    /**
+     *  Release every block of /list/ whose lifetime misses all of the /n/
+     *  reservations [lo[i], hi[i]], and compact the rest to the front.
+     *  Returns how many are left.
+     */
+    static uintptr_t sweep(retired_t * list, uintptr_t count,
+                           const uintptr_t * lo, const uintptr_t * hi,
+                           uintptr_t n)
+    {
+        uintptr_t kept = 0;
+        for (uintptr_t r = 0; r < count; r++) {
+            uintptr_t birth = wbmm_header(list[r].ptr)->pad;
+            uintptr_t retire = list[r].retire;
+            bool reserved = false;
+            for (uintptr_t i = 0; i < n && !reserved; i++)
+                reserved = (lo[i] <= retire) && (birth <= hi[i]);
+            if (reserved) {
+                list[kept++] = list[r];
+            }
+            else {
+                wbmm_release(list[r].ptr);
+                wbmm_count_unreclaimed(-1);
+            }
+        }
+        return kept;
+    }
+
+    /**
+     *  Release every retired block whose lifetime misses all reservations,
+     *  ours and those that departed threads left behind.
+     */
+    static void scan()
+    {
+        uintptr_t n = threadcount.val;
+        uintptr_t * lo = new uintptr_t[2 * n];
+        uintptr_t * hi = lo + n;
+        for (uintptr_t i = 0; i < n; i++) {
+            lo[i] = slot_aux[i].val;
+            hi[i] = trans_nums[i].val;
+        }
+        retired_count = sweep(retired, retired_count, lo, hi, n);
+        if (orphans.load() != NULL) {
+            orphan_t * o = orphans.exchange(NULL);
+            while (o != NULL) {
+                orphan_t * next = o->next;
+                o->count = sweep(o->list, o->count, lo, hi, n);
+                if (o->count == 0) {
+                    free(o->list);
+                    delete o;
+                }
+                else {
+                    push_orphan(o);
+                }
+                o = next;
+            }
+        }
+        delete [] lo;
+    }
+};
+
+pad_word_t                           ibr_policy_t::era;
+atomic<ibr_policy_t::orphan_t *>     ibr_policy_t::orphans;
+thread_local ibr_policy_t::retired_t * ibr_policy_t::retired;
+thread_local uintptr_t               ibr_policy_t::retired_count;
+thread_local uintptr_t               ibr_policy_t::retired_cap;
+thread_local uintptr_t               ibr_policy_t::allocs;
+
+/**
+ *  Never reclaim anything: operations pay nothing for reclamation at all.
+ *  This is the baseline that the other policies are measured against.
+ */
+struct leak_policy_t
+{
+    static void init(bool) { }
+    static void shutdown() { }
+    static void thread_init() { wbmm_register(); }
+    static void thread_fini()
+    {
+        wbmm_orphan_freelists();
+        wbmm_deregister();
+    }
+
+    static void * alloc(size_t size) { return wbmm_alloc(size); }
+    static void free_unsafe(void * ptr) { wbmm_free_unsafe(ptr); }
+    static void free_safe(void *) { wbmm_count_unreclaimed(1); }
+
+    static void begin() { }
+    static void end() { }
+
+    template <typename T>
+    static T read(const std::atomic<T> & a) { return a.load(); }
+
+    static uintptr_t get_tid() { return my_id; }
+    static uintptr_t get_epoch() { return 0; }
+};
@@ -2,20 +2,31 @@
 #include <iomanip>
 #include <string>
 #include <vector>
+#include <cstdio>
 #include <cstdlib>
 #include <ctime>
 #include <thread>
+#include <chrono>
 #include <atomic>
 #include <cstring>
+#include <algorithm>
 #include <unistd.h>
+#include <sys/resource.h>
 
 #include "alt-license/rand_r_32.h"
-#include "mm.hpp"
+#include "reclaim.hpp"
+#include "hashfn.hpp"
 
 #include "hash.hpp"
 #include "hash_cptr.hpp"
 #include "hash_htm.hpp"
 #include "hash_inplace.hpp"
+#include "hash_inline.hpp"
+#include "hash_wf.hpp"
+#include "hash_adaptive.hpp"
+#include "hash_so.hpp"
+#include "hashmap.hpp"
+#include "ordered.hpp"
 #include "bst.hpp"
 #include "bst_cptr.hpp"
 #include "bst_htm1.hpp"
@@ -24,9 +35,12 @@
 #include "bst_htm2ff.hpp"
 #include "bst_htm3.hpp"
 #include "bst_htm3ff.hpp"
+#include "bst_sg.hpp"
+#include "bstmap.hpp"
 #include "skip.hpp"
 #include "skip_htm.hpp"
 #include "skip_htmff.hpp"
+#include "skipmap.hpp"
 
 using namespace std;
 
@@ -37,10 +51,37 @@ static uint32_t KEY_RANGE    = 4096;
 static uint32_t INIT_SIZE    = 1024;
 static string ALG_NAME  = "BST";
 static bool SANITY_MODE = false;
+static bool BG_RECLAIM  = false;
+static string RECLAIMER = "wbmm";
+static bool STALL       = false;
+static string HASH_FN   = "identity";
+static string KEY_DIST  = "uniform";
+static bool LARGE_MODE  = false;
+static bool PHASES      = false;
+static bool SEQ_MODE    = false;
+static uint32_t BATCH_SIZE = 1;
+static uint32_t RANGE_SPAN = 0;
+static bool NEXT_MODE   = false;
+
+/*** Key range of the large mode, unless -M says otherwise */
+static const uint32_t LARGE_KEY_RANGE = 100000000;
+
+/**
+ *  The clustered key distribution models IDs handed out in blocks: the key
+ *  range is cut into runs of CLUSTER_LEN consecutive keys, and successive
+ *  runs start CLUSTER_GAP apart.  With the identity hash, every key in a run
+ *  shares its low bits with the same key of every other run.
+ */
+static const uint32_t CLUSTER_LEN = 8;
+static const uint32_t CLUSTER_GAP = 4096;
 
 static std::atomic<bool> bench_begin;
 static std::atomic<bool> bench_stop;
 
+/*** The next key to insert, and the oldest key not yet removed, under -S */
+static std::atomic<uint32_t> seq_head;
+static std::atomic<uint32_t> seq_tail;
+
 static void printHelp()
 {
     cout << "  -a     algorithm" << endl;
@@ -50,12 +91,26 @@ static void printHelp()
     cout << "  -M     key range" << endl;
     cout << "  -I     initial size" << endl;
     cout << "  -c     sanity mode" << endl;
+    cout << "  -b     background reclamation thread (wbmm only)" << endl;
+    cout << "  -r     reclamation policy (wbmm, ebr, ibr, leak)" << endl;
+    cout << "  -s     park one extra thread mid-operation for the whole run" << endl;
+    cout << "  -H     hash function for Hash* (identity, fib, murmur)" << endl;
+    cout << "  -k     key distribution (uniform, clustered)" << endl;
+    cout << "  -B     log2 of the most buckets a Hash* table may grow to" << endl;
+    cout << "  -L     large mode: 10^8 keys, half of them preloaded" << endl;
+    cout << "  -F     fill/drain phases instead of a random mix (ignores -R)" << endl;
+    cout << "  -S     sequential keys: inserts take ascending keys, removes the oldest" << endl;
+    cout << "  -g     keys per batched operation (1 = no batching)" << endl;
+    cout << "  -T     lock-free attempts before HashAdaptive escalates" << endl;
+    cout << "  -Q     lookups are range queries of this many keys (0 = point lookups)" << endl;
+    cout << "  -N     lookups are next-key queries (least key >= k)" << endl;
 }
 
 static bool parseArgs(int argc, char** argv)
 {
     int c;
-    while ((c = getopt(argc, argv, "a:p:d:R:M:I:hc")) != -1)
+    bool range_set = false, init_set = false;
+    while ((c = getopt(argc, argv, "a:p:d:R:M:I:r:H:k:B:g:T:Q:hcbsLFNS")) != -1)
     {
         switch(c)
         {
@@ -73,13 +128,54 @@ static bool parseArgs(int argc, char** argv)
             break;
           case 'M':
             KEY_RANGE = atoi(optarg);
+            range_set = true;
             break;
           case 'I':
             INIT_SIZE = atoi(optarg);
+            init_set = true;
             break;
           case 'c':
             SANITY_MODE = true;
             break;
+          case 'b':
+            BG_RECLAIM = true;
+            break;
+          case 'r':
+            RECLAIMER = string(optarg);
+            break;
+          case 's':
+            STALL = true;
+            break;
+          case 'H':
+            HASH_FN = string(optarg);
+            break;
+          case 'k':
+            KEY_DIST = string(optarg);
+            break;
+          case 'B':
+            chash_max_bucket_bits = std::min(30, atoi(optarg));
+            break;
+          case 'L':
+            LARGE_MODE = true;
+            break;
+          case 'F':
+            PHASES = true;
+            break;
+          case 'S':
+            SEQ_MODE = true;
+            break;
+          case 'g':
+            BATCH_SIZE = std::max(1, atoi(optarg));
+            break;
+          case 'T':
+            chash_adaptive_trials = std::max(1, atoi(optarg));
+            break;
+          case 'Q':
+            RANGE_SPAN = atoi(optarg);
+            break;
+          case 'N':
+            NEXT_MODE = true;
+            break;
           case 'h':
             printHelp();
             return false;
@@ -87,9 +183,234 @@ static bool parseArgs(int argc, char** argv)
             return false;
         }
     }
+    if (LARGE_MODE) {
+        if (!range_set)
+            KEY_RANGE = LARGE_KEY_RANGE;
+        if (!init_set)
+            INIT_SIZE = KEY_RANGE / 2;
+    }
     return true;
 }
 
+/**
+ *  Map a key index in [0, KEY_RANGE) to the key the set sees.  The
+ *  benchmarks draw indices, so the sanity check can keep its per-key
+ *  counters dense whatever the distribution.
+ */
+static int keyOf(uint32_t idx)
+{
+    if (KEY_DIST == "clustered")
+        return (idx / CLUSTER_LEN) * CLUSTER_GAP + idx % CLUSTER_LEN;
+    return idx;
+}
+
+/**
+ *  Drive a map through the set interface.  Every key maps to a value
+ *  derived from it, and contains() checks that value, so the sanity check
+ *  catches a lost or torn value just as it catches a lost key.
+ */
+template<class MAP>
+struct map_set_t
+{
+    MAP map;
+
+    static uint64_t valueOf(int key) { return (uint64_t)key * 2 + 1; }
+
+    bool insert(int key) { return map.putIfAbsent(key, valueOf(key)); }
+    bool remove(int key) { return map.remove(key); }
+    bool grow() { return map.grow(); }
+    bool shrink() { return map.shrink(); }
+
+    bool contains(int key)
+    {
+        uint64_t v;
+        return map.get(key, v) && v == valueOf(key);
+    }
+};
+
+/**
+ *  Batched operations.  The hash sets with a batch interface get the whole
+ *  batch in one call; any other set gets one call per key, which is the
+ *  baseline that batching is measured against.
+ */
+template<class SET>
+static int containsBatch(SET * set, const int * keys, int n, bool * done)
+{
+    int r = 0;
+    for (int j = 0; j < n; j++)
+        r += (done[j] = set->contains(keys[j]));
+    return r;
+}
+
+template<class SET>
+static int insertBatch(SET * set, const int * keys, int n, bool * done)
+{
+    int r = 0;
+    for (int j = 0; j < n; j++)
+        r += (done[j] = set->insert(keys[j]));
+    return r;
+}
+
+template<class SET>
+static int removeBatch(SET * set, const int * keys, int n, bool * done)
+{
+    int r = 0;
+    for (int j = 0; j < n; j++)
+        r += (done[j] = set->remove(keys[j]));
+    return r;
+}
+
+template<class RP, class HP>
+static int containsBatch(hashset_t<RP, HP> * set, const int * keys, int n, bool * done)
+{
+    return set->containsBatch(keys, n, done);
+}
+
+template<class RP, class HP>
+static int insertBatch(hashset_t<RP, HP> * set, const int * keys, int n, bool * done)
+{
+    return set->insertBatch(keys, n, done);
+}
+
+template<class RP, class HP>
+static int removeBatch(hashset_t<RP, HP> * set, const int * keys, int n, bool * done)
+{
+    return set->removeBatch(keys, n, done);
+}
+
+template<class RP, class HP>
+static int containsBatch(hashset_inplace_t<RP, HP> * set, const int * keys, int n, bool * done)
+{
+    return set->containsBatch(keys, n, done);
+}
+
+template<class RP, class HP>
+static int insertBatch(hashset_inplace_t<RP, HP> * set, const int * keys, int n, bool * done)
+{
+    return set->insertBatch(keys, n, done);
+}
+
+template<class RP, class HP>
+static int removeBatch(hashset_inplace_t<RP, HP> * set, const int * keys, int n, bool * done)
+{
+    return set->removeBatch(keys, n, done);
+}
+
+/**
+ *  Range queries.  The sets with a rangeQuery() answer in one call; any
+ *  other set probes each key of the range, which is the baseline that range
+ *  queries are measured against.  Pass 0 as the last argument: it prefers
+ *  the int overload, which only exists when the set has rangeQuery().
+ */
+template<class SET>
+static auto rangeQuery(SET * set, int lo, int hi, std::vector<int> & out, int)
+    -> decltype(set->rangeQuery(lo, hi, out))
+{
+    return set->rangeQuery(lo, hi, out);
+}
+
+template<class SET>
+static int rangeQuery(SET * set, int lo, int hi, std::vector<int> & out, long)
+{
+    out.clear();
+    for (int k = lo; k <= hi; k++)
+        if (set->contains(k))
+            out.push_back(k);
+    return out.size();
+}
+
+/**
+ *  Ordered queries.  The ordered sets answer lowerBound() and predecessor()
+ *  in one call; any other set probes contains() one key at a time, up to
+ *  the largest (down to the smallest) key the benchmark uses.  Pass 0 as
+ *  the last argument, as for rangeQuery().
+ */
+template<class SET>
+static auto lowerBound(SET * set, int key, int & out, int)
+    -> decltype(set->lowerBound(key, out))
+{
+    return set->lowerBound(key, out);
+}
+
+template<class SET>
+static bool lowerBound(SET * set, int key, int & out, long)
+{
+    for (int k = key, last = keyOf(KEY_RANGE - 1); k <= last; k++) {
+        if (set->contains(k)) {
+            out = k;
+            return true;
+        }
+    }
+    return false;
+}
+
+template<class SET>
+static auto predecessor(SET * set, int key, int & out, int)
+    -> decltype(set->predecessor(key, out))
+{
+    return set->predecessor(key, out);
+}
+
+template<class SET>
+static bool predecessor(SET * set, int key, int & out, long)
+{
+    for (int k = key - 1, first = keyOf(0); k >= first; k--) {
+        if (set->contains(k)) {
+            out = k;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*** Check that an ordered_iter_t over the quiet set returns /expect/ */
+template<class SET>
+static auto iterMatches(SET * set, const std::vector<int> & expect, int)
+    -> decltype(set->scan(0, (int *)NULL, 0), bool())
+{
+    ordered_iter_t<SET> it(set);
+    std::vector<int> keys;
+    int key;
+    while (it.next(key))
+        keys.push_back(key);
+    return keys == expect;
+}
+
+template<class SET>
+static bool iterMatches(SET * set, const std::vector<int> & expect, long)
+{
+    return true;
+}
+
+/**
+ *  How many updates escalated to a wait-free path, for the sets that have
+ *  one; -1 for the rest.
+ */
+template<class SET>
+static int64_t escalations(SET * set)
+{
+    return -1;
+}
+
+template<class RP, class HP>
+static int64_t escalations(hashset_adaptive_t<RP, HP> * set)
+{
+    return set->escalations();
+}
+
+/*** Resident set size right now, from /proc; 0 if it cannot be read */
+static uintptr_t currentRssKB()
+{
+    unsigned long pages = 0, rss = 0;
+    FILE * f = fopen("/proc/self/statm", "r");
+    if (f == NULL)
+        return 0;
+    if (fscanf(f, "%lu %lu", &pages, &rss) != 2)
+        rss = 0;
+    fclose(f);
+    return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
 struct bench_ops_thread_arg_t
 {
     uintptr_t tid;
@@ -97,10 +418,100 @@ struct bench_ops_thread_arg_t
     uint64_t  ops;
 };
 
-template<class SET>
+/**
+ *  Enter an operation and then sit in it until the benchmark stops, like a
+ *  worker that was descheduled halfway through.  Reclamation policies that
+ *  wait for every thread to leave its operation cannot free anything
+ *  retired while this thread is parked.
+ */
+template<class RP>
+void stallThread()
+{
+    RP::thread_init();
+    while (!bench_begin);
+    RP::begin();
+    while (!bench_stop)
+        usleep(1000);
+    RP::end();
+    RP::thread_fini();
+}
+
+/**
+ *  The fill/drain workload.  Each thread owns the key indices that are equal
+ *  to its id modulo the thread count, and in each round inserts all of them
+ *  and then removes all of them, so the whole set swings between empty and
+ *  the full key range.  This is the workload that makes a table grow and
+ *  shrink.
+ */
+template<class RP, class SET>
+void phaseOpsThread(bench_ops_thread_arg_t * arg)
+{
+    RP::thread_init();
+
+    uint64_t ops = 0;
+    SET * set = (SET *)arg->set;
+
+    while (!bench_begin);
+
+    while (!bench_stop) {
+        for (uint32_t k = arg->tid - 1; k < KEY_RANGE && !bench_stop; k += NUM_THREADS) {
+            set->insert(keyOf(k));
+            ops++;
+        }
+        for (uint32_t k = arg->tid - 1; k < KEY_RANGE && !bench_stop; k += NUM_THREADS) {
+            set->remove(keyOf(k));
+            ops++;
+        }
+    }
+    arg->ops = ops;
+    RP::thread_fini();
+}
+
+/**
+ *  Sequential keys, as from a monotone ID: inserts take the next key in
+ *  order, removes take the oldest key, and lookups pick a key in between.
+ *  So the set slides up the key space, always growing at its right end.
+ */
+template<class RP, class SET>
+void seqOpsThread(bench_ops_thread_arg_t * arg)
+{
+    RP::thread_init();
+
+    int cRatio = RO_RATIO;
+    int iRatio = cRatio + (100 - cRatio) / 2;
+
+    uint32_t seed1 = arg->tid;
+    uint32_t seed2 = seed1 + 1;
+
+    uint64_t ops = 0;
+    SET * set = (SET *)arg->set;
+
+    while (!bench_begin);
+
+    while (!bench_stop) {
+        int op = rand_r_32(&seed1) % 100;
+        if (op < cRatio) {
+            uint32_t lo = seq_tail, hi = seq_head;
+            set->contains(lo + rand_r_32(&seed2) % (hi - lo + 1));
+        }
+        else if (op < iRatio) {
+            set->insert(seq_head++);
+        }
+        else {
+            uint32_t t = seq_tail;
+            if (t < seq_head && bcas(&seq_tail, &t, t + 1))
+                set->remove(t);
+        }
+        ops++;
+    }
+    arg->ops = ops;
+    RP::thread_fini();
+}
+
+template<class RP, class SET>
 void benchOpsThread(bench_ops_thread_arg_t * arg)
 {
-    wbmm_thread_init(arg->tid);
+    RP::thread_init();
 
     int cRatio = RO_RATIO;
     int iRatio = cRatio + (100 - cRatio) / 2;
@@ -110,14 +521,21 @@ void benchOpsThread(bench_ops_thread_arg_t * arg)
 
     uint64_t ops = 0;
     SET * set = (SET *)arg->set;
+    std::vector<int> range;
+    int next;
 
     while (!bench_begin);
 
     while (!bench_stop) {
         int op  = rand_r_32(&seed1) % 100;
-        int key = rand_r_32(&seed2) % KEY_RANGE;
+        int key = keyOf(rand_r_32(&seed2) % KEY_RANGE);
         if (op < cRatio) {
-            set->contains(key);
+            if (RANGE_SPAN > 0)
+                rangeQuery(set, key, key + RANGE_SPAN - 1, range, 0);
+            else if (NEXT_MODE)
+                lowerBound(set, key, next, 0);
+            else
+                set->contains(key);
         }
         else if (op < iRatio) {
             set->insert(key);
@@ -128,20 +546,78 @@ void benchOpsThread(bench_ops_thread_arg_t * arg)
         ops++;
     }
     arg->ops = ops;
+    RP::thread_fini();
 }
 
-template<class SET>
+/**
+ *  The random mix, BATCH_SIZE keys at a time.  Every key of a batch gets
+ *  the same operation, and each key counts as one op.
+ */
+template<class RP, class SET>
+void batchOpsThread(bench_ops_thread_arg_t * arg)
+{
+    RP::thread_init();
+
+    int cRatio = RO_RATIO;
+    int iRatio = cRatio + (100 - cRatio) / 2;
+
+    uint32_t seed1 = arg->tid;
+    uint32_t seed2 = seed1 + 1;
+
+    uint64_t ops = 0;
+    SET * set = (SET *)arg->set;
+    int  * keys = new int[BATCH_SIZE];
+    bool * done = new bool[BATCH_SIZE];
+
+    while (!bench_begin);
+
+    while (!bench_stop) {
+        int op = rand_r_32(&seed1) % 100;
+        for (uint32_t j = 0; j < BATCH_SIZE; j++)
+            keys[j] = keyOf(rand_r_32(&seed2) % KEY_RANGE);
+        if (op < cRatio) {
+            containsBatch(set, keys, BATCH_SIZE, done);
+        }
+        else if (op < iRatio) {
+            insertBatch(set, keys, BATCH_SIZE, done);
+        }
+        else {
+            removeBatch(set, keys, BATCH_SIZE, done);
+        }
+        ops += BATCH_SIZE;
+    }
+    arg->ops = ops;
+    delete [] keys;
+    delete [] done;
+    RP::thread_fini();
+}
+
+template<class RP, class SET>
 static void runBench()
 {
     SET set;
 
+    // the prefill runs alone, so the memory it adds is the set's own
+    intptr_t fillRss = currentRssKB();
+    auto fillStart = std::chrono::steady_clock::now();
     uint32_t seed = 0;
     for (uint32_t i = 0; i < INIT_SIZE; i++) {
+        if (SEQ_MODE) {
+            set.insert(i);
+            continue;
+        }
         while (true) {
-            int key = rand_r_32(&seed) % KEY_RANGE;
+            int key = keyOf(rand_r_32(&seed) % KEY_RANGE);
             if (set.insert(key)) break;
         }
     }
+    seq_head = INIT_SIZE;
+    seq_tail = 0;
+    auto fillTime = std::chrono::steady_clock::now() - fillStart;
+    fillRss = (intptr_t)currentRssKB() - fillRss;
+
+    // the main thread sits idle while the workers run
+    RP::thread_fini();
 
     bench_begin = false;
     bench_stop = false;
@@ -154,18 +630,37 @@ static void runBench()
         arg.tid = j + 1;
         arg.set = &set;
         arg.ops = 0;
-        thrs[j] = new thread(benchOpsThread<SET>, &arg);
+        thrs[j] = PHASES ? new thread(phaseOpsThread<RP, SET>, &arg)
+            : SEQ_MODE ? new thread(seqOpsThread<RP, SET>, &arg)
+            : BATCH_SIZE > 1 ? new thread(batchOpsThread<RP, SET>, &arg)
+            : new thread(benchOpsThread<RP, SET>, &arg);
     }
+    thread * staller = STALL ? new thread(stallThread<RP>) : NULL;
 
     // broadcast begin signal
     bench_begin = true;
 
-    sleep(DURATION);
+    // sample the number of retired-but-unreclaimed blocks while we wait, and
+    // the resident set, which falls when a shrinking table unmaps its buckets
+    uintptr_t maxUnreclaimed = 0;
+    uintptr_t minRss = UINTPTR_MAX;
+    for (uint32_t t = 0; t < DURATION * 100; t++) {
+        usleep(10000);
+        maxUnreclaimed = std::max(maxUnreclaimed, wbmm_unreclaimed());
+        minRss = std::min(minRss, currentRssKB());
+    }
 
     bench_stop = true;
 
     for (uint32_t j = 0; j < NUM_THREADS; j++)
         thrs[j]->join();
+    if (staller) {
+        staller->join();
+        delete staller;
+    }
+
+    // the main thread takes a slot again now that the workers are done
+    RP::thread_init();
 
     uint64_t totalOps = 0;
     for (uint32_t j = 0; j < NUM_THREADS; j++) {
@@ -175,6 +670,25 @@ static void runBench()
     cout << ("Throughput(ops/ms): ")
          << std::setprecision(6)
          << (double)totalOps / DURATION / 1000 << endl;
+    cout << ("Unreclaimed(max blocks): ") << maxUnreclaimed << endl;
+    int64_t escalated = escalations(&set);
+    if (escalated >= 0)
+        cout << ("Escalated(ops): ") << escalated << endl;
+    cout << ("Prefill(ms): ")
+         << std::chrono::duration_cast<std::chrono::milliseconds>(fillTime).count()
+         << endl;
+    if (INIT_SIZE > 0)
+        cout << ("Prefill(bytes/key): ")
+             << std::max<intptr_t>(fillRss, 0) * 1024 / INIT_SIZE << endl;
+
+    // peak resident set, to compare the 32-bit and 64-bit node layouts
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    cout << ("Footprint(max RSS KB): ") << ru.ru_maxrss << endl;
+    cout << ("Footprint(min RSS KB): ") << minRss << endl;
+
+    // per-site HTM outcomes, summed over all threads (nothing if no HTM ran)
+    htm_stats_print();
 }
 
 struct chk_thread_arg_t
@@ -183,6 +697,7 @@ struct chk_thread_arg_t
     void *     set;
     uint32_t * numInsert;
     uint32_t * numRemove;
+    bool       badQuery;
 };
 
 struct rsz_thread_arg_t
@@ -193,35 +708,117 @@ struct rsz_thread_arg_t
     uint32_t   numShrink;
 };
 
-template<class SET>
+/*** The keys of a range query must be ascending, distinct, and in [lo, hi] */
+static bool rangeWellFormed(const std::vector<int> & keys, int lo, int hi)
+{
+    for (size_t i = 0; i < keys.size(); i++)
+        if (keys[i] < lo || keys[i] > hi || (i > 0 && keys[i] <= keys[i - 1]))
+            return false;
+    return true;
+}
+
+template<class RP, class SET>
 void checkingThread(chk_thread_arg_t * arg)
 {
-    wbmm_thread_init(arg->tid);
+    RP::thread_init();
 
     uint32_t seed = arg->tid;
     SET * set = (SET *)arg->set;
+    std::vector<int> range;
 
     while (!bench_begin);
 
     while (!bench_stop) {
-        int key = rand_r_32(&seed) % KEY_RANGE;
-        if (set->contains(key)) {
-            if (set->remove(key)) {
+        uint32_t key = rand_r_32(&seed) % KEY_RANGE;
+        if (RANGE_SPAN > 0) {
+            int lo = keyOf(key), hi = lo + RANGE_SPAN - 1;
+            rangeQuery(set, lo, hi, range, 0);
+            if (!rangeWellFormed(range, lo, hi))
+                arg->badQuery = true;
+        }
+        if (NEXT_MODE) {
+            int k = keyOf(key), next;
+            if (lowerBound(set, k, next, 0) && next < k)
+                arg->badQuery = true;
+            if (predecessor(set, k, next, 0) && next >= k)
+                arg->badQuery = true;
+        }
+        if (set->contains(keyOf(key))) {
+            if (set->remove(keyOf(key))) {
                 arg->numRemove[key]++;
             }
         }
         else {
-            if (set->insert(key)) {
+            if (set->insert(keyOf(key))) {
                 arg->numInsert[key]++;
             }
         }
     }
+    RP::thread_fini();
 }
 
-template<class SET>
+/**
+ *  checkingThread, BATCH_SIZE keys at a time: look the batch up, then remove
+ *  the keys that were found and insert the ones that were not.  A batch may
+ *  repeat a key, and only one of the repeats may take effect.
+ */
+template<class RP, class SET>
+void batchCheckingThread(chk_thread_arg_t * arg)
+{
+    RP::thread_init();
+
+    uint32_t seed = arg->tid;
+    SET * set = (SET *)arg->set;
+    uint32_t * idx  = new uint32_t[BATCH_SIZE];
+    int      * keys = new int[BATCH_SIZE];
+    bool     * done = new bool[BATCH_SIZE];
+    uint32_t * pidx = new uint32_t[BATCH_SIZE];
+    int      * pkey = new int[BATCH_SIZE];
+    uint32_t * aidx = new uint32_t[BATCH_SIZE];
+    int      * akey = new int[BATCH_SIZE];
+
+    while (!bench_begin);
+
+    while (!bench_stop) {
+        for (uint32_t j = 0; j < BATCH_SIZE; j++) {
+            idx[j] = rand_r_32(&seed) % KEY_RANGE;
+            keys[j] = keyOf(idx[j]);
+        }
+        containsBatch(set, keys, BATCH_SIZE, done);
+        uint32_t np = 0, na = 0;
+        for (uint32_t j = 0; j < BATCH_SIZE; j++) {
+            if (done[j]) {
+                pidx[np] = idx[j];
+                pkey[np++] = keys[j];
+            }
+            else {
+                aidx[na] = idx[j];
+                akey[na++] = keys[j];
+            }
+        }
+        removeBatch(set, pkey, np, done);
+        for (uint32_t j = 0; j < np; j++)
+            if (done[j])
+                arg->numRemove[pidx[j]]++;
+        insertBatch(set, akey, na, done);
+        for (uint32_t j = 0; j < na; j++)
+            if (done[j])
+                arg->numInsert[aidx[j]]++;
+    }
+    delete [] idx;
+    delete [] keys;
+    delete [] done;
+    delete [] pidx;
+    delete [] pkey;
+    delete [] aidx;
+    delete [] akey;
+    RP::thread_fini();
+}
+
+template<class RP, class SET>
 void resizingThread(rsz_thread_arg_t * arg)
 {
-    wbmm_thread_init(arg->tid);
+    RP::thread_init();
 
     uint32_t seed = arg->tid;
     SET * set = (SET *)arg->set;
@@ -240,9 +837,10 @@ void resizingThread(rsz_thread_arg_t * arg)
             }
         }
     }
+    RP::thread_fini();
 }
 
-template<class SET>
+template<class RP, class SET>
 static bool sanityCheck(uint32_t numCheckingThread, uint32_t numResizingThread)
 {
     SET set;
@@ -252,17 +850,26 @@ static bool sanityCheck(uint32_t numCheckingThread, uint32_t numResizingThread)
     std::memset(totalInsert, 0, sizeof(uint64_t) * KEY_RANGE);
     std::memset(totalRemove, 0, sizeof(uint64_t) * KEY_RANGE);
 
+    // with -S, preload the keys in order, so the checks run on the shape
+    // that sorted inserts give
     uint32_t seed = 0;
     for (uint32_t i = 0; i < INIT_SIZE; i++) {
+        if (SEQ_MODE && set.insert(keyOf(i))) {
+            totalInsert[i]++;
+            continue;
+        }
         while (true) {
-            int key = rand_r_32(&seed) % KEY_RANGE;
-            if (set.insert(key)) {
+            uint32_t key = rand_r_32(&seed) % KEY_RANGE;
+            if (set.insert(keyOf(key))) {
                 totalInsert[key]++;
                 break;
             }
         }
     }
 
+    // the main thread sits idle while the workers run
+    RP::thread_fini();
+
     bench_begin = false;
     bench_stop = false;
 
@@ -277,9 +884,12 @@ static bool sanityCheck(uint32_t numCheckingThread, uint32_t numResizingThread)
         arg.set = &set;
         arg.numInsert = new uint32_t[KEY_RANGE];
         arg.numRemove = new uint32_t[KEY_RANGE];
+        arg.badQuery = false;
         std::memset(arg.numInsert, 0, sizeof(uint32_t) * KEY_RANGE);
         std::memset(arg.numRemove, 0, sizeof(uint32_t) * KEY_RANGE);
-        cthrs[j] = new thread(checkingThread<SET>, &arg);
+        cthrs[j] = BATCH_SIZE > 1
+            ? new thread(batchCheckingThread<RP, SET>, &arg)
+            : new thread(checkingThread<RP, SET>, &arg);
     }
     for (uint32_t j = 0; j < numResizingThread; j++) {
         rsz_thread_arg_t & arg = rargs[j];
@@ -287,7 +897,7 @@ static bool sanityCheck(uint32_t numCheckingThread, uint32_t numResizingThread)
         arg.set = &set;
         arg.numGrow = 0;
         arg.numShrink = 0;
-        rthrs[j] = new thread(resizingThread<SET>, &arg);
+        rthrs[j] = new thread(resizingThread<RP, SET>, &arg);
     }
 
     // broadcast begin signal
@@ -304,6 +914,9 @@ static bool sanityCheck(uint32_t numCheckingThread, uint32_t numResizingThread)
     for (uint32_t j = 0; j < numResizingThread; j++)
         rthrs[j]->join();
 
+    // the main thread takes a slot again to check the result
+    RP::thread_init();
+
     // collect per-thread # of ops
     for (uint32_t i = 0; i < numCheckingThread; i++) {
         for (uint32_t key = 0; key < KEY_RANGE; key++) {
@@ -312,6 +925,10 @@ static bool sanityCheck(uint32_t numCheckingThread, uint32_t numResizingThread)
         }
     }
 
+    bool badQuery = false;
+    for (uint32_t i = 0; i < numCheckingThread; i++)
+        badQuery |= cargs[i].badQuery;
+
     // free threads & args
     for (uint32_t j = 0; j < numCheckingThread; j++) {
         chk_thread_arg_t & arg = cargs[j];
@@ -326,7 +943,7 @@ static bool sanityCheck(uint32_t numCheckingThread, uint32_t numResizingThread)
     // check set-membership of each key value matches the number of effective
     // insert and remove operations on that key
     for (uint32_t key = 0; key < KEY_RANGE; key++) {
-        if (set.contains(key)) {
+        if (set.contains(keyOf(key))) {
             if (totalInsert[key] != totalRemove[key] + 1) {
                 cout << "Key exist.." << endl;
                 cout << totalInsert[key] << endl;
@@ -345,63 +962,166 @@ static bool sanityCheck(uint32_t numCheckingThread, uint32_t numResizingThread)
             }
         }
     }
+
+    // range queries must have been well formed, and now that the set is
+    // quiet, one over all keys must find exactly the keys contains() finds
+    if (RANGE_SPAN > 0) {
+        std::vector<int> range, expect;
+        for (uint32_t key = 0; key < KEY_RANGE; key++)
+            if (set.contains(keyOf(key)))
+                expect.push_back(keyOf(key));
+        rangeQuery(&set, keyOf(0), keyOf(KEY_RANGE - 1), range, 0);
+        if (badQuery || range != expect) {
+            cout << "Range query mismatch.." << endl;
+            cout << "Sanity check: failed." << endl;
+            return false;
+        }
+    }
+
+    // likewise, on the quiet set, successors and predecessors must chain
+    // through exactly the keys contains() finds, as must an iterator
+    if (NEXT_MODE) {
+        std::vector<int> up, down, expect;
+        for (uint32_t key = 0; key < KEY_RANGE; key++)
+            if (set.contains(keyOf(key)))
+                expect.push_back(keyOf(key));
+        int k;
+        for (bool ok = lowerBound(&set, keyOf(0), k, 0); ok;
+             ok = k < keyOf(KEY_RANGE - 1) && lowerBound(&set, k + 1, k, 0))
+            up.push_back(k);
+        for (bool ok = predecessor(&set, keyOf(KEY_RANGE - 1) + 1, k, 0); ok;
+             ok = k > keyOf(0) && predecessor(&set, k, k, 0))
+            down.insert(down.begin(), k);
+        if (badQuery || up != expect || down != expect || !iterMatches(&set, expect, 0)) {
+            cout << "Ordered query mismatch.." << endl;
+            cout << "Sanity check: failed." << endl;
+            return false;
+        }
+    }
     cout << "Sanity check: okay." << endl;
     return true;
 }
 
-template<typename SET>
+template<class RP, class SET>
 void run()
 {
     if (SANITY_MODE) {
-        sanityCheck<SET>(1, NUM_THREADS);
-        sanityCheck<SET>(NUM_THREADS, 1);
+        sanityCheck<RP, SET>(1, NUM_THREADS);
+        sanityCheck<RP, SET>(NUM_THREADS, 1);
     }
     else
-        runBench<SET>();
+        runBench<RP, SET>();
 }
 
-int main(int argc, char** argv)
+/** Instantiate the hash sets with hash policy HP */
+template<class RP, class HP>
+void dispatchHash()
 {
-    if (!parseArgs(argc, argv)) {
-        return 0;
-    }
+    if (ALG_NAME == "Hash")
+        run<RP, hashset_t<RP, HP> >();
+    else if (ALG_NAME == "HashHTM")
+        run<RP, hashset_htm_t<RP, HP> >();
+    else if (ALG_NAME == "HashSO")
+        run<RP, hashset_so_t<RP, HP> >();
+    else if (ALG_NAME == "HashSOHTM")
+        run<RP, hashset_so_t<RP, HP, true> >();
+    else if (ALG_NAME == "HashInplace")
+        run<RP, hashset_inplace_t<RP, HP> >();
+    else if (ALG_NAME == "HashInline")
+        run<RP, hashset_inline_t<RP, HP> >();
+    else if (ALG_NAME == "HashCPTR")
+        run<RP, hashset_cptr_t<RP, HP> >();
+    else if (ALG_NAME == "HashWF")
+        run<RP, hashset_wf_t<RP, HP> >();
+    else if (ALG_NAME == "HashWFHTM")
+        run<RP, hashset_wf_t<RP, HP, true> >();
+    else if (ALG_NAME == "HashAdaptive")
+        run<RP, hashset_adaptive_t<RP, HP> >();
+    else if (ALG_NAME == "HashMap")
+        run<RP, map_set_t<hashmap_t<uint64_t, uint64_t, RP, HP> > >();
+    else
+        cout << "Algorithm not found." << endl;
+}
 
-    wbmm_init(NUM_THREADS + 2);
-    wbmm_thread_init(0);
+template<class RP>
+void dispatch()
+{
+    RP::init(BG_RECLAIM);
+    RP::thread_init();
 
     if (ALG_NAME == "Tree")
-        run<bstset_t>();
+        run<RP, bstset_t<RP> >();
     else if (ALG_NAME == "TreeHTM1")
-        run<bstset_htm1_t>();
+        run<RP, bstset_htm1_t<RP> >();
     else if (ALG_NAME == "TreeHTM1FF")
-        run<bstset_htm1ff_t>();
+        run<RP, bstset_htm1ff_t<RP> >();
     else if (ALG_NAME == "TreeHTM2")
-        run<bstset_htm2_t>();
+        run<RP, bstset_htm2_t<RP> >();
     else if (ALG_NAME == "TreeHTM2FF")
-        run<bstset_htm2ff_t>();
+        run<RP, bstset_htm2ff_t<RP> >();
     else if (ALG_NAME == "TreeHTM3")
-        run<bstset_htm3_t>();
+        run<RP, bstset_htm3_t<RP> >();
     else if (ALG_NAME == "TreeHTM3FF")
-        run<bstset_htm3ff_t>();
+        run<RP, bstset_htm3ff_t<RP> >();
     else if (ALG_NAME == "TreeCPTR")
-        run<bstset_cptr_t>();
-    else if (ALG_NAME == "Hash")
-        run<hashset_t>();
-    else if (ALG_NAME == "HashHTM")
-        run<hashset_htm_t>();
-    else if (ALG_NAME == "HashInplace")
-        run<hashset_inplace_t>();
-    else if (ALG_NAME == "HashCPTR")
-        run<hashset_cptr_t>();
+        run<RP, bstset_cptr_t<RP> >();
+    else if (ALG_NAME == "TreeSG")
+        run<RP, bstset_sg_t<RP> >();
+    else if (ALG_NAME == "TreeSGHTM")
+        run<RP, bstset_sg_t<RP, true> >();
+    else if (ALG_NAME == "TreeMap")
+        run<RP, map_set_t<bstmap_t<uint64_t, uint64_t, RP> > >();
+    else if (ALG_NAME == "TreeMapHTM")
+        run<RP, map_set_t<bstmap_t<uint64_t, uint64_t, RP, std::less<uint64_t>, true> > >();
+    else if (ALG_NAME.compare(0, 4, "Hash") == 0) {
+        if (HASH_FN == "identity")
+            dispatchHash<RP, identity_hash_t>();
+        else if (HASH_FN == "fib")
+            dispatchHash<RP, fib_hash_t>();
+        else if (HASH_FN == "murmur")
+            dispatchHash<RP, murmur_hash_t>();
+        else
+            cout << "Hash function not found." << endl;
+    }
     else if (ALG_NAME == "Skip")
-        run<slset_t>();
+        run<RP, slset_t<RP> >();
     else if (ALG_NAME == "SkipHTM")
-        run<slset_htm_t>();
+        run<RP, slset_htm_t<RP> >();
     else if (ALG_NAME == "SkipHTMFF")
-        run<slset_htmff_t>();
+        run<RP, slset_htmff_t<RP> >();
+    else if (ALG_NAME == "SkipMap")
+        run<RP, map_set_t<slmap_t<uint64_t, uint64_t, RP> > >();
+    else if (ALG_NAME == "SkipMapHTM")
+        run<RP, map_set_t<slmap_t<uint64_t, uint64_t, RP, std::less<uint64_t>, true> > >();
     else {
         cout << "Algorithm not found." << endl;
     }
 
+    RP::thread_fini();
+    RP::shutdown();
+}
+
+int main(int argc, char** argv)
+{
+    if (!parseArgs(argc, argv)) {
+        return 0;
+    }
+
+    if (RECLAIMER == "wbmm")
+        dispatch<wbmm_policy_t>();
+    else if (RECLAIMER == "ebr")
+        dispatch<ebr_policy_t>();
+    else if (RECLAIMER == "ibr") {
+        // only the hash routes its loads through RP::read
+        if (ALG_NAME == "Hash")
+            dispatch<ibr_policy_t>();
+        else
+            cout << "ibr supports only Hash." << endl;
+    }
+    else if (RECLAIMER == "leak")
+        dispatch<leak_policy_t>();
+    else
+        cout << "Reclamation policy not found." << endl;
+
     return 0;
 }
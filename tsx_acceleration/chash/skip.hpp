@@ -42,13 +42,14 @@
 #include <atomic>
 
 #include "common.hpp"
-#include "mm.hpp"
+#include "reclaim.hpp"
 
 using std::atomic;
 using std::stringstream;
 using std::string;
 using std::endl;
 
+template<class RP = wbmm_policy_t>
 class slset_t
 {
   private:
@@ -84,7 +85,7 @@ class slset_t
 
     static slnode_t * alloc_node(uint32_t val, slnode_t *next, uint32_t toplevel)
     {
-        slnode_t *node = (slnode_t*)wbmm_alloc(sizeof(slnode_t));
+        slnode_t *node = (slnode_t*)RP::alloc(sizeof(slnode_t));
         node->key = val;
         node->toplevel = toplevel;
         node->mark = 0;
@@ -95,12 +96,12 @@ class slset_t
 
     static void free_node_safe(slnode_t * ptr)
     {
-        wbmm_free_safe(ptr);
+        RP::free_safe(ptr);
     }
 
     static void free_node_unsafe(slnode_t * ptr)
     {
-        wbmm_free_unsafe(ptr);
+        RP::free_unsafe(ptr);
     }
 
   public:
@@ -113,7 +114,7 @@ class slset_t
 
     bool insert(int key)
     {
-        wbmm_begin();
+        RP::begin();
 
         slnode_t
             * NEW = NULL, * new_next,
@@ -170,13 +171,13 @@ class slset_t
             do_full_delete(NEW, NEW->toplevel);
 
       exit:
-        wbmm_end();
+        RP::end();
         return result;
     }
 
     bool remove(int key)
     {
-        wbmm_begin();
+        RP::begin();
 
         bool result = false;
         slnode_t * succ = search_weak(key, NULL, NULL);
@@ -191,19 +192,78 @@ class slset_t
             }
         }
 
-        wbmm_end();
+        RP::end();
         return result;
     }
 
 
     bool contains(int key)
     {
-        wbmm_begin();
+        RP::begin();
         bool result = search_weak(key, NULL, NULL)->key == key;
-        wbmm_end();
+        RP::end();
         return result;
     }
 
+    /**
+     *  Find the least key >= /key/; false if there is none.  Linearizable,
+     *  for the same reason contains() is: search_weak() ends at the first
+     *  node of level 0 it found unmarked.
+     */
+    bool lowerBound(int key, int & out)
+    {
+        RP::begin();
+        slnode_t * n = search_weak(key, NULL, NULL);
+        bool result = n != tail;
+        if (result)
+            out = n->key;
+        RP::end();
+        return result;
+    }
+
+    /** Find the least key > /key/; false if there is none.  Linearizable. */
+    bool successor(int key, int & out)
+    {
+        return key != VAL_MAX && lowerBound(key + 1, out);
+    }
+
+    /** Find the greatest key < /key/; false if there is none.  Linearizable. */
+    bool predecessor(int key, int & out)
+    {
+        RP::begin();
+        slnode_t * preds[LEVEL_MAX], * succs[LEVEL_MAX];
+        slnode_t * right = search_weak(key, preds, succs);
+        /* preds[0] is the answer once it links straight to right, which
+         * also shows that it is unmarked; search() snips what lies between */
+        while (preds[0]->nexts[0] != right)
+            right = search(key, preds, succs);
+        bool result = preds[0] != head;
+        if (result)
+            out = preds[0]->key;
+        RP::end();
+        return result;
+    }
+
+    /**
+     *  Copy up to /max/ keys >= /key/ into /buf/, in ascending order, and
+     *  return how many.  A walk of level 0 that skips marked nodes, so it is
+     *  weakly consistent.  ordered_iter_t is built on this.
+     */
+    int scan(int key, int * buf, int max)
+    {
+        RP::begin();
+        int n = 0;
+        slnode_t * curr = search_weak(key, NULL, NULL);
+        while (curr != tail && n < max) {
+            buf[n++] = curr->key;
+            curr = (slnode_t *)REF_UNMARKED(curr->nexts[0].load());
+            while (IS_MARKED(curr->nexts[0].load()))
+                curr = (slnode_t *)REF_UNMARKED(curr->nexts[0].load());
+        }
+        RP::end();
+        return n;
+    }
+
     bool grow() { return false; }
     bool shrink() { return false; }
 
@@ -300,5 +360,6 @@ class slset_t
     }
 };
 
-thread_local uint32_t slset_t::seed = 0;
+template<class RP>
+thread_local uint32_t slset_t<RP>::seed = 0;
 
@@ -43,13 +43,14 @@
 #include <x86intrin.h>
 
 #include "common.hpp"
-#include "mm.hpp"
+#include "reclaim.hpp"
 
 using std::atomic;
 using std::stringstream;
 using std::string;
 using std::endl;
 
+template<class RP = wbmm_policy_t>
 class slset_htm_t
 {
   private:
@@ -58,8 +59,6 @@ class slset_htm_t
     const static int32_t VAL_MAX = std::numeric_limits<int32_t>::max();
     const static int32_t LEVEL_MAX = 20;
 
-    static const int MAX_ATTEMPT_NUM = 4;
-
     struct slnode_t
     {
         int32_t key;
@@ -88,7 +87,7 @@ class slset_htm_t
 
     static slnode_t * alloc_node(uint32_t val, slnode_t *next, uint32_t toplevel)
     {
-        slnode_t *node = (slnode_t*)wbmm_alloc(sizeof(slnode_t));
+        slnode_t *node = (slnode_t*)RP::alloc(sizeof(slnode_t));
         node->key = val;
         node->toplevel = toplevel;
         node->mark = 0;
@@ -99,12 +98,12 @@ class slset_htm_t
 
     static void free_node_safe(slnode_t * ptr)
     {
-        wbmm_free_safe(ptr);
+        RP::free_safe(ptr);
     }
 
     static void free_node_unsafe(slnode_t * ptr)
     {
-        wbmm_free_unsafe(ptr);
+        RP::free_unsafe(ptr);
     }
 
   public:
@@ -117,7 +116,8 @@ class slset_htm_t
 
     bool insert(int key)
     {
-        wbmm_begin();
+        HTM_SITE(site, "slset_htm_t::insert");
+        RP::begin();
 
         slnode_t
             * NEW = NULL, * new_next,
@@ -148,11 +148,9 @@ class slset_htm_t
         result = true;
 
         uint32_t status;
-        uint32_t attempts;
-        attempts = 0;
-      htm_retry:
-        status = _xbegin();
-        if (status == _XBEGIN_STARTED) {
+      retry_htm:
+        status = htm_begin(site, 42);
+        if (status == HTM_STARTED) {
             for (int i = 1; i < NEW->toplevel; i++) {
                 pred = preds[i];
                 succ = succs[i];
@@ -162,20 +160,21 @@ class slset_htm_t
                 if (new_next != succ)
                     NEW->nexts[i] = succ;
                 if (pred->nexts[i] != succ)
-                    _xabort(42);
+                    htm_abort(42);
                 pred->nexts[i] = NEW;
             }
           commit:
-            _xend();
+            htm_end(site);
             goto success;
         }
         else {
-            if ((status & _XABORT_EXPLICIT) && _XABORT_CODE(status) == 42) {
+            if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
                 // try slow path
             }
-            else if (++attempts < MAX_ATTEMPT_NUM) {
-                goto htm_retry;
+            else if (htm_retry(site, status)) {
+                goto retry_htm;
             }
+            htm_fallback(site);
         }
 
         for (int i = 1; i < NEW->toplevel; i++) {
@@ -205,13 +204,13 @@ class slset_htm_t
             do_full_delete(NEW, NEW->toplevel);
 
       exit:
-        wbmm_end();
+        RP::end();
         return result;
     }
 
     bool remove(int key)
     {
-        wbmm_begin();
+        RP::begin();
 
         bool result = false;
         slnode_t * succ = search_weak(key, NULL, NULL);
@@ -226,16 +225,16 @@ class slset_htm_t
             }
         }
 
-        wbmm_end();
+        RP::end();
         return result;
     }
 
 
     bool contains(int key)
     {
-        wbmm_begin();
+        RP::begin();
         bool result = search_weak(key, NULL, NULL)->key == key;
-        wbmm_end();
+        RP::end();
         return result;
     }
 
@@ -316,15 +315,14 @@ class slset_htm_t
 
     static bool mark_node_ptrs(slnode_t * n)
     {
+        HTM_SITE(site, "slset_htm_t::mark_node_ptrs");
         slnode_t * n_next;
         bool result;
 
         uint32_t status;
-        uint32_t attempts;
-        attempts = 0;
-      htm_retry:
-        status = _xbegin();
-        if (status == _XBEGIN_STARTED) {
+      retry_htm:
+        status = htm_begin(site, 42);
+        if (status == HTM_STARTED) {
             for (int i = n->toplevel-1; i >= 0; i--) {
                 n_next = n->nexts[i];
                 if (IS_MARKED(n_next))
@@ -334,16 +332,17 @@ class slset_htm_t
                     result = true;
                 }
             }
-            _xend();
+            htm_end(site);
             return result;
         }
         else {
-            if ((status & _XABORT_EXPLICIT) && _XABORT_CODE(status) == 42) {
+            if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
                 // try slow path
             }
-            else if (++attempts < MAX_ATTEMPT_NUM) {
-                goto htm_retry;
+            else if (htm_retry(site, status)) {
+                goto retry_htm;
             }
+            htm_fallback(site);
         }
 
         for (int i = n->toplevel-1; i >= 0; i--) {
@@ -363,4 +362,5 @@ class slset_htm_t
     }
 };
 
-thread_local uint32_t slset_htm_t::seed = 0;
+template<class RP>
+thread_local uint32_t slset_htm_t<RP>::seed = 0;
@@ -0,0 +1,500 @@
+/******************************************************************************
+ * skip_cas.c
+ *
+ * Skip lists, allowing concurrent update by use of CAS primitives.
+ *
+ * Copyright (c) 2001-2003, K A Fraser
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * The name of the author may not be used to endorse or promote products
+ * derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <cstdint>
+#include <atomic>
+#include <functional>
+#include <type_traits>
+#include <x86intrin.h>
+
+#include "common.hpp"
+#include "reclaim.hpp"
+
+using std::atomic;
+using std::stringstream;
+using std::string;
+using std::endl;
+
+/**
+ *  An ordered map from K to V, in the order of CMP.  It is the skip list of
+ *  slset_t with a value in every node, and with FAST it takes the
+ *  transactions of slset_htm_t, which link a new node's upper levels, and
+ *  mark a node's pointers, in one go.
+ *
+ *  head and tail are told apart by address rather than by key, so all of K
+ *  is usable: the search stops at tail, and never looks at head's key.
+ *
+ *  A node points to its value, and the first value lives in the node
+ *  itself.  put() and replace() of a present key swap that pointer for a
+ *  new value with one CAS.  The pointer's low bit means the key is gone:
+ *  remove() sets it, and that is the point where it takes effect.  Marking
+ *  the node's next pointers, and unlinking it, follow as before, and any
+ *  thread that finds the bit set helps, so an insert of the same key never
+ *  waits on a remove.
+ *
+ *  K and V must be trivially copyable.
+ */
+template<class K, class V, class RP = wbmm_policy_t, class CMP = std::less<K>, bool FAST = false>
+class slmap_t
+{
+    static_assert(std::is_trivially_copyable<K>::value, "keys are copied into nodes");
+    static_assert(std::is_trivially_copyable<V>::value, "values are copied into nodes");
+
+  private:
+
+    const static int32_t LEVEL_MAX = 20;
+
+    struct slnode_t
+    {
+        K                  key;
+        int32_t            toplevel;
+        atomic<uint32_t>   mark;
+        atomic<V *>        val;
+        V                  first;
+        atomic<slnode_t *> nexts[LEVEL_MAX];
+    };
+
+    slnode_t * head;
+    slnode_t * tail;
+
+    CMP cmp;
+
+    static thread_local uint32_t seed;
+
+  private:
+
+    /* 1 <= level <= LEVELMAX */
+    static int get_rand_level()
+    {
+        int r = rand_r_32(&seed);
+        int l = 1;
+        r = (r >> 4) & ((1 << (LEVEL_MAX-1)) - 1);
+        while ( (r & 1) ) { l++; r >>= 1; }
+        return (l);
+    }
+
+    static slnode_t * alloc_node(const K & key, const V & val, slnode_t *next, uint32_t toplevel)
+    {
+        slnode_t *node = (slnode_t*)RP::alloc(sizeof(slnode_t));
+        node->key = key;
+        node->toplevel = toplevel;
+        node->mark = 0;
+        node->first = val;
+        node->val = &node->first;
+        for (int i = 0; i < LEVEL_MAX; i++)
+            node->nexts[i] = next;
+        return node;
+    }
+
+    static V * alloc_val(const V & val)
+    {
+        V * v = (V *)RP::alloc(sizeof(V));
+        *v = val;
+        return v;
+    }
+
+    static inline V * VAL_OF(V * w)
+    {
+        return (V *)REF_UNMARKED(w);
+    }
+
+    /** Retire /v/, a value of /n/, unless it lives in n */
+    static void free_val_safe(slnode_t * n, V * v)
+    {
+        if (v != &n->first)
+            RP::free_safe(v);
+    }
+
+    static void free_node_safe(slnode_t * ptr)
+    {
+        free_val_safe(ptr, VAL_OF(ptr->val));
+        RP::free_safe(ptr);
+    }
+
+    static void free_node_unsafe(slnode_t * ptr)
+    {
+        RP::free_unsafe(ptr);
+    }
+
+    /** Is /n/ at or past /key/?  tail is past every key */
+    bool atOrPast(slnode_t * n, const K & key) const
+    {
+        return n == tail || !cmp(n->key, key);
+    }
+
+    /** Is /n/, which is at or past /key/, the node of key? */
+    bool matches(slnode_t * n, const K & key) const
+    {
+        return n != tail && !cmp(key, n->key);
+    }
+
+  public:
+
+    slmap_t()
+    {
+        tail = alloc_node(K(), V(), NULL, LEVEL_MAX);
+        head = alloc_node(K(), V(), tail, LEVEL_MAX);
+    }
+
+    /** Copy the value of /key/ into /val/, if the key is present */
+    bool get(K key, V & val)
+    {
+        RP::begin();
+        slnode_t * n = search_weak(key, NULL, NULL);
+        bool result = false;
+        if (matches(n, key)) {
+            V * w = n->val;
+            result = !IS_MARKED(w);
+            if (result)
+                val = *w;
+        }
+        RP::end();
+        return result;
+    }
+
+    bool contains(K key)
+    {
+        V v;
+        return get(key, v);
+    }
+
+    /** Map /key/ to /val/.  Returns true if the key was not present */
+    bool put(K key, V val)
+    {
+        return !update(key, val, true, true);
+    }
+
+    /** Map /key/ to /val/ unless it is present.  Returns true if it was not */
+    bool putIfAbsent(K key, V val)
+    {
+        return !update(key, val, true, false);
+    }
+
+    /** Give /key/ the value /val/ only if it is present */
+    bool replace(K key, V val)
+    {
+        return update(key, val, false, true);
+    }
+
+    bool remove(K key)
+    {
+        RP::begin();
+
+        bool result = false;
+        slnode_t * succ = search_weak(key, NULL, NULL);
+
+        if (matches(succ, key)) {
+            V * w = succ->val;
+            while (!IS_MARKED(w)) {
+                if (bcas(&succ->val, &w, (V *)REF_MARKED(w))) {
+                    result = true;
+                    unlink(succ);
+                    break;
+                }
+            }
+        }
+
+        RP::end();
+        return result;
+    }
+
+    bool grow() { return false; }
+    bool shrink() { return false; }
+
+  private:
+
+    /**
+     *  Give /key/ the value /val/ if it is absent and /ifAbsent/, or if it
+     *  is present and /ifPresent/.  Returns true if the key was present.
+     */
+    bool update(const K & key, const V & val, bool ifAbsent, bool ifPresent)
+    {
+        RP::begin();
+
+        slnode_t
+            * NEW = NULL, * new_next,
+            * pred, * succ,
+            * succs[LEVEL_MAX], * preds[LEVEL_MAX];
+        V * newVal = NULL;
+        bool found;
+
+        succ = search_weak(key, preds, succs);
+      retry:
+        if (matches(succ, key)) {
+            V * w = succ->val;
+            if (!IS_MARKED(w)) {
+                found = true;
+                if (!ifPresent)
+                    goto exit;
+                if (!newVal)
+                    newVal = alloc_val(val);
+                while (!IS_MARKED(w)) {
+                    if (bcas(&succ->val, &w, newVal)) {
+                        free_val_safe(succ, w);
+                        newVal = NULL;
+                        goto exit;
+                    }
+                }
+            }
+            // the key is gone, but its node is in the way
+            unlink(succ);
+            succ = search(key, preds, succs);
+            goto retry;
+        }
+
+        found = false;
+        if (!ifAbsent)
+            goto exit;
+
+        if (!NEW)
+            NEW = alloc_node(key, val, NULL, get_rand_level());
+
+        for (int i = 0; i < NEW->toplevel; i++)
+            NEW->nexts[i] = succs[i];
+
+        /* Node is visible once inserted at lowest level */
+        if (!bcas(&preds[0]->nexts[0], &succ, NEW)) {
+            succ = search(key, preds, succs);
+            goto retry;
+        }
+
+        if (FAST && txLinkUpper(NEW, preds, succs))
+            goto success;
+
+        for (int i = 1; i < NEW->toplevel; i++) {
+            while (true) {
+                pred = preds[i];
+                succ = succs[i];
+
+                new_next = NEW->nexts[i];
+                if (IS_MARKED(new_next)) goto success;
+
+                /* Update the forward pointer if it is stale */
+                if (new_next != succ) {
+                    if (!bcas(&NEW->nexts[i], &new_next, succ))
+                        goto success;
+                }
+
+                /* We retry the search if the CAS fails */
+                if (bcas(&pred->nexts[i], &succ, NEW))
+                    break;
+
+                search(key, preds, succs);
+            }
+        }
+
+      success:
+        if (check_for_full_delete(NEW))
+            do_full_delete(NEW, NEW->toplevel);
+        NEW = NULL;
+
+      exit:
+        if (NEW) free_node_unsafe(NEW);
+        if (newVal) RP::free_unsafe(newVal);
+        RP::end();
+        return found;
+    }
+
+    /** Take out /n/, whose value is marked; any thread may do it */
+    void unlink(slnode_t * n)
+    {
+        if (mark_node_ptrs(n) && check_for_full_delete(n))
+            do_full_delete(n, n->toplevel);
+    }
+
+    /** Link levels 1 and up of /NEW/ in one transaction; false if that fails */
+    bool txLinkUpper(slnode_t * NEW, slnode_t ** preds, slnode_t ** succs)
+    {
+        HTM_SITE(site, "slmap_t::insert");
+        slnode_t * pred, * succ, * new_next;
+        uint32_t status;
+      retry_htm:
+        status = htm_begin(site, 42);
+        if (status == HTM_STARTED) {
+            for (int i = 1; i < NEW->toplevel; i++) {
+                pred = preds[i];
+                succ = succs[i];
+                new_next = NEW->nexts[i];
+                if (IS_MARKED(new_next))
+                    goto commit;
+                if (new_next != succ)
+                    NEW->nexts[i] = succ;
+                if (pred->nexts[i] != succ)
+                    htm_abort(42);
+                pred->nexts[i] = NEW;
+            }
+          commit:
+            htm_end(site);
+            return true;
+        }
+        else {
+            if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
+                // try slow path
+            }
+            else if (htm_retry(site, status)) {
+                goto retry_htm;
+            }
+            htm_fallback(site);
+        }
+        return false;
+    }
+
+    static bool check_for_full_delete(slnode_t * x)
+    {
+        uint32_t mark = x->mark;
+        return (mark == 1 || !bcas(&x->mark, &mark, (uint32_t)1));
+    }
+
+    void do_full_delete(slnode_t * x, int level)
+    {
+        search(x->key, NULL, NULL);
+        free_node_safe(x);
+    }
+
+    slnode_t * search_weak(const K & key, slnode_t **left_list, slnode_t **right_list)
+    {
+        slnode_t *left, *left_next, *right, *right_next;
+        left = head;
+        for (int i = LEVEL_MAX - 1; i >= 0; i--) {
+            left_next = (slnode_t *)REF_UNMARKED(left->nexts[i].load());
+            /* Find unmarked node pair at this level */
+            for (right = left_next; ; right = right_next) {
+                /* Skip a sequence of marked nodes */
+                right_next = right->nexts[i];
+                while (IS_MARKED(right_next)) {
+                    right = (slnode_t *)REF_UNMARKED(right_next);
+                    right_next = right->nexts[i];
+                }
+                if (atOrPast(right, key)) break;
+                left = right;
+                left_next = right_next;
+            }
+            if (left_list != NULL) left_list[i] = left;
+            if (right_list != NULL) right_list[i] = right;
+        }
+        return right;
+    }
+
+    slnode_t * search(const K & key, slnode_t **left_list, slnode_t **right_list)
+    {
+        slnode_t *left, *left_next, *right, *right_next;
+      retry:
+        left = head;
+        for (int i = LEVEL_MAX - 1; i >= 0; i--) {
+            left_next = left->nexts[i];
+            if (IS_MARKED(left_next))
+                goto retry;
+            /* Find unmarked node pair at this level */
+            for (right = left_next; ; right = right_next) {
+                /* Skip a sequence of marked nodes */
+                right_next = right->nexts[i];
+                while (IS_MARKED(right_next)) {
+                    right = (slnode_t *)REF_UNMARKED(right_next);
+                    right_next = right->nexts[i];
+                }
+                if (atOrPast(right, key))
+                    break;
+                left = right;
+                left_next = right_next;
+            }
+
+            /* Ensure left and right nodes are adjacent */
+            if (left_next != right)
+                if (!bcas(&left->nexts[i], &left_next, right))
+                    goto retry;
+            if (left_list != NULL) left_list[i] = left;
+            if (right_list != NULL) right_list[i] = right;
+        }
+        return right;
+    }
+
+    static bool mark_node_ptrs(slnode_t * n)
+    {
+        slnode_t * n_next;
+        bool result;
+
+        if (FAST) {
+            HTM_SITE(site, "slmap_t::mark_node_ptrs");
+            uint32_t status;
+          retry_htm:
+            status = htm_begin(site, 42);
+            if (status == HTM_STARTED) {
+                for (int i = n->toplevel-1; i >= 0; i--) {
+                    n_next = n->nexts[i];
+                    if (IS_MARKED(n_next))
+                        result = false;
+                    else {
+                        n->nexts[i] = (slnode_t *)REF_MARKED(n_next);
+                        result = true;
+                    }
+                }
+                htm_end(site);
+                return result;
+            }
+            else {
+                if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
+                    // try slow path
+                }
+                else if (htm_retry(site, status)) {
+                    goto retry_htm;
+                }
+                htm_fallback(site);
+            }
+        }
+
+        for (int i = n->toplevel-1; i >= 0; i--) {
+            do {
+                n_next = n->nexts[i];
+                if (IS_MARKED(n_next)) {
+                    result = false;
+                    break;
+                }
+                if (bcas(&n->nexts[i], &n_next, (slnode_t *)REF_MARKED(n_next))) {
+                    result = true;
+                    break;
+                }
+            } while (true);
+        }
+        return result;
+    }
+};
+
+template<class K, class V, class RP, class CMP, bool FAST>
+thread_local uint32_t slmap_t<K, V, RP, CMP, FAST>::seed = 0;
@@ -42,13 +42,14 @@
 #include <atomic>
 
 #include "common.hpp"
-#include "mm.hpp"
+#include "reclaim.hpp"
 
 using std::atomic;
 using std::stringstream;
 using std::string;
 using std::endl;
 
+template<class RP = wbmm_policy_t>
 class slpq_t
 {
   private:
@@ -91,9 +92,9 @@ class slpq_t
 
     static slnode_t * alloc_node(uint32_t val, slnode_t *next, uint32_t toplevel)
     {
-        slnode_t *node = (slnode_t*)wbmm_alloc(sizeof(slnode_t));
+        slnode_t *node = (slnode_t*)RP::alloc(sizeof(slnode_t));
         node->key = val;
-        node->ext = (((uint64_t)wbmm_get_tid()) << 32) & (uint64_t)wbmm_get_epoch();
+        node->ext = (((uint64_t)RP::get_tid()) << 32) & (uint64_t)RP::get_epoch();
         node->toplevel = toplevel;
         node->mark = 0;
         for (int i = 0; i < LEVEL_MAX; i++)
@@ -103,12 +104,12 @@ class slpq_t
 
     static void free_node_safe(slnode_t * ptr)
     {
-        wbmm_free_safe(ptr);
+        RP::free_safe(ptr);
     }
 
     static void free_node_unsafe(slnode_t * ptr)
     {
-        wbmm_free_unsafe(ptr);
+        RP::free_unsafe(ptr);
     }
 
   public:
@@ -121,7 +122,7 @@ class slpq_t
 
     void add(int32_t key)
     {
-        wbmm_begin();
+        RP::begin();
 
         slnode_t
             * NEW = NULL, * new_next,
@@ -168,12 +169,12 @@ class slpq_t
             do_full_delete(NEW);
 
       exit:
-        wbmm_end();
+        RP::end();
     }
 
     int32_t remove()
     {
-        wbmm_begin();
+        RP::begin();
 
         slnode_t * x = mark_first_strict();
 
@@ -187,7 +188,7 @@ class slpq_t
             do_full_delete(x);
         }
 
-        wbmm_end();
+        RP::end();
         return result;
     }
 
@@ -296,4 +297,5 @@ class slpq_t
     }
 };
 
-thread_local uint32_t slpq_t::seed = 0;
+template<class RP>
+thread_local uint32_t slpq_t<RP>::seed = 0;
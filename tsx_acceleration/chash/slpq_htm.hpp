@@ -43,13 +43,14 @@
 #include <x86intrin.h>
 
 #include "common.hpp"
-#include "mm.hpp"
+#include "reclaim.hpp"
 
 using std::atomic;
 using std::stringstream;
 using std::string;
 using std::endl;
 
+template<class RP = wbmm_policy_t>
 class slpq_htm_t
 {
   private:
@@ -60,8 +61,6 @@ class slpq_htm_t
 
     static thread_local uint32_t seed;
 
-    static const int MAX_ATTEMPT_NUM = 4;
-
     struct slnode_t
     {
         int32_t  key;
@@ -94,9 +93,9 @@ class slpq_htm_t
 
     static slnode_t * alloc_node(uint32_t val, slnode_t *next, uint32_t toplevel)
     {
-        slnode_t *node = (slnode_t*)wbmm_alloc(sizeof(slnode_t));
+        slnode_t *node = (slnode_t*)RP::alloc(sizeof(slnode_t));
         node->key = val;
-        node->ext = (((uint64_t)wbmm_get_tid()) << 32) & (uint64_t)wbmm_get_epoch();
+        node->ext = (((uint64_t)RP::get_tid()) << 32) & (uint64_t)RP::get_epoch();
         node->toplevel = toplevel;
         node->mark = 0;
         for (int i = 0; i < LEVEL_MAX; i++)
@@ -106,12 +105,12 @@ class slpq_htm_t
 
     static void free_node_safe(slnode_t * ptr)
     {
-        wbmm_free_safe(ptr);
+        RP::free_safe(ptr);
     }
 
     static void free_node_unsafe(slnode_t * ptr)
     {
-        wbmm_free_unsafe(ptr);
+        RP::free_unsafe(ptr);
     }
 
   public:
@@ -124,7 +123,8 @@ class slpq_htm_t
 
     void add(int32_t key)
     {
-        wbmm_begin();
+        HTM_SITE(site, "slpq_htm_t::add");
+        RP::begin();
 
         slnode_t
             * NEW = NULL, * new_next,
@@ -145,11 +145,9 @@ class slpq_htm_t
         }
 
         uint32_t status;
-        uint32_t attempts;
-        attempts = 0;
-      htm_retry:
-        status = _xbegin();
-        if (status == _XBEGIN_STARTED) {
+      retry_htm:
+        status = htm_begin(site, 42);
+        if (status == HTM_STARTED) {
             for (int i = 1; i < NEW->toplevel; i++) {
                 pred = preds[i];
                 succ = succs[i];
@@ -159,20 +157,21 @@ class slpq_htm_t
                 if (new_next != succ)
                     NEW->nexts[i] = succ;
                 if (pred->nexts[i] != succ)
-                    _xabort(42);
+                    htm_abort(42);
                 pred->nexts[i] = NEW;
             }
           commit:
-            _xend();
+            htm_end(site);
             goto success;
         }
         else {
-            if ((status & _XABORT_EXPLICIT) && _XABORT_CODE(status) == 42) {
+            if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
                 // try slow path
             }
-            else if (++attempts < MAX_ATTEMPT_NUM) {
-                goto htm_retry;
+            else if (htm_retry(site, status)) {
+                goto retry_htm;
             }
+            htm_fallback(site);
         }
 
         for (int i = 1; i < NEW->toplevel; i++) {
@@ -202,12 +201,12 @@ class slpq_htm_t
             do_full_delete(NEW);
 
       exit:
-        wbmm_end();
+        RP::end();
     }
 
     int32_t remove()
     {
-        wbmm_begin();
+        RP::begin();
 
         slnode_t * x = mark_first_strict();
 
@@ -221,7 +220,7 @@ class slpq_htm_t
             do_full_delete(x);
         }
 
-        wbmm_end();
+        RP::end();
         return result;
     }
 
@@ -319,28 +318,28 @@ class slpq_htm_t
 
     static void mark_node_ptrs(slnode_t * n)
     {
+        HTM_SITE(site, "slpq_htm_t::mark_node_ptrs");
         slnode_t * n_next;
 
         uint32_t status;
-        uint32_t attempts;
-        attempts = 0;
-      htm_retry:
-        status = _xbegin();
-        if (status == _XBEGIN_STARTED) {
+      retry_htm:
+        status = htm_begin(site, 42);
+        if (status == HTM_STARTED) {
             for (int i = n->toplevel-1; i >= 1; i--) {
                 n_next = n->nexts[i];
                 n->nexts[i] = (slnode_t *)REF_MARKED(n_next);
             }
-            _xend();
+            htm_end(site);
             return;
         }
         else {
-            if ((status & _XABORT_EXPLICIT) && _XABORT_CODE(status) == 42) {
+            if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
                 // try slow path
             }
-            else if (++attempts < MAX_ATTEMPT_NUM) {
-                goto htm_retry;
+            else if (htm_retry(site, status)) {
+                goto retry_htm;
             }
+            htm_fallback(site);
         }
 
         for (int i = n->toplevel-1; i >= 1; i--) {
@@ -354,4 +353,5 @@ class slpq_htm_t
     }
 };
 
-thread_local uint32_t slpq_htm_t::seed = 0;
+template<class RP>
+thread_local uint32_t slpq_htm_t<RP>::seed = 0;
@@ -43,13 +43,14 @@
 #include <x86intrin.h>
 
 #include "common.hpp"
-#include "mm.hpp"
+#include "reclaim.hpp"
 
 using std::atomic;
 using std::stringstream;
 using std::string;
 using std::endl;
 
+template<class RP = wbmm_policy_t>
 class slpq_htmff_t
 {
   private:
@@ -60,8 +61,6 @@ class slpq_htmff_t
 
     static thread_local uint32_t seed;
 
-    static const int MAX_ATTEMPT_NUM = 4;
-
     struct slnode_t
     {
         int32_t key;
@@ -94,7 +93,7 @@ class slpq_htmff_t
 
     slnode_t * alloc_node(uint32_t val, slnode_t *next, uint32_t toplevel)
     {
-        slnode_t *node = (slnode_t*)wbmm_alloc(sizeof(slnode_t));
+        slnode_t *node = (slnode_t*)RP::alloc(sizeof(slnode_t));
         node->key = val;
         node->toplevel = toplevel;
         node->mark = 0;
@@ -105,12 +104,12 @@ class slpq_htmff_t
 
     static void free_node_safe(slnode_t * ptr)
     {
-        wbmm_free_safe(ptr);
+        RP::free_safe(ptr);
     }
 
     static void free_node_unsafe(slnode_t * ptr)
     {
-        wbmm_free_unsafe(ptr);
+        RP::free_unsafe(ptr);
     }
 
   public:
@@ -123,7 +122,8 @@ class slpq_htmff_t
 
     void add(int32_t key)
     {
-        wbmm_begin();
+        HTM_SITE(site, "slpq_htmff_t::add");
+        RP::begin();
 
         slnode_t
             * NEW = NULL, * new_next,
@@ -144,11 +144,9 @@ class slpq_htmff_t
         }
 
         uint32_t status;
-        uint32_t attempts;
-        attempts = 0;
-      htm_retry:
-        status = _xbegin();
-        if (status == _XBEGIN_STARTED) {
+      retry_htm:
+        status = htm_begin(site, 42);
+        if (status == HTM_STARTED) {
             for (int i = 1; i < NEW->toplevel; i++) {
                 pred = preds[i];
                 succ = succs[i];
@@ -158,20 +156,21 @@ class slpq_htmff_t
                 if (new_next != succ)
                     xst(&NEW->nexts[i], succ);
                 if (xld(&pred->nexts[i]) != succ)
-                    _xabort(42);
+                    htm_abort(42);
                 xst(&pred->nexts[i], NEW);
             }
           commit:
-            _xend();
+            htm_end(site);
             goto success;
         }
         else {
-            if ((status & _XABORT_EXPLICIT) && _XABORT_CODE(status) == 42) {
+            if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
                 // try slow path
             }
-            else if (++attempts < MAX_ATTEMPT_NUM) {
-                goto htm_retry;
+            else if (htm_retry(site, status)) {
+                goto retry_htm;
             }
+            htm_fallback(site);
         }
 
         for (int i = 1; i < NEW->toplevel; i++) {
@@ -201,12 +200,12 @@ class slpq_htmff_t
             do_full_delete(NEW);
 
       exit:
-        wbmm_end();
+        RP::end();
     }
 
     int32_t remove()
     {
-        wbmm_begin();
+        RP::begin();
 
         slnode_t * x = mark_first_strict();
 
@@ -220,7 +219,7 @@ class slpq_htmff_t
             do_full_delete(x);
         }
 
-        wbmm_end();
+        RP::end();
         return result;
     }
 
@@ -317,28 +316,28 @@ class slpq_htmff_t
 
     static void mark_node_ptrs(slnode_t * n)
     {
+        HTM_SITE(site, "slpq_htmff_t::mark_node_ptrs");
         slnode_t * n_next;
 
         uint32_t status;
-        uint32_t attempts;
-        attempts = 0;
-      htm_retry:
-        status = _xbegin();
-        if (status == _XBEGIN_STARTED) {
+      retry_htm:
+        status = htm_begin(site, 42);
+        if (status == HTM_STARTED) {
             for (int i = n->toplevel-1; i >= 1; i--) {
                 n_next = xld(&n->nexts[i]);
                 xst(&n->nexts[i], (slnode_t *)REF_MARKED(n_next));
             }
-            _xend();
+            htm_end(site);
             return;
         }
         else {
-            if ((status & _XABORT_EXPLICIT) && _XABORT_CODE(status) == 42) {
+            if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 42) {
                 // try slow path
             }
-            else if (++attempts < MAX_ATTEMPT_NUM) {
-                goto htm_retry;
+            else if (htm_retry(site, status)) {
+                goto retry_htm;
             }
+            htm_fallback(site);
         }
 
         for (int i = n->toplevel-1; i >= 1; i--) {
@@ -352,4 +351,5 @@ class slpq_htmff_t
     }
 };
 
-thread_local uint32_t slpq_htmff_t::seed = 0;
+template<class RP>
+thread_local uint32_t slpq_htmff_t<RP>::seed = 0;
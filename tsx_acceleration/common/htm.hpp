@@ -0,0 +1,372 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014
+// Lehigh University
+// Computer Science and Engineering Department
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright notice,
+//      this list of conditions and the following disclaimer.
+//
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//
+//    * Neither the name of the University of Rochester nor the names of its
+//      contributors may be used to endorse or promote products derived from
+//      this software without specific prior written permission.
+//
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef HTM_HPP__
+#define HTM_HPP__
+
+/**
+ *  This file hides whether the CPU we are running on actually has RTM.
+ *
+ *  Every HTM fast path in the tree has the same shape: begin a transaction,
+ *  and if it aborts with an explicit code, go straight to the software slow
+ *  path.  htm_begin(site, code) keeps that shape, but when RTM is missing (or
+ *  the microcode forces every transaction to abort) it does not issue xbegin
+ *  at all.  It returns the status that _xabort(code) would have produced, so
+ *  the caller falls through to its slow path on the first try.
+ *
+ *  Building with -DHTM_DISABLED removes every RTM instruction.  htm_begin then
+ *  folds to a constant, and the compiler drops the transactional code.  That
+ *  build does not need -mrtm.
+ *
+ *  Each fast path also names itself with HTM_SITE, so that we can count, per
+ *  thread and per site, how transactions end: commits, the abort causes that
+ *  the status word reports, and how often the caller gave up and took its
+ *  slow path (htm_fallback).  Counting happens outside of transactions, so it
+ *  never adds to a read or write set.
+ *
+ *  The same per-thread, per-site state drives the retry policy.  Instead of a
+ *  fixed MAX_ATTEMPT_NUM, a fast path asks htm_retry(site, status) whether to
+ *  try again, and the answer comes from a budget that follows recent history:
+ *
+ *  - Every HTM_WINDOW operations, if retries that ended in a commit beat
+ *    retries that ended in a fallback, the budget doubles.  If they lost
+ *    badly, it halves.  A budget of 1 (no retries) gets no feedback, so after
+ *    HTM_PROBE_WINDOWS quiet windows it is raised to 2 to probe again.
+ *
+ *  - A capacity abort without the retry hint will not go away on retry.
+ *    After HTM_CAPACITY_STREAK operations in a row end that way, the site
+ *    skips HTM for a while, and htm_begin returns an explicit abort without
+ *    issuing xbegin.  The skip length doubles on each failed probe, up to
+ *    HTM_MAX_SKIP, and resets on a commit.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mutex>
+
+#ifdef HTM_DISABLED
+
+#define HTM_STARTED          (~0u)
+#define HTM_ABORT_EXPLICIT   (1 << 0)
+#define HTM_ABORT_RETRY      (1 << 1)
+#define HTM_ABORT_CONFLICT   (1 << 2)
+#define HTM_ABORT_CAPACITY   (1 << 3)
+#define HTM_ABORT_NESTED     (1 << 5)
+#define HTM_ABORT_CODE(s)    (((s) >> 24) & 0xFF)
+
+#define htm_abort(code)      ((void)0)
+
+static const bool htm_rtm_ok = false;
+
+#else
+
+#include <immintrin.h>
+#include <cpuid.h>
+
+#define HTM_STARTED          _XBEGIN_STARTED
+#define HTM_ABORT_EXPLICIT   _XABORT_EXPLICIT
+#define HTM_ABORT_RETRY      _XABORT_RETRY
+#define HTM_ABORT_CONFLICT   _XABORT_CONFLICT
+#define HTM_ABORT_CAPACITY   _XABORT_CAPACITY
+#define HTM_ABORT_NESTED     _XABORT_NESTED
+#define HTM_ABORT_CODE(s)    _XABORT_CODE(s)
+
+#define htm_abort(code)      _xabort(code)
+
+/**
+ *  CPUID leaf 7 reports RTM in EBX bit 11.  Parts whose microcode disabled
+ *  TSX may still report it, but then set RTM_ALWAYS_ABORT (EDX bit 11).
+ */
+static inline bool htm_detect_rtm()
+{
+    uint32_t a, b, c, d;
+    if (__get_cpuid_max(0, 0) < 7)
+        return false;
+    __cpuid_count(7, 0, a, b, c, d);
+    return (b & (1u << 11)) && !(d & (1u << 11));
+}
+
+/*** Probed once at startup; never changes afterward */
+static const bool htm_rtm_ok = htm_detect_rtm();
+
+#endif
+
+/*** Set in a synthesized status, when we never tried a transaction */
+#define HTM_ABORT_NO_RTM     (1 << 16)
+#define HTM_ABORT_SKIPPED    (1 << 17)
+
+/*** The outcomes we count for each site */
+enum htm_event_t {
+    HTM_EV_COMMIT, HTM_EV_CONFLICT, HTM_EV_CAPACITY, HTM_EV_EXPLICIT,
+    HTM_EV_RETRY, HTM_EV_NESTED, HTM_EV_OTHER, HTM_EV_NO_RTM,
+    HTM_EV_SKIPPED, HTM_EV_FALLBACK, HTM_NUM_EVENTS
+};
+
+static const uint32_t HTM_MAX_SITES = 64;
+
+/*** Tuning knobs for the adaptive retry policy */
+static const uint32_t HTM_INITIAL_BUDGET  = 4;
+static const uint32_t HTM_MAX_BUDGET      = 64;
+static const uint32_t HTM_WINDOW          = 64;
+static const uint32_t HTM_PROBE_WINDOWS   = 16;
+static const uint32_t HTM_CAPACITY_STREAK = 2;
+static const uint32_t HTM_MIN_SKIP        = 16;
+static const uint32_t HTM_MAX_SKIP        = 4096;
+
+/*** One thread's retry policy state for one site */
+struct htm_adapt_t
+{
+    uint32_t budget;    // attempts allowed per operation
+    uint32_t tries;     // attempts made by the current operation
+    uint32_t ops;       // operations finished in this window
+    uint32_t wins;      // ... that committed after at least one retry
+    uint32_t losses;    // ... that fell back after at least one retry
+    uint32_t quiet;     // windows in a row with no retries at all
+    uint32_t streak;    // operations in a row that ended in capacity aborts
+    uint32_t skip;      // operations left to run without HTM
+    uint32_t skip_len;  // how long the next skip will be
+};
+
+/**
+ *  One thread's counters.  Blocks are cache-line aligned and never freed, so
+ *  the counts of threads that have exited can still be summed at the end.
+ */
+struct htm_counters_t
+{
+    uint64_t         count[HTM_MAX_SITES][HTM_NUM_EVENTS];
+    htm_adapt_t      adapt[HTM_MAX_SITES];
+    htm_counters_t * next;
+};
+
+/*** Site names, and the list of every thread's counters */
+struct htm_registry_t
+{
+    std::mutex       lock;
+    const char *     names[HTM_MAX_SITES];
+    uint32_t         sites;
+    htm_counters_t * threads;
+};
+
+/*** A function-local static, so all translation units share one registry */
+inline htm_registry_t & htm_registry()
+{
+    static htm_registry_t r;
+    return r;
+}
+
+/*** Map a site name to a small integer, reusing the id of an equal name */
+inline uint32_t htm_site_register(const char * name)
+{
+    htm_registry_t & r = htm_registry();
+    std::lock_guard<std::mutex> g(r.lock);
+    for (uint32_t i = 0; i < r.sites; ++i)
+        if (strcmp(r.names[i], name) == 0)
+            return i;
+    if (r.sites == HTM_MAX_SITES) {
+        fprintf(stderr, "Too many HTM sites\n");
+        exit(-1);
+    }
+    r.names[r.sites] = name;
+    return r.sites++;
+}
+
+/*** Declare the site id for the enclosing fast path */
+#define HTM_SITE(var, name) static const uint32_t var = htm_site_register(name)
+
+/*** Get the calling thread's counters, creating them on first use */
+inline htm_counters_t * htm_my_counters()
+{
+    static thread_local htm_counters_t * mine = NULL;
+    if (__builtin_expect(mine == NULL, false)) {
+        void * p;
+        if (posix_memalign(&p, 64, sizeof(htm_counters_t)) != 0) {
+            fprintf(stderr, "Could not allocate HTM counters\n");
+            exit(-1);
+        }
+        memset(p, 0, sizeof(htm_counters_t));
+        mine = (htm_counters_t *)p;
+        for (uint32_t i = 0; i < HTM_MAX_SITES; ++i) {
+            mine->adapt[i].budget = HTM_INITIAL_BUDGET;
+            mine->adapt[i].skip_len = HTM_MIN_SKIP;
+        }
+        htm_registry_t & r = htm_registry();
+        std::lock_guard<std::mutex> g(r.lock);
+        mine->next = r.threads;
+        r.threads = mine;
+    }
+    return mine;
+}
+
+/*** Count the reasons reported by an abort status */
+inline void htm_record_abort(uint32_t site, uint32_t status)
+{
+    uint64_t * c = htm_my_counters()->count[site];
+    if (status & HTM_ABORT_CONFLICT) c[HTM_EV_CONFLICT]++;
+    if (status & HTM_ABORT_CAPACITY) c[HTM_EV_CAPACITY]++;
+    if (status & HTM_ABORT_EXPLICIT) c[HTM_EV_EXPLICIT]++;
+    if (status & HTM_ABORT_RETRY)    c[HTM_EV_RETRY]++;
+    if (status & HTM_ABORT_NESTED)   c[HTM_EV_NESTED]++;
+    if (!(status & (HTM_ABORT_CONFLICT | HTM_ABORT_CAPACITY | HTM_ABORT_EXPLICIT
+                    | HTM_ABORT_RETRY | HTM_ABORT_NESTED)))
+        c[HTM_EV_OTHER]++;
+}
+
+/*** Close out one operation at a site, and adjust the budget per window */
+inline void htm_finish_op(htm_adapt_t & a, bool committed)
+{
+    if (a.tries > 1)
+        committed ? a.wins++ : a.losses++;
+    a.tries = 0;
+    if (++a.ops < HTM_WINDOW)
+        return;
+    if (a.wins + a.losses == 0) {
+        if (a.budget == 1 && ++a.quiet >= HTM_PROBE_WINDOWS) {
+            a.budget = 2;
+            a.quiet = 0;
+        }
+    }
+    else {
+        a.quiet = 0;
+        if (a.wins > a.losses)
+            a.budget = (a.budget * 2 > HTM_MAX_BUDGET) ? HTM_MAX_BUDGET : a.budget * 2;
+        else if (a.wins * 4 < a.losses)
+            a.budget = (a.budget > 1) ? a.budget / 2 : 1;
+    }
+    a.ops = a.wins = a.losses = 0;
+}
+
+static inline uint32_t htm_begin(uint32_t site, uint32_t code)
+{
+    htm_counters_t * c = htm_my_counters();
+#ifndef HTM_DISABLED
+    if (__builtin_expect(htm_rtm_ok, true)) {
+        htm_adapt_t & a = c->adapt[site];
+        if (__builtin_expect(a.skip != 0, false)) {
+            a.skip--;
+            c->count[site][HTM_EV_SKIPPED]++;
+            return HTM_ABORT_EXPLICIT | HTM_ABORT_SKIPPED | (code << 24);
+        }
+        a.tries++;
+        uint32_t status = _xbegin();
+        if (status == HTM_STARTED)
+            return status;
+        htm_record_abort(site, status);
+        return status;
+    }
+#endif
+    c->count[site][HTM_EV_NO_RTM]++;
+    return HTM_ABORT_EXPLICIT | HTM_ABORT_NO_RTM | (code << 24);
+}
+
+static inline void htm_end(uint32_t site)
+{
+#ifndef HTM_DISABLED
+    _xend();
+#endif
+    htm_counters_t * c = htm_my_counters();
+    htm_adapt_t & a = c->adapt[site];
+    c->count[site][HTM_EV_COMMIT]++;
+    a.streak = 0;
+    a.skip_len = HTM_MIN_SKIP;
+    htm_finish_op(a, true);
+}
+
+/**
+ *  Decide whether to try the transaction again after it aborted with
+ *  /status/.  Explicit aborts (including the ones we synthesize) always go to
+ *  the slow path.
+ */
+static inline bool htm_retry(uint32_t site, uint32_t status)
+{
+    if (status & HTM_ABORT_EXPLICIT)
+        return false;
+    htm_adapt_t & a = htm_my_counters()->adapt[site];
+    if ((status & HTM_ABORT_CAPACITY) && !(status & HTM_ABORT_RETRY)) {
+        if (++a.streak >= HTM_CAPACITY_STREAK) {
+            a.skip = a.skip_len;
+            a.skip_len = (a.skip_len * 2 > HTM_MAX_SKIP) ? HTM_MAX_SKIP : a.skip_len * 2;
+        }
+        return false;
+    }
+    a.streak = 0;
+    return a.tries < a.budget;
+}
+
+/*** The caller is done retrying, and is taking its slow path */
+static inline void htm_fallback(uint32_t site)
+{
+    htm_counters_t * c = htm_my_counters();
+    c->count[site][HTM_EV_FALLBACK]++;
+    htm_adapt_t & a = c->adapt[site];
+    if (a.tries != 0)
+        htm_finish_op(a, false);
+}
+
+/*** Sum every thread's counters, and print one line per site that ran */
+inline void htm_stats_print(FILE * out = stdout)
+{
+    static const char * labels[HTM_NUM_EVENTS] = {
+        "commit", "conflict", "capacity", "explicit", "retry", "nested",
+        "other", "no-rtm", "skipped", "fallback"
+    };
+    htm_registry_t & r = htm_registry();
+    std::lock_guard<std::mutex> g(r.lock);
+    bool header = false;
+    for (uint32_t s = 0; s < r.sites; ++s) {
+        uint64_t sum[HTM_NUM_EVENTS] = {0};
+        uint64_t any = 0;
+        for (htm_counters_t * t = r.threads; t != NULL; t = t->next)
+            for (int e = 0; e < HTM_NUM_EVENTS; ++e) {
+                sum[e] += t->count[s][e];
+                any += t->count[s][e];
+            }
+        if (!any)
+            continue;
+        if (!header) {
+            fprintf(out, "%-36s", "HTM site");
+            for (int e = 0; e < HTM_NUM_EVENTS; ++e)
+                fprintf(out, " %10s", labels[e]);
+            fprintf(out, "\n");
+            header = true;
+        }
+        fprintf(out, "%-36s", r.names[s]);
+        for (int e = 0; e < HTM_NUM_EVENTS; ++e)
+            fprintf(out, " %10llu", (unsigned long long)sum[e]);
+        fprintf(out, "\n");
+    }
+}
+
+#endif // HTM_HPP__
@@ -32,10 +32,9 @@
 #include "../common/platform.hpp"
 #include <cstdlib>
 #include <pthread.h>
-#include <x86intrin.h>
+#include "../common/htm.hpp"
 
 // Skip list type and varialble definitions
-//static const int MAX_ATTEMPT_NUM = 1;
 
 //static  uint32_t count = 0;
 
@@ -205,14 +204,14 @@ retry:
 
 inline int mark_node_ptrs(sl_node_t *n)
 {
+    HTM_SITE(site, "mark_node_ptrs");
     sl_node_t *n_next;
     
     uint32_t status;
-    //uint32_t attempts = 0;
     uint32_t i = n->toplevel - 1;
-//retry:
-    status = _xbegin();
-    if(status == _XBEGIN_STARTED)
+  retry:
+    status = htm_begin(site, 66);
+    if(status == HTM_STARTED)
     {
         while ( i > 0 )
         {
@@ -222,19 +221,18 @@ inline int mark_node_ptrs(sl_node_t *n)
         }
         if (is_marked((uint32_t)n->nexts[0]))
         {
-            _xend();
+            htm_end(site);
             return 0;
         }else
         {
             n->nexts[0] = (sl_node_t*)set_mark((uint32_t)n->nexts[0]);
-            _xend();
+            htm_end(site);
             return 1;
         }
-    }/*else{
-        if (++attempts < MAX_ATTEMPT_NUM) {
-            goto retry;
-        }
-    }*/
+    }
+    else if (htm_retry(site, status))
+        goto retry;
+    htm_fallback(site);
         
     for (int i=n->toplevel-1; i>0; i--) {
         do {
@@ -277,10 +275,10 @@ int fraser_remove(sl_intset_t *set, uint32_t val)
  */
 void fraser_insert(sl_intset_t *set, uint32_t v, bool lin)
 {
+    HTM_SITE(site, "fraser_insert");
     sl_node_t *NEW, *new_next, *pred, *succ, *succs[LEVELMAX], *preds[LEVELMAX];
     uint32_t i;
     uint32_t status;
-   // uint32_t attempts = 0;
     NEW = sl_new_simple_node(v, get_rand_level(), lin);
 retry:
     fraser_search(set, v, preds, succs);
@@ -290,26 +288,22 @@ retry:
     if (!ATOMIC_CAS_MB(&preds[0]->nexts[0], succs[0], NEW))
         goto retry;
     
-//retry_HTM:
-    status = _xbegin();
-    if(status == _XBEGIN_STARTED)
+  retry_HTM:
+    status = htm_begin(site, 66);
+    if(status == HTM_STARTED)
     {
         for (i = 1; i < NEW->toplevel; i++) {
             if(preds[i]->nexts[i] == succs[i])
                 preds[i]->nexts[i] = NEW;
             else
-                _xabort(66);
+                htm_abort(66);
         }
-        _xend();
+        htm_end(site);
         return;
-    }/*else
-    {
-        if ((status & _XABORT_EXPLICIT) && _XABORT_CODE(status) == 66) {
-        }
-        else if (++attempts < MAX_ATTEMPT_NUM) {
-            goto retry_HTM;
-        }
-    }*/
+    }
+    else if (htm_retry(site, status))
+        goto retry_HTM;
+    htm_fallback(site);
     
     for (i = 1; i < NEW->toplevel; i++) {
         while (1) {
@@ -39,14 +39,13 @@
 
 #include "../common/platform.hpp"
 #include "common.hpp"
-#include <x86intrin.h>
+#include "../common/htm.hpp"
 
 namespace mindicator
 {
     /*** Represent a sosi node. */
     struct RTM_node_t
     {
-        static const int MAX_ATTEMPT_NUM = 3;
         word64_t          word;  // per-node data
         RTM_node_t*     my_parent;
         RTM_node_t*     first_child;
@@ -60,6 +59,7 @@ namespace mindicator
 
         void arrive(int32_t n)
         {
+            HTM_SITE(site, "RTM_node_t::arrive");
             word64_t temp;
             MAKE_WORD(temp, STEADY, n, 0);
 #ifdef STM_CPU_X86
@@ -75,11 +75,10 @@ namespace mindicator
              ***************************************/
             RTM_node_t* turn_up = my_parent;
             uint32_t status;
-            uint32_t attempts = 0;
 
         retry:
-            status = _xbegin();
-            if(status == _XBEGIN_STARTED)
+            status = htm_begin(site, 66);
+            if(status == HTM_STARTED)
             {
                 while(turn_up)
                 {
@@ -87,7 +86,7 @@ namespace mindicator
                     //turn_up->word.fields.word.bits.ver++;
                     //abort when node is dirty
                     if(turn_up->word.fields.word.bits.steady == TENTATIVE)
-                        _xabort(66);
+                        htm_abort(66);
 
                     if(turn_up->word.fields.min > n)
                     {
@@ -101,19 +100,20 @@ namespace mindicator
                     }
 
                 }
-                _xend();
+                htm_end(site);
             /***************************************
             * END
             ***************************************/
             }else
             {
-                if ((status & _XABORT_EXPLICIT) && _XABORT_CODE(status) == 66) {
+                if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 66) {
                     // try slow path
 
                 }
-                else if (++attempts < MAX_ATTEMPT_NUM) {
+                else if (htm_retry(site, status)) {
                     goto retry;
                 }
+                htm_fallback(site);
                 turn_up->lin32_arrive_internal(n);
             }
         }
@@ -124,6 +124,7 @@ namespace mindicator
          */
         void depart()
         {
+            HTM_SITE(site, "RTM_node_t::depart");
             // write max at the leaf node... no CAS required, but we need
             // ordering
             int32_t n = word.fields.min;
@@ -143,16 +144,15 @@ namespace mindicator
             uint32_t status;
             RTM_node_t* turn_up = my_parent;
             int32_t mvc;
-            uint32_t attempts = 0;
 
         retry:
-            status = _xbegin();
-            if(status == _XBEGIN_STARTED)
+            status = htm_begin(site, 66);
+            if(status == HTM_STARTED)
             {
                 while(turn_up)
                 {
                     if(turn_up->word.fields.word.bits.steady == TENTATIVE)
-                        _xabort(66);
+                        htm_abort(66);
                     else
                     {
                         if(turn_up->word.fields.min < n)
@@ -171,19 +171,20 @@ namespace mindicator
                         }
                     }
                 }
-                _xend();
+                htm_end(site);
                 /***************************************
                  * END
                  ***************************************/
             }else
             {
-                if ((status & _XABORT_EXPLICIT) && _XABORT_CODE(status) == 66) {
+                if ((status & HTM_ABORT_EXPLICIT) && HTM_ABORT_CODE(status) == 66) {
                     // try slow path
 
                 }
-                else if (++attempts < MAX_ATTEMPT_NUM) {
+                else if (htm_retry(site, status)) {
                     goto retry;
                 }
+                htm_fallback(site);
                 lin32_depart_internal(turn_up, n);
             }
         }
@@ -44,6 +44,7 @@
 
 #include "../common/platform.hpp"
 #include "../common/locks.hpp"
+#include "../common/htm.hpp"
 #include "common.hpp"
 
 namespace mindicator
@@ -96,8 +97,6 @@ class sosilRTM_cgl_t
     static const int NUM_NODES = GeoSum<1, WAY, DEPTH>::value;
     static const int FIRST_LEAF = GeoSum<1, WAY, DEPTH - 1>::value;
     volatile uintptr_t  lock = 0;  // lock of the tree
-    
-    //static const int MAX_ATTEMPT_NUM = 128;
 
   public:
 
@@ -184,14 +183,14 @@ class sosilRTM_cgl_t
 template<int W, int D>
 void sosilRTM_cgl_node_t<W, D>::arrive(int32_t n)
 {
-  //  int attempts = 0;
+    HTM_SITE(site, "sosilRTM_cgl_node_t::arrive");
     uint32_t status;
-//retry:
-    status = _xbegin();
-    if(status == _XBEGIN_STARTED)
+  retry:
+    status = htm_begin(site, 66);
+    if(status == HTM_STARTED)
     {
         if(tree->lock != 0)
-            _xabort(66);
+            htm_abort(66);
         
         sosilRTM_cgl_node_t<W, D> *current = this;
         while(n < current->value)
@@ -202,16 +201,13 @@ void sosilRTM_cgl_node_t<W, D>::arrive(int32_t n)
             }else
                 break;
         }
-        _xend();
+        htm_end(site);
         
     }else
     {
-       /* if ((status & _XABORT_EXPLICIT) && _XABORT_CODE(status) == 66) {
-            // try slow path
-        }
-        else if (++attempts < tree->MAX_ATTEMPT_NUM) {
+        if (htm_retry(site, status))
             goto retry;
-        }*/
+        htm_fallback(site);
         // lock this node
         tatas_acquire(&tree->lock);
         sosilRTM_cgl_node_t<W, D> *current = this;
@@ -231,14 +227,14 @@ void sosilRTM_cgl_node_t<W, D>::arrive(int32_t n)
 template<int W, int D>
 void sosilRTM_cgl_node_t<W, D>::depart()
 {
-   // int attempts = 0;
-//retry:
+    HTM_SITE(site, "sosilRTM_cgl_node_t::depart");
     uint32_t status;
-    status = _xbegin();
-    if(status == _XBEGIN_STARTED)
+  retry:
+    status = htm_begin(site, 66);
+    if(status == HTM_STARTED)
     {
         if(tree->lock != 0)
-            _xabort(66);
+            htm_abort(66);
         
         sosilRTM_cgl_node_t<W, D> *current = this;
         int32_t mvc = INT_MAX;
@@ -259,15 +255,12 @@ void sosilRTM_cgl_node_t<W, D>::depart()
                     mvc = temp;
             }
         }
-        _xend();
+        htm_end(site);
     }else
     {
-        /*if ((status & _XABORT_EXPLICIT) && _XABORT_CODE(status) == 66) {
-            // try slow path
-        }
-        else if (++attempts < tree->MAX_ATTEMPT_NUM) {
+        if (htm_retry(site, status))
             goto retry;
-        }*/
+        htm_fallback(site);
         // lock this node
         tatas_acquire(&tree->lock);
         
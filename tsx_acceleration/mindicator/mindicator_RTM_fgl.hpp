@@ -44,6 +44,7 @@
 
 #include "../common/platform.hpp"
 #include "../common/locks.hpp"
+#include "../common/htm.hpp"
 #include "common.hpp"
 
 namespace mindicator
@@ -183,12 +184,14 @@ class sosilRTM_fgl_t
 template<int W, int D>
 void sosilRTM_fgl_node_t<W, D>::arrive(int32_t n)
 {
+    HTM_SITE(site, "sosilRTM_fgl_node_t::arrive");
     uint32_t status;
-    status = _xbegin();
-    if(status == _XBEGIN_STARTED)
+  retry:
+    status = htm_begin(site, 6);
+    if(status == HTM_STARTED)
     {
         if(lock != 0)
-            _xabort(6);
+            htm_abort(6);
         
         sosilRTM_fgl_node_t<W, D> *current = this;
         while(n < current->value)
@@ -197,14 +200,17 @@ void sosilRTM_fgl_node_t<W, D>::arrive(int32_t n)
             if (!tree->is_root(current)) {
                  current = tree->parent(current);
                 if(current->lock != 0)
-                    _xabort(6);
+                    htm_abort(6);
             }else
                 break;
         }
-        _xend();
+        htm_end(site);
         
     }else
     {
+        if (htm_retry(site, status))
+            goto retry;
+        htm_fallback(site);
         // lock this node
         tatas_acquire(&lock);
         sosilRTM_fgl_node_t<W, D> *current = this;
@@ -246,13 +252,15 @@ void sosilRTM_fgl_node_t<W, D>::arrive(int32_t n)
 template<int W, int D>
 void sosilRTM_fgl_node_t<W, D>::depart()
 {
+    HTM_SITE(site, "sosilRTM_fgl_node_t::depart");
     uint32_t status;
-    status = _xbegin();
-    if(status == _XBEGIN_STARTED)
+  retry:
+    status = htm_begin(site, 6);
+    if(status == HTM_STARTED)
     {
         
         if(lock != 0)
-            _xabort(6);
+            htm_abort(6);
         
         sosilRTM_fgl_node_t<W, D> *current = this;
         int32_t mvc = INT_MAX;
@@ -263,7 +271,7 @@ void sosilRTM_fgl_node_t<W, D>::depart()
             if (!tree->is_root(current)) {
                 current = tree->parent(current);
                 if(current->lock != 0)
-                    _xabort(6);
+                    htm_abort(6);
             }else
                 break;
             sosilRTM_fgl_node_t<W, D> * begin = tree->children(current);
@@ -275,9 +283,12 @@ void sosilRTM_fgl_node_t<W, D>::depart()
                     mvc = temp;
             }
         }
-        _xend();
+        htm_end(site);
     }else
     {
+        if (htm_retry(site, status))
+            goto retry;
+        htm_fallback(site);
         // lock this node
         tatas_acquire(&lock);
         
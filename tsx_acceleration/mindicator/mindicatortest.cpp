@@ -347,6 +347,8 @@ static void run()
         sosil_bench < SOSI > ();
     else
         sosil_concurrent_test < SOSI > ();
+    if (PRINT_SUMMARY)
+        htm_stats_print();
 }
 
 void usage()
@@ -360,7 +362,7 @@ void usage()
          << "  -q [Q] : query thread number (benchmark mode only)" << endl
          << "  -l     : run linearizable test (must pair with -t)" << endl
          << "  -t [T] : run test for SOSI given by name T" << endl
-         << "  -p     : print detailed output" << endl
+         << "  -v     : print detailed output and HTM abort counts" << endl
          << "  -d [D] : run each experiment for D seconds" << endl << endl
          << "Valid values for T:" << endl
          << "  List      : CGL DList implementation" << endl